@@ -17,6 +17,10 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
 
 struct AioHandler
 {
@@ -24,12 +28,214 @@ struct AioHandler
     IOHandler *io_read;
     IOHandler *io_write;
     AioFlushHandler *io_flush;
+    AioPollHandler *io_poll;
     int deleted;
     int pollfds_idx;
+    uint32_t epoll_events;      /* events registered in ctx->epollfd */
     void *opaque;
     QLIST_ENTRY(AioHandler) node;
 };
 
+static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node);
+
+#ifdef CONFIG_EPOLL
+
+/* poll(2) needs no system call to change the set of file descriptors, and
+ * it is as fast as epoll(7) when there are only a few of them.  Beyond this
+ * many handlers, switch to epoll, whose cost only depends on the number of
+ * ready file descriptors.
+ */
+#define EPOLL_ENABLE_THRESHOLD  64
+
+/* Maximum number of handlers dispatched by one aio_poll call */
+#define EPOLL_MAX_EVENTS        128
+
+void aio_context_setup(AioContext *ctx)
+{
+    ctx->epollfd = -1;
+    ctx->epoll_enabled = false;
+    ctx->epoll_available = true;
+}
+
+void aio_context_cleanup(AioContext *ctx)
+{
+    if (ctx->epollfd >= 0) {
+        close(ctx->epollfd);
+        ctx->epollfd = -1;
+    }
+}
+
+static void aio_epoll_try_enable(AioContext *ctx)
+{
+    ctx->epollfd = epoll_create(EPOLL_MAX_EVENTS);
+    if (ctx->epollfd < 0) {
+        ctx->epoll_available = false;
+        return;
+    }
+    qemu_set_cloexec(ctx->epollfd);
+    ctx->epoll_enabled = true;
+}
+
+/* Go back to poll(2) for good, for example because one of the file
+ * descriptors does not support epoll.
+ */
+static void aio_epoll_disable(AioContext *ctx)
+{
+    AioHandler *node;
+
+    close(ctx->epollfd);
+    ctx->epollfd = -1;
+    ctx->epoll_enabled = false;
+    ctx->epoll_available = false;
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        node->epoll_events = 0;
+    }
+}
+
+static uint32_t aio_epoll_events(AioHandler *node)
+{
+    return (node->pfd.events & G_IO_IN ? EPOLLIN : 0) |
+           (node->pfd.events & G_IO_OUT ? EPOLLOUT : 0);
+}
+
+static int aio_epoll_revents(uint32_t events)
+{
+    return (events & EPOLLIN ? G_IO_IN : 0) |
+           (events & EPOLLOUT ? G_IO_OUT : 0) |
+           (events & EPOLLHUP ? G_IO_HUP : 0) |
+           (events & EPOLLERR ? G_IO_ERR : 0);
+}
+
+/* Makes ctx->epollfd wait for @events on the file descriptor of @node;
+ * no events means the file descriptor is not waited for.
+ */
+static void aio_epoll_update(AioContext *ctx, AioHandler *node,
+                             uint32_t events)
+{
+    struct epoll_event event;
+    int op;
+
+    if (!ctx->epoll_enabled || node->epoll_events == events) {
+        return;
+    }
+
+    if (!node->epoll_events) {
+        op = EPOLL_CTL_ADD;
+    } else if (!events) {
+        op = EPOLL_CTL_DEL;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+
+    event.events = events;
+    event.data.ptr = node;
+    if (epoll_ctl(ctx->epollfd, op, node->pfd.fd, &event) < 0) {
+        aio_epoll_disable(ctx);
+        return;
+    }
+    node->epoll_events = events;
+}
+
+/* Brings the epoll set up to date with the handlers and their io_flush
+ * callbacks.  Returns whether any handler has pending AIO operations.
+ * This only makes system calls for handlers that changed, so the cost of
+ * an idle handler is a function call.
+ */
+static bool aio_epoll_prepare(AioContext *ctx)
+{
+    AioHandler *node;
+    bool busy = false;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        uint32_t events = 0;
+
+        if (node->deleted) {
+            continue;
+        }
+        if (!node->io_flush || node->io_flush(node->opaque)) {
+            busy |= node->io_flush != NULL;
+            events = aio_epoll_events(node);
+        }
+        aio_epoll_update(ctx, node, events);
+        if (!ctx->epoll_enabled) {
+            break;
+        }
+    }
+    return busy;
+}
+
+/* Waits for the handlers in the epoll set and dispatches the ready ones.
+ * @timeout is in nanoseconds, -1 waits forever.  Returns whether any
+ * handler was called.
+ */
+static bool aio_epoll_poll(AioContext *ctx, int64_t timeout)
+{
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    bool progress = false;
+    int i, ret = 0;
+
+    /* epoll_wait only has millisecond resolution, so wait for the epoll
+     * file descriptor itself with ppoll when there is a timer deadline.
+     */
+    if (timeout > 0) {
+        GPollFD pfd = {
+            .fd = ctx->epollfd,
+            .events = G_IO_IN | G_IO_OUT | G_IO_HUP | G_IO_ERR,
+        };
+        ret = qemu_poll_ns(&pfd, 1, timeout);
+    }
+    if (timeout <= 0 || ret > 0) {
+        ret = epoll_wait(ctx->epollfd, events, ARRAY_SIZE(events),
+                         timeout < 0 ? -1 : 0);
+    }
+    if (ret <= 0) {
+        return false;
+    }
+
+    /* Deleted handlers are freed by the next aio_dispatch */
+    ctx->walking_handlers++;
+    for (i = 0; i < ret; i++) {
+        AioHandler *node = events[i].data.ptr;
+
+        node->pfd.revents = aio_epoll_revents(events[i].events);
+        if (aio_dispatch_handler(ctx, node)) {
+            progress = true;
+        }
+    }
+    ctx->walking_handlers--;
+    return progress;
+}
+
+#else
+
+void aio_context_setup(AioContext *ctx)
+{
+    ctx->epollfd = -1;
+    ctx->epoll_enabled = false;
+    ctx->epoll_available = false;
+}
+
+void aio_context_cleanup(AioContext *ctx)
+{
+}
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node,
+                             uint32_t events)
+{
+}
+
+static bool aio_epoll_prepare(AioContext *ctx)
+{
+    abort();
+}
+
+static bool aio_epoll_poll(AioContext *ctx, int64_t timeout)
+{
+    abort();
+}
+
+#endif
+
 static AioHandler *find_aio_handler(AioContext *ctx, int fd)
 {
     AioHandler *node;
@@ -58,6 +264,7 @@ void aio_set_fd_handler(AioContext *ctx,
     if (!io_read && !io_write) {
         if (node) {
             g_source_remove_poll(&ctx->source, &node->pfd);
+            aio_epoll_update(ctx, node, 0);
 
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
@@ -105,6 +312,22 @@ void aio_set_event_notifier(AioContext *ctx,
                        (AioFlushHandler *)io_flush, notifier);
 }
 
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollHandler *io_poll)
+{
+    AioHandler *node = find_aio_handler(ctx, fd);
+
+    assert(node);
+    node->io_poll = io_poll;
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollEventNotifierHandler *io_poll)
+{
+    aio_set_fd_poll(ctx, event_notifier_get_fd(notifier),
+                    (AioPollHandler *)io_poll);
+}
+
 bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
@@ -124,6 +347,32 @@ bool aio_pending(AioContext *ctx)
     return false;
 }
 
+/* Calls the handlers of @node for its pending events.  The caller must
+ * increment ctx->walking_handlers.
+ */
+static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
+{
+    bool progress = false;
+    int revents;
+
+    revents = node->pfd.revents & node->pfd.events;
+    node->pfd.revents = 0;
+
+    if (!node->deleted &&
+        (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) &&
+        node->io_read) {
+        node->io_read(node->opaque);
+        progress = true;
+    }
+    if (!node->deleted &&
+        (revents & (G_IO_OUT | G_IO_ERR)) &&
+        node->io_write) {
+        node->io_write(node->opaque);
+        progress = true;
+    }
+    return progress;
+}
+
 static bool aio_dispatch(AioContext *ctx)
 {
     AioHandler *node;
@@ -136,23 +385,10 @@ static bool aio_dispatch(AioContext *ctx)
     node = QLIST_FIRST(&ctx->aio_handlers);
     while (node) {
         AioHandler *tmp;
-        int revents;
 
         ctx->walking_handlers++;
 
-        revents = node->pfd.revents & node->pfd.events;
-        node->pfd.revents = 0;
-
-        if (!node->deleted &&
-            (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) &&
-            node->io_read) {
-            node->io_read(node->opaque);
-            progress = true;
-        }
-        if (!node->deleted &&
-            (revents & (G_IO_OUT | G_IO_ERR)) &&
-            node->io_write) {
-            node->io_write(node->opaque);
+        if (aio_dispatch_handler(ctx, node)) {
             progress = true;
         }
 
@@ -169,9 +405,120 @@ static bool aio_dispatch(AioContext *ctx)
     return progress;
 }
 
+/* Fills ctx->pollfds with the handlers that must be waited for.  Returns
+ * whether any handler has pending AIO operations.
+ */
+static bool aio_poll_prepare(AioContext *ctx)
+{
+    AioHandler *node;
+    bool busy = false;
+    int count = 0;
+
+    g_array_set_size(ctx->pollfds, 0);
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        node->pollfds_idx = -1;
+        count++;
+
+        /* If there aren't pending AIO operations, don't invoke callbacks.
+         * Otherwise, if there are no AIO requests, qemu_aio_wait() would
+         * wait indefinitely.
+         */
+        if (!node->deleted && node->io_flush) {
+            if (node->io_flush(node->opaque) == 0) {
+                continue;
+            }
+            busy = true;
+        }
+        if (!node->deleted && node->pfd.events) {
+            GPollFD pfd = {
+                .fd = node->pfd.fd,
+                .events = node->pfd.events,
+            };
+            node->pollfds_idx = ctx->pollfds->len;
+            g_array_append_val(ctx->pollfds, pfd);
+        }
+    }
+
+#ifdef CONFIG_EPOLL
+    /* Switch to epoll for the next iteration if there are many handlers */
+    if (count >= EPOLL_ENABLE_THRESHOLD && ctx->epoll_available) {
+        aio_epoll_try_enable(ctx);
+    }
+#endif
+    return busy;
+}
+
+/* Adaptive polling
+ *
+ * Before blocking, aio_poll busy-waits for up to ctx->poll_ns nanoseconds,
+ * calling the io_poll callbacks of the handlers.  If events arrive quickly,
+ * this saves the cost of going to sleep and being woken up, which is
+ * comparable to the latency of fast storage.
+ *
+ * ctx->poll_ns grows when aio_poll blocked for less than ctx->poll_max_ns,
+ * because polling a little longer would have caught the event.  It shrinks
+ * when aio_poll blocked for longer, so that an idle AioContext goes back
+ * to sleeping without spinning first.
+ */
+#define POLL_NS_INITIAL         4000
+#define POLL_GROW               2
+#define POLL_SHRINK             2
+
+/* Calls io_read for the handlers whose io_poll callback reports work.  The
+ * caller must increment ctx->walking_handlers.
+ */
+static bool aio_poll_handlers_once(AioContext *ctx)
+{
+    AioHandler *node;
+    bool progress = false;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll && node->io_read &&
+            node->io_poll(node->opaque)) {
+            node->io_read(node->opaque);
+            progress = true;
+        }
+    }
+    return progress;
+}
+
+static bool aio_poll_busy_wait(AioContext *ctx, int64_t start)
+{
+    bool progress;
+
+    ctx->walking_handlers++;
+    do {
+        progress = aio_poll_handlers_once(ctx);
+    } while (!progress && get_clock() - start < ctx->poll_ns);
+    ctx->walking_handlers--;
+
+    return progress;
+}
+
+static void aio_poll_adjust(AioContext *ctx, int64_t block_ns)
+{
+    if (block_ns <= ctx->poll_ns) {
+        /* Polling was long enough */
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* Polling would not have helped, poll less */
+        ctx->poll_ns /= POLL_SHRINK;
+        if (ctx->poll_ns < POLL_NS_INITIAL) {
+            ctx->poll_ns = 0;
+        }
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* Polling a little longer would have avoided blocking */
+        ctx->poll_ns = ctx->poll_ns ? ctx->poll_ns * POLL_GROW
+                                    : POLL_NS_INITIAL;
+        ctx->poll_ns = MIN(ctx->poll_ns, ctx->poll_max_ns);
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
+    int64_t start = 0;
+    int64_t deadline, timeout;
     int ret;
     bool busy, progress;
 
@@ -191,65 +538,75 @@ bool aio_poll(AioContext *ctx, bool blocking)
         progress = true;
     }
 
+    if (qemu_timer_list_group_run_timers(&ctx->tlg)) {
+        progress = true;
+    }
+
     if (progress && !blocking) {
         return true;
     }
 
     ctx->walking_handlers++;
 
-    g_array_set_size(ctx->pollfds, 0);
-
-    /* fill pollfds */
+    /* fill the epoll set or pollfds; if epoll fails, fall back to poll */
     busy = false;
-    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
-        node->pollfds_idx = -1;
-
-        /* If there aren't pending AIO operations, don't invoke callbacks.
-         * Otherwise, if there are no AIO requests, qemu_aio_wait() would
-         * wait indefinitely.
-         */
-        if (!node->deleted && node->io_flush) {
-            if (node->io_flush(node->opaque) == 0) {
-                continue;
-            }
-            busy = true;
-        }
-        if (!node->deleted && node->pfd.events) {
-            GPollFD pfd = {
-                .fd = node->pfd.fd,
-                .events = node->pfd.events,
-            };
-            node->pollfds_idx = ctx->pollfds->len;
-            g_array_append_val(ctx->pollfds, pfd);
-        }
+    if (ctx->epoll_enabled) {
+        busy = aio_epoll_prepare(ctx);
+    }
+    if (!ctx->epoll_enabled) {
+        busy = aio_poll_prepare(ctx);
     }
 
     ctx->walking_handlers--;
 
-    /* No AIO operations?  Get us out of here */
-    if (!busy) {
+    /* No AIO operations, bottom halves or timers?  Get us out of here */
+    deadline = aio_compute_timeout(ctx);
+    if (!busy && deadline < 0) {
         return progress;
     }
+    timeout = blocking ? deadline : 0;
 
-    /* wait until next event */
-    ret = g_poll((GPollFD *)ctx->pollfds->data,
-                 ctx->pollfds->len,
-                 blocking ? -1 : 0);
-
-    /* if we have any readable fds, dispatch event */
-    if (ret > 0) {
-        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
-            if (node->pollfds_idx != -1) {
-                GPollFD *pfd = &g_array_index(ctx->pollfds, GPollFD,
-                                              node->pollfds_idx);
-                node->pfd.revents = pfd->revents;
-            }
+    /* busy-wait for a while before going to sleep */
+    if (blocking && ctx->poll_max_ns) {
+        start = get_clock();
+        if (ctx->poll_ns && aio_poll_busy_wait(ctx, start)) {
+            return true;
         }
-        if (aio_dispatch(ctx)) {
+    }
+
+    if (ctx->epoll_enabled) {
+        if (aio_epoll_poll(ctx, timeout)) {
             progress = true;
         }
+    } else {
+        /* wait until next event or timer */
+        ret = qemu_poll_ns((GPollFD *)ctx->pollfds->data,
+                           ctx->pollfds->len,
+                           timeout);
+
+        /* if we have any readable fds, dispatch event */
+        if (ret > 0) {
+            QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+                if (node->pollfds_idx != -1) {
+                    GPollFD *pfd = &g_array_index(ctx->pollfds, GPollFD,
+                                                  node->pollfds_idx);
+                    node->pfd.revents = pfd->revents;
+                }
+            }
+            if (aio_dispatch(ctx)) {
+                progress = true;
+            }
+        }
+    }
+
+    if (blocking && ctx->poll_max_ns) {
+        aio_poll_adjust(ctx, get_clock() - start);
+    }
+
+    if (qemu_timer_list_group_run_timers(&ctx->tlg)) {
+        progress = true;
     }
 
-    assert(progress || busy);
+    assert(progress || busy || deadline >= 0);
     return true;
 }
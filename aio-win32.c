@@ -29,6 +29,21 @@ struct AioHandler {
     QLIST_ENTRY(AioHandler) node;
 };
 
+void aio_context_setup(AioContext *ctx)
+{
+}
+
+void aio_context_cleanup(AioContext *ctx)
+{
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *e,
+                                 AioPollEventNotifierHandler *io_poll)
+{
+    /* Busy-waiting is not implemented, aio_poll always blocks */
+}
+
 void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *e,
                             EventNotifierHandler *io_notify,
@@ -97,6 +112,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
     AioHandler *node;
     HANDLE events[MAXIMUM_WAIT_OBJECTS + 1];
     bool busy, progress;
+    int64_t deadline;
     int count;
 
     progress = false;
@@ -140,6 +156,10 @@ bool aio_poll(AioContext *ctx, bool blocking)
         }
     }
 
+    if (qemu_timer_list_group_run_timers(&ctx->tlg)) {
+        progress = true;
+    }
+
     if (progress && !blocking) {
         return true;
     }
@@ -167,14 +187,15 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     ctx->walking_handlers--;
 
-    /* No AIO operations?  Get us out of here */
-    if (!busy) {
+    /* No AIO operations, bottom halves or timers?  Get us out of here */
+    deadline = aio_compute_timeout(ctx);
+    if (!busy && deadline < 0) {
         return progress;
     }
 
-    /* wait until next event */
+    /* wait until next event or timer */
     while (count > 0) {
-        int timeout = blocking ? INFINITE : 0;
+        int timeout = blocking ? qemu_timeout_ns_to_ms(deadline) : 0;
         int ret = WaitForMultipleObjects(count, events, FALSE, timeout);
 
         /* if we have any signaled events, dispatch event */
@@ -214,6 +235,10 @@ bool aio_poll(AioContext *ctx, bool blocking)
         events[ret - WAIT_OBJECT_0] = events[--count];
     }
 
-    assert(progress || busy);
+    if (qemu_timer_list_group_run_timers(&ctx->tlg)) {
+        progress = true;
+    }
+
+    assert(progress || busy || deadline >= 0);
     return true;
 }
@@ -30,16 +30,70 @@
 /***********************************************************/
 /* bottom halves (can be seen as timers which expire ASAP) */
 
+/* QEMUBH::flags values */
+enum {
+    /* Already on ctx->bh_list or ctx->bh_slice */
+    BH_PENDING   = (1 << 0),
+
+    /* Invoke the callback */
+    BH_SCHEDULED = (1 << 1),
+
+    /* Delete without invoking the callback */
+    BH_DELETED   = (1 << 2),
+
+    /* Idle bottom halves do not count as progress and do not wake up
+     * the event loop right away
+     */
+    BH_IDLE      = (1 << 3),
+};
+
 struct QEMUBH {
     AioContext *ctx;
     QEMUBHFunc *cb;
     void *opaque;
-    QEMUBH *next;
-    bool scheduled;
-    bool idle;
-    bool deleted;
+    QSLIST_ENTRY(QEMUBH) next;
+    unsigned flags;
 };
 
+/*
+ * Only bottom halves that have been scheduled or deleted are linked into
+ * their AioContext, so aio_bh_poll does not have to look at the idle ones.
+ * Any thread can add a bottom half to ctx->bh_list without taking a lock;
+ * the BH_PENDING flag makes sure that it is on the list only once.  The
+ * thread running the AioContext takes the whole list at once, and runs the
+ * bottom halves in the order they were scheduled.  A bottom half is only
+ * freed by that thread, after it has been taken off the list.
+ */
+
+/* Adds @bh to its AioContext unless it is already pending there.  Returns
+ * the flags that @bh had before.
+ */
+static unsigned aio_bh_enqueue(QEMUBH *bh, unsigned new_flags)
+{
+    unsigned old_flags;
+
+    old_flags = atomic_fetch_or(&bh->flags, BH_PENDING | new_flags);
+    if (!(old_flags & BH_PENDING)) {
+        QSLIST_INSERT_HEAD_ATOMIC(&bh->ctx->bh_list, bh, next);
+    }
+    return old_flags;
+}
+
+/* Moves the bottom halves that were scheduled since the last call to the
+ * end of ctx->bh_slice, in FIFO order.
+ */
+static void aio_bh_take_pending(AioContext *ctx)
+{
+    QSLIST_HEAD(, QEMUBH) pending;
+    QEMUBH *bh;
+
+    QSLIST_MOVE_ATOMIC(&pending, &ctx->bh_list);
+    while ((bh = QSLIST_FIRST(&pending)) != NULL) {
+        QSLIST_REMOVE_HEAD(&pending, next);
+        QSLIST_INSERT_HEAD(&ctx->bh_slice, bh, next);
+    }
+}
+
 QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
 {
     QEMUBH *bh;
@@ -47,43 +101,32 @@ QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
     bh->ctx = ctx;
     bh->cb = cb;
     bh->opaque = opaque;
-    bh->next = ctx->first_bh;
-    ctx->first_bh = bh;
     return bh;
 }
 
 int aio_bh_poll(AioContext *ctx)
 {
-    QEMUBH *bh, **bhp, *next;
+    QEMUBH *bh;
+    unsigned flags;
     int ret;
 
-    ctx->walking_bh++;
+    /* Bottom halves left over by a nested aio_bh_poll run first */
+    if (QSLIST_EMPTY(&ctx->bh_slice)) {
+        aio_bh_take_pending(ctx);
+    }
 
     ret = 0;
-    for (bh = ctx->first_bh; bh; bh = next) {
-        next = bh->next;
-        if (!bh->deleted && bh->scheduled) {
-            bh->scheduled = 0;
-            if (!bh->idle)
+    while ((bh = QSLIST_FIRST(&ctx->bh_slice)) != NULL) {
+        QSLIST_REMOVE_HEAD(&ctx->bh_slice, next);
+        flags = atomic_fetch_and(&bh->flags,
+                                 ~(BH_PENDING | BH_SCHEDULED | BH_IDLE));
+        if (flags & BH_DELETED) {
+            g_free(bh);
+        } else if (flags & BH_SCHEDULED) {
+            if (!(flags & BH_IDLE)) {
                 ret = 1;
-            bh->idle = 0;
-            bh->cb(bh->opaque);
-        }
-    }
-
-    ctx->walking_bh--;
-
-    /* remove deleted bhs */
-    if (!ctx->walking_bh) {
-        bhp = &ctx->first_bh;
-        while (*bhp) {
-            bh = *bhp;
-            if (bh->deleted) {
-                *bhp = bh->next;
-                g_free(bh);
-            } else {
-                bhp = &bh->next;
             }
+            bh->cb(bh->opaque);
         }
     }
 
@@ -92,68 +135,90 @@ int aio_bh_poll(AioContext *ctx)
 
 void qemu_bh_schedule_idle(QEMUBH *bh)
 {
-    if (bh->scheduled)
+    if (atomic_read(&bh->flags) & BH_SCHEDULED) {
         return;
-    bh->scheduled = 1;
-    bh->idle = 1;
+    }
+    aio_bh_enqueue(bh, BH_SCHEDULED | BH_IDLE);
 }
 
 void qemu_bh_schedule(QEMUBH *bh)
 {
-    if (bh->scheduled)
+    unsigned old_flags;
+
+    if ((atomic_read(&bh->flags) & (BH_SCHEDULED | BH_IDLE)) == BH_SCHEDULED) {
         return;
-    bh->scheduled = 1;
-    bh->idle = 0;
-    aio_notify(bh->ctx);
+    }
+
+    /* A pending qemu_bh_schedule_idle() is upgraded to a normal one */
+    old_flags = atomic_fetch_and(&bh->flags, ~BH_IDLE);
+    old_flags |= aio_bh_enqueue(bh, BH_SCHEDULED);
+    if ((old_flags & (BH_SCHEDULED | BH_IDLE)) != BH_SCHEDULED) {
+        aio_notify(bh->ctx);
+    }
 }
 
 void qemu_bh_cancel(QEMUBH *bh)
 {
-    bh->scheduled = 0;
+    atomic_fetch_and(&bh->flags, ~(BH_SCHEDULED | BH_IDLE));
 }
 
 void qemu_bh_delete(QEMUBH *bh)
 {
-    bh->scheduled = 0;
-    bh->deleted = 1;
+    atomic_fetch_and(&bh->flags, ~(BH_SCHEDULED | BH_IDLE));
+    aio_bh_enqueue(bh, BH_DELETED);
 }
 
-static gboolean
-aio_ctx_prepare(GSource *source, gint    *timeout)
+static int64_t aio_bh_list_timeout(QEMUBH *bh, int64_t timeout)
 {
-    AioContext *ctx = (AioContext *) source;
-    QEMUBH *bh;
+    unsigned flags;
 
-    for (bh = ctx->first_bh; bh; bh = bh->next) {
-        if (!bh->deleted && bh->scheduled) {
-            if (bh->idle) {
-                /* idle bottom halves will be polled at least
-                 * every 10ms */
-                *timeout = 10;
-            } else {
-                /* non-idle bottom halves will be executed
-                 * immediately */
-                *timeout = 0;
-                return true;
-            }
+    for (; bh; bh = QSLIST_NEXT(bh, next)) {
+        flags = atomic_read(&bh->flags);
+        if (!(flags & BH_SCHEDULED)) {
+            continue;
+        }
+        if (!(flags & BH_IDLE)) {
+            /* non-idle bottom halves will be executed immediately */
+            return 0;
         }
+        /* idle bottom halves will be polled at least every 10ms */
+        timeout = 10 * SCALE_MS;
     }
+    return timeout;
+}
+
+int64_t aio_compute_timeout(AioContext *ctx)
+{
+    int64_t timeout, deadline;
+
+    timeout = aio_bh_list_timeout(QSLIST_FIRST(&ctx->bh_slice), -1);
+    if (timeout) {
+        timeout = aio_bh_list_timeout(atomic_read(&ctx->bh_list.slh_first),
+                                      timeout);
+    }
+    if (timeout == 0) {
+        return 0;
+    }
+
+    deadline = qemu_timer_list_group_deadline_ns(&ctx->tlg);
+    return qemu_soonest_timeout(timeout, deadline);
+}
 
-    return false;
+static gboolean
+aio_ctx_prepare(GSource *source, gint    *timeout)
+{
+    AioContext *ctx = (AioContext *) source;
+
+    *timeout = qemu_timeout_ns_to_ms(aio_compute_timeout(ctx));
+    return *timeout == 0;
 }
 
 static gboolean
 aio_ctx_check(GSource *source)
 {
     AioContext *ctx = (AioContext *) source;
-    QEMUBH *bh;
 
-    for (bh = ctx->first_bh; bh; bh = bh->next) {
-        if (!bh->deleted && bh->scheduled) {
-            return true;
-	}
-    }
-    return aio_pending(ctx);
+    return aio_pending(ctx) || aio_compute_timeout(ctx) == 0;
 }
 
 static gboolean
@@ -172,11 +237,23 @@ static void
 aio_ctx_finalize(GSource     *source)
 {
     AioContext *ctx = (AioContext *) source;
+    QEMUBH *bh;
 
     thread_pool_free(ctx->thread_pool);
     aio_set_event_notifier(ctx, &ctx->notifier, NULL, NULL);
     event_notifier_cleanup(&ctx->notifier);
     g_array_free(ctx->pollfds, TRUE);
+    aio_context_cleanup(ctx);
+    qemu_timer_list_group_deinit(&ctx->tlg);
+
+    /* Free the bottom halves whose deletion is still pending */
+    aio_bh_take_pending(ctx);
+    while ((bh = QSLIST_FIRST(&ctx->bh_slice)) != NULL) {
+        QSLIST_REMOVE_HEAD(&ctx->bh_slice, next);
+        if (bh->flags & BH_DELETED) {
+            g_free(bh);
+        }
+    }
 }
 
 static GSourceFuncs aio_source_funcs = {
@@ -202,7 +279,36 @@ ThreadPool *aio_get_thread_pool(AioContext *ctx)
 
 void aio_notify(AioContext *ctx)
 {
-    event_notifier_set(&ctx->notifier);
+    /* Only the first call after the notifier was last cleared writes to
+     * it, so wakeups from many threads cost a single system call.
+     */
+    if (!atomic_xchg(&ctx->notified, true)) {
+        event_notifier_set(&ctx->notifier);
+    }
+}
+
+static void aio_notify_accept(EventNotifier *e)
+{
+    AioContext *ctx = container_of(e, AioContext, notifier);
+
+    /* Clear the notifier before ctx->notified, or the wakeup of a thread
+     * that sets ctx->notified in between would be lost.  Anything it
+     * scheduled is visible to aio_compute_timeout once the flag is clear.
+     */
+    event_notifier_test_and_clear(e);
+    atomic_xchg(&ctx->notified, false);
+}
+
+static bool aio_notify_poll(EventNotifier *e)
+{
+    AioContext *ctx = container_of(e, AioContext, notifier);
+
+    return atomic_read(&ctx->notified);
+}
+
+static void aio_timer_notify(void *opaque)
+{
+    aio_notify(opaque);
 }
 
 AioContext *aio_context_new(void)
@@ -211,14 +317,22 @@ AioContext *aio_context_new(void)
     ctx = (AioContext *) g_source_new(&aio_source_funcs, sizeof(AioContext));
     ctx->pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
     ctx->thread_pool = NULL;
+    init_clocks();
+    qemu_timer_list_group_init(&ctx->tlg, aio_timer_notify, ctx);
+    aio_context_setup(ctx);
     event_notifier_init(&ctx->notifier, false);
-    aio_set_event_notifier(ctx, &ctx->notifier, 
-                           (EventNotifierHandler *)
-                           event_notifier_test_and_clear, NULL);
+    aio_set_event_notifier(ctx, &ctx->notifier, aio_notify_accept, NULL);
+    aio_set_event_notifier_poll(ctx, &ctx->notifier, aio_notify_poll);
 
     return ctx;
 }
 
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns)
+{
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+}
+
 void aio_context_ref(AioContext *ctx)
 {
     g_source_ref(&ctx->source);
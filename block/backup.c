@@ -0,0 +1,571 @@
+/*
+ * Point-in-time backup
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "block/blockjob.h"
+#include "block/block_int.h"
+#include "qemu/ratelimit.h"
+
+#define BACKUP_CLUSTER_BITS 16
+#define BACKUP_CLUSTER_SIZE (1 << BACKUP_CLUSTER_BITS)
+#define BACKUP_SECTORS_PER_CLUSTER (BACKUP_CLUSTER_SIZE / BDRV_SECTOR_SIZE)
+
+/* Background copies are issued in chunks of up to 1 MB, several at a time */
+#define BACKUP_MAX_CHUNK_CLUSTERS 16
+#define BACKUP_MAX_IN_FLIGHT 8
+
+#define SLICE_TIME 100000000ULL /* ns */
+
+typedef struct CowRequest {
+    int64_t start;
+    int64_t end;
+    QLIST_ENTRY(CowRequest) list;
+    CoQueue wait_queue; /* coroutines blocked on this request */
+} CowRequest;
+
+typedef struct BackupBlockJob {
+    BlockJob common;
+    BlockDriverState *target;
+    MirrorSyncMode sync_mode;
+    RateLimit limit;
+    BlockdevOnError on_source_error;
+    BlockdevOnError on_target_error;
+    CoRwlock flush_rwlock;
+
+    /* Sectors that still have to be copied, at cluster granularity.  A bit
+     * is cleared once the old contents of the cluster are on the target.
+     */
+    HBitmap *copy_bitmap;
+
+    /* For incremental backups: the name of the user's dirty bitmap and the
+     * clusters taken from it when the job started.  If the job fails they
+     * are marked dirty again, so that the next backup picks them up.
+     */
+    char *sync_bitmap_name;
+    HBitmap *sync_snapshot;
+
+    NotifierWithReturn before_write;
+    QLIST_HEAD(, CowRequest) inflight_reqs;
+
+    int64_t sector_num;     /* next sector considered by the background copy */
+    int in_flight;          /* background chunks being copied */
+    bool waiting;           /* job coroutine waits for a chunk to complete */
+    int ret;
+} BackupBlockJob;
+
+typedef struct BackupOp {
+    BackupBlockJob *job;
+    int64_t sector_num;
+    int nb_sectors;
+} BackupOp;
+
+/* See if in-flight requests overlap and wait for them to complete */
+static void coroutine_fn wait_for_overlapping_requests(BackupBlockJob *job,
+                                                       int64_t start,
+                                                       int64_t end)
+{
+    CowRequest *req;
+    bool retry;
+
+    do {
+        retry = false;
+        QLIST_FOREACH(req, &job->inflight_reqs, list) {
+            if (end > req->start && start < req->end) {
+                qemu_co_queue_wait(&req->wait_queue);
+                retry = true;
+                break;
+            }
+        }
+    } while (retry);
+}
+
+/* Keep track of an in-flight request */
+static void cow_request_begin(CowRequest *req, BackupBlockJob *job,
+                              int64_t start, int64_t end)
+{
+    req->start = start;
+    req->end = end;
+    qemu_co_queue_init(&req->wait_queue);
+    QLIST_INSERT_HEAD(&job->inflight_reqs, req, list);
+}
+
+/* Forget about a completed request */
+static void cow_request_end(CowRequest *req)
+{
+    QLIST_REMOVE(req, list);
+    qemu_co_queue_restart_all(&req->wait_queue);
+}
+
+/*
+ * Copy the clusters covering @sector_num..@sector_num+@nb_sectors that have
+ * not been copied yet.  Contiguous clusters are read and written with a
+ * single request.  Unless called from the before write notifier, clusters
+ * that are not allocated in the top image are skipped for sync=top.
+ */
+static int coroutine_fn backup_do_cow(BackupBlockJob *job,
+                                      int64_t sector_num, int nb_sectors,
+                                      bool *error_is_read,
+                                      bool is_write_notifier)
+{
+    BlockDriverState *bs = job->common.bs;
+    CowRequest cow_request;
+    struct iovec iov;
+    QEMUIOVector bounce_qiov;
+    void *bounce_buffer = NULL;
+    int64_t start, end, run_end, total_sectors;
+    int n, pnum;
+    int ret = 0;
+
+    qemu_co_rwlock_rdlock(&job->flush_rwlock);
+
+    start = sector_num / BACKUP_SECTORS_PER_CLUSTER;
+    end = DIV_ROUND_UP(sector_num + nb_sectors, BACKUP_SECTORS_PER_CLUSTER);
+    total_sectors = bs->total_sectors;
+
+    trace_backup_do_cow_enter(job, start, sector_num, nb_sectors);
+
+    wait_for_overlapping_requests(job, start, end);
+    cow_request_begin(&cow_request, job, start, end);
+
+    while (start < end) {
+        if (!hbitmap_get(job->copy_bitmap,
+                         start * BACKUP_SECTORS_PER_CLUSTER)) {
+            trace_backup_do_cow_skip(job, start);
+            start++;
+            continue;
+        }
+
+        run_end = start + 1;
+        while (run_end < end &&
+               run_end - start < BACKUP_MAX_CHUNK_CLUSTERS &&
+               hbitmap_get(job->copy_bitmap,
+                           run_end * BACKUP_SECTORS_PER_CLUSTER)) {
+            run_end++;
+        }
+        n = MIN((run_end - start) * BACKUP_SECTORS_PER_CLUSTER,
+                total_sectors - start * BACKUP_SECTORS_PER_CLUSTER);
+
+        if (job->sync_mode == MIRROR_SYNC_MODE_TOP && !is_write_notifier) {
+            ret = bdrv_co_is_allocated(bs, start * BACKUP_SECTORS_PER_CLUSTER,
+                                       n, &pnum);
+            if (ret < 0) {
+                if (error_is_read) {
+                    *error_is_read = true;
+                }
+                goto out;
+            }
+            if (ret == 0 && pnum >= BACKUP_SECTORS_PER_CLUSTER) {
+                /* The target's backing file provides these clusters */
+                pnum = QEMU_ALIGN_DOWN(pnum, BACKUP_SECTORS_PER_CLUSTER);
+                hbitmap_reset(job->copy_bitmap,
+                              start * BACKUP_SECTORS_PER_CLUSTER, pnum);
+                job->common.offset += pnum * BDRV_SECTOR_SIZE;
+                start += pnum / BACKUP_SECTORS_PER_CLUSTER;
+                continue;
+            }
+        }
+
+        trace_backup_do_cow_process(job, start, n);
+
+        if (!bounce_buffer) {
+            bounce_buffer = qemu_blockalign(bs, BACKUP_MAX_CHUNK_CLUSTERS *
+                                                BACKUP_CLUSTER_SIZE);
+        }
+        iov.iov_base = bounce_buffer;
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+        ret = bdrv_co_readv_no_serialising(bs,
+                                           start * BACKUP_SECTORS_PER_CLUSTER,
+                                           n, &bounce_qiov);
+        if (ret < 0) {
+            trace_backup_do_cow_read_fail(job, start, ret);
+            if (error_is_read) {
+                *error_is_read = true;
+            }
+            goto out;
+        }
+
+        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
+            ret = bdrv_co_write_zeroes(job->target,
+                                       start * BACKUP_SECTORS_PER_CLUSTER, n);
+        } else {
+            ret = bdrv_co_writev(job->target,
+                                 start * BACKUP_SECTORS_PER_CLUSTER, n,
+                                 &bounce_qiov);
+        }
+        if (ret < 0) {
+            trace_backup_do_cow_write_fail(job, start, ret);
+            if (error_is_read) {
+                *error_is_read = false;
+            }
+            goto out;
+        }
+
+        hbitmap_reset(job->copy_bitmap, start * BACKUP_SECTORS_PER_CLUSTER, n);
+        job->common.offset += n * BDRV_SECTOR_SIZE;
+        start = run_end;
+    }
+
+out:
+    if (bounce_buffer) {
+        qemu_vfree(bounce_buffer);
+    }
+
+    cow_request_end(&cow_request);
+
+    trace_backup_do_cow_return(job, sector_num, nb_sectors, ret);
+
+    qemu_co_rwlock_unlock(&job->flush_rwlock);
+
+    return ret;
+}
+
+static int coroutine_fn backup_before_write_notify(
+        NotifierWithReturn *notifier,
+        void *opaque)
+{
+    BackupBlockJob *job = container_of(notifier, BackupBlockJob, before_write);
+    BdrvTrackedRequest *req = opaque;
+
+    return backup_do_cow(job, req->sector_num, req->nb_sectors, NULL, true);
+}
+
+static void backup_set_speed(BlockJob *job, int64_t speed, Error **errp)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+
+    if (speed < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER, "speed");
+        return;
+    }
+    ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
+}
+
+static void backup_iostatus_reset(BlockJob *job)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+
+    bdrv_iostatus_reset(s->target);
+}
+
+static BlockJobType backup_job_type = {
+    .instance_size = sizeof(BackupBlockJob),
+    .job_type = "backup",
+    .set_speed = backup_set_speed,
+    .iostatus_reset = backup_iostatus_reset,
+};
+
+static BlockErrorAction backup_error_action(BackupBlockJob *job,
+                                            bool read, int error)
+{
+    if (read) {
+        return block_job_error_action(&job->common, job->common.bs,
+                                      job->on_source_error, true, error);
+    } else {
+        return block_job_error_action(&job->common, job->target,
+                                      job->on_target_error, false, error);
+    }
+}
+
+static void coroutine_fn backup_co_op(void *opaque)
+{
+    BackupOp *op = opaque;
+    BackupBlockJob *job = op->job;
+    bool error_is_read;
+    int ret;
+
+    ret = backup_do_cow(job, op->sector_num, op->nb_sectors,
+                        &error_is_read, false);
+    if (ret < 0) {
+        if (backup_error_action(job, error_is_read, -ret) ==
+            BDRV_ACTION_REPORT) {
+            if (job->ret == 0) {
+                job->ret = ret;
+            }
+        } else {
+            /* The clusters are still marked in copy_bitmap, retry them */
+            job->sector_num = MIN(job->sector_num, op->sector_num);
+        }
+    }
+
+    job->in_flight--;
+    g_slice_free(BackupOp, op);
+
+    if (job->waiting) {
+        qemu_coroutine_enter(job->common.co, NULL);
+    }
+}
+
+static void coroutine_fn backup_wait_for_op(BackupBlockJob *job)
+{
+    assert(job->in_flight > 0);
+    job->waiting = true;
+    qemu_coroutine_yield();
+    job->waiting = false;
+}
+
+/*
+ * Find the next run of clusters to copy in the background, starting at
+ * job->sector_num.  Returns the first sector of the chunk, or -1 if
+ * everything past job->sector_num has been copied.
+ */
+static int64_t backup_next_chunk(BackupBlockJob *job, int *nb_sectors)
+{
+    int64_t total_sectors = job->common.bs->total_sectors;
+    int64_t sector_num, end;
+    HBitmapIter hbi;
+
+    if (job->sector_num >= total_sectors) {
+        return -1;
+    }
+
+    hbitmap_iter_init(&hbi, job->copy_bitmap, job->sector_num);
+    sector_num = hbitmap_iter_next(&hbi);
+    if (sector_num < 0 || sector_num >= total_sectors) {
+        job->sector_num = total_sectors;
+        return -1;
+    }
+
+    end = sector_num + BACKUP_SECTORS_PER_CLUSTER;
+    while (end < total_sectors &&
+           end - sector_num < BACKUP_MAX_CHUNK_CLUSTERS *
+                              BACKUP_SECTORS_PER_CLUSTER &&
+           hbitmap_get(job->copy_bitmap, end)) {
+        end += BACKUP_SECTORS_PER_CLUSTER;
+    }
+    end = MIN(end, total_sectors);
+
+    job->sector_num = end;
+    *nb_sectors = end - sector_num;
+    return sector_num;
+}
+
+static void backup_start_op(BackupBlockJob *job, int64_t sector_num,
+                            int nb_sectors)
+{
+    BackupOp *op;
+    Coroutine *co;
+
+    op = g_slice_new(BackupOp);
+    op->job = job;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+
+    job->in_flight++;
+    co = qemu_coroutine_create(backup_co_op);
+    qemu_coroutine_enter(co, op);
+}
+
+static void backup_complete_sync_bitmap(BackupBlockJob *job, int ret)
+{
+    BlockDriverState *bs = job->common.bs;
+    BdrvDirtyBitmap *bitmap;
+    HBitmapIter hbi;
+    int64_t sector_num;
+
+    if (!job->sync_snapshot) {
+        return;
+    }
+
+    /* On success the user's bitmap has been tracking the writes since the
+     * point in time of the backup, which is exactly what the next
+     * incremental backup needs.  Otherwise the data was not copied and must
+     * be considered dirty again.
+     */
+    bitmap = bdrv_find_dirty_bitmap(bs, job->sync_bitmap_name);
+    if (ret < 0 && bitmap) {
+        hbitmap_iter_init(&hbi, job->sync_snapshot, 0);
+        while ((sector_num = hbitmap_iter_next(&hbi)) >= 0) {
+            bdrv_set_dirty_bitmap(bitmap, sector_num,
+                                  MIN(BACKUP_SECTORS_PER_CLUSTER,
+                                      bs->total_sectors - sector_num));
+        }
+    }
+
+    hbitmap_free(job->sync_snapshot);
+    g_free(job->sync_bitmap_name);
+}
+
+static void coroutine_fn backup_run(void *opaque)
+{
+    BackupBlockJob *job = opaque;
+    BlockDriverState *bs = job->common.bs;
+    BlockDriverState *target = job->target;
+    int64_t last_pause_ns, delay_ns;
+    int64_t sector_num;
+    int nb_sectors;
+    int ret = 0;
+
+    QLIST_INIT(&job->inflight_reqs);
+    qemu_co_rwlock_init(&job->flush_rwlock);
+
+    job->before_write.notify = backup_before_write_notify;
+    bdrv_add_before_write_notifier(bs, &job->before_write);
+
+    /* Only the write notifier copies data for sync=none */
+    if (job->sync_mode == MIRROR_SYNC_MODE_NONE) {
+        job->sector_num = bs->total_sectors;
+    }
+
+    last_pause_ns = qemu_get_clock_ns(rt_clock);
+    delay_ns = 0;
+    for (;;) {
+        if (job->ret < 0 || block_job_is_cancelled(&job->common)) {
+            break;
+        }
+
+        /* Note that even when no rate limit is applied we need to yield
+         * periodically with no pending I/O so that bdrv_drain_all() returns.
+         * We do so every SLICE_TIME nanoseconds, when the rate limit is
+         * exceeded, or when there is an error, whichever comes first.
+         */
+        if (qemu_get_clock_ns(rt_clock) - last_pause_ns < SLICE_TIME &&
+            delay_ns == 0 &&
+            job->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
+            if (job->in_flight == BACKUP_MAX_IN_FLIGHT) {
+                backup_wait_for_op(job);
+                continue;
+            }
+
+            sector_num = backup_next_chunk(job, &nb_sectors);
+            if (sector_num >= 0) {
+                if (job->common.speed) {
+                    delay_ns = ratelimit_calculate_delay(&job->limit,
+                                                         nb_sectors);
+                }
+                backup_start_op(job, sector_num, nb_sectors);
+                continue;
+            }
+
+            if (job->in_flight > 0) {
+                backup_wait_for_op(job);
+                continue;
+            }
+
+            if (job->sync_mode != MIRROR_SYNC_MODE_NONE) {
+                /* Everything has been copied */
+                break;
+            }
+        }
+
+        while (job->in_flight > 0) {
+            backup_wait_for_op(job);
+        }
+
+        /* With sync=none the job runs until it is cancelled */
+        if (job->sync_mode == MIRROR_SYNC_MODE_NONE && delay_ns == 0) {
+            delay_ns = SLICE_TIME;
+        }
+        block_job_sleep_ns(&job->common, rt_clock, delay_ns);
+        last_pause_ns = qemu_get_clock_ns(rt_clock);
+        delay_ns = 0;
+    }
+
+    while (job->in_flight > 0) {
+        backup_wait_for_op(job);
+    }
+    ret = job->ret;
+
+    notifier_with_return_remove(&job->before_write);
+
+    /* wait until pending backup_do_cow() calls have completed */
+    qemu_co_rwlock_wrlock(&job->flush_rwlock);
+    qemu_co_rwlock_unlock(&job->flush_rwlock);
+
+    if (ret == 0 && !hbitmap_empty(job->copy_bitmap) &&
+        job->sync_mode != MIRROR_SYNC_MODE_NONE) {
+        ret = -ECANCELED;
+    }
+    if (ret == 0) {
+        ret = bdrv_flush(target);
+    }
+
+    backup_complete_sync_bitmap(job, ret);
+    hbitmap_free(job->copy_bitmap);
+
+    bdrv_iostatus_disable(target);
+    bdrv_delete(target);
+
+    block_job_completed(&job->common, ret);
+}
+
+void backup_start(BlockDriverState *bs, BlockDriverState *target,
+                  int64_t speed, MirrorSyncMode sync_mode,
+                  BdrvDirtyBitmap *sync_bitmap,
+                  BlockdevOnError on_source_error,
+                  BlockdevOnError on_target_error,
+                  BlockDriverCompletionFunc *cb, void *opaque,
+                  Error **errp)
+{
+    BackupBlockJob *job;
+    HBitmapIter hbi;
+    int64_t len, sector_num;
+    int granularity, nb_sectors;
+
+    assert(bs);
+    assert(target);
+    assert(cb);
+    assert((sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) == !!sync_bitmap);
+
+    if ((on_source_error == BLOCKDEV_ON_ERROR_STOP ||
+         on_source_error == BLOCKDEV_ON_ERROR_ENOSPC) &&
+        !bdrv_iostatus_is_enabled(bs)) {
+        error_set(errp, QERR_INVALID_PARAMETER, "on-source-error");
+        return;
+    }
+
+    len = bdrv_getlength(bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "unable to get length for '%s'",
+                         bdrv_get_device_name(bs));
+        return;
+    }
+
+    job = block_job_create(&backup_job_type, bs, speed, cb, opaque, errp);
+    if (!job) {
+        return;
+    }
+
+    job->on_source_error = on_source_error;
+    job->on_target_error = on_target_error;
+    job->target = target;
+    job->sync_mode = sync_mode;
+    job->copy_bitmap = hbitmap_alloc(bs->total_sectors,
+                                     BACKUP_CLUSTER_BITS - BDRV_SECTOR_BITS);
+
+    if (sync_bitmap) {
+        /* Take the dirty clusters out of the user's bitmap.  From now on it
+         * records the writes made after this point in time.
+         */
+        job->sync_bitmap_name = g_strdup(sync_bitmap->name);
+        job->sync_snapshot = hbitmap_alloc(bs->total_sectors,
+                                           BACKUP_CLUSTER_BITS -
+                                           BDRV_SECTOR_BITS);
+        granularity = bdrv_dirty_bitmap_granularity(sync_bitmap) >>
+                      BDRV_SECTOR_BITS;
+        bdrv_dirty_iter_init(bs, sync_bitmap, &hbi);
+        while ((sector_num = hbitmap_iter_next(&hbi)) >= 0) {
+            nb_sectors = MIN(granularity, bs->total_sectors - sector_num);
+            hbitmap_set(job->copy_bitmap, sector_num, nb_sectors);
+            hbitmap_set(job->sync_snapshot, sector_num, nb_sectors);
+        }
+        bdrv_clear_dirty_bitmap(sync_bitmap);
+    } else {
+        hbitmap_set(job->copy_bitmap, 0, bs->total_sectors);
+    }
+    job->common.len = MIN(len, hbitmap_count(job->copy_bitmap) *
+                               BDRV_SECTOR_SIZE);
+
+    bdrv_set_enable_write_cache(target, true);
+    bdrv_set_on_error(target, on_target_error, on_target_error);
+    bdrv_iostatus_enable(target);
+    job->common.co = qemu_coroutine_create(backup_run);
+    trace_backup_start(bs, job, job->common.co, opaque);
+    qemu_coroutine_enter(job->common.co, job);
+}
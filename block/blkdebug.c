@@ -25,6 +25,7 @@
 #include "qemu-common.h"
 #include "qemu/config-file.h"
 #include "block/block_int.h"
+#include "qemu/main-loop.h"
 #include "qemu/module.h"
 
 typedef struct BDRVBlkdebugState {
@@ -10,6 +10,7 @@
 #include <stdarg.h>
 #include "qemu/sockets.h" /* for EINPROGRESS on Windows */
 #include "block/block_int.h"
+#include "qemu/main-loop.h"
 
 typedef struct {
     BlockDriverState *test_file;
@@ -23,6 +23,7 @@
  */
 #include "qemu-common.h"
 #include "block/block_int.h"
+#include "qemu/main-loop.h"
 #include <curl/curl.h>
 
 // #define DEBUG
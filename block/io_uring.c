@@ -0,0 +1,519 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "block/block.h"
+#include "block/aio.h"
+#include "block/raw-aio.h"
+#include "qemu/event_notifier.h"
+#include "trace.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/falloc.h>
+#include <linux/io_uring.h>
+
+/*
+ * Submission queue size (per-device).  The completion queue is twice as
+ * large, and the kernel does not drop completions when it overflows anyway
+ * (IORING_FEAT_NODROP), so this only bounds how many requests can be
+ * submitted with a single system call.
+ */
+#define MAX_ENTRIES 128
+
+typedef struct LuringAIOCB {
+    BlockDriverAIOCB common;
+    struct LuringState *s;
+    ssize_t ret;
+    size_t nbytes;
+    QEMUIOVector *qiov;
+    int type;
+} LuringAIOCB;
+
+typedef struct LuringState {
+    int ring_fd;
+    EventNotifier e;
+    AioContext *ctx;
+    QEMUBH *submit_bh;
+    int count;          /* requests submitted or queued, not completed */
+    unsigned queued;    /* SQEs that io_uring_enter has not seen yet */
+    bool retry_submit;  /* resubmit the queued SQEs after a completion */
+    bool has_fallocate;
+
+    /* Submission queue, shared with the kernel */
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    /* Completion queue, shared with the kernel */
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    unsigned *cq_entries;
+    struct io_uring_cqe *cqes;
+} LuringState;
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Completes an AIO request (calls the callback and frees the ACB).
+ */
+static void luring_process_completion(LuringState *s, LuringAIOCB *acb)
+{
+    ssize_t ret;
+
+    s->count--;
+
+    ret = acb->ret;
+    trace_luring_process_completion(s, acb, ret);
+    if (ret != -ECANCELED) {
+        switch (acb->type) {
+        case QEMU_AIO_READ:
+        case QEMU_AIO_WRITE:
+            if (ret == acb->nbytes) {
+                ret = 0;
+            } else if (ret >= 0) {
+                /* Short reads mean EOF, pad with zeros. */
+                if (acb->type == QEMU_AIO_READ) {
+                    qemu_iovec_memset(acb->qiov, ret, 0,
+                                      acb->qiov->size - ret);
+                    ret = 0;
+                } else {
+                    ret = -EINVAL;
+                }
+            }
+            break;
+        case QEMU_AIO_DISCARD:
+            /* Later discards go through the thread pool, which knows
+             * about the other ways to punch holes.
+             */
+            if (ret == -EOPNOTSUPP || ret == -ENOSYS || ret == -EINVAL) {
+                s->has_fallocate = false;
+                ret = 0;
+            }
+            break;
+        }
+
+        acb->common.cb(acb->common.opaque, ret);
+    }
+
+    qemu_aio_release(acb);
+}
+
+static void luring_process_completions(LuringState *s)
+{
+    /* The head is written back before each callback, so that callbacks
+     * can safely poll the ring again, for example through luring_cancel().
+     */
+    while (*s->cq_head != *(volatile unsigned *)s->cq_tail) {
+        unsigned head = *s->cq_head;
+        struct io_uring_cqe *cqe;
+        LuringAIOCB *acb;
+
+        /* Read the tail before the entry */
+        smp_rmb();
+        cqe = &s->cqes[head & *s->cq_mask];
+        acb = (LuringAIOCB *)(uintptr_t)cqe->user_data;
+        acb->ret = cqe->res;
+
+        /* Read the entry before giving it back to the kernel */
+        smp_mb();
+        *s->cq_head = head + 1;
+
+        luring_process_completion(s, acb);
+    }
+}
+
+/* Submits all queued SQEs.  Returns 0 or a negative errno value. */
+static int luring_flush_submissions(LuringState *s)
+{
+    int ret;
+
+    while (s->queued) {
+        ret = io_uring_enter(s->ring_fd, s->queued, 0, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        trace_luring_submit(s, ret);
+        if (ret == 0) {
+            return -EAGAIN;
+        }
+        s->queued -= ret;
+    }
+    return 0;
+}
+
+/*
+ * Takes the queued SQEs back from the submission queue and completes their
+ * requests with the error @ret.  The kernel only consumes SQEs inside
+ * io_uring_enter, so the unsubmitted tail of the ring is still ours.
+ */
+static void luring_fail_submissions(LuringState *s, int ret)
+{
+    unsigned tail, i, n = s->queued;
+    LuringAIOCB **acbs;
+
+    if (n == 0) {
+        return;
+    }
+
+    /* Rewind the ring before running callbacks, which may queue new SQEs */
+    acbs = g_new(LuringAIOCB *, n);
+    tail = *s->sq_tail - n;
+    for (i = 0; i < n; i++) {
+        unsigned index = s->sq_array[(tail + i) & *s->sq_mask];
+        acbs[i] = (LuringAIOCB *)(uintptr_t)s->sqes[index].user_data;
+    }
+    *s->sq_tail = tail;
+    s->queued = 0;
+
+    trace_luring_fail_submissions(s, n, ret);
+    for (i = 0; i < n; i++) {
+        acbs[i]->ret = ret;
+        luring_process_completion(s, acbs[i]);
+    }
+    g_free(acbs);
+}
+
+static void luring_do_submit(LuringState *s)
+{
+    int ret;
+
+    s->retry_submit = false;
+    ret = luring_flush_submissions(s);
+    if ((ret == -EAGAIN || ret == -EBUSY) && s->count > s->queued) {
+        /* Out of kernel resources, retry once completions come in */
+        s->retry_submit = true;
+    } else if (ret < 0) {
+        luring_fail_submissions(s, ret);
+    }
+}
+
+static void luring_submit_bh(void *opaque)
+{
+    luring_do_submit(opaque);
+}
+
+static void luring_completion_cb(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    event_notifier_test_and_clear(&s->e);
+    luring_process_completions(s);
+    if (s->retry_submit) {
+        luring_do_submit(s);
+    }
+}
+
+static int luring_flush_cb(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    return (s->count > 0) ? 1 : 0;
+}
+
+/* Busy-wait callback, see aio_set_event_notifier_poll() */
+static bool luring_poll_cb(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    return *s->cq_head != *(volatile unsigned *)s->cq_tail;
+}
+
+static void luring_cancel(BlockDriverAIOCB *blockacb)
+{
+    LuringAIOCB *acb = (LuringAIOCB *)blockacb;
+    LuringState *s = acb->s;
+
+    if (acb->ret != -EINPROGRESS) {
+        return;
+    }
+
+    /*
+     * Like Linux AIO, reads and writes to files and block devices are not
+     * really cancellable, so just wait for the request to finish.  If it
+     * cannot be submitted, luring_do_submit() completes it with an error.
+     */
+    while (acb->ret == -EINPROGRESS) {
+        if (s->queued) {
+            luring_do_submit(s);
+            if (acb->ret != -EINPROGRESS) {
+                break;
+            }
+        }
+        if (io_uring_enter(s->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+            errno != EINTR) {
+            /* Wait for the completion notifier instead */
+            aio_poll(s->ctx, true);
+            continue;
+        }
+        luring_process_completions(s);
+    }
+}
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(LuringAIOCB),
+    .cancel             = luring_cancel,
+};
+
+BlockDriverAIOCB *luring_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int type)
+{
+    LuringState *s = aio_ctx;
+    LuringAIOCB *acb;
+    struct io_uring_sqe *sqe;
+    unsigned tail, index;
+
+    if (type == QEMU_AIO_DISCARD && !s->has_fallocate) {
+        return NULL;
+    }
+
+    /* Completions that do not fit in the completion queue would be held
+     * back by the kernel until the next io_uring_enter, so let the caller
+     * use the thread pool instead.
+     */
+    if (s->count >= (int)*s->cq_entries) {
+        return NULL;
+    }
+
+    /* Make room in the submission queue if needed */
+    tail = *s->sq_tail;
+    if (tail - *(volatile unsigned *)s->sq_head == *s->sq_entries &&
+        luring_flush_submissions(s) < 0) {
+        return NULL;
+    }
+    if (tail - *(volatile unsigned *)s->sq_head == *s->sq_entries) {
+        return NULL;
+    }
+
+    acb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    acb->s = s;
+    acb->ret = -EINPROGRESS;
+    acb->nbytes = nb_sectors * BDRV_SECTOR_SIZE;
+    acb->qiov = qiov;
+    acb->type = type;
+
+    index = tail & *s->sq_mask;
+    sqe = &s->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = fd;
+    sqe->user_data = (uintptr_t)acb;
+
+    switch (type) {
+    case QEMU_AIO_READ:
+    case QEMU_AIO_WRITE:
+        sqe->opcode = type == QEMU_AIO_READ ? IORING_OP_READV
+                                            : IORING_OP_WRITEV;
+        sqe->addr = (uintptr_t)qiov->iov;
+        sqe->len = qiov->niov;
+        sqe->off = sector_num * BDRV_SECTOR_SIZE;
+        break;
+    case QEMU_AIO_FLUSH:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        break;
+    case QEMU_AIO_DISCARD:
+        sqe->opcode = IORING_OP_FALLOCATE;
+        sqe->len = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+        sqe->off = sector_num * BDRV_SECTOR_SIZE;
+        sqe->addr = acb->nbytes;
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        qemu_aio_release(acb);
+        return NULL;
+    }
+
+    s->sq_array[index] = index;
+
+    /* Write the entry before publishing it */
+    smp_wmb();
+    *s->sq_tail = tail + 1;
+
+    /* Requests submitted in the same main loop iteration share one
+     * io_uring_enter call.
+     */
+    s->count++;
+    s->queued++;
+    qemu_bh_schedule(s->submit_bh);
+    return &acb->common;
+}
+
+/* Returns true if the kernel supports IORING_OP_FALLOCATE */
+static bool luring_probe_fallocate(LuringState *s)
+{
+    struct io_uring_probe *probe;
+    size_t size = sizeof(*probe) + IORING_OP_LAST * sizeof(probe->ops[0]);
+    bool ret = false;
+
+    probe = g_malloc0(size);
+    if (io_uring_register(s->ring_fd, IORING_REGISTER_PROBE,
+                          probe, IORING_OP_LAST) == 0 &&
+        probe->last_op >= IORING_OP_FALLOCATE) {
+        ret = probe->ops[IORING_OP_FALLOCATE].flags & IO_URING_OP_SUPPORTED;
+    }
+    g_free(probe);
+    return ret;
+}
+
+static int luring_map_rings(LuringState *s, struct io_uring_params *p)
+{
+    s->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    s->cq_ring_size = p->cq_off.cqes +
+                      p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        s->sq_ring_size = MAX(s->sq_ring_size, s->cq_ring_size);
+        s->cq_ring_size = 0;
+    }
+
+    s->sq_ring = mmap(NULL, s->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, s->ring_fd,
+                      IORING_OFF_SQ_RING);
+    if (s->sq_ring == MAP_FAILED) {
+        s->sq_ring = NULL;
+        return -errno;
+    }
+
+    if (s->cq_ring_size) {
+        s->cq_ring = mmap(NULL, s->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, s->ring_fd,
+                          IORING_OFF_CQ_RING);
+        if (s->cq_ring == MAP_FAILED) {
+            s->cq_ring = NULL;
+            return -errno;
+        }
+    } else {
+        s->cq_ring = s->sq_ring;
+    }
+
+    s->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    s->sqes = mmap(NULL, s->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, s->ring_fd, IORING_OFF_SQES);
+    if (s->sqes == MAP_FAILED) {
+        s->sqes = NULL;
+        return -errno;
+    }
+
+    s->sq_head = s->sq_ring + p->sq_off.head;
+    s->sq_tail = s->sq_ring + p->sq_off.tail;
+    s->sq_mask = s->sq_ring + p->sq_off.ring_mask;
+    s->sq_entries = s->sq_ring + p->sq_off.ring_entries;
+    s->sq_array = s->sq_ring + p->sq_off.array;
+
+    s->cq_head = s->cq_ring + p->cq_off.head;
+    s->cq_tail = s->cq_ring + p->cq_off.tail;
+    s->cq_mask = s->cq_ring + p->cq_off.ring_mask;
+    s->cq_entries = s->cq_ring + p->cq_off.ring_entries;
+    s->cqes = s->cq_ring + p->cq_off.cqes;
+    return 0;
+}
+
+static void luring_unmap_rings(LuringState *s)
+{
+    if (s->sqes) {
+        munmap(s->sqes, s->sqes_size);
+    }
+    if (s->cq_ring && s->cq_ring != s->sq_ring) {
+        munmap(s->cq_ring, s->cq_ring_size);
+    }
+    if (s->sq_ring) {
+        munmap(s->sq_ring, s->sq_ring_size);
+    }
+}
+
+void *luring_init(AioContext *ctx)
+{
+    LuringState *s;
+    struct io_uring_params p;
+    int fd;
+
+    /* Old kernels do not have io_uring at all, or lack features that
+     * this code relies on.  The caller falls back to the thread pool.
+     */
+    memset(&p, 0, sizeof(p));
+    fd = io_uring_setup(MAX_ENTRIES, &p);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (!(p.features & IORING_FEAT_NODROP)) {
+        close(fd);
+        return NULL;
+    }
+
+    s = g_malloc0(sizeof(*s));
+    s->ring_fd = fd;
+    s->ctx = ctx;
+    if (luring_map_rings(s, &p) < 0) {
+        goto out_unmap;
+    }
+
+    if (event_notifier_init(&s->e, false) < 0) {
+        goto out_unmap;
+    }
+    fd = event_notifier_get_fd(&s->e);
+    if (io_uring_register(s->ring_fd, IORING_REGISTER_EVENTFD, &fd, 1) < 0) {
+        goto out_close_efd;
+    }
+
+    s->has_fallocate = luring_probe_fallocate(s);
+    s->submit_bh = aio_bh_new(ctx, luring_submit_bh, s);
+    aio_set_event_notifier(ctx, &s->e, luring_completion_cb,
+                           luring_flush_cb);
+    aio_set_event_notifier_poll(ctx, &s->e, luring_poll_cb);
+    trace_luring_init(s, s->has_fallocate);
+
+    return s;
+
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_unmap:
+    luring_unmap_rings(s);
+    close(s->ring_fd);
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(void *aio_ctx)
+{
+    LuringState *s = aio_ctx;
+
+    assert(s->count == 0);
+    aio_set_event_notifier(s->ctx, &s->e, NULL, NULL);
+    qemu_bh_delete(s->submit_bh);
+    event_notifier_cleanup(&s->e);
+    luring_unmap_rings(s);
+    close(s->ring_fd);
+    g_free(s);
+}
@@ -18,7 +18,18 @@
 #include "qemu/bitmap.h"
 
 #define SLICE_TIME    100000000ULL /* ns */
-#define MAX_IN_FLIGHT 16
+
+/* The number of operations in flight adapts to the throughput of the target,
+ * between MIN_IN_FLIGHT and MAX_IN_FLIGHT.
+ */
+#define MIN_IN_FLIGHT      1
+#define INITIAL_IN_FLIGHT  16
+#define MAX_IN_FLIGHT      64
+
+/* Adjacent dirty chunks are merged into large requests, but the buffer
+ * must still hold at least this many of them.
+ */
+#define MIN_PARALLEL_OPS   4
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -32,6 +43,7 @@ typedef struct MirrorBlockJob {
     RateLimit limit;
     BlockDriverState *target;
     MirrorSyncMode mode;
+    MirrorCopyMode copy_mode;
     BlockdevOnError on_source_error, on_target_error;
     bool synced;
     bool should_complete;
@@ -39,14 +51,28 @@ typedef struct MirrorBlockJob {
     int64_t granularity;
     size_t buf_size;
     unsigned long *cow_bitmap;
+    BdrvDirtyBitmap *dirty_bitmap;
     HBitmapIter hbi;
     uint8_t *buf;
     QSIMPLEQ_HEAD(, MirrorBuffer) buf_free;
     int buf_free_count;
 
     unsigned long *in_flight_bitmap;
+    unsigned long *waiting_bitmap;  /* in flight, waiting for guest writes */
     int in_flight;
+    CoQueue in_flight_queue;    /* woken up when an operation completes */
+    bool waiting_for_io;        /* job coroutine waits for an operation */
     int ret;
+
+    /* Adaptive window: current limit, and throughput in the last slice */
+    int max_in_flight;
+    bool window_full;
+    uint64_t bytes_done;
+    uint64_t last_throughput;
+
+    /* write-blocking mode: guest writes are copied synchronously */
+    NotifierWithReturn before_write;
+    CoRwlock active_rwlock;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -60,6 +86,7 @@ static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
                                             int error)
 {
     s->synced = false;
+    s->max_in_flight = MAX(s->max_in_flight / 2, MIN_IN_FLIGHT);
     if (read) {
         return block_job_error_action(&s->common, s->common.bs,
                                       s->on_source_error, true, error);
@@ -88,52 +115,136 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
 
     sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     chunk_num = op->sector_num / sectors_per_chunk;
-    nb_chunks = op->nb_sectors / sectors_per_chunk;
+    nb_chunks = DIV_ROUND_UP(op->nb_sectors, sectors_per_chunk);
     bitmap_clear(s->in_flight_bitmap, chunk_num, nb_chunks);
-    if (s->cow_bitmap && ret >= 0) {
-        bitmap_set(s->cow_bitmap, chunk_num, nb_chunks);
+    if (ret >= 0) {
+        if (s->cow_bitmap) {
+            bitmap_set(s->cow_bitmap, chunk_num, nb_chunks);
+        }
+        s->bytes_done += op->nb_sectors * BDRV_SECTOR_SIZE;
     }
 
+    qemu_iovec_destroy(&op->qiov);
     g_slice_free(MirrorOp, op);
-    qemu_coroutine_enter(s->common.co, NULL);
+
+    qemu_co_queue_restart_all(&s->in_flight_queue);
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
 }
 
-static void mirror_write_complete(void *opaque, int ret)
+static void coroutine_fn mirror_wait_for_io(MirrorBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
+static void mirror_set_waiting(MirrorOp *op, bool waiting)
 {
-    MirrorOp *op = opaque;
     MirrorBlockJob *s = op->s;
-    if (ret < 0) {
-        BlockDriverState *source = s->common.bs;
-        BlockErrorAction action;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t chunk_num = op->sector_num / sectors_per_chunk;
+    int nb_chunks = DIV_ROUND_UP(op->nb_sectors, sectors_per_chunk);
 
-        bdrv_set_dirty(source, op->sector_num, op->nb_sectors);
-        action = mirror_error_action(s, false, -ret);
-        if (action == BDRV_ACTION_REPORT && s->ret >= 0) {
-            s->ret = ret;
+    if (waiting) {
+        bitmap_set(s->waiting_bitmap, chunk_num, nb_chunks);
+        qemu_co_queue_restart_all(&s->in_flight_queue);
+    } else {
+        bitmap_clear(s->waiting_bitmap, chunk_num, nb_chunks);
+    }
+}
+
+/* Returns true if an operation that may still write old data to the target
+ * is in flight for chunks [chunk, end_chunk).
+ */
+static bool mirror_copy_in_flight(MirrorBlockJob *s, int64_t chunk,
+                                  int64_t end_chunk)
+{
+    for (; chunk < end_chunk; chunk++) {
+        if (test_bit(chunk, s->in_flight_bitmap) &&
+            !test_bit(chunk, s->waiting_bitmap)) {
+            return true;
         }
     }
-    mirror_iteration_done(op, ret);
+    return false;
 }
 
-static void mirror_read_complete(void *opaque, int ret)
+static bool mirror_qiov_is_zero(QEMUIOVector *qiov)
+{
+    int i;
+
+    for (i = 0; i < qiov->niov; i++) {
+        if (!buffer_is_zero(qiov->iov[i].iov_base, qiov->iov[i].iov_len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void coroutine_fn mirror_co_op(void *opaque)
 {
     MirrorOp *op = opaque;
     MirrorBlockJob *s = op->s;
-    if (ret < 0) {
-        BlockDriverState *source = s->common.bs;
-        BlockErrorAction action;
+    BlockDriverState *source = s->common.bs;
+    bool zero = false;
+    int ret, n;
+
+    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING &&
+        bdrv_write_in_flight(source, op->sector_num, op->nb_sectors)) {
+        /* The guest write is copied to the target by the before write
+         * notifier, but reading the source now could return old data.
+         * Wait for the write to complete.  The notifier does not wait for
+         * this operation in the meanwhile, as it has not read anything.
+         */
+        trace_mirror_yield_active_write(s, op->sector_num, op->nb_sectors);
+        mirror_set_waiting(op, true);
+        bdrv_co_wait_for_writes(source, op->sector_num, op->nb_sectors);
+        mirror_set_waiting(op, false);
+    }
 
-        bdrv_set_dirty(source, op->sector_num, op->nb_sectors);
-        action = mirror_error_action(s, true, -ret);
-        if (action == BDRV_ACTION_REPORT && s->ret >= 0) {
-            s->ret = ret;
+    /* With sync=full the target has no backing file, so the areas that are
+     * not allocated anywhere in the chain read as zeroes.  Do not bother
+     * reading them.
+     */
+    if (s->mode == MIRROR_SYNC_MODE_FULL) {
+        ret = bdrv_co_is_allocated_above(source, NULL, op->sector_num,
+                                         op->nb_sectors, &n);
+        zero = (ret == 0 && n == op->nb_sectors);
+    }
+
+    if (!zero) {
+        ret = bdrv_co_readv(source, op->sector_num, op->nb_sectors,
+                            &op->qiov);
+        if (ret < 0) {
+            bdrv_set_dirty_bitmap(s->dirty_bitmap, op->sector_num,
+                                  op->nb_sectors);
+            if (mirror_error_action(s, true, -ret) == BDRV_ACTION_REPORT &&
+                s->ret >= 0) {
+                s->ret = ret;
+            }
+            mirror_iteration_done(op, ret);
+            return;
         }
+        zero = mirror_qiov_is_zero(&op->qiov);
+    }
 
-        mirror_iteration_done(op, ret);
-        return;
+    if (zero) {
+        trace_mirror_write_zeroes(s, op->sector_num, op->nb_sectors);
+        ret = bdrv_co_write_zeroes(s->target, op->sector_num, op->nb_sectors);
+    } else {
+        ret = bdrv_co_writev(s->target, op->sector_num, op->nb_sectors,
+                             &op->qiov);
     }
-    bdrv_aio_writev(s->target, op->sector_num, &op->qiov, op->nb_sectors,
-                    mirror_write_complete, op);
+    if (ret < 0) {
+        bdrv_set_dirty_bitmap(s->dirty_bitmap, op->sector_num, op->nb_sectors);
+        if (mirror_error_action(s, false, -ret) == BDRV_ACTION_REPORT &&
+            s->ret >= 0) {
+            s->ret = ret;
+        }
+    }
+    mirror_iteration_done(op, ret);
 }
 
 static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
@@ -141,19 +252,24 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
     BlockDriverState *source = s->common.bs;
     int nb_sectors, sectors_per_chunk, nb_chunks;
     int64_t end, sector_num, next_chunk, next_sector, hbitmap_next_sector;
+    int64_t max_io_sectors;
     MirrorOp *op;
+    Coroutine *co;
 
     s->sector_num = hbitmap_iter_next(&s->hbi);
     if (s->sector_num < 0) {
-        bdrv_dirty_iter_init(source, &s->hbi);
+        bdrv_dirty_iter_init(source, s->dirty_bitmap, &s->hbi);
         s->sector_num = hbitmap_iter_next(&s->hbi);
-        trace_mirror_restart_iter(s, bdrv_get_dirty_count(source));
+        trace_mirror_restart_iter(s, bdrv_get_dirty_count(source,
+                                                          s->dirty_bitmap));
         assert(s->sector_num >= 0);
     }
 
     hbitmap_next_sector = s->sector_num;
     sector_num = s->sector_num;
     sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    max_io_sectors = MAX(s->buf_size / MIN_PARALLEL_OPS, s->granularity) >>
+                     BDRV_SECTOR_BITS;
     end = s->common.len >> BDRV_SECTOR_BITS;
 
     /* Extend the QEMUIOVector to include all adjacent blocks that will
@@ -167,7 +283,8 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
      *
      * We also want to extend the QEMUIOVector to include more adjacent
      * dirty blocks if possible, to limit the number of I/O operations and
-     * run efficiently even with a small granularity.
+     * run efficiently even with a small granularity.  Requests are capped
+     * so that several of them can be in flight.
      */
     nb_chunks = 0;
     nb_sectors = 0;
@@ -177,13 +294,13 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* Wait for I/O to this cluster (from a previous iteration) to be done.  */
     while (test_bit(next_chunk, s->in_flight_bitmap)) {
         trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
-        qemu_coroutine_yield();
+        mirror_wait_for_io(s);
     }
 
     do {
         int added_sectors, added_chunks;
 
-        if (!bdrv_get_dirty(source, next_sector) ||
+        if (!bdrv_get_dirty(source, s->dirty_bitmap, next_sector) ||
             test_bit(next_chunk, s->in_flight_bitmap)) {
             assert(nb_sectors > 0);
             break;
@@ -208,12 +325,16 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
         added_sectors = MIN(added_sectors, end - (sector_num + nb_sectors));
         added_chunks = (added_sectors + sectors_per_chunk - 1) / sectors_per_chunk;
 
+        if (nb_chunks > 0 && nb_sectors + added_sectors > max_io_sectors) {
+            break;
+        }
+
         /* When doing COW, it may happen that there is not enough space for
          * a full cluster.  Wait if that is the case.
          */
         while (nb_chunks == 0 && s->buf_free_count < added_chunks) {
             trace_mirror_yield_buf_busy(s, nb_chunks, s->in_flight);
-            qemu_coroutine_yield();
+            mirror_wait_for_io(s);
         }
         if (s->buf_free_count < nb_chunks + added_chunks) {
             trace_mirror_break_buf_busy(s, nb_chunks, s->in_flight);
@@ -229,7 +350,7 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
         next_chunk += added_chunks;
     } while (next_sector < end);
 
-    /* Allocate a MirrorOp that is used as an AIO callback.  */
+    /* Allocate a MirrorOp that is passed to the coroutine doing the copy.  */
     op = g_slice_new(MirrorOp);
     op->s = s;
     op->sector_num = sector_num;
@@ -242,27 +363,105 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
     next_sector = sector_num;
     while (nb_chunks-- > 0) {
         MirrorBuffer *buf = QSIMPLEQ_FIRST(&s->buf_free);
+        size_t remaining = (nb_sectors << BDRV_SECTOR_BITS) - op->qiov.size;
+
         QSIMPLEQ_REMOVE_HEAD(&s->buf_free, next);
         s->buf_free_count--;
-        qemu_iovec_add(&op->qiov, buf, s->granularity);
+        qemu_iovec_add(&op->qiov, buf, MIN(s->granularity, remaining));
 
         /* Advance the HBitmapIter in parallel, so that we do not examine
          * the same sector twice.
          */
-        if (next_sector > hbitmap_next_sector && bdrv_get_dirty(source, next_sector)) {
+        if (next_sector > hbitmap_next_sector &&
+            bdrv_get_dirty(source, s->dirty_bitmap, next_sector)) {
             hbitmap_next_sector = hbitmap_iter_next(&s->hbi);
         }
 
         next_sector += sectors_per_chunk;
     }
 
-    bdrv_reset_dirty(source, sector_num, nb_sectors);
+    bdrv_reset_dirty_bitmap(s->dirty_bitmap, sector_num, nb_sectors);
 
     /* Copy the dirty cluster.  */
     s->in_flight++;
+    if (s->in_flight >= s->max_in_flight) {
+        s->window_full = true;
+    }
     trace_mirror_one_iteration(s, sector_num, nb_sectors);
-    bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
-                   mirror_read_complete, op);
+    co = qemu_coroutine_create(mirror_co_op);
+    qemu_coroutine_enter(co, op);
+}
+
+/*
+ * Adapt the number of operations in flight to the target.  The window grows
+ * as long as doing so increases the throughput, and shrinks when the
+ * throughput drops.  Slices in which the window was never full, e.g. because
+ * of the rate limit or because there was little to copy, say nothing about
+ * the target and are ignored.
+ */
+static void mirror_adjust_window(MirrorBlockJob *s, uint64_t elapsed_ns)
+{
+    uint64_t throughput;
+
+    if (s->window_full && elapsed_ns > 0) {
+        throughput = muldiv64(s->bytes_done, 1000000000, elapsed_ns);
+        if (throughput > s->last_throughput + s->last_throughput / 8) {
+            s->max_in_flight = MIN(s->max_in_flight * 2, MAX_IN_FLIGHT);
+        } else if (throughput < s->last_throughput - s->last_throughput / 8) {
+            s->max_in_flight = MAX(s->max_in_flight * 3 / 4, MIN_IN_FLIGHT);
+        }
+        s->last_throughput = throughput;
+        trace_mirror_adjust_window(s, throughput, s->max_in_flight);
+    }
+
+    s->window_full = false;
+    s->bytes_done = 0;
+}
+
+/*
+ * In write-blocking mode, copy guest writes to the target before they are
+ * completed.  The guest thus cannot dirty the source faster than the target
+ * can absorb the writes, and the job is guaranteed to converge.
+ */
+static int coroutine_fn mirror_before_write_notify(NotifierWithReturn *notifier,
+                                                   void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, before_write);
+    BdrvTrackedRequest *req = opaque;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t chunk, end_chunk;
+    int ret;
+
+    qemu_co_rwlock_rdlock(&s->active_rwlock);
+
+    /* Background copies of the same area must not overwrite the new data */
+    chunk = req->sector_num / sectors_per_chunk;
+    end_chunk = DIV_ROUND_UP(req->sector_num + req->nb_sectors,
+                             sectors_per_chunk);
+    while (mirror_copy_in_flight(s, chunk, end_chunk)) {
+        qemu_co_queue_wait(&s->in_flight_queue);
+    }
+
+    trace_mirror_active_write(s, req->sector_num, req->nb_sectors);
+    if (req->is_discard) {
+        /* Let the background copy pick up whatever the source returns */
+        ret = -ENOTSUP;
+    } else if (req->qiov) {
+        ret = bdrv_co_writev(s->target, req->sector_num, req->nb_sectors,
+                             req->qiov);
+    } else {
+        ret = bdrv_co_write_zeroes(s->target, req->sector_num,
+                                   req->nb_sectors);
+    }
+
+    if (ret < 0) {
+        /* The guest write itself must not fail because of the target */
+        bdrv_set_dirty_bitmap(s->dirty_bitmap, req->sector_num,
+                              req->nb_sectors);
+    }
+
+    qemu_co_rwlock_unlock(&s->active_rwlock);
+    return 0;
 }
 
 static void mirror_free_init(MirrorBlockJob *s)
@@ -282,10 +481,10 @@ static void mirror_free_init(MirrorBlockJob *s)
     }
 }
 
-static void mirror_drain(MirrorBlockJob *s)
+static void coroutine_fn mirror_drain(MirrorBlockJob *s)
 {
     while (s->in_flight > 0) {
-        qemu_coroutine_yield();
+        mirror_wait_for_io(s);
     }
 }
 
@@ -312,6 +511,19 @@ static void coroutine_fn mirror_run(void *opaque)
 
     length = (bdrv_getlength(bs) + s->granularity - 1) / s->granularity;
     s->in_flight_bitmap = bitmap_new(length);
+    s->waiting_bitmap = bitmap_new(length);
+    qemu_co_queue_init(&s->in_flight_queue);
+    s->max_in_flight = INITIAL_IN_FLIGHT;
+
+    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        /* Guest writes go to the target directly, they need not be tracked
+         * in the dirty bitmap anymore.
+         */
+        qemu_co_rwlock_init(&s->active_rwlock);
+        s->dirty_bitmap->disabled = true;
+        s->before_write.notify = mirror_before_write_notify;
+        bdrv_add_before_write_notifier(bs, &s->before_write);
+    }
 
     /* If we have no backing file yet in the destination, we cannot let
      * the destination do COW.  Instead, we copy sectors around the
@@ -347,7 +559,7 @@ static void coroutine_fn mirror_run(void *opaque)
 
             assert(n > 0);
             if (ret == 1) {
-                bdrv_set_dirty(bs, sector_num, n);
+                bdrv_set_dirty_bitmap(s->dirty_bitmap, sector_num, n);
                 sector_num = next;
             } else {
                 sector_num += n;
@@ -355,7 +567,7 @@ static void coroutine_fn mirror_run(void *opaque)
         }
     }
 
-    bdrv_dirty_iter_init(bs, &s->hbi);
+    bdrv_dirty_iter_init(bs, s->dirty_bitmap, &s->hbi);
     last_pause_ns = qemu_get_clock_ns(rt_clock);
     for (;;) {
         uint64_t delay_ns;
@@ -367,7 +579,7 @@ static void coroutine_fn mirror_run(void *opaque)
             goto immediate_exit;
         }
 
-        cnt = bdrv_get_dirty_count(bs);
+        cnt = bdrv_get_dirty_count(bs, s->dirty_bitmap);
 
         /* Note that even when no rate limit is applied we need to yield
          * periodically with no pending I/O so that qemu_aio_flush() returns.
@@ -376,10 +588,10 @@ static void coroutine_fn mirror_run(void *opaque)
          */
         if (qemu_get_clock_ns(rt_clock) - last_pause_ns < SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight == MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
-                qemu_coroutine_yield();
+                mirror_wait_for_io(s);
                 continue;
             } else if (cnt != 0) {
                 mirror_iteration(s);
@@ -409,7 +621,7 @@ static void coroutine_fn mirror_run(void *opaque)
 
                 should_complete = s->should_complete ||
                     block_job_is_cancelled(&s->common);
-                cnt = bdrv_get_dirty_count(bs);
+                cnt = bdrv_get_dirty_count(bs, s->dirty_bitmap);
             }
         }
 
@@ -424,7 +636,7 @@ static void coroutine_fn mirror_run(void *opaque)
              */
             trace_mirror_before_drain(s, cnt);
             bdrv_drain_all();
-            cnt = bdrv_get_dirty_count(bs);
+            cnt = bdrv_get_dirty_count(bs, s->dirty_bitmap);
         }
 
         ret = 0;
@@ -454,6 +666,7 @@ static void coroutine_fn mirror_run(void *opaque)
             s->common.cancelled = false;
             break;
         }
+        mirror_adjust_window(s, qemu_get_clock_ns(rt_clock) - last_pause_ns);
         last_pause_ns = qemu_get_clock_ns(rt_clock);
     }
 
@@ -468,10 +681,20 @@ immediate_exit:
     }
 
     assert(s->in_flight == 0);
+
+    if (s->before_write.notify) {
+        notifier_with_return_remove(&s->before_write);
+
+        /* wait until pending guest writes to the target have completed */
+        qemu_co_rwlock_wrlock(&s->active_rwlock);
+        qemu_co_rwlock_unlock(&s->active_rwlock);
+    }
+
     qemu_vfree(s->buf);
     g_free(s->cow_bitmap);
     g_free(s->in_flight_bitmap);
-    bdrv_set_dirty_tracking(bs, 0);
+    g_free(s->waiting_bitmap);
+    bdrv_release_dirty_bitmap(bs, s->dirty_bitmap);
     bdrv_iostatus_disable(s->target);
     if (s->should_complete && ret == 0) {
         if (bdrv_get_flags(s->target) != bdrv_get_flags(s->common.bs)) {
@@ -534,23 +757,19 @@ static BlockJobType mirror_job_type = {
 
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, int64_t granularity, int64_t buf_size,
-                  MirrorSyncMode mode, BlockdevOnError on_source_error,
+                  MirrorSyncMode mode, MirrorCopyMode copy_mode,
+                  BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp)
 {
     MirrorBlockJob *s;
+    BdrvDirtyBitmap *dirty_bitmap;
 
     if (granularity == 0) {
         /* Choose the default granularity based on the target file's cluster
-         * size, clamped between 4k and 64k.  */
-        BlockDriverInfo bdi;
-        if (bdrv_get_info(target, &bdi) >= 0 && bdi.cluster_size != 0) {
-            granularity = MAX(4096, bdi.cluster_size);
-            granularity = MIN(65536, granularity);
-        } else {
-            granularity = 65536;
-        }
+         * size.  */
+        granularity = bdrv_get_default_bitmap_granularity(target);
     }
 
     assert ((granularity & (granularity - 1)) == 0);
@@ -562,8 +781,14 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
         return;
     }
 
+    dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity, NULL, errp);
+    if (!dirty_bitmap) {
+        return;
+    }
+
     s = block_job_create(&mirror_job_type, bs, speed, cb, opaque, errp);
     if (!s) {
+        bdrv_release_dirty_bitmap(bs, dirty_bitmap);
         return;
     }
 
@@ -571,10 +796,11 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
     s->on_target_error = on_target_error;
     s->target = target;
     s->mode = mode;
+    s->copy_mode = copy_mode;
     s->granularity = granularity;
     s->buf_size = MAX(buf_size, granularity);
+    s->dirty_bitmap = dirty_bitmap;
 
-    bdrv_set_dirty_tracking(bs, granularity);
     bdrv_set_enable_write_cache(s->target, true);
     bdrv_set_on_error(s->target, on_target_error, on_target_error);
     bdrv_iostatus_enable(s->target);
@@ -48,27 +48,63 @@
 #endif
 
 #define MAX_NBD_REQUESTS	16
-#define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
-#define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
+#define MAX_NBD_REQUESTS_LIMIT  1024
+#define MAX_NBD_CONNECTIONS     16
+#define HANDLE_TO_INDEX(conn, handle) ((handle) ^ ((uint64_t)(intptr_t)conn))
+#define INDEX_TO_HANDLE(conn, index)  ((index)  ^ ((uint64_t)(intptr_t)conn))
 
-typedef struct BDRVNBDState {
+typedef struct NBDExtent {
+    uint32_t length;
+    uint32_t flags;
+} NBDExtent;
+
+typedef struct BDRVNBDState BDRVNBDState;
+
+/* A socket connected to the export.  Every connection has its own set of
+ * request handles and its own reply state, so requests on different
+ * connections are completely independent.
+ */
+typedef struct NBDConnection {
+    BDRVNBDState *s;
     int sock;
-    uint32_t nbdflags;
-    off_t size;
-    size_t blocksize;
+    NBDExtensions ext;
 
     CoMutex send_mutex;
-    CoMutex free_sema;
+    CoQueue free_sema;
     Coroutine *send_coroutine;
     int in_flight;
 
-    Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
+    Coroutine **recv_coroutine;     /* max_requests entries */
     struct nbd_reply reply;
+} NBDConnection;
+
+struct BDRVNBDState {
+    uint32_t nbdflags;
+    off_t size;
+    size_t blocksize;
+
+    NBDConnection *conns;
+    int num_conns;
+    int max_requests;               /* per connection */
+    int next_conn;
 
     int is_unix;
     char *host_spec;
     char *export_name; /* An NBD server may export several devices */
-} BDRVNBDState;
+};
+
+static int nbd_parse_int(const char *value, int min, int max, int *result)
+{
+    char *end;
+    long n;
+
+    n = strtol(value, &end, 10);
+    if (*end || n < min || n > max) {
+        return -EINVAL;
+    }
+    *result = n;
+    return 0;
+}
 
 static int nbd_parse_uri(BDRVNBDState *s, const char *filename)
 {
@@ -76,6 +112,7 @@ static int nbd_parse_uri(BDRVNBDState *s, const char *filename)
     const char *p;
     QueryParams *qp = NULL;
     int ret = 0;
+    int i;
 
     uri = uri_parse(filename);
     if (!uri) {
@@ -100,19 +137,33 @@ static int nbd_parse_uri(BDRVNBDState *s, const char *filename)
         s->export_name = g_strdup(p);
     }
 
+    /* socket=path (for nbd+unix only), connections=N, requests=N */
     qp = query_params_parse(uri->query);
-    if (qp->n > 1 || (s->is_unix && !qp->n) || (!s->is_unix && qp->n)) {
-        ret = -EINVAL;
-        goto out;
+    for (i = 0; i < qp->n; i++) {
+        const char *name = qp->p[i].name;
+        const char *value = qp->p[i].value;
+
+        if (!strcmp(name, "socket") && s->is_unix && !s->host_spec) {
+            s->host_spec = g_strdup(value);
+        } else if (!strcmp(name, "connections")) {
+            ret = nbd_parse_int(value, 1, MAX_NBD_CONNECTIONS, &s->num_conns);
+        } else if (!strcmp(name, "requests")) {
+            ret = nbd_parse_int(value, 1, MAX_NBD_REQUESTS_LIMIT,
+                                &s->max_requests);
+        } else {
+            ret = -EINVAL;
+        }
+        if (ret < 0) {
+            goto out;
+        }
     }
 
     if (s->is_unix) {
         /* nbd+unix:///export?socket=path */
-        if (uri->server || uri->port || strcmp(qp->p[0].name, "socket")) {
+        if (uri->server || uri->port || !s->host_spec) {
             ret = -EINVAL;
             goto out;
         }
-        s->host_spec = g_strdup(qp->p[0].value);
     } else {
         /* nbd[+tcp]://host:port/export */
         if (!uri->server) {
@@ -126,6 +177,10 @@ static int nbd_parse_uri(BDRVNBDState *s, const char *filename)
     }
 
 out:
+    if (ret < 0) {
+        g_free(s->host_spec);
+        s->host_spec = NULL;
+    }
     if (qp) {
         query_params_free(qp);
     }
@@ -182,53 +237,73 @@ out:
     return err;
 }
 
-static void nbd_coroutine_start(BDRVNBDState *s, struct nbd_request *request)
+/* Picks the connection for the next request: round-robin, but skipping
+ * connections that are busier than the others.
+ */
+static NBDConnection *nbd_get_connection(BDRVNBDState *s)
+{
+    NBDConnection *conn = &s->conns[s->next_conn];
+    int i;
+
+    for (i = 1; i < s->num_conns; i++) {
+        NBDConnection *c = &s->conns[(s->next_conn + i) % s->num_conns];
+        if (c->in_flight < conn->in_flight) {
+            conn = c;
+        }
+    }
+    s->next_conn = (conn - s->conns + 1) % s->num_conns;
+    return conn;
+}
+
+static void nbd_coroutine_start(NBDConnection *conn,
+                                struct nbd_request *request)
 {
+    BDRVNBDState *s = conn->s;
     int i;
 
-    /* Poor man semaphore.  The free_sema is locked when no other request
-     * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight >= MAX_NBD_REQUESTS - 1) {
-        qemu_co_mutex_lock(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
+    /* Wait for a free slot.  A woken up coroutine does not run right
+     * away, so somebody else may have taken the slot in the meantime.  */
+    while (conn->in_flight >= s->max_requests) {
+        qemu_co_queue_wait(&conn->free_sema);
     }
-    s->in_flight++;
+    conn->in_flight++;
 
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i] == NULL) {
-            s->recv_coroutine[i] = qemu_coroutine_self();
+    for (i = 0; i < s->max_requests; i++) {
+        if (conn->recv_coroutine[i] == NULL) {
+            conn->recv_coroutine[i] = qemu_coroutine_self();
             break;
         }
     }
 
-    assert(i < MAX_NBD_REQUESTS);
-    request->handle = INDEX_TO_HANDLE(s, i);
+    assert(i < s->max_requests);
+    request->handle = INDEX_TO_HANDLE(conn, i);
 }
 
 static int nbd_have_request(void *opaque)
 {
-    BDRVNBDState *s = opaque;
+    NBDConnection *conn = opaque;
 
-    return s->in_flight > 0;
+    return conn->in_flight > 0;
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BDRVNBDState *s = opaque;
+    NBDConnection *conn = opaque;
+    BDRVNBDState *s = conn->s;
     uint64_t i;
     int ret;
 
-    if (s->reply.handle == 0) {
+    if (conn->reply.handle == 0) {
         /* No reply already in flight.  Fetch a header.  It is possible
          * that another thread has done the same thing in parallel, so
          * the socket is not readable anymore.
          */
-        ret = nbd_receive_reply(s->sock, &s->reply);
+        ret = nbd_receive_reply(conn->sock, &conn->reply);
         if (ret == -EAGAIN) {
             return;
         }
         if (ret < 0) {
-            s->reply.handle = 0;
+            conn->reply.handle = 0;
             goto fail;
         }
     }
@@ -236,94 +311,225 @@ static void nbd_reply_ready(void *opaque)
     /* There's no need for a mutex on the receive side, because the
      * handler acts as a synchronization point and ensures that only
      * one coroutine is called until the reply finishes.  */
-    i = HANDLE_TO_INDEX(s, s->reply.handle);
-    if (i >= MAX_NBD_REQUESTS) {
+    i = HANDLE_TO_INDEX(conn, conn->reply.handle);
+    if (i >= s->max_requests) {
         goto fail;
     }
 
-    if (s->recv_coroutine[i]) {
-        qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+    if (conn->recv_coroutine[i]) {
+        qemu_coroutine_enter(conn->recv_coroutine[i], NULL);
         return;
     }
 
 fail:
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i]) {
-            qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+    for (i = 0; i < s->max_requests; i++) {
+        if (conn->recv_coroutine[i]) {
+            qemu_coroutine_enter(conn->recv_coroutine[i], NULL);
         }
     }
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BDRVNBDState *s = opaque;
-    qemu_coroutine_enter(s->send_coroutine, NULL);
+    NBDConnection *conn = opaque;
+    qemu_coroutine_enter(conn->send_coroutine, NULL);
 }
 
-static int nbd_co_send_request(BDRVNBDState *s, struct nbd_request *request,
+static int nbd_co_send_request(NBDConnection *conn,
+                               struct nbd_request *request,
                                QEMUIOVector *qiov, int offset)
 {
     int rc, ret;
 
-    qemu_co_mutex_lock(&s->send_mutex);
-    s->send_coroutine = qemu_coroutine_self();
-    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, nbd_restart_write,
-                            nbd_have_request, s);
-    rc = nbd_send_request(s->sock, request);
+    qemu_co_mutex_lock(&conn->send_mutex);
+    conn->send_coroutine = qemu_coroutine_self();
+    qemu_aio_set_fd_handler(conn->sock, nbd_reply_ready, nbd_restart_write,
+                            nbd_have_request, conn);
+    rc = nbd_send_request(conn->sock, request);
     if (rc >= 0 && qiov) {
-        ret = qemu_co_sendv(s->sock, qiov->iov, qiov->niov,
+        ret = qemu_co_sendv(conn->sock, qiov->iov, qiov->niov,
                             offset, request->len);
         if (ret != request->len) {
-            return -EIO;
+            rc = -EIO;
         }
     }
-    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, NULL,
-                            nbd_have_request, s);
-    s->send_coroutine = NULL;
-    qemu_co_mutex_unlock(&s->send_mutex);
+    qemu_aio_set_fd_handler(conn->sock, nbd_reply_ready, NULL,
+                            nbd_have_request, conn);
+    conn->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&conn->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(BDRVNBDState *s, struct nbd_request *request,
+static int nbd_co_skip(NBDConnection *conn, uint32_t len)
+{
+    char buf[512];
+
+    while (len > 0) {
+        uint32_t n = MIN(len, sizeof(buf));
+        if (qemu_co_recv(conn->sock, buf, n) != n) {
+            return -EIO;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/* Receives the payload of a structured reply chunk.  Returns the error
+ * carried by an error chunk, or a negative errno value if the chunk could
+ * not be processed.
+ */
+static int nbd_co_receive_chunk(NBDConnection *conn,
+                                struct nbd_request *request,
+                                struct nbd_reply *chunk, QEMUIOVector *qiov,
+                                int offset, NBDExtent *extent)
+{
+    uint64_t from;
+    uint32_t len, error, id;
+    uint16_t msg_len;
+
+    switch (chunk->type) {
+    case NBD_REPLY_TYPE_NONE:
+        return chunk->length ? -EIO : 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        if (!qiov || chunk->length < sizeof(from) ||
+            qemu_co_recv(conn->sock, &from, sizeof(from)) != sizeof(from)) {
+            return -EIO;
+        }
+        from = be64_to_cpu(from);
+        if (chunk->type == NBD_REPLY_TYPE_OFFSET_DATA) {
+            len = chunk->length - sizeof(from);
+        } else if (chunk->length != sizeof(from) + sizeof(len) ||
+                   qemu_co_recv(conn->sock, &len, sizeof(len)) != sizeof(len)) {
+            return -EIO;
+        } else {
+            len = be32_to_cpu(len);
+        }
+
+        if (from < request->from ||
+            from + len > request->from + request->len) {
+            logout("Chunk outside of the request\n");
+            return -EIO;
+        }
+        offset += from - request->from;
+
+        if (chunk->type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+            qemu_iovec_memset(qiov, offset, 0, len);
+        } else if (qemu_co_recvv(conn->sock, qiov->iov, qiov->niov,
+                                 offset, len) != len) {
+            return -EIO;
+        }
+        return 0;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        if (!extent || chunk->length < 3 * sizeof(uint32_t) ||
+            qemu_co_recv(conn->sock, &id, sizeof(id)) != sizeof(id) ||
+            qemu_co_recv(conn->sock, extent, sizeof(*extent)) !=
+            sizeof(*extent)) {
+            return -EIO;
+        }
+        if (be32_to_cpu(id) != conn->ext.context_id) {
+            return -EIO;
+        }
+        extent->length = be32_to_cpu(extent->length);
+        extent->flags = be32_to_cpu(extent->flags);
+
+        /* Only the first extent is needed */
+        return nbd_co_skip(conn, chunk->length - 3 * sizeof(uint32_t));
+
+    default:
+        if (!NBD_REPLY_TYPE_IS_ERR(chunk->type)) {
+            nbd_co_skip(conn, chunk->length);
+            return -EIO;
+        }
+
+        /* Error chunk: error (4), message length (2), message, and for
+         * NBD_REPLY_TYPE_ERROR_OFFSET the offset of the error (8) */
+        if (chunk->length < sizeof(error) + sizeof(msg_len) ||
+            qemu_co_recv(conn->sock, &error, sizeof(error)) != sizeof(error) ||
+            qemu_co_recv(conn->sock, &msg_len, sizeof(msg_len)) !=
+            sizeof(msg_len)) {
+            return -EIO;
+        }
+        error = be32_to_cpu(error);
+        len = chunk->length - sizeof(error) - sizeof(msg_len);
+        if (nbd_co_skip(conn, len) < 0) {
+            return -EIO;
+        }
+        return error ? error : EIO;
+    }
+}
+
+static void nbd_co_receive_reply(NBDConnection *conn,
+                                 struct nbd_request *request,
                                  struct nbd_reply *reply,
-                                 QEMUIOVector *qiov, int offset)
+                                 QEMUIOVector *qiov, int offset,
+                                 NBDExtent *extent)
 {
+    int error = 0;
     int ret;
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
-                                offset, request->len);
-            if (ret != request->len) {
-                reply->error = EIO;
+    for (;;) {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        *reply = conn->reply;
+        if (reply->handle != request->handle) {
+            reply->error = EIO;
+            return;
+        }
+
+        if (!reply->structured) {
+            if (qiov && reply->error == 0) {
+                ret = qemu_co_recvv(conn->sock, qiov->iov, qiov->niov,
+                                    offset, request->len);
+                if (ret != request->len) {
+                    reply->error = EIO;
+                }
             }
+
+            /* Tell the read handler to read another header.  */
+            conn->reply.handle = 0;
+            return;
         }
 
-        /* Tell the read handler to read another header.  */
-        s->reply.handle = 0;
+        /* A structured reply may consist of several chunks, the last of
+         * which has NBD_REPLY_FLAG_DONE set.  Errors are only reported
+         * after all of them have been received.  */
+        ret = nbd_co_receive_chunk(conn, request, reply, qiov, offset, extent);
+        conn->reply.handle = 0;
+        if (ret < 0) {
+            /* The stream is out of sync, don't wait for more chunks */
+            reply->error = -ret;
+            return;
+        }
+        if (ret > 0 && !error) {
+            error = ret;
+        }
+        if (reply->flags & NBD_REPLY_FLAG_DONE) {
+            break;
+        }
     }
+
+    reply->error = error;
 }
 
-static void nbd_coroutine_end(BDRVNBDState *s, struct nbd_request *request)
+static void nbd_coroutine_end(NBDConnection *conn,
+                              struct nbd_request *request)
 {
-    int i = HANDLE_TO_INDEX(s, request->handle);
-    s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
-        qemu_co_mutex_unlock(&s->free_sema);
-    }
+    int i = HANDLE_TO_INDEX(conn, request->handle);
+    conn->recv_coroutine[i] = NULL;
+    conn->in_flight--;
+    qemu_co_queue_next(&conn->free_sema);
 }
 
-static int nbd_establish_connection(BlockDriverState *bs)
+static int nbd_establish_connection(BlockDriverState *bs, NBDConnection *conn)
 {
     BDRVNBDState *s = bs->opaque;
     int sock;
     int ret;
+    uint32_t nbdflags;
     off_t size;
     size_t blocksize;
 
@@ -339,50 +545,74 @@ static int nbd_establish_connection(BlockDriverState *bs)
         return -errno;
     }
 
-    /* NBD handshake */
-    ret = nbd_receive_negotiate(sock, s->export_name, &s->nbdflags, &size,
-                                &blocksize);
+    /* NBD handshake; ask for sparse reads and block status */
+    conn->ext.structured_reply = true;
+    conn->ext.base_allocation = true;
+    ret = nbd_receive_negotiate(sock, s->export_name, &nbdflags, &size,
+                                &blocksize, &conn->ext);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         closesocket(sock);
         return ret;
     }
 
+    if (conn == &s->conns[0]) {
+        s->nbdflags = nbdflags;
+        s->size = size;
+        s->blocksize = blocksize;
+    } else if (nbdflags != s->nbdflags || size != s->size) {
+        logout("Connections to the NBD server disagree on the export\n");
+        closesocket(sock);
+        return -EINVAL;
+    }
+
     /* Now that we're connected, set the socket to be non-blocking and
      * kick the reply mechanism.  */
     socket_set_nonblock(sock);
     qemu_aio_set_fd_handler(sock, nbd_reply_ready, NULL,
-                            nbd_have_request, s);
-
-    s->sock = sock;
-    s->size = size;
-    s->blocksize = blocksize;
+                            nbd_have_request, conn);
+    conn->sock = sock;
 
     logout("Established connection with NBD server\n");
     return 0;
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(NBDConnection *conn)
 {
-    BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
 
     request.type = NBD_CMD_DISC;
     request.from = 0;
     request.len = 0;
-    nbd_send_request(s->sock, &request);
+    nbd_send_request(conn->sock, &request);
 
-    qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL, NULL);
-    closesocket(s->sock);
+    qemu_aio_set_fd_handler(conn->sock, NULL, NULL, NULL, NULL);
+    closesocket(conn->sock);
+    conn->sock = -1;
+}
+
+static void nbd_free_connections(BDRVNBDState *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_conns; i++) {
+        if (s->conns[i].sock >= 0) {
+            nbd_teardown_connection(&s->conns[i]);
+        }
+        g_free(s->conns[i].recv_coroutine);
+    }
+    g_free(s->conns);
+    s->conns = NULL;
 }
 
 static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
 {
     BDRVNBDState *s = bs->opaque;
     int result;
+    int i;
 
-    qemu_co_mutex_init(&s->send_mutex);
-    qemu_co_mutex_init(&s->free_sema);
+    s->num_conns = 1;
+    s->max_requests = MAX_NBD_REQUESTS;
 
     /* Pop the config into our state object. Exit if invalid. */
     result = nbd_config(s, filename);
@@ -390,12 +620,31 @@ static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
         return result;
     }
 
-    /* establish TCP connection, return error if it fails
+    s->conns = g_new0(NBDConnection, s->num_conns);
+    for (i = 0; i < s->num_conns; i++) {
+        NBDConnection *conn = &s->conns[i];
+
+        conn->s = s;
+        conn->sock = -1;
+        conn->recv_coroutine = g_new0(Coroutine *, s->max_requests);
+        qemu_co_mutex_init(&conn->send_mutex);
+        qemu_co_queue_init(&conn->free_sema);
+    }
+
+    /* establish TCP connections, return error if any of them fails
      * TODO: Configurable retry-until-timeout behaviour.
      */
-    result = nbd_establish_connection(bs);
+    for (i = 0; i < s->num_conns; i++) {
+        result = nbd_establish_connection(bs, &s->conns[i]);
+        if (result < 0) {
+            nbd_free_connections(s);
+            g_free(s->export_name);
+            g_free(s->host_spec);
+            return result;
+        }
+    }
 
-    return result;
+    return 0;
 }
 
 static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
@@ -403,6 +652,7 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
                           int offset)
 {
     BDRVNBDState *s = bs->opaque;
+    NBDConnection *conn = nbd_get_connection(s);
     struct nbd_request request;
     struct nbd_reply reply;
     ssize_t ret;
@@ -411,14 +661,14 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(s, &request, &reply, qiov, offset);
+        nbd_co_receive_reply(conn, &request, &reply, qiov, offset, NULL);
     }
-    nbd_coroutine_end(s, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 
 }
@@ -428,6 +678,7 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
                            int offset)
 {
     BDRVNBDState *s = bs->opaque;
+    NBDConnection *conn = nbd_get_connection(s);
     struct nbd_request request;
     struct nbd_reply reply;
     ssize_t ret;
@@ -440,14 +691,40 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, qiov, offset);
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, qiov, offset);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, NULL);
+    }
+    nbd_coroutine_end(conn, &request);
+    return -reply.error;
+}
+
+static int nbd_co_flush_1(NBDConnection *conn)
+{
+    BDRVNBDState *s = conn->s;
+    struct nbd_request request;
+    struct nbd_reply reply;
+    ssize_t ret;
+
+    request.type = NBD_CMD_FLUSH;
+    if (s->nbdflags & NBD_FLAG_SEND_FUA) {
+        request.type |= NBD_CMD_FLAG_FUA;
+    }
+
+    request.from = 0;
+    request.len = 0;
+
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, NULL);
     }
-    nbd_coroutine_end(s, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 }
 
@@ -455,74 +732,155 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
  * remain aligned to 4K. */
 #define NBD_MAX_SECTORS 2040
 
-static int nbd_co_readv(BlockDriverState *bs, int64_t sector_num,
-                        int nb_sectors, QEMUIOVector *qiov)
+/*
+ * Large requests are split into NBD_MAX_SECTORS pieces, and flushes are
+ * sent to every connection.  The parts are submitted in parallel, each
+ * from its own coroutine, and spread over the connections.
+ */
+typedef struct NBDSplitRequest {
+    Coroutine *co;          /* the waiting parent request */
+    int pending;
+    int ret;
+} NBDSplitRequest;
+
+typedef struct NBDPartRequest {
+    BlockDriverState *bs;
+    NBDSplitRequest *split;
+    int type;               /* NBD_CMD_READ, NBD_CMD_WRITE or NBD_CMD_FLUSH */
+    NBDConnection *conn;    /* for flushes only */
+    int64_t sector_num;
+    int nb_sectors;
+    QEMUIOVector *qiov;
+    int offset;
+} NBDPartRequest;
+
+static void coroutine_fn nbd_co_part_entry(void *opaque)
 {
-    int offset = 0;
+    NBDPartRequest *part = opaque;
+    NBDSplitRequest *split = part->split;
     int ret;
-    while (nb_sectors > NBD_MAX_SECTORS) {
-        ret = nbd_co_readv_1(bs, sector_num, NBD_MAX_SECTORS, qiov, offset);
-        if (ret < 0) {
-            return ret;
+
+    switch (part->type) {
+    case NBD_CMD_READ:
+        ret = nbd_co_readv_1(part->bs, part->sector_num, part->nb_sectors,
+                             part->qiov, part->offset);
+        break;
+    case NBD_CMD_WRITE:
+        ret = nbd_co_writev_1(part->bs, part->sector_num, part->nb_sectors,
+                              part->qiov, part->offset);
+        break;
+    default:
+        ret = nbd_co_flush_1(part->conn);
+        break;
+    }
+
+    if (ret < 0 && !split->ret) {
+        split->ret = ret;
+    }
+    if (--split->pending == 0 && split->co) {
+        qemu_coroutine_enter(split->co, NULL);
+    }
+}
+
+static int coroutine_fn nbd_co_run_parts(NBDPartRequest *parts, int n)
+{
+    NBDSplitRequest split = {
+        .pending = n,
+    };
+    int i;
+
+    for (i = 0; i < n; i++) {
+        parts[i].split = &split;
+        qemu_coroutine_enter(qemu_coroutine_create(nbd_co_part_entry),
+                             &parts[i]);
+    }
+
+    if (split.pending) {
+        split.co = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+    return split.ret;
+}
+
+static int nbd_co_rw(BlockDriverState *bs, int64_t sector_num,
+                     int nb_sectors, QEMUIOVector *qiov, int type)
+{
+    NBDPartRequest *parts;
+    int i, n, ret;
+
+    if (nb_sectors <= NBD_MAX_SECTORS) {
+        if (type == NBD_CMD_READ) {
+            return nbd_co_readv_1(bs, sector_num, nb_sectors, qiov, 0);
+        } else {
+            return nbd_co_writev_1(bs, sector_num, nb_sectors, qiov, 0);
         }
-        offset += NBD_MAX_SECTORS * 512;
-        sector_num += NBD_MAX_SECTORS;
-        nb_sectors -= NBD_MAX_SECTORS;
     }
-    return nbd_co_readv_1(bs, sector_num, nb_sectors, qiov, offset);
+
+    n = DIV_ROUND_UP(nb_sectors, NBD_MAX_SECTORS);
+    parts = g_new0(NBDPartRequest, n);
+    for (i = 0; i < n; i++) {
+        parts[i] = (NBDPartRequest) {
+            .bs         = bs,
+            .type       = type,
+            .sector_num = sector_num + i * NBD_MAX_SECTORS,
+            .nb_sectors = MIN(nb_sectors - i * NBD_MAX_SECTORS,
+                              NBD_MAX_SECTORS),
+            .qiov       = qiov,
+            .offset     = i * NBD_MAX_SECTORS * 512,
+        };
+    }
+
+    ret = nbd_co_run_parts(parts, n);
+    g_free(parts);
+    return ret;
+}
+
+static int nbd_co_readv(BlockDriverState *bs, int64_t sector_num,
+                        int nb_sectors, QEMUIOVector *qiov)
+{
+    return nbd_co_rw(bs, sector_num, nb_sectors, qiov, NBD_CMD_READ);
 }
 
 static int nbd_co_writev(BlockDriverState *bs, int64_t sector_num,
                          int nb_sectors, QEMUIOVector *qiov)
 {
-    int offset = 0;
-    int ret;
-    while (nb_sectors > NBD_MAX_SECTORS) {
-        ret = nbd_co_writev_1(bs, sector_num, NBD_MAX_SECTORS, qiov, offset);
-        if (ret < 0) {
-            return ret;
-        }
-        offset += NBD_MAX_SECTORS * 512;
-        sector_num += NBD_MAX_SECTORS;
-        nb_sectors -= NBD_MAX_SECTORS;
-    }
-    return nbd_co_writev_1(bs, sector_num, nb_sectors, qiov, offset);
+    return nbd_co_rw(bs, sector_num, nb_sectors, qiov, NBD_CMD_WRITE);
 }
 
+/* A flush only covers the writes that completed on the same connection,
+ * so it has to be sent on all of them.
+ */
 static int nbd_co_flush(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
-    struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
+    NBDPartRequest *parts;
+    int i, ret;
 
     if (!(s->nbdflags & NBD_FLAG_SEND_FLUSH)) {
         return 0;
     }
 
-    request.type = NBD_CMD_FLUSH;
-    if (s->nbdflags & NBD_FLAG_SEND_FUA) {
-        request.type |= NBD_CMD_FLAG_FUA;
+    if (s->num_conns == 1) {
+        return nbd_co_flush_1(&s->conns[0]);
     }
 
-    request.from = 0;
-    request.len = 0;
-
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
+    parts = g_new0(NBDPartRequest, s->num_conns);
+    for (i = 0; i < s->num_conns; i++) {
+        parts[i].bs = bs;
+        parts[i].type = NBD_CMD_FLUSH;
+        parts[i].conn = &s->conns[i];
     }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+
+    ret = nbd_co_run_parts(parts, s->num_conns);
+    g_free(parts);
+    return ret;
 }
 
 static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
                           int nb_sectors)
 {
     BDRVNBDState *s = bs->opaque;
+    NBDConnection *conn;
     struct nbd_request request;
     struct nbd_reply reply;
     ssize_t ret;
@@ -534,24 +892,122 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
+    conn = nbd_get_connection(s);
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, NULL);
+    }
+    nbd_coroutine_end(conn, &request);
+    return -reply.error;
+}
+
+/* NBD requests have a 32-bit length; stay aligned to 4K */
+#define NBD_MAX_ZERO_SECTORS    ((UINT32_MAX >> BDRV_SECTOR_BITS) & ~7)
+
+static int nbd_co_write_zeroes_1(BlockDriverState *bs, int64_t sector_num,
+                                 int nb_sectors)
+{
+    BDRVNBDState *s = bs->opaque;
+    NBDConnection *conn = nbd_get_connection(s);
+    struct nbd_request request;
+    struct nbd_reply reply;
+    ssize_t ret;
+
+    request.type = NBD_CMD_WRITE_ZEROES;
+    if (!bdrv_enable_write_cache(bs) && (s->nbdflags & NBD_FLAG_SEND_FUA)) {
+        request.type |= NBD_CMD_FLAG_FUA;
+    }
+
+    request.from = sector_num * 512;
+    request.len = nb_sectors * 512;
+
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, NULL);
     }
-    nbd_coroutine_end(s, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 }
 
+static int coroutine_fn nbd_co_write_zeroes(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            int nb_sectors)
+{
+    BDRVNBDState *s = bs->opaque;
+    int ret;
+
+    if (!(s->nbdflags & NBD_FLAG_SEND_WRITE_ZEROES)) {
+        return -ENOTSUP;
+    }
+
+    while (nb_sectors > NBD_MAX_ZERO_SECTORS) {
+        ret = nbd_co_write_zeroes_1(bs, sector_num, NBD_MAX_ZERO_SECTORS);
+        if (ret < 0) {
+            return ret;
+        }
+        sector_num += NBD_MAX_ZERO_SECTORS;
+        nb_sectors -= NBD_MAX_ZERO_SECTORS;
+    }
+    return nbd_co_write_zeroes_1(bs, sector_num, nb_sectors);
+}
+
+/* Holes are reported as unallocated.  Whether an area reads as zeroes is
+ * independent of that, so that e.g. qemu-img convert can skip zeroed data
+ * as well as holes.
+ */
+static int coroutine_fn nbd_co_get_block_status(BlockDriverState *bs,
+                                                int64_t sector_num,
+                                                int nb_sectors, int *pnum)
+{
+    BDRVNBDState *s = bs->opaque;
+    NBDConnection *conn = nbd_get_connection(s);
+    struct nbd_request request;
+    struct nbd_reply reply;
+    NBDExtent extent = { 0 };
+    ssize_t ret;
+
+    if (!conn->ext.base_allocation) {
+        *pnum = nb_sectors;
+        return BDRV_BLOCK_DATA;
+    }
+
+    request.type = NBD_CMD_BLOCK_STATUS | NBD_CMD_FLAG_REQ_ONE;
+    request.from = sector_num * 512;
+    request.len = MIN(nb_sectors, NBD_MAX_ZERO_SECTORS) * 512;
+
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, &extent);
+    }
+    nbd_coroutine_end(conn, &request);
+    if (reply.error) {
+        return -reply.error;
+    }
+
+    *pnum = MIN(extent.length / 512, nb_sectors);
+    if (*pnum == 0) {
+        return -EIO;
+    }
+    return (extent.flags & NBD_STATE_HOLE ? 0 : BDRV_BLOCK_DATA) |
+           (extent.flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0);
+}
+
 static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
     g_free(s->export_name);
     g_free(s->host_spec);
 
-    nbd_teardown_connection(bs);
+    nbd_free_connections(s);
 }
 
 static int64_t nbd_getlength(BlockDriverState *bs)
@@ -571,6 +1027,8 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close          = nbd_close,
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
+    .bdrv_co_write_zeroes = nbd_co_write_zeroes,
+    .bdrv_co_get_block_status = nbd_co_get_block_status,
     .bdrv_getlength      = nbd_getlength,
 };
 
@@ -584,6 +1042,8 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_close          = nbd_close,
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
+    .bdrv_co_write_zeroes = nbd_co_write_zeroes,
+    .bdrv_co_get_block_status = nbd_co_get_block_status,
     .bdrv_getlength      = nbd_getlength,
 };
 
@@ -597,6 +1057,8 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_close          = nbd_close,
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
+    .bdrv_co_write_zeroes = nbd_co_write_zeroes,
+    .bdrv_co_get_block_status = nbd_co_get_block_status,
     .bdrv_getlength      = nbd_getlength,
 };
 
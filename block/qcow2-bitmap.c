@@ -0,0 +1,331 @@
+/*
+ * Persistent dirty bitmaps for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "qemu/hbitmap.h"
+
+/*
+ * All persistent bitmaps of an image are stored in one run of clusters that
+ * is referenced by the dirty bitmaps header extension.  The run starts with
+ * a directory of Qcow2BitmapEntry structures (each followed by the bitmap
+ * name and padded to 8 bytes), followed by the bitmap data.  Each bitmap is
+ * a plain array with one bit per granule, least significant bit first.
+ *
+ * The contents are only valid while the dirty bitmaps autoclear bit is set.
+ * qcow2_open clears it when the image is opened read-write, and it is set
+ * again when the bitmaps are written back on close.  After a crash, or after
+ * an older version of QEMU has written to the image, the bitmaps are thus
+ * ignored and a full backup is needed.
+ */
+
+#define QCOW2_MAX_BITMAPS               65535
+#define QCOW2_MAX_BITMAP_GRANULARITY    26  /* 64 MB */
+
+typedef struct QEMU_PACKED Qcow2BitmapEntry {
+    /* header is 8 byte aligned */
+    uint64_t data_offset;       /* relative to the start of the bitmaps */
+    uint64_t nb_bits;
+    uint32_t granularity_bits;  /* log2 of the granularity in bytes */
+    uint16_t name_size;
+    uint16_t reserved;
+    /* name follows */
+} Qcow2BitmapEntry;
+
+static uint64_t bitmap_nb_bits(BlockDriverState *bs, int granularity_bits)
+{
+    int64_t granule = 1LL << (granularity_bits - BDRV_SECTOR_BITS);
+    return (bs->total_sectors + granule - 1) / granule;
+}
+
+static uint64_t bitmap_data_size(uint64_t nb_bits)
+{
+    return align_offset((nb_bits + 7) / 8, 8);
+}
+
+static void bitmap_load(BdrvDirtyBitmap *bitmap, const uint8_t *data,
+                        uint64_t nb_bits, int granularity_bits)
+{
+    int sector_bits = granularity_bits - BDRV_SECTOR_BITS;
+    uint64_t i, start;
+
+    for (i = 0; i < nb_bits; ) {
+        if (!(data[i / 8] & (1 << (i % 8)))) {
+            i++;
+            if ((i % 8) == 0) {
+                /* Skip clean bytes quickly */
+                while (i < nb_bits && data[i / 8] == 0) {
+                    i += 8;
+                }
+            }
+            continue;
+        }
+
+        start = i;
+        while (i < nb_bits && (data[i / 8] & (1 << (i % 8)))) {
+            i++;
+        }
+        hbitmap_set(bitmap->bitmap, start << sector_bits,
+                    (i - start) << sector_bits);
+    }
+}
+
+static void bitmap_save(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                        uint8_t *data, int granularity_bits)
+{
+    int sector_bits = granularity_bits - BDRV_SECTOR_BITS;
+    HBitmapIter hbi;
+    int64_t sector;
+    uint64_t bit;
+
+    bdrv_dirty_iter_init(bs, bitmap, &hbi);
+    while ((sector = hbitmap_iter_next(&hbi)) >= 0) {
+        bit = sector >> sector_bits;
+        data[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+bool qcow2_can_store_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    /* The autoclear bit is needed to detect stale bitmaps */
+    return s->qcow_version >= 3;
+}
+
+/*
+ * Loads the bitmaps saved in the image into @bs.  Stale or unusable bitmaps
+ * (e.g. because the image was resized) are skipped; their clusters are
+ * freed the next time the bitmaps are stored.
+ */
+int qcow2_read_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BitmapEntry *e;
+    BdrvDirtyBitmap *bitmap;
+    uint8_t *buf;
+    uint64_t offset, nb_bits, data_size;
+    int i, name_size, ret;
+    char *name;
+
+    if (!s->nb_bitmaps ||
+        !(s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_BITMAPS)) {
+        return 0;
+    }
+
+    if (s->bitmaps_size > INT_MAX) {
+        return -EFBIG;
+    }
+
+    buf = g_malloc(s->bitmaps_size);
+    ret = bdrv_pread(bs->file, s->bitmaps_offset, buf, s->bitmaps_size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    offset = 0;
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        if (offset + sizeof(*e) > s->bitmaps_size) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        e = (Qcow2BitmapEntry *) (buf + offset);
+        be64_to_cpus(&e->data_offset);
+        be64_to_cpus(&e->nb_bits);
+        be32_to_cpus(&e->granularity_bits);
+        be16_to_cpus(&e->name_size);
+        offset += sizeof(*e);
+
+        name_size = e->name_size;
+        if (offset + name_size > s->bitmaps_size) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        name = g_strndup((char *) buf + offset, name_size);
+        offset = align_offset(offset + name_size, 8);
+
+        data_size = bitmap_data_size(e->nb_bits);
+        if (e->granularity_bits < BDRV_SECTOR_BITS ||
+            e->granularity_bits > QCOW2_MAX_BITMAP_GRANULARITY ||
+            e->data_offset > s->bitmaps_size ||
+            data_size > s->bitmaps_size - e->data_offset) {
+            g_free(name);
+            ret = -EINVAL;
+            goto fail;
+        }
+
+        nb_bits = bitmap_nb_bits(bs, e->granularity_bits);
+        if (e->nb_bits != nb_bits || bdrv_find_dirty_bitmap(bs, name)) {
+            g_free(name);
+            continue;
+        }
+
+        bitmap = bdrv_create_dirty_bitmap(bs, 1 << e->granularity_bits,
+                                          name, NULL);
+        g_free(name);
+        if (!bitmap) {
+            continue;
+        }
+        bitmap->persistent = true;
+        bitmap_load(bitmap, buf + e->data_offset, nb_bits,
+                    e->granularity_bits);
+    }
+    ret = 0;
+
+fail:
+    g_free(buf);
+    return ret;
+}
+
+/*
+ * Writes all persistent bitmaps of @bs to newly allocated clusters, points
+ * the header at them and frees the previously stored bitmaps.
+ *
+ * Returns 0 on success, -errno in error cases.
+ */
+int qcow2_store_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Qcow2BitmapEntry *e;
+    uint64_t old_offset, old_size;
+    uint32_t old_nb_bitmaps;
+    uint64_t dir_size, size, offset, data_offset, nb_bits;
+    int64_t bitmaps_offset = 0;
+    int nb_bitmaps, granularity_bits;
+    uint8_t *buf = NULL;
+    size_t name_size;
+    int ret;
+
+    /* Compute the size of the directory and of the data */
+    nb_bitmaps = 0;
+    dir_size = 0;
+    size = 0;
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (!bitmap->persistent || strlen(bitmap->name) > UINT16_MAX ||
+            nb_bitmaps == QCOW2_MAX_BITMAPS) {
+            continue;
+        }
+        granularity_bits = ffs(bdrv_dirty_bitmap_granularity(bitmap)) - 1;
+        nb_bitmaps++;
+        dir_size += align_offset(sizeof(*e) + strlen(bitmap->name), 8);
+        size += bitmap_data_size(bitmap_nb_bits(bs, granularity_bits));
+    }
+    size += dir_size;
+
+    if (nb_bitmaps == 0 && s->bitmaps_offset == 0) {
+        return 0;
+    }
+
+    if (nb_bitmaps) {
+        if (size > INT_MAX) {
+            return -EFBIG;
+        }
+
+        /* Allocate space for the new bitmaps */
+        bitmaps_offset = qcow2_alloc_clusters(bs, size);
+        if (bitmaps_offset < 0) {
+            return bitmaps_offset;
+        }
+        ret = bdrv_flush(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf = g_malloc0(size);
+        offset = 0;
+        data_offset = dir_size;
+        QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+            if (!bitmap->persistent || strlen(bitmap->name) > UINT16_MAX) {
+                continue;
+            }
+            if (offset == dir_size) {
+                break;
+            }
+            granularity_bits = ffs(bdrv_dirty_bitmap_granularity(bitmap)) - 1;
+            nb_bits = bitmap_nb_bits(bs, granularity_bits);
+            name_size = strlen(bitmap->name);
+
+            e = (Qcow2BitmapEntry *) (buf + offset);
+            e->data_offset = cpu_to_be64(data_offset);
+            e->nb_bits = cpu_to_be64(nb_bits);
+            e->granularity_bits = cpu_to_be32(granularity_bits);
+            e->name_size = cpu_to_be16(name_size);
+            memcpy(buf + offset + sizeof(*e), bitmap->name, name_size);
+            offset = align_offset(offset + sizeof(*e) + name_size, 8);
+
+            bitmap_save(bs, bitmap, buf + data_offset, granularity_bits);
+            data_offset += bitmap_data_size(nb_bits);
+        }
+
+        ret = bdrv_pwrite(bs->file, bitmaps_offset, buf, size);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        /* The new bitmaps must be stable on disk before the header points
+         * to them.
+         */
+        ret = bdrv_flush(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    old_offset = s->bitmaps_offset;
+    old_size = s->bitmaps_size;
+    old_nb_bitmaps = s->nb_bitmaps;
+
+    s->bitmaps_offset = nb_bitmaps ? bitmaps_offset : 0;
+    s->bitmaps_size = nb_bitmaps ? size : 0;
+    s->nb_bitmaps = nb_bitmaps;
+    if (nb_bitmaps) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+    } else {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+    }
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->bitmaps_offset = old_offset;
+        s->bitmaps_size = old_size;
+        s->nb_bitmaps = old_nb_bitmaps;
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+        goto fail;
+    }
+
+    /* free the old bitmaps */
+    if (old_offset) {
+        qcow2_free_clusters(bs, old_offset, old_size);
+    }
+
+    g_free(buf);
+    return 0;
+
+fail:
+    if (bitmaps_offset > 0) {
+        qcow2_free_clusters(bs, bitmaps_offset, size);
+    }
+    g_free(buf);
+    return ret;
+}
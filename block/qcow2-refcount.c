@@ -1179,6 +1179,10 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->snapshots_offset, s->snapshots_size);
 
+    /* persistent dirty bitmaps */
+    inc_refcounts(bs, res, refcount_table, nb_clusters,
+        s->bitmaps_offset, s->bitmaps_size);
+
     /* refcount data */
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->refcount_table_offset,
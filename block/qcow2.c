@@ -27,6 +27,7 @@
 #include <zlib.h>
 #include "block/aes.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
 #include "trace.h"
@@ -56,6 +57,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_DIRTY_BITMAPS 0x23852875
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -136,6 +138,33 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
 #endif
             break;
 
+        case QCOW2_EXT_MAGIC_DIRTY_BITMAPS:
+        {
+            Qcow2BitmapHeaderExt bitmaps_ext;
+
+            if (ext.len != sizeof(bitmaps_ext)) {
+                error_report("Dirty bitmaps header extension has invalid "
+                             "length %u", ext.len);
+                return -EINVAL;
+            }
+            ret = bdrv_pread(bs->file, offset, &bitmaps_ext, ext.len);
+            if (ret < 0) {
+                return ret;
+            }
+            be32_to_cpus(&bitmaps_ext.nb_bitmaps);
+            be64_to_cpus(&bitmaps_ext.bitmaps_size);
+            be64_to_cpus(&bitmaps_ext.bitmaps_offset);
+
+            if (bitmaps_ext.bitmaps_offset & (s->cluster_size - 1)) {
+                error_report("Dirty bitmaps are not cluster aligned");
+                return -EINVAL;
+            }
+            s->nb_bitmaps = bitmaps_ext.nb_bitmaps;
+            s->bitmaps_size = bitmaps_ext.bitmaps_size;
+            s->bitmaps_offset = bitmaps_ext.bitmaps_offset;
+            break;
+        }
+
         case QCOW2_EXT_MAGIC_FEATURE_TABLE:
             if (p_feature_table != NULL) {
                 void* feature_table = g_malloc0(ext.len + 2 * sizeof(Qcow2Feature));
@@ -487,7 +516,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
         goto fail;
     }
 
-    /* Clear unknown autoclear feature bits */
+    ret = qcow2_read_bitmaps(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* Clear autoclear feature bits.  For known features this marks the
+     * image as in use, e.g. the dirty bitmaps become stale as soon as
+     * anything is written to the image; they are saved again on close.
+     */
     if (!bs->read_only && s->autoclear_features != 0) {
         s->autoclear_features = 0;
         ret = qcow2_update_header(bs);
@@ -904,6 +941,11 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    if (!bs->read_only) {
+        qcow2_store_bitmaps(bs);
+    }
+
     g_free(s->l1_table);
 
     qcow2_cache_flush(bs, s->l2_table_cache);
@@ -1073,6 +1115,24 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Dirty bitmaps header extension */
+    if (s->bitmaps_offset) {
+        Qcow2BitmapHeaderExt bitmaps_ext = {
+            .nb_bitmaps     = cpu_to_be32(s->nb_bitmaps),
+            .bitmaps_size   = cpu_to_be64(s->bitmaps_size),
+            .bitmaps_offset = cpu_to_be64(s->bitmaps_offset),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DIRTY_BITMAPS,
+                             &bitmaps_ext, sizeof(bitmaps_ext), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Feature table */
     Qcow2Feature features[] = {
         {
@@ -1085,6 +1145,11 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
             .name = "lazy refcounts",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+            .bit  = QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR,
+            .name = "dirty bitmaps",
+        },
     };
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1503,16 +1568,97 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+/*
+ * Compresses @src_size bytes from @src into at most @dest_size bytes at
+ * @dest.  Returns the compressed size, or -ENOSPC if the data does not
+ * compress, or -EINVAL on failure.
+ */
+static ssize_t qcow2_compress(void *dest, size_t dest_size,
+                              const void *src, size_t src_size)
+{
+    ssize_t ret;
+    z_stream strm;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = src_size;
+    strm.next_in = (uint8_t *)src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = dest_size - strm.avail_out;
+    } else {
+        ret = (ret == Z_OK ? -ENOSPC : -EINVAL);
+    }
+
+    deflateEnd(&strm);
+    return ret;
+}
+
+typedef struct Qcow2CompressData {
+    void *dest;
+    size_t dest_size;
+    const void *src;
+    size_t src_size;
+    ssize_t ret;
+} Qcow2CompressData;
+
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+
+    data->ret = qcow2_compress(data->dest, data->dest_size,
+                               data->src, data->src_size);
+    return 0;
+}
+
+/*
+ * Compression is CPU bound, so when called from a coroutine it runs in the
+ * thread pool and other requests (e.g. the other clusters of qemu-img
+ * convert) can make progress meanwhile.
+ */
+static ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                              void *dest, size_t dest_size,
+                                              const void *src,
+                                              size_t src_size)
+{
+    ThreadPool *pool;
+    Qcow2CompressData data = {
+        .dest       = dest,
+        .dest_size  = dest_size,
+        .src        = src,
+        .src_size   = src_size,
+    };
+
+    if (!qemu_in_coroutine()) {
+        return qcow2_compress(dest, dest_size, src, src_size);
+    }
+
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    thread_pool_submit_co(pool, qcow2_compress_pool_func, &data);
+    return data.ret;
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
+    ssize_t out_len;
     uint8_t *out_buf;
     uint64_t cluster_offset;
+    bool in_co = qemu_in_coroutine();
+    int ret;
 
     if (nb_sectors == 0) {
         /* align end of file to a sector boundary to ease reading with
@@ -1526,54 +1672,45 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
     if (nb_sectors != s->cluster_sectors)
         return -EINVAL;
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    /* Compressed data must be smaller than a cluster to be of any use */
+    out_buf = g_malloc(s->cluster_size);
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
-    }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
-
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
+                                buf, s->cluster_size);
+    if (out_len == -ENOSPC) {
         /* could not compress: write normal cluster */
         ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
             goto fail;
         }
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
-        }
+        goto success;
+    } else if (out_len < 0) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* Several compressed writes may be in flight at the same time, so the
+     * metadata update must be serialised against other requests */
+    if (in_co) {
+        qemu_co_mutex_lock(&s->lock);
+    }
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        sector_num << 9, out_len);
+    if (cluster_offset) {
         cluster_offset &= s->cluster_offset_mask;
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
         ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
+    } else {
+        ret = -EIO;
+    }
+    if (in_co) {
+        qemu_co_mutex_unlock(&s->lock);
+    }
+    if (ret < 0) {
+        goto fail;
     }
 
+success:
     ret = 0;
 fail:
     g_free(out_buf);
@@ -1748,6 +1885,8 @@ static BlockDriver bdrv_qcow2 = {
 
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
 
+    .bdrv_can_store_dirty_bitmaps = qcow2_can_store_dirty_bitmaps,
+
     .create_options = qcow2_create_options,
     .bdrv_check = qcow2_check,
 };
@@ -13,6 +13,7 @@
  */
 
 #include "qemu/timer.h"
+#include "qemu/main-loop.h"
 #include "trace.h"
 #include "qed.h"
 #include "qapi/qmp/qerror.h"
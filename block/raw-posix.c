@@ -138,6 +138,10 @@ typedef struct BDRVRawState {
     int use_aio;
     void *aio_ctx;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    bool use_io_uring;
+    void *io_uring_ctx;
+#endif
 #ifdef CONFIG_XFS
     bool is_xfs : 1;
 #endif
@@ -150,6 +154,9 @@ typedef struct BDRVRawReopenState {
 #ifdef CONFIG_LINUX_AIO
     int use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    bool use_io_uring;
+#endif
 } BDRVRawReopenState;
 
 static int fd_open(BlockDriverState *bs);
@@ -262,6 +269,24 @@ error:
 }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+/* Unlike Linux AIO, io_uring also works without O_DIRECT.  If the kernel
+ * does not support it, requests silently go to the thread pool.
+ */
+static void raw_set_io_uring(BDRVRawState *s, bool *use_io_uring,
+                             int bdrv_flags)
+{
+    *use_io_uring = false;
+    if (bdrv_flags & BDRV_O_IO_URING) {
+        /* if non-NULL, luring_init() has already been run */
+        if (s->io_uring_ctx == NULL) {
+            s->io_uring_ctx = luring_init(qemu_get_aio_context());
+        }
+        *use_io_uring = s->io_uring_ctx != NULL;
+    }
+}
+#endif
+
 static int raw_open_common(BlockDriverState *bs, const char *filename,
                            int bdrv_flags, int open_flags)
 {
@@ -292,6 +317,9 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
         return -errno;
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    raw_set_io_uring(s, &s->use_io_uring, bdrv_flags);
+#endif
 
     s->has_discard = 1;
 #ifdef CONFIG_XFS
@@ -336,6 +364,9 @@ static int raw_reopen_prepare(BDRVReopenState *state,
         return -1;
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    raw_set_io_uring(s, &raw_s->use_io_uring, state->flags);
+#endif
 
     if (s->type == FTYPE_FD || s->type == FTYPE_CD) {
         raw_s->open_flags |= O_NONBLOCK;
@@ -403,6 +434,9 @@ static void raw_reopen_commit(BDRVReopenState *state)
 #ifdef CONFIG_LINUX_AIO
     s->use_aio = raw_s->use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    s->use_io_uring = raw_s->use_io_uring;
+#endif
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -768,11 +802,32 @@ static BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
     return thread_pool_submit_aio(pool, aio_worker, acb, cb, opaque);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+/* Tries to submit the request through io_uring, returns NULL if the caller
+ * should use the thread pool instead.
+ */
+static BlockDriverAIOCB *raw_try_io_uring(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int type)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (!s->use_io_uring || (type & (QEMU_AIO_MISALIGNED | QEMU_AIO_BLKDEV))) {
+        return NULL;
+    }
+    return luring_submit(bs, s->io_uring_ctx, s->fd, sector_num, qiov,
+                         nb_sectors, cb, opaque, type);
+}
+#endif
+
 static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type)
 {
     BDRVRawState *s = bs->opaque;
+#ifdef CONFIG_LINUX_IO_URING
+    BlockDriverAIOCB *acb;
+#endif
 
     if (fd_open(bs) < 0)
         return NULL;
@@ -793,6 +848,13 @@ static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
         }
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    acb = raw_try_io_uring(bs, sector_num, qiov, nb_sectors, cb, opaque, type);
+    if (acb) {
+        return acb;
+    }
+#endif
+
     return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
                        cb, opaque, type);
 }
@@ -817,16 +879,32 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
     BDRVRawState *s = bs->opaque;
+#ifdef CONFIG_LINUX_IO_URING
+    BlockDriverAIOCB *acb;
+#endif
 
     if (fd_open(bs) < 0)
         return NULL;
 
+#ifdef CONFIG_LINUX_IO_URING
+    acb = raw_try_io_uring(bs, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
+    if (acb) {
+        return acb;
+    }
+#endif
+
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring_ctx) {
+        luring_cleanup(s->io_uring_ctx);
+        s->io_uring_ctx = NULL;
+    }
+#endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -1142,6 +1220,17 @@ static coroutine_fn BlockDriverAIOCB *raw_aio_discard(BlockDriverState *bs,
     BlockDriverCompletionFunc *cb, void *opaque)
 {
     BDRVRawState *s = bs->opaque;
+#ifdef CONFIG_LINUX_IO_URING
+    BlockDriverAIOCB *acb;
+
+    if (s->has_discard) {
+        acb = raw_try_io_uring(bs, sector_num, NULL, nb_sectors,
+                               cb, opaque, QEMU_AIO_DISCARD);
+        if (acb) {
+            return acb;
+        }
+    }
+#endif
 
     return paio_submit(bs, s->fd, sector_num, NULL, nb_sectors,
                        cb, opaque, QEMU_AIO_DISCARD);
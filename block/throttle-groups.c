@@ -0,0 +1,275 @@
+/*
+ * Block I/O throttle groups
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/timer.h"
+#include "block/throttle-groups.h"
+
+/*
+ * A throttle group is a set of BlockDriverStates that share the same I/O
+ * limits.  Drives that are throttled on their own are placed in a group
+ * named after the device.
+ *
+ * Requests that exceed the limits are queued in the throttled_reqs queue
+ * of their BlockDriverState.  The queues of all members are served in
+ * round-robin order, so that a single busy drive cannot starve the other
+ * drives of the group.  tokens[] points to the member whose turn it is.
+ *
+ * There is only one timer per direction for the whole group, and it is
+ * only armed for the request at the head of the round-robin order.  When
+ * it fires, that request is submitted and in turn schedules the next one,
+ * so queued requests do not cause any timer activity of their own.
+ */
+struct ThrottleGroup {
+    char *name;
+    int refcount;
+    ThrottleState ts;
+    QLIST_HEAD(, BlockDriverState) head;
+    BlockDriverState *tokens[2];
+    QEMUTimer *timers[2];
+    QTAILQ_ENTRY(ThrottleGroup) list;
+};
+
+static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
+    QTAILQ_HEAD_INITIALIZER(throttle_groups);
+
+static void schedule_next_request(BlockDriverState *bs, bool is_write);
+
+static void throttle_group_timer_cb(ThrottleGroup *tg, bool is_write)
+{
+    BlockDriverState *token = tg->tokens[is_write];
+
+    if (!token) {
+        return;
+    }
+
+    /* Submit the request that was waiting for this timer, or look for
+     * another one if it has gone away in the meantime.
+     */
+    if (!qemu_co_queue_next(&token->throttled_reqs[is_write])) {
+        schedule_next_request(token, is_write);
+    }
+}
+
+static void throttle_group_read_timer_cb(void *opaque)
+{
+    throttle_group_timer_cb(opaque, false);
+}
+
+static void throttle_group_write_timer_cb(void *opaque)
+{
+    throttle_group_timer_cb(opaque, true);
+}
+
+static ThrottleGroup *throttle_group_ref(const char *name)
+{
+    ThrottleGroup *tg;
+
+    QTAILQ_FOREACH(tg, &throttle_groups, list) {
+        if (!strcmp(name, tg->name)) {
+            tg->refcount++;
+            return tg;
+        }
+    }
+
+    tg = g_new0(ThrottleGroup, 1);
+    tg->name = g_strdup(name);
+    tg->refcount = 1;
+    throttle_init(&tg->ts, qemu_get_clock_ns(vm_clock));
+    QLIST_INIT(&tg->head);
+    tg->timers[0] = qemu_new_timer_ns(vm_clock,
+                                      throttle_group_read_timer_cb, tg);
+    tg->timers[1] = qemu_new_timer_ns(vm_clock,
+                                      throttle_group_write_timer_cb, tg);
+    QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
+
+    return tg;
+}
+
+static void throttle_group_unref(ThrottleGroup *tg)
+{
+    int i;
+
+    if (--tg->refcount > 0) {
+        return;
+    }
+
+    assert(QLIST_EMPTY(&tg->head));
+    QTAILQ_REMOVE(&throttle_groups, tg, list);
+    for (i = 0; i < 2; i++) {
+        qemu_del_timer(tg->timers[i]);
+        qemu_free_timer(tg->timers[i]);
+    }
+    g_free(tg->name);
+    g_free(tg);
+}
+
+const char *throttle_group_get_name(BlockDriverState *bs)
+{
+    return bs->throttle_group->name;
+}
+
+/* Changes the limits of the group that @bs belongs to.  Queued requests are
+ * rescheduled according to the new limits.
+ */
+void throttle_group_config(BlockDriverState *bs, ThrottleConfig *cfg)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    int i;
+
+    throttle_config(&tg->ts, cfg, now);
+    for (i = 0; i < 2; i++) {
+        if (qemu_timer_pending(tg->timers[i])) {
+            qemu_mod_timer(tg->timers[i], now);
+        }
+    }
+}
+
+void throttle_group_get_config(BlockDriverState *bs, ThrottleConfig *cfg)
+{
+    throttle_get_config(&bs->throttle_group->ts, cfg);
+}
+
+/* Adds @bs to the group called @groupname, creating it if needed.  A newly
+ * created group has no limits.
+ */
+void throttle_group_register_bs(BlockDriverState *bs, const char *groupname)
+{
+    ThrottleGroup *tg = throttle_group_ref(groupname);
+    int i;
+
+    assert(!bs->throttle_group);
+    for (i = 0; i < 2; i++) {
+        if (!tg->tokens[i]) {
+            tg->tokens[i] = bs;
+        }
+    }
+    QLIST_INSERT_HEAD(&tg->head, bs, round_robin);
+    bs->throttle_group = tg;
+}
+
+static BlockDriverState *throttle_group_next_bs(BlockDriverState *bs)
+{
+    BlockDriverState *next = QLIST_NEXT(bs, round_robin);
+
+    return next ? next : QLIST_FIRST(&bs->throttle_group->head);
+}
+
+/* Removes @bs from its group; its throttled_reqs queues must be empty or
+ * about to be restarted.
+ */
+void throttle_group_unregister_bs(BlockDriverState *bs)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *token;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (tg->tokens[i] == bs) {
+            token = throttle_group_next_bs(bs);
+            tg->tokens[i] = token == bs ? NULL : token;
+        }
+    }
+    QLIST_REMOVE(bs, round_robin);
+    bs->throttle_group = NULL;
+    throttle_group_unref(tg);
+}
+
+/* Returns the next member of the group (in round-robin order) that has
+ * queued requests, or @bs if there are none.
+ */
+static BlockDriverState *next_throttle_token(BlockDriverState *bs,
+                                             bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *token, *start;
+
+    start = token = tg->tokens[is_write];
+    do {
+        token = throttle_group_next_bs(token);
+    } while (token != start && !token->pending_reqs[is_write]);
+
+    if (token == start && !token->pending_reqs[is_write]) {
+        token = bs;
+    }
+    return token;
+}
+
+/* Checks whether the next request of @bs has to wait and, if so, arms the
+ * group timer for it unless it is already armed.
+ */
+static bool throttle_group_schedule_timer(BlockDriverState *bs, bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    int64_t now, next_timestamp;
+
+    if (qemu_timer_pending(tg->timers[is_write])) {
+        return true;
+    }
+
+    now = qemu_get_clock_ns(vm_clock);
+    if (!throttle_compute_timer(&tg->ts, is_write, now, &next_timestamp)) {
+        return false;
+    }
+
+    qemu_mod_timer(tg->timers[is_write], next_timestamp);
+    tg->tokens[is_write] = bs;
+    return true;
+}
+
+/* Wakes up or schedules the next queued request of the group */
+static void schedule_next_request(BlockDriverState *bs, bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *token;
+
+    token = next_throttle_token(bs, is_write);
+    if (!token->pending_reqs[is_write]) {
+        return;
+    }
+
+    if (throttle_group_schedule_timer(token, is_write)) {
+        return;
+    }
+
+    /* Prefer the current drive if it has queued requests, too */
+    if (qemu_co_queue_next(&bs->throttled_reqs[is_write])) {
+        token = bs;
+    } else {
+        qemu_co_queue_next(&token->throttled_reqs[is_write]);
+    }
+    tg->tokens[is_write] = token;
+}
+
+void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
+                                                        uint64_t bytes,
+                                                        bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *token;
+    bool must_wait;
+
+    token = next_throttle_token(bs, is_write);
+    must_wait = throttle_group_schedule_timer(token, is_write);
+
+    /* Keep the requests of each drive in FIFO order */
+    if (must_wait || bs->pending_reqs[is_write]) {
+        bs->pending_reqs[is_write]++;
+        qemu_co_queue_wait(&bs->throttled_reqs[is_write]);
+        bs->pending_reqs[is_write]--;
+
+        /* Throttling may have been disabled or moved to another group */
+        tg = bs->throttle_group;
+        if (!tg) {
+            return;
+        }
+    }
+
+    throttle_account(&tg->ts, is_write, bytes);
+    schedule_next_request(bs, is_write);
+}
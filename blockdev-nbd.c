@@ -28,7 +28,7 @@ static void nbd_accept(void *opaque)
 
     int fd = accept(server_fd, (struct sockaddr *)&addr, &addr_len);
     if (fd >= 0) {
-        nbd_client_new(NULL, fd, nbd_client_put);
+        nbd_client_new(NULL, fd, NULL, nbd_client_put);
     }
 }
 
@@ -40,6 +40,7 @@
 #include "qapi/qmp/types.h"
 #include "sysemu/sysemu.h"
 #include "block/block_int.h"
+#include "block/thread-pool.h"
 #include "qmp-commands.h"
 #include "trace.h"
 #include "sysemu/arch_init.h"
@@ -280,38 +281,6 @@ static int parse_block_error_action(const char *buf, bool is_read)
     }
 }
 
-static bool do_check_io_limits(BlockIOLimit *io_limits, Error **errp)
-{
-    bool bps_flag;
-    bool iops_flag;
-
-    assert(io_limits);
-
-    bps_flag  = (io_limits->bps[BLOCK_IO_LIMIT_TOTAL] != 0)
-                 && ((io_limits->bps[BLOCK_IO_LIMIT_READ] != 0)
-                 || (io_limits->bps[BLOCK_IO_LIMIT_WRITE] != 0));
-    iops_flag = (io_limits->iops[BLOCK_IO_LIMIT_TOTAL] != 0)
-                 && ((io_limits->iops[BLOCK_IO_LIMIT_READ] != 0)
-                 || (io_limits->iops[BLOCK_IO_LIMIT_WRITE] != 0));
-    if (bps_flag || iops_flag) {
-        error_setg(errp, "bps(iops) and bps_rd/bps_wr(iops_rd/iops_wr) "
-                         "cannot be used at the same time");
-        return false;
-    }
-
-    if (io_limits->bps[BLOCK_IO_LIMIT_TOTAL] < 0 ||
-        io_limits->bps[BLOCK_IO_LIMIT_WRITE] < 0 ||
-        io_limits->bps[BLOCK_IO_LIMIT_READ] < 0 ||
-        io_limits->iops[BLOCK_IO_LIMIT_TOTAL] < 0 ||
-        io_limits->iops[BLOCK_IO_LIMIT_WRITE] < 0 ||
-        io_limits->iops[BLOCK_IO_LIMIT_READ] < 0) {
-        error_setg(errp, "bps and iops values must be 0 or greater");
-        return false;
-    }
-
-    return true;
-}
-
 DriveInfo *drive_init(QemuOpts *all_opts, BlockInterfaceType block_default_type)
 {
     const char *buf;
@@ -330,7 +299,8 @@ DriveInfo *drive_init(QemuOpts *all_opts, BlockInterfaceType block_default_type)
     int on_read_error, on_write_error;
     const char *devaddr;
     DriveInfo *dinfo;
-    BlockIOLimit io_limits;
+    ThrottleConfig cfg;
+    const char *throttling_group;
     int snapshot = 0;
     bool copy_on_read;
     int ret;
@@ -457,12 +427,18 @@ DriveInfo *drive_init(QemuOpts *all_opts, BlockInterfaceType block_default_type)
         }
     }
 
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     if ((buf = qemu_opt_get(opts, "aio")) != NULL) {
-        if (!strcmp(buf, "native")) {
-            bdrv_flags |= BDRV_O_NATIVE_AIO;
-        } else if (!strcmp(buf, "threads")) {
+        if (!strcmp(buf, "threads")) {
             /* this is the default */
+#ifdef CONFIG_LINUX_AIO
+        } else if (!strcmp(buf, "native")) {
+            bdrv_flags |= BDRV_O_NATIVE_AIO;
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+        } else if (!strcmp(buf, "io_uring")) {
+            bdrv_flags |= BDRV_O_IO_URING;
+#endif
         } else {
            error_report("invalid aio option");
            return NULL;
@@ -485,20 +461,49 @@ DriveInfo *drive_init(QemuOpts *all_opts, BlockInterfaceType block_default_type)
     }
 
     /* disk I/O throttling */
-    io_limits.bps[BLOCK_IO_LIMIT_TOTAL]  =
-                           qemu_opt_get_number(opts, "bps", 0);
-    io_limits.bps[BLOCK_IO_LIMIT_READ]   =
-                           qemu_opt_get_number(opts, "bps_rd", 0);
-    io_limits.bps[BLOCK_IO_LIMIT_WRITE]  =
-                           qemu_opt_get_number(opts, "bps_wr", 0);
-    io_limits.iops[BLOCK_IO_LIMIT_TOTAL] =
-                           qemu_opt_get_number(opts, "iops", 0);
-    io_limits.iops[BLOCK_IO_LIMIT_READ]  =
-                           qemu_opt_get_number(opts, "iops_rd", 0);
-    io_limits.iops[BLOCK_IO_LIMIT_WRITE] =
-                           qemu_opt_get_number(opts, "iops_wr", 0);
-
-    if (!do_check_io_limits(&io_limits, &error)) {
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg =
+        qemu_opt_get_number(opts, "bps", 0);
+    cfg.buckets[THROTTLE_BPS_READ].avg  =
+        qemu_opt_get_number(opts, "bps_rd", 0);
+    cfg.buckets[THROTTLE_BPS_WRITE].avg =
+        qemu_opt_get_number(opts, "bps_wr", 0);
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg =
+        qemu_opt_get_number(opts, "iops", 0);
+    cfg.buckets[THROTTLE_OPS_READ].avg =
+        qemu_opt_get_number(opts, "iops_rd", 0);
+    cfg.buckets[THROTTLE_OPS_WRITE].avg =
+        qemu_opt_get_number(opts, "iops_wr", 0);
+
+    cfg.buckets[THROTTLE_BPS_TOTAL].max =
+        qemu_opt_get_number(opts, "bps_max", 0);
+    cfg.buckets[THROTTLE_BPS_READ].max  =
+        qemu_opt_get_number(opts, "bps_rd_max", 0);
+    cfg.buckets[THROTTLE_BPS_WRITE].max =
+        qemu_opt_get_number(opts, "bps_wr_max", 0);
+    cfg.buckets[THROTTLE_OPS_TOTAL].max =
+        qemu_opt_get_number(opts, "iops_max", 0);
+    cfg.buckets[THROTTLE_OPS_READ].max =
+        qemu_opt_get_number(opts, "iops_rd_max", 0);
+    cfg.buckets[THROTTLE_OPS_WRITE].max =
+        qemu_opt_get_number(opts, "iops_wr_max", 0);
+
+    cfg.buckets[THROTTLE_BPS_TOTAL].burst_length =
+        qemu_opt_get_number(opts, "bps_max_length", 1);
+    cfg.buckets[THROTTLE_BPS_READ].burst_length  =
+        qemu_opt_get_number(opts, "bps_rd_max_length", 1);
+    cfg.buckets[THROTTLE_BPS_WRITE].burst_length =
+        qemu_opt_get_number(opts, "bps_wr_max_length", 1);
+    cfg.buckets[THROTTLE_OPS_TOTAL].burst_length =
+        qemu_opt_get_number(opts, "iops_max_length", 1);
+    cfg.buckets[THROTTLE_OPS_READ].burst_length =
+        qemu_opt_get_number(opts, "iops_rd_max_length", 1);
+    cfg.buckets[THROTTLE_OPS_WRITE].burst_length =
+        qemu_opt_get_number(opts, "iops_wr_max_length", 1);
+
+    throttling_group = qemu_opt_get(opts, "group");
+
+    if (!throttle_is_valid(&cfg, &error)) {
         error_report("%s", error_get_pretty(error));
         error_free(error);
         return NULL;
@@ -625,7 +630,13 @@ DriveInfo *drive_init(QemuOpts *all_opts, BlockInterfaceType block_default_type)
     bdrv_set_on_error(dinfo->bdrv, on_read_error, on_write_error);
 
     /* disk I/O throttling */
-    bdrv_set_io_limits(dinfo->bdrv, &io_limits);
+    if (throttle_enabled(&cfg)) {
+        if (!throttling_group) {
+            throttling_group = dinfo->bdrv->device_name;
+        }
+        bdrv_io_limits_enable(dinfo->bdrv, throttling_group);
+        bdrv_set_io_limits(dinfo->bdrv, &cfg);
+    }
 
     switch(type) {
     case IF_IDE:
@@ -1041,10 +1052,38 @@ void qmp_change_blockdev(const char *device, const char *filename,
 
 /* throttling disk I/O limits */
 void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
-                               int64_t bps_wr, int64_t iops, int64_t iops_rd,
-                               int64_t iops_wr, Error **errp)
+                               int64_t bps_wr,
+                               int64_t iops,
+                               int64_t iops_rd,
+                               int64_t iops_wr,
+                               bool has_bps_max,
+                               int64_t bps_max,
+                               bool has_bps_rd_max,
+                               int64_t bps_rd_max,
+                               bool has_bps_wr_max,
+                               int64_t bps_wr_max,
+                               bool has_iops_max,
+                               int64_t iops_max,
+                               bool has_iops_rd_max,
+                               int64_t iops_rd_max,
+                               bool has_iops_wr_max,
+                               int64_t iops_wr_max,
+                               bool has_bps_max_length,
+                               int64_t bps_max_length,
+                               bool has_bps_rd_max_length,
+                               int64_t bps_rd_max_length,
+                               bool has_bps_wr_max_length,
+                               int64_t bps_wr_max_length,
+                               bool has_iops_max_length,
+                               int64_t iops_max_length,
+                               bool has_iops_rd_max_length,
+                               int64_t iops_rd_max_length,
+                               bool has_iops_wr_max_length,
+                               int64_t iops_wr_max_length,
+                               bool has_group,
+                               const char *group, Error **errp)
 {
-    BlockIOLimit io_limits;
+    ThrottleConfig cfg;
     BlockDriverState *bs;
 
     bs = bdrv_find(device);
@@ -1053,28 +1092,70 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         return;
     }
 
-    io_limits.bps[BLOCK_IO_LIMIT_TOTAL] = bps;
-    io_limits.bps[BLOCK_IO_LIMIT_READ]  = bps_rd;
-    io_limits.bps[BLOCK_IO_LIMIT_WRITE] = bps_wr;
-    io_limits.iops[BLOCK_IO_LIMIT_TOTAL]= iops;
-    io_limits.iops[BLOCK_IO_LIMIT_READ] = iops_rd;
-    io_limits.iops[BLOCK_IO_LIMIT_WRITE]= iops_wr;
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = bps;
+    cfg.buckets[THROTTLE_BPS_READ].avg  = bps_rd;
+    cfg.buckets[THROTTLE_BPS_WRITE].avg = bps_wr;
 
-    if (!do_check_io_limits(&io_limits, errp)) {
-        return;
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = iops;
+    cfg.buckets[THROTTLE_OPS_READ].avg  = iops_rd;
+    cfg.buckets[THROTTLE_OPS_WRITE].avg = iops_wr;
+
+    if (has_bps_max) {
+        cfg.buckets[THROTTLE_BPS_TOTAL].max = bps_max;
+    }
+    if (has_bps_rd_max) {
+        cfg.buckets[THROTTLE_BPS_READ].max = bps_rd_max;
+    }
+    if (has_bps_wr_max) {
+        cfg.buckets[THROTTLE_BPS_WRITE].max = bps_wr_max;
+    }
+    if (has_iops_max) {
+        cfg.buckets[THROTTLE_OPS_TOTAL].max = iops_max;
+    }
+    if (has_iops_rd_max) {
+        cfg.buckets[THROTTLE_OPS_READ].max = iops_rd_max;
+    }
+    if (has_iops_wr_max) {
+        cfg.buckets[THROTTLE_OPS_WRITE].max = iops_wr_max;
     }
 
-    bs->io_limits = io_limits;
-    bs->slice_time = BLOCK_IO_SLICE_TIME;
+    if (has_bps_max_length) {
+        cfg.buckets[THROTTLE_BPS_TOTAL].burst_length = bps_max_length;
+    }
+    if (has_bps_rd_max_length) {
+        cfg.buckets[THROTTLE_BPS_READ].burst_length = bps_rd_max_length;
+    }
+    if (has_bps_wr_max_length) {
+        cfg.buckets[THROTTLE_BPS_WRITE].burst_length = bps_wr_max_length;
+    }
+    if (has_iops_max_length) {
+        cfg.buckets[THROTTLE_OPS_TOTAL].burst_length = iops_max_length;
+    }
+    if (has_iops_rd_max_length) {
+        cfg.buckets[THROTTLE_OPS_READ].burst_length = iops_rd_max_length;
+    }
+    if (has_iops_wr_max_length) {
+        cfg.buckets[THROTTLE_OPS_WRITE].burst_length = iops_wr_max_length;
+    }
 
-    if (!bs->io_limits_enabled && bdrv_io_limits_enabled(bs)) {
-        bdrv_io_limits_enable(bs);
-    } else if (bs->io_limits_enabled && !bdrv_io_limits_enabled(bs)) {
-        bdrv_io_limits_disable(bs);
-    } else {
-        if (bs->block_timer) {
-            qemu_mod_timer(bs->block_timer, qemu_get_clock_ns(vm_clock));
+    if (!throttle_is_valid(&cfg, errp)) {
+        return;
+    }
+
+    if (throttle_enabled(&cfg)) {
+        /* Enable I/O limits if they're not enabled yet, otherwise
+         * change the throttle group if a new one was given */
+        if (!bs->io_limits_enabled) {
+            bdrv_io_limits_enable(bs, has_group ? group : device);
+        } else if (has_group) {
+            bdrv_io_limits_update_group(bs, group);
         }
+        /* Set the new throttling configuration */
+        bdrv_set_io_limits(bs, &cfg);
+    } else if (bs->io_limits_enabled) {
+        /* If all throttling settings are set to 0, disable I/O limits */
+        bdrv_io_limits_disable(bs);
     }
 }
 
@@ -1273,6 +1354,143 @@ void qmp_block_commit(const char *device,
     drive_get_ref(drive_get_by_blockdev(bs));
 }
 
+void qmp_drive_backup(const char *device, const char *target,
+                      bool has_format, const char *format,
+                      enum MirrorSyncMode sync,
+                      bool has_mode, enum NewImageMode mode,
+                      bool has_speed, int64_t speed,
+                      bool has_bitmap, const char *bitmap,
+                      bool has_on_source_error, BlockdevOnError on_source_error,
+                      bool has_on_target_error, BlockdevOnError on_target_error,
+                      Error **errp)
+{
+    BlockDriverState *bs;
+    BlockDriverState *target_bs;
+    BlockDriverState *source = NULL;
+    BdrvDirtyBitmap *sync_bitmap = NULL;
+    BlockDriver *drv = NULL;
+    Error *local_err = NULL;
+    int flags;
+    int64_t size;
+    int ret;
+
+    if (!has_speed) {
+        speed = 0;
+    }
+    if (!has_on_source_error) {
+        on_source_error = BLOCKDEV_ON_ERROR_REPORT;
+    }
+    if (!has_on_target_error) {
+        on_target_error = BLOCKDEV_ON_ERROR_REPORT;
+    }
+    if (!has_mode) {
+        mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
+    }
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return;
+    }
+
+    if (sync == MIRROR_SYNC_MODE_INCREMENTAL) {
+        if (!has_bitmap) {
+            error_set(errp, QERR_MISSING_PARAMETER, "bitmap");
+            return;
+        }
+        sync_bitmap = bdrv_find_dirty_bitmap(bs, bitmap);
+        if (!sync_bitmap) {
+            error_setg(errp, "Dirty bitmap '%s' not found", bitmap);
+            return;
+        }
+    } else if (has_bitmap) {
+        error_set(errp, QERR_INVALID_PARAMETER, "bitmap");
+        return;
+    }
+
+    if (!has_format) {
+        format = mode == NEW_IMAGE_MODE_EXISTING ? NULL : bs->drv->format_name;
+    }
+    if (format) {
+        drv = bdrv_find_format(format);
+        if (!drv) {
+            error_set(errp, QERR_INVALID_BLOCK_FORMAT, format);
+            return;
+        }
+    }
+
+    if (bdrv_in_use(bs)) {
+        error_set(errp, QERR_DEVICE_IN_USE, device);
+        return;
+    }
+
+    flags = bs->open_flags | BDRV_O_RDWR;
+
+    /* See if we have a backing HD we can use to create our new image
+     * on top of.  With sync=none the target is an overlay of the device
+     * itself, and only receives the data that the guest overwrites.
+     */
+    if (sync == MIRROR_SYNC_MODE_TOP) {
+        source = bs->backing_hd;
+        if (!source) {
+            sync = MIRROR_SYNC_MODE_FULL;
+        }
+    }
+    if (sync == MIRROR_SYNC_MODE_NONE) {
+        source = bs;
+    }
+
+    size = bdrv_getlength(bs);
+    if (size < 0) {
+        error_setg_errno(errp, -size, "bdrv_getlength failed");
+        return;
+    }
+
+    if (mode != NEW_IMAGE_MODE_EXISTING) {
+        assert(format && drv);
+        if (source) {
+            bdrv_img_create(target, format, source->filename,
+                            source->drv->format_name, NULL,
+                            size, flags, &local_err, false);
+        } else {
+            bdrv_img_create(target, format, NULL, NULL, NULL,
+                            size, flags, &local_err, false);
+        }
+    }
+
+    if (error_is_set(&local_err)) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    target_bs = bdrv_new("");
+    ret = bdrv_open(target_bs, target, NULL, flags, drv);
+    if (ret < 0) {
+        bdrv_delete(target_bs);
+        error_set(errp, QERR_OPEN_FILE_FAILED, target);
+        return;
+    }
+
+    backup_start(bs, target_bs, speed, sync, sync_bitmap,
+                 on_source_error, on_target_error,
+                 block_job_cb, bs, &local_err);
+    if (local_err != NULL) {
+        bdrv_delete(target_bs);
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    /* Grab a reference so hotplug does not delete the BlockDriverState from
+     * underneath us.
+     */
+    drive_get_ref(drive_get_by_blockdev(bs));
+}
+
 #define DEFAULT_MIRROR_BUF_SIZE   (10 << 20)
 
 void qmp_drive_mirror(const char *device, const char *target,
@@ -1284,6 +1502,7 @@ void qmp_drive_mirror(const char *device, const char *target,
                       bool has_buf_size, int64_t buf_size,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
+                      bool has_copy_mode, MirrorCopyMode copy_mode,
                       Error **errp)
 {
     BlockDriverState *bs;
@@ -1313,6 +1532,9 @@ void qmp_drive_mirror(const char *device, const char *target,
     if (!has_buf_size) {
         buf_size = DEFAULT_MIRROR_BUF_SIZE;
     }
+    if (!has_copy_mode) {
+        copy_mode = MIRROR_COPY_MODE_BACKGROUND;
+    }
 
     if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
         error_set(errp, QERR_INVALID_PARAMETER, device);
@@ -1322,6 +1544,10 @@ void qmp_drive_mirror(const char *device, const char *target,
         error_set(errp, QERR_INVALID_PARAMETER, device);
         return;
     }
+    if (sync == MIRROR_SYNC_MODE_INCREMENTAL) {
+        error_set(errp, QERR_INVALID_PARAMETER, "sync");
+        return;
+    }
 
     bs = bdrv_find(device);
     if (!bs) {
@@ -1404,7 +1630,7 @@ void qmp_drive_mirror(const char *device, const char *target,
     }
 
     mirror_start(bs, target_bs, speed, granularity, buf_size, sync,
-                 on_source_error, on_target_error,
+                 copy_mode, on_source_error, on_target_error,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
         bdrv_delete(target_bs);
@@ -1418,6 +1644,101 @@ void qmp_drive_mirror(const char *device, const char *target,
     drive_get_ref(drive_get_by_blockdev(bs));
 }
 
+void qmp_block_dirty_bitmap_add(const char *device, const char *name,
+                                bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
+                                Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return;
+    }
+
+    if (has_granularity) {
+        if (granularity < 512 || granularity > 1048576 * 64 ||
+            (granularity & (granularity - 1))) {
+            error_set(errp, QERR_INVALID_PARAMETER, "granularity");
+            return;
+        }
+    } else {
+        granularity = bdrv_get_default_bitmap_granularity(bs);
+    }
+
+    if (has_persistent && persistent) {
+        if (bdrv_is_read_only(bs) || !bs->drv->bdrv_can_store_dirty_bitmaps ||
+            !bs->drv->bdrv_can_store_dirty_bitmaps(bs)) {
+            error_setg(errp, "Device '%s' cannot store persistent bitmaps",
+                       device);
+            return;
+        }
+    } else {
+        persistent = false;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (bitmap) {
+        bitmap->persistent = persistent;
+    }
+}
+
+static BdrvDirtyBitmap *find_dirty_bitmap(const char *device,
+                                          const char *name,
+                                          BlockDriverState **pbs,
+                                          Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return NULL;
+    }
+
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (!bitmap) {
+        error_setg(errp, "Dirty bitmap '%s' not found on device '%s'",
+                   name, device);
+        return NULL;
+    }
+
+    *pbs = bs;
+    return bitmap;
+}
+
+void qmp_block_dirty_bitmap_remove(const char *device, const char *name,
+                                   Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = find_dirty_bitmap(device, name, &bs, errp);
+    if (bitmap) {
+        bdrv_release_dirty_bitmap(bs, bitmap);
+    }
+}
+
+void qmp_block_dirty_bitmap_clear(const char *device, const char *name,
+                                  Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = find_dirty_bitmap(device, name, &bs, errp);
+    if (bitmap) {
+        bdrv_clear_dirty_bitmap(bitmap);
+    }
+}
+
 static BlockJob *find_block_job(const char *device)
 {
     BlockDriverState *bs;
@@ -1524,6 +1845,106 @@ BlockJobInfoList *qmp_query_block_jobs(Error **errp)
     return dummy.next;
 }
 
+static void do_qmp_query_thread_pools_one(AioContext *ctx,
+                                          ThreadPoolStats *stats,
+                                          void *opaque)
+{
+    ThreadPoolInfoList **prev = opaque;
+    ThreadPoolInfoList *elem = g_new0(ThreadPoolInfoList, 1);
+    ThreadPoolInfo *info = g_new0(ThreadPoolInfo, 1);
+
+    info->main = ctx == qemu_get_aio_context();
+    info->min_threads = stats->min_threads;
+    info->max_threads = stats->max_threads;
+    info->threads = stats->threads;
+    info->idle_threads = stats->idle_threads;
+    info->queue_depth = stats->queue_depth;
+    info->max_queue_depth = stats->max_queue_depth;
+    info->completed = stats->completed;
+    info->wait_time_ns = stats->wait_ns;
+    info->max_wait_time_ns = stats->max_wait_ns;
+    info->service_time_ns = stats->service_ns;
+    info->notifications = stats->notifications;
+
+    elem->value = info;
+    (*prev)->next = elem;
+    *prev = elem;
+}
+
+ThreadPoolInfoList *qmp_query_thread_pools(Error **errp)
+{
+    ThreadPoolInfoList dummy = {};
+    ThreadPoolInfoList *prev = &dummy;
+    thread_pool_foreach(do_qmp_query_thread_pools_one, &prev);
+    return dummy.next;
+}
+
+/* Parses a CPU list such as "0-3,6" into params->cpus */
+static bool parse_thread_pool_cpus(ThreadPoolParams *params,
+                                   const char *str, Error **errp)
+{
+    char **ranges = g_strsplit(str, ",", 0);
+    unsigned long long value, endvalue;
+    char *endptr;
+    int i;
+
+    g_free(params->cpus);
+    params->cpus = NULL;
+    params->nb_cpus = 0;
+
+    for (i = 0; *str && ranges[i]; i++) {
+        if (parse_uint(ranges[i], &value, &endptr, 10) < 0) {
+            goto error;
+        }
+        if (*endptr == '-') {
+            if (parse_uint_full(endptr + 1, &endvalue, 10) < 0) {
+                goto error;
+            }
+        } else if (*endptr == '\0') {
+            endvalue = value;
+        } else {
+            goto error;
+        }
+        if (endvalue < value || endvalue >= 65536) {
+            goto error;
+        }
+
+        params->cpus = g_renew(int, params->cpus,
+                               params->nb_cpus + endvalue - value + 1);
+        while (value <= endvalue) {
+            params->cpus[params->nb_cpus++] = value++;
+        }
+    }
+
+    g_strfreev(ranges);
+    return true;
+
+error:
+    error_setg(errp, "invalid CPU range '%s'", ranges[i]);
+    g_strfreev(ranges);
+    return false;
+}
+
+void qmp_thread_pool_set_params(bool has_min_threads, int64_t min_threads,
+                                bool has_max_threads, int64_t max_threads,
+                                bool has_cpus, const char *cpus,
+                                Error **errp)
+{
+    ThreadPoolParams params;
+
+    thread_pool_get_params(&params);
+    if (has_min_threads) {
+        params.min_threads = MIN(MAX(min_threads, -1), INT_MAX);
+    }
+    if (has_max_threads) {
+        params.max_threads = MIN(MAX(max_threads, 0), INT_MAX);
+    }
+    if (!has_cpus || parse_thread_pool_cpus(&params, cpus, errp)) {
+        thread_pool_set_params(&params, errp);
+    }
+    g_free(params.cpus);
+}
+
 QemuOptsList qemu_common_drive_opts = {
     .name = "drive",
     .head = QTAILQ_HEAD_INITIALIZER(qemu_common_drive_opts.head),
@@ -1633,6 +2054,58 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "bps_wr",
             .type = QEMU_OPT_NUMBER,
             .help = "limit write bytes per second",
+        },{
+            .name = "iops_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "I/O operations burst rate",
+        },{
+            .name = "iops_rd_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "I/O operations read burst rate",
+        },{
+            .name = "iops_wr_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "I/O operations write burst rate",
+        },{
+            .name = "bps_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total bytes burst rate",
+        },{
+            .name = "bps_rd_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total bytes read burst rate",
+        },{
+            .name = "bps_wr_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total bytes write burst rate",
+        },{
+            .name = "iops_max_length",
+            .type = QEMU_OPT_NUMBER,
+            .help = "length of the iops burst period, in seconds",
+        },{
+            .name = "iops_rd_max_length",
+            .type = QEMU_OPT_NUMBER,
+            .help = "length of the iops_rd burst period, in seconds",
+        },{
+            .name = "iops_wr_max_length",
+            .type = QEMU_OPT_NUMBER,
+            .help = "length of the iops_wr burst period, in seconds",
+        },{
+            .name = "bps_max_length",
+            .type = QEMU_OPT_NUMBER,
+            .help = "length of the bps burst period, in seconds",
+        },{
+            .name = "bps_rd_max_length",
+            .type = QEMU_OPT_NUMBER,
+            .help = "length of the bps_rd burst period, in seconds",
+        },{
+            .name = "bps_wr_max_length",
+            .type = QEMU_OPT_NUMBER,
+            .help = "length of the bps_wr burst period, in seconds",
+        },{
+            .name = "group",
+            .type = QEMU_OPT_STRING,
+            .help = "name of the throttle group to share the limits with",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
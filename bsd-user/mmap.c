@@ -48,6 +48,15 @@ void mmap_unlock(void)
     }
 }
 
+/* Drop the lock if an exception longjmp'ed out of a region that held it.  */
+void mmap_lock_reset(void)
+{
+    if (mmap_lock_count) {
+        mmap_lock_count = 1;
+        mmap_unlock();
+    }
+}
+
 /* Grab lock to make sure things are in a consistent state after fork().  */
 void mmap_fork_start(void)
 {
@@ -72,6 +81,10 @@ void mmap_lock(void)
 void mmap_unlock(void)
 {
 }
+
+void mmap_lock_reset(void)
+{
+}
 #endif
 
 static void *bsd_vmalloc(size_t size)
@@ -22,6 +22,7 @@
 #include "tcg.h"
 #include "qemu/atomic.h"
 #include "sysemu/qtest.h"
+#include "qemu/main-loop.h"
 
 //#define CONFIG_DEBUG_EXEC
 
@@ -96,62 +97,93 @@ static void cpu_exec_nocache(CPUArchState *env, int max_cycles,
     tb_free(tb);
 }
 
+struct tb_desc {
+    target_ulong pc;
+    target_ulong cs_base;
+    CPUArchState *env;
+    tb_page_addr_t phys_page1;
+    uint64_t flags;
+};
+
+static bool tb_cmp(const void *p, const void *d)
+{
+    const TranslationBlock *tb = p;
+    const struct tb_desc *desc = d;
+
+    if (tb->pc == desc->pc &&
+        tb->page_addr[0] == desc->phys_page1 &&
+        tb->cs_base == desc->cs_base &&
+        tb->flags == desc->flags) {
+        /* check next page if needed */
+        if (tb->page_addr[1] == -1) {
+            return true;
+        } else {
+            tb_page_addr_t phys_page2;
+            target_ulong virt_page2;
+
+            virt_page2 = (desc->pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+            phys_page2 = get_page_addr_code(desc->env, virt_page2);
+            if (tb->page_addr[1] == phys_page2) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
 static TranslationBlock *tb_find_slow(CPUArchState *env,
                                       target_ulong pc,
                                       target_ulong cs_base,
                                       uint64_t flags)
 {
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
-    target_ulong virt_page2;
-
-    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+    TranslationBlock *tb;
+    struct tb_desc desc;
+    tb_page_addr_t phys_pc;
+    uint32_t h;
+    bool locked;
+
+    /* Looking up the physical address and translating may have to fill
+       the TLB, which needs the iothread lock; it nests outside tb_lock.
+       In user mode, translating protects the guest pages that hold code,
+       which needs mmap_lock.  */
+    locked = qemu_tcg_lock_iothread();
+    mmap_lock();
+    tb_lock();
 
     /* find translated block using physical mappings */
     phys_pc = get_page_addr_code(env, pc);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb)
-            goto not_found;
-        if (tb->pc == pc &&
-            tb->page_addr[0] == phys_page1 &&
-            tb->cs_base == cs_base &&
-            tb->flags == flags) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                tb_page_addr_t phys_page2;
-
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2)
-                    goto found;
-            } else {
-                goto found;
-            }
-        }
-        ptb1 = &tb->phys_hash_next;
-    }
- not_found:
-   /* if no translated code available, then translate it now */
-    tb = tb_gen_code(env, pc, cs_base, flags, 0);
-
- found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tcg_ctx.tb_ctx.tb_phys_hash[h];
-        tcg_ctx.tb_ctx.tb_phys_hash[h] = tb;
+    desc.env = env;
+    desc.pc = pc;
+    desc.cs_base = cs_base;
+    desc.flags = flags;
+    desc.phys_page1 = phys_pc & TARGET_PAGE_MASK;
+    h = tb_hash_func(phys_pc, pc, flags);
+    tb = qht_lookup(&tcg_ctx.tb_ctx.htable, tb_cmp, &desc, h);
+    if (!tb) {
+        /* if no translated code available, then translate it now */
+        tb = tb_gen_code(env, pc, cs_base, flags, 0);
     }
+
     /* we add the TB in the virtual pc hash table */
     env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    tb_unlock();
+    mmap_unlock();
+    qemu_tcg_unlock_iothread(locked);
     return tb;
 }
 
+/* Record that the region of the translation buffer which contains tb is
+   in use, so that it is not the next one to be evicted.  TBs reached by
+   chaining are not accounted, so this is only an approximation of LRU.  */
+static inline void tb_region_touch(TranslationBlock *tb)
+{
+    TBRegion *r = &tcg_ctx.tb_ctx.regions[tb->region];
+
+    if (r->last_use != tcg_ctx.tb_ctx.clock) {
+        r->last_use = tcg_ctx.tb_ctx.clock;
+    }
+}
+
 static inline TranslationBlock *tb_find_fast(CPUArchState *env)
 {
     TranslationBlock *tb;
@@ -167,9 +199,30 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env)
                  tb->flags != flags)) {
         tb = tb_find_slow(env, pc, cs_base, flags);
     }
+    tb_region_touch(tb);
     return tb;
 }
 
+/* Called from generated code by tcg_gen_lookup_and_goto_ptr.  Only the
+   jump cache is looked at, so that translated code never takes tb_lock;
+   on a miss, return to cpu_exec which does the full lookup.  */
+void *tcg_helper_lookup_tb_ptr(void *opaque)
+{
+    CPUArchState *env = opaque;
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags || tb->invalid)) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+    tb_region_touch(tb);
+    return tb->tc_ptr;
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 void cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -206,6 +259,7 @@ int cpu_exec(CPUArchState *env)
     TranslationBlock *tb;
     uint8_t *tc_ptr;
     tcg_target_ulong next_tb;
+    unsigned int tb_generation, last_tb_generation = 0;
 
     if (cpu->halted) {
         if (!cpu_has_work(cpu)) {
@@ -274,7 +328,10 @@ int cpu_exec(CPUArchState *env)
                     ret = env->exception_index;
                     break;
 #else
+                    bool locked = qemu_tcg_lock_iothread();
+
                     cc->do_interrupt(cpu);
+                    qemu_tcg_unlock_iothread(locked);
                     env->exception_index = -1;
 #endif
                 }
@@ -284,6 +341,12 @@ int cpu_exec(CPUArchState *env)
             for(;;) {
                 interrupt_request = cpu->interrupt_request;
                 if (unlikely(interrupt_request)) {
+                    /* Interrupt controllers are only accessed with the
+                       iothread lock held; if an interrupt is taken, the
+                       longjmp below drops it.  */
+                    bool locked = qemu_tcg_lock_iothread();
+
+                    interrupt_request = cpu->interrupt_request;
                     if (unlikely(env->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -560,6 +623,7 @@ int cpu_exec(CPUArchState *env)
                            the program flow was changed */
                         next_tb = 0;
                     }
+                    qemu_tcg_unlock_iothread(locked);
                 }
                 if (unlikely(cpu->exit_request)) {
                     cpu->exit_request = 0;
@@ -585,17 +649,8 @@ int cpu_exec(CPUArchState *env)
 #endif
                 }
 #endif /* DEBUG_DISAS || CONFIG_DEBUG_EXEC */
-                spin_lock(&tcg_ctx.tb_ctx.tb_lock);
+                tb_generation = atomic_read(&tcg_ctx.tb_ctx.tb_generation);
                 tb = tb_find_fast(env);
-                /* Note: we do it here to avoid a gcc bug on Mac OS X when
-                   doing it in tb_find_slow */
-                if (tcg_ctx.tb_ctx.tb_invalidated_flag) {
-                    /* as some TB could have been invalidated because
-                       of memory exceptions while generating the code, we
-                       must recompute the hash index here */
-                    next_tb = 0;
-                    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
-                }
 #ifdef CONFIG_DEBUG_EXEC
                 qemu_log_mask(CPU_LOG_EXEC, "Trace %p [" TARGET_FMT_lx "] %s\n",
                              tb->tc_ptr, tb->pc,
@@ -603,12 +658,25 @@ int cpu_exec(CPUArchState *env)
 #endif
                 /* see if we can patch the calling TB. When the TB
                    spans two pages, we cannot safely do a direct
-                   jump. */
+                   jump.  tb_lock is only taken here, so that threads
+                   which find their TBs in the jump cache do not
+                   serialize on it.  If TBs were freed since the calling
+                   TB was looked up, for example because translating
+                   this one flushed the buffer, the calling TB may be
+                   gone; another vCPU may also have invalidated either
+                   of them.  */
                 if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
-                                next_tb & TB_EXIT_MASK, tb);
+                    TranslationBlock *last_tb = (TranslationBlock *)
+                        (next_tb & ~TB_EXIT_MASK);
+
+                    tb_lock();
+                    if (tcg_ctx.tb_ctx.tb_generation == last_tb_generation &&
+                        !last_tb->invalid && !tb->invalid) {
+                        tb_add_jump(last_tb, next_tb & TB_EXIT_MASK, tb);
+                    }
+                    tb_unlock();
                 }
-                spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
+                last_tb_generation = tb_generation;
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -671,6 +739,14 @@ int cpu_exec(CPUArchState *env)
             /* Reload env after longjmp - the compiler may have smashed all
              * local variables as longjmp is marked 'noreturn'. */
             env = cpu_single_env;
+            /* Drop the locks that the longjmp skipped past.  */
+            tb_lock_reset();
+            mmap_lock_reset();
+#if !defined(CONFIG_USER_ONLY)
+            if (parallel_cpus && qemu_mutex_iothread_locked()) {
+                qemu_mutex_unlock_iothread();
+            }
+#endif
         }
     } /* for(;;) */
 
@@ -33,10 +33,13 @@
 #include "qmp-commands.h"
 
 #include "qemu/thread.h"
+#include "qemu/tls.h"
 #include "sysemu/cpus.h"
 #include "sysemu/qtest.h"
 #include "qemu/main-loop.h"
 #include "qemu/bitmap.h"
+#include "tcg.h"
+#include "exec/tb-cache.h"
 
 #ifndef _WIN32
 #include "qemu/compatfd.h"
@@ -358,6 +361,10 @@ void configure_icount(const char *option)
     if (!option) {
         return;
     }
+    if (parallel_cpus) {
+        fprintf(stderr, "-icount is not supported with tcg-thread=multi\n");
+        exit(1);
+    }
 
     icount_warp_timer = qemu_new_timer_ns(rt_clock, icount_warp_rt, NULL);
     if (strcmp(option, "auto") != 0) {
@@ -618,6 +625,10 @@ static void qemu_tcg_init_cpu_signals(void)
 static QemuMutex qemu_global_mutex;
 static QemuCond qemu_io_proceeded_cond;
 static bool iothread_requesting_mutex;
+/* Only per-thread on Linux, see qemu/tls.h; elsewhere qemu_tcg_lock_iothread
+ * and cpu_exec only look at it with parallel_cpus, which needs Linux.
+ */
+static DEFINE_TLS(bool, iothread_locked);
 
 static QemuThread io_thread;
 
@@ -630,6 +641,11 @@ static QemuCond qemu_cpu_cond;
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
 
+/* exclusive sections, with -machine tcg-thread=multi */
+static QemuCond qemu_exclusive_cond;
+static QemuCond qemu_exclusive_resume;
+static int pending_cpus;
+
 void qemu_init_cpu_loop(void)
 {
     qemu_init_sigbus();
@@ -637,11 +653,114 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_pause_cond);
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
+    qemu_cond_init(&qemu_exclusive_cond);
+    qemu_cond_init(&qemu_exclusive_resume);
     qemu_mutex_init(&qemu_global_mutex);
 
     qemu_thread_get_self(&io_thread);
 }
 
+void qemu_tcg_configure(QemuOpts *opts, Error **errp)
+{
+    const char *t = opts ? qemu_opt_get(opts, "tcg-thread") : NULL;
+    const char *cache = opts ? qemu_opt_get(opts, "tb-cache") : NULL;
+
+    if (cache) {
+        tb_cache_init(cache, errp);
+        if (error_is_set(errp)) {
+            return;
+        }
+    }
+    if (!t || !strcmp(t, "single")) {
+        return;
+    }
+    if (strcmp(t, "multi")) {
+        error_setg(errp, "Invalid 'tcg-thread' setting %s", t);
+        return;
+    }
+    /* Generated code for the guest must not rely on a single vCPU running
+       at a time, the host must not reorder the guest's memory accesses,
+       and cpu_single_env must really be per-thread.  */
+#if defined(TARGET_SUPPORTS_MTTCG) && defined(TCG_TARGET_SUPPORTS_MTTCG) && \
+    defined(__linux__)
+    parallel_cpus = true;
+#else
+    error_setg(errp, "tcg-thread=multi is not supported for this "
+               "guest on this host");
+#endif
+}
+
+/* The exclusive sections below mirror the ones of linux-user/main.c.
+   They are protected by the iothread lock, which must be held.  */
+static void exclusive_idle(void)
+{
+    while (pending_cpus) {
+        qemu_cond_wait(&qemu_exclusive_resume, &qemu_global_mutex);
+    }
+}
+
+/* Start an exclusive operation.  Must be called from outside cpu_exec.  */
+static void start_exclusive(void)
+{
+    CPUArchState *other;
+    CPUState *other_cpu;
+
+    exclusive_idle();
+
+    pending_cpus = 1;
+    /* Make all other cpus stop executing.  */
+    for (other = first_cpu; other; other = other->next_cpu) {
+        other_cpu = ENV_GET_CPU(other);
+        if (other_cpu->running) {
+            pending_cpus++;
+            cpu_exit(other);
+        }
+    }
+    while (pending_cpus > 1) {
+        qemu_cond_wait(&qemu_exclusive_cond, &qemu_global_mutex);
+    }
+}
+
+/* Finish an exclusive operation.  */
+static void end_exclusive(void)
+{
+    pending_cpus = 0;
+    qemu_cond_broadcast(&qemu_exclusive_resume);
+}
+
+/* Wait for exclusive ops to finish, and begin cpu execution.  */
+static void cpu_exec_start(CPUState *cpu)
+{
+    exclusive_idle();
+    cpu->running = true;
+}
+
+/* Mark cpu as not executing, and release pending exclusive ops.  */
+static void cpu_exec_end(CPUState *cpu)
+{
+    cpu->running = false;
+    if (pending_cpus > 1) {
+        pending_cpus--;
+        if (pending_cpus == 1) {
+            qemu_cond_signal(&qemu_exclusive_cond);
+        }
+    }
+}
+
+static void queue_work_on_cpu(CPUState *cpu, struct qemu_work_item *wi)
+{
+    if (cpu->queued_work_first == NULL) {
+        cpu->queued_work_first = wi;
+    } else {
+        cpu->queued_work_last->next = wi;
+    }
+    cpu->queued_work_last = wi;
+    wi->next = NULL;
+    wi->done = false;
+
+    qemu_cpu_kick(cpu);
+}
+
 void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
 {
     struct qemu_work_item wi;
@@ -653,16 +772,9 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
 
     wi.func = func;
     wi.data = data;
-    if (cpu->queued_work_first == NULL) {
-        cpu->queued_work_first = &wi;
-    } else {
-        cpu->queued_work_last->next = &wi;
-    }
-    cpu->queued_work_last = &wi;
-    wi.next = NULL;
-    wi.done = false;
-
-    qemu_cpu_kick(cpu);
+    wi.free = false;
+    wi.exclusive = false;
+    queue_work_on_cpu(cpu, &wi);
     while (!wi.done) {
         CPUArchState *self_env = cpu_single_env;
 
@@ -671,6 +783,39 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     }
 }
 
+void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
+{
+    struct qemu_work_item *wi;
+
+    if (qemu_cpu_is_self(cpu)) {
+        func(data);
+        return;
+    }
+
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    queue_work_on_cpu(cpu, wi);
+}
+
+void async_safe_run_on_cpu(CPUState *cpu, void (*func)(void *data),
+                           void *data)
+{
+    struct qemu_work_item *wi;
+
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    wi->exclusive = true;
+    queue_work_on_cpu(cpu, wi);
+    if (qemu_cpu_is_self(cpu)) {
+        /* leave cpu_exec so that the work is picked up */
+        cpu_exit(cpu->env_ptr);
+    }
+}
+
 static void flush_queued_work(CPUState *cpu)
 {
     struct qemu_work_item *wi;
@@ -681,8 +826,18 @@ static void flush_queued_work(CPUState *cpu)
 
     while ((wi = cpu->queued_work_first)) {
         cpu->queued_work_first = wi->next;
-        wi->func(wi->data);
-        wi->done = true;
+        if (wi->exclusive && parallel_cpus) {
+            start_exclusive();
+            wi->func(wi->data);
+            end_exclusive();
+        } else {
+            wi->func(wi->data);
+        }
+        if (wi->free) {
+            g_free(wi);
+        } else {
+            wi->done = true;
+        }
     }
     cpu->queued_work_last = NULL;
     qemu_cond_broadcast(&qemu_work_cond);
@@ -719,6 +874,17 @@ static void qemu_tcg_wait_io_event(void)
     }
 }
 
+static void qemu_mttcg_wait_io_event(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+
+    while (cpu_thread_is_idle(env)) {
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    }
+
+    qemu_wait_io_event_common(cpu);
+}
+
 static void qemu_kvm_wait_io_event(CPUArchState *env)
 {
     CPUState *cpu = ENV_GET_CPU(env);
@@ -738,6 +904,7 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
     int r;
 
     qemu_mutex_lock(&qemu_global_mutex);
+    tls_var(iothread_locked) = true;
     qemu_thread_get_self(cpu->thread);
     cpu->thread_id = qemu_get_thread_id();
     cpu_single_env = env;
@@ -810,6 +977,7 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
 #endif
 }
 
+static int tcg_cpu_exec(CPUArchState *env);
 static void tcg_exec_all(void);
 
 static void *qemu_tcg_cpu_thread_fn(void *arg)
@@ -822,6 +990,7 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
 
     /* signal CPU creation */
     qemu_mutex_lock(&qemu_global_mutex);
+    tls_var(iothread_locked) = true;
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         cpu = ENV_GET_CPU(env);
         cpu->thread_id = qemu_get_thread_id();
@@ -850,6 +1019,39 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+/* With -machine tcg-thread=multi each vCPU has its own thread, and runs
+   guest code without holding the iothread lock.  */
+static void *qemu_mttcg_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+    CPUArchState *env = cpu->env_ptr;
+    int r;
+
+    qemu_mutex_lock_iothread();
+    qemu_thread_get_self(cpu->thread);
+    cpu->thread_id = qemu_get_thread_id();
+
+    /* signal CPU creation */
+    cpu->created = true;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(cpu)) {
+            cpu_exec_start(cpu);
+            qemu_mutex_unlock_iothread();
+            r = tcg_cpu_exec(env);
+            qemu_mutex_lock_iothread();
+            cpu_exec_end(cpu);
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(env);
+            }
+        }
+        qemu_mttcg_wait_io_event(env);
+    }
+
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -872,7 +1074,9 @@ static void qemu_cpu_kick_thread(CPUState *cpu)
 void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
-    if (!tcg_enabled() && !cpu->thread_kicked) {
+    if (parallel_cpus) {
+        cpu_exit(cpu->env_ptr);
+    } else if (!tcg_enabled() && !cpu->thread_kicked) {
         qemu_cpu_kick_thread(cpu);
         cpu->thread_kicked = true;
     }
@@ -905,7 +1109,7 @@ static bool qemu_in_vcpu_thread(void)
 
 void qemu_mutex_lock_iothread(void)
 {
-    if (!tcg_enabled()) {
+    if (!tcg_enabled() || parallel_cpus) {
         qemu_mutex_lock(&qemu_global_mutex);
     } else {
         iothread_requesting_mutex = true;
@@ -916,13 +1120,39 @@ void qemu_mutex_lock_iothread(void)
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    tls_var(iothread_locked) = true;
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    tls_var(iothread_locked) = false;
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
+bool qemu_mutex_iothread_locked(void)
+{
+    return tls_var(iothread_locked);
+}
+
+/* Take the iothread lock around accesses to devices from generated code
+   or from helpers.  Returns true if the caller has to release it with
+   qemu_tcg_unlock_iothread; with a single TCG thread it is always held.  */
+bool qemu_tcg_lock_iothread(void)
+{
+    if (!parallel_cpus || tls_var(iothread_locked)) {
+        return false;
+    }
+    qemu_mutex_lock_iothread();
+    return true;
+}
+
+void qemu_tcg_unlock_iothread(bool locked)
+{
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 static int all_vcpus_paused(void)
 {
     CPUArchState *penv = first_cpu;
@@ -952,7 +1182,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !parallel_cpus) {
             while (penv) {
                 CPUState *pcpu = ENV_GET_CPU(penv);
                 pcpu->stop = 0;
@@ -989,6 +1219,18 @@ void resume_all_vcpus(void)
 
 static void qemu_tcg_init_vcpu(CPUState *cpu)
 {
+    if (parallel_cpus) {
+        cpu->thread = g_malloc0(sizeof(QemuThread));
+        cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(cpu->halt_cond);
+        qemu_thread_create(cpu->thread, qemu_mttcg_cpu_thread_fn, cpu,
+                           QEMU_THREAD_JOINABLE);
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+        return;
+    }
+
     /* share a single thread for all cpus with TCG */
     if (!tcg_cpu_thread) {
         cpu->thread = g_malloc0(sizeof(QemuThread));
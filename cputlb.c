@@ -26,12 +26,30 @@
 #include "exec/cputlb.h"
 
 #include "exec/memory-internal.h"
+#include "qemu/atomic.h"
 
 //#define DEBUG_TLB
 //#define DEBUG_TLB_CHECK
 
 /* statistics */
 int tlb_flush_count;
+int tlb_refill_count;
+int tlb_victim_hit_count;
+
+/* The TLB of a vCPU is only filled and flushed by its own thread, but other
+   threads mark its entries as not dirty when they reset the dirty flags of
+   a RAM range.  tlb_lock serializes the two, so that a TLB_NOTDIRTY flag is
+   not lost when an entry is copied around.  The fast path only reads the
+   entries, and does not need the lock.  */
+static inline void tlb_lock(CPUArchState *env)
+{
+    qemu_mutex_lock(&ENV_GET_CPU(env)->tlb_lock);
+}
+
+static inline void tlb_unlock(CPUArchState *env)
+{
+    qemu_mutex_unlock(&ENV_GET_CPU(env)->tlb_lock);
+}
 
 static const CPUTLBEntry s_cputlb_empty_entry = {
     .addr_read  = -1,
@@ -64,6 +82,7 @@ void tlb_flush(CPUArchState *env, int flush_global)
        links while we are modifying them */
     cpu->current_tb = NULL;
 
+    tlb_lock(env);
     for (i = 0; i < CPU_TLB_SIZE; i++) {
         int mmu_idx;
 
@@ -71,6 +90,14 @@ void tlb_flush(CPUArchState *env, int flush_global)
             env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
         }
     }
+    for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        int mmu_idx;
+
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+        }
+    }
+    tlb_unlock(env);
 
     memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
 
@@ -91,6 +118,16 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
     }
 }
 
+static inline void tlb_flush_vtlb_page(CPUArchState *env, int mmu_idx,
+                                       target_ulong addr)
+{
+    int k;
+
+    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+    }
+}
+
 void tlb_flush_page(CPUArchState *env, target_ulong addr)
 {
     CPUState *cpu = ENV_GET_CPU(env);
@@ -116,13 +153,82 @@ void tlb_flush_page(CPUArchState *env, target_ulong addr)
 
     addr &= TARGET_PAGE_MASK;
     i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    tlb_lock(env);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        tlb_flush_vtlb_page(env, mmu_idx, addr);
     }
+    tlb_unlock(env);
 
     tb_flush_jmp_cache(env, addr);
 }
 
+/* With tcg-thread=multi, the TLB of a vCPU can only be modified by its own
+   thread; other vCPUs are asked to flush it before they run any more code.  */
+static bool tlb_flush_is_async(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+
+    return parallel_cpus && cpu->created && !qemu_cpu_is_self(cpu);
+}
+
+static void tlb_flush_global_work(void *data)
+{
+    tlb_flush(data, 1);
+}
+
+static void tlb_flush_local_work(void *data)
+{
+    tlb_flush(data, 0);
+}
+
+/* flush the TLB of all the vCPUs */
+void tlb_flush_all(int flush_global)
+{
+    CPUArchState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (tlb_flush_is_async(env)) {
+            async_run_on_cpu(ENV_GET_CPU(env),
+                             flush_global ? tlb_flush_global_work
+                                          : tlb_flush_local_work, env);
+        } else {
+            tlb_flush(env, flush_global);
+        }
+    }
+}
+
+typedef struct TLBFlushPageData {
+    CPUArchState *env;
+    target_ulong addr;
+} TLBFlushPageData;
+
+static void tlb_flush_page_work(void *data)
+{
+    TLBFlushPageData *d = data;
+
+    tlb_flush_page(d->env, d->addr);
+    g_free(d);
+}
+
+/* flush the TLB entries for 'addr' of all the vCPUs */
+void tlb_flush_page_all(target_ulong addr)
+{
+    CPUArchState *env;
+    TLBFlushPageData *d;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (tlb_flush_is_async(env)) {
+            d = g_new(TLBFlushPageData, 1);
+            d->env = env;
+            d->addr = addr;
+            async_run_on_cpu(ENV_GET_CPU(env), tlb_flush_page_work, d);
+        } else {
+            tlb_flush_page(env, addr);
+        }
+    }
+}
+
 /* update the TLBs so that writes to code in the virtual page 'addr'
    can be detected */
 void tlb_protect_code(ram_addr_t ram_addr)
@@ -149,11 +255,13 @@ void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
                            uintptr_t length)
 {
     uintptr_t addr;
+    target_ulong addr_write = tlb_entry->addr_write;
 
     if (tlb_is_dirty_ram(tlb_entry)) {
-        addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
+        addr = (addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
-            tlb_entry->addr_write |= TLB_NOTDIRTY;
+            /* The owner of the entry may be running guest code.  */
+            atomic_set(&tlb_entry->addr_write, addr_write | TLB_NOTDIRTY);
         }
     }
 }
@@ -180,6 +288,7 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         int mmu_idx;
 
+        tlb_lock(env);
         for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
             unsigned int i;
 
@@ -187,7 +296,12 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
             }
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
         }
+        tlb_unlock(env);
     }
 }
 
@@ -207,9 +321,68 @@ void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
 
     vaddr &= TARGET_PAGE_MASK;
     i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    tlb_lock(env);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
     }
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
+        }
+    }
+    tlb_unlock(env);
+}
+
+static inline bool tlb_entry_is_empty(const CPUTLBEntry *te)
+{
+    return te->addr_read == -1 && te->addr_write == -1 &&
+           te->addr_code == -1;
+}
+
+static inline bool tlb_entry_is_page(const CPUTLBEntry *te, target_ulong page)
+{
+    target_ulong mask = TARGET_PAGE_MASK | TLB_INVALID_MASK;
+
+    return (te->addr_read & mask) == page || (te->addr_write & mask) == page ||
+           (te->addr_code & mask) == page;
+}
+
+/* Look for the page of 'addr' in the victim TLB.  On a hit, the entry is
+   swapped with the one at 'index' in the main TLB, and true is returned.
+   'elt_ofs' is the offset in CPUTLBEntry of the address to compare,
+   depending on the kind of access.  */
+bool tlb_victim_hit(CPUArchState *env, int mmu_idx, int index,
+                    size_t elt_ofs, target_ulong addr)
+{
+    target_ulong page = addr & TARGET_PAGE_MASK;
+    bool hit = false;
+    int vidx;
+
+    tlb_lock(env);
+    for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++) {
+        CPUTLBEntry *vte = &env->tlb_v_table[mmu_idx][vidx];
+        target_ulong cmp = *(target_ulong *)((uintptr_t)vte + elt_ofs);
+
+        if ((cmp & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) == page) {
+            CPUTLBEntry tmp_te, *te = &env->tlb_table[mmu_idx][index];
+            hwaddr tmp_io, *io = &env->iotlb[mmu_idx][index];
+
+            tmp_te = *te;
+            *te = *vte;
+            *vte = tmp_te;
+            tmp_io = *io;
+            *io = env->iotlb_v[mmu_idx][vidx];
+            env->iotlb_v[mmu_idx][vidx] = tmp_io;
+            tlb_victim_hit_count++;
+            hit = true;
+            break;
+        }
+    }
+    tlb_unlock(env);
+    return hit;
 }
 
 /* Our TLB does not support large pages, so remember the area covered by
@@ -280,8 +453,26 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                                             &address);
 
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
+
+    tlb_lock(env);
+
+    /* The page may have been evicted before; there must be only one
+       entry for it.  */
+    tlb_flush_vtlb_page(env, mmu_idx, vaddr & TARGET_PAGE_MASK);
+
+    /* Keep the entry that we are replacing in the victim TLB, unless it
+       is empty or maps the same page.  */
+    if (!tlb_entry_is_empty(te) &&
+        !tlb_entry_is_page(te, vaddr & TARGET_PAGE_MASK)) {
+        unsigned int vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    }
+    tlb_refill_count++;
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -310,6 +501,7 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
     } else {
         te->addr_write = -1;
     }
+    tlb_unlock(env);
 }
 
 /* NOTE: this function can trigger an exception */
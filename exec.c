@@ -288,6 +288,7 @@ void cpu_exec_init(CPUArchState *env)
     QTAILQ_INIT(&env->watchpoints);
 #ifndef CONFIG_USER_ONLY
     cpu->thread_id = qemu_get_thread_id();
+    qemu_mutex_init(&cpu->tlb_lock);
 #endif
     *penv = env;
 #if defined(CONFIG_USER_ONLY)
@@ -1434,7 +1435,9 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
     dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
     if (!(dirty_flags & CODE_DIRTY_FLAG)) {
 #if !defined(CONFIG_USER_ONLY)
+        tb_lock();
         tb_invalidate_phys_page_fast(ram_addr, size);
+        tb_unlock();
         dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
 #endif
     }
@@ -1488,13 +1491,16 @@ static void check_watchpoint(int offset, int len_mask, int flags)
             wp->flags |= BP_WATCHPOINT_HIT;
             if (!env->watchpoint_hit) {
                 env->watchpoint_hit = wp;
+                tb_lock();
                 tb_check_watchpoint(env);
                 if (wp->flags & BP_STOP_BEFORE_ACCESS) {
+                    tb_unlock();
                     env->exception_index = EXCP_DEBUG;
                     cpu_loop_exit(env);
                 } else {
                     cpu_get_tb_cpu_state(env, &pc, &cs_base, &cpu_flags);
                     tb_gen_code(env, pc, cs_base, cpu_flags, 1);
+                    tb_unlock();
                     cpu_resume_from_signal(env, NULL);
                 }
             }
@@ -1712,14 +1718,10 @@ static void core_begin(MemoryListener *listener)
 
 static void tcg_commit(MemoryListener *listener)
 {
-    CPUArchState *env;
-
     /* since each CPU stores ram addresses in its TLB cache, we must
        reset the modified entries */
     /* XXX: slow ! */
-    for(env = first_cpu; env != NULL; env = env->next_cpu) {
-        tlb_flush(env, 1);
-    }
+    tlb_flush_all(1);
 }
 
 static void core_log_global_start(MemoryListener *listener)
@@ -1867,12 +1869,13 @@ int cpu_memory_rw_debug(CPUArchState *env, target_ulong addr,
 
 #else
 
-static void invalidate_and_set_dirty(hwaddr addr,
-                                     hwaddr length)
+void invalidate_and_set_dirty(hwaddr addr, hwaddr length)
 {
     if (!cpu_physical_memory_is_dirty(addr)) {
         /* invalidate code */
+        tb_lock();
         tb_invalidate_phys_page_range(addr, addr + length, 0);
+        tb_unlock();
         /* set dirty bit */
         cpu_physical_memory_set_dirty_flags(addr, (0xff & ~CODE_DIRTY_FLAG));
     }
@@ -2387,7 +2390,9 @@ void stl_phys_notdirty(hwaddr addr, uint32_t val)
         if (unlikely(in_migration)) {
             if (!cpu_physical_memory_is_dirty(addr1)) {
                 /* invalidate code */
+                tb_lock();
                 tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
+                tb_unlock();
                 /* set dirty bit */
                 cpu_physical_memory_set_dirty_flags(
                     addr1, (0xff & ~CODE_DIRTY_FLAG));
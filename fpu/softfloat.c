@@ -40,6 +40,8 @@ these four paragraphs for those parts of this code that are retained.
  */
 #include "config.h"
 
+#include <float.h>
+#include <math.h>
 #include "fpu/softfloat.h"
 
 /*----------------------------------------------------------------------------
@@ -1858,6 +1860,247 @@ static float32 subFloat32Sigs( float32 a, float32 b, flag zSign STATUS_PARAM)
 
 }
 
+/*----------------------------------------------------------------------------
+| Fast paths using the host FPU.  When both inputs are zero or normal and the
+| rounding mode is nearest-even, the host computes the same result as the
+| code below, except when the result overflows or is tiny.  Everything else
+| (NaNs, infinities, denormals, overflow and underflow) is left to the soft
+| implementation, which knows about the target-specific NaN handling and
+| flushing to zero.
+|
+| The inexact flag is sticky, so most of the time it is already set and
+| need not be computed.  Otherwise it is derived from the exact error of the
+| operation: with Knuth's TwoSum for additions, and by redoing the operation
+| in double precision for single-precision multiplication, division and
+| square root.  Double-precision multiplication, division and square root
+| use the soft implementation until the flag is set.
+|
+| This requires the host to evaluate `float' and `double' expressions in
+| their own precision, which excludes the x87 FPU.
+*----------------------------------------------------------------------------*/
+
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define USE_HOST_FPU 1
+#else
+#define USE_HOST_FPU 0
+#endif
+
+typedef union {
+    float32 s;
+    float h;
+} float32_host;
+
+typedef union {
+    float64 s;
+    double h;
+} float64_host;
+
+INLINE flag float32_is_zero_or_normal(float32 a)
+{
+    int_fast16_t aExp = extractFloat32Exp(a);
+
+    return (aExp != 0 && aExp != 0xFF) || float32_is_zero(a);
+}
+
+INLINE flag float64_is_zero_or_normal(float64 a)
+{
+    int_fast16_t aExp = extractFloat64Exp(a);
+
+    return (aExp != 0 && aExp != 0x7FF) || float64_is_zero(a);
+}
+
+flag float_use_host_fpu = 1;
+
+INLINE flag host_fpu_usable(float_status *status)
+{
+    return USE_HOST_FPU && float_use_host_fpu &&
+           STATUS(float_rounding_mode) == float_round_nearest_even;
+}
+
+INLINE flag inexact_is_set(float_status *status)
+{
+    return (STATUS(float_exception_flags) & float_flag_inexact) != 0;
+}
+
+/* A result is left to the soft code if it is zero, tiny or infinite.  */
+INLINE flag float32_host_result_ok(float r)
+{
+    r = fabsf(r);
+    return r > FLT_MIN && r <= FLT_MAX;
+}
+
+INLINE flag float64_host_result_ok(double r)
+{
+    r = fabs(r);
+    return r > DBL_MIN && r <= DBL_MAX;
+}
+
+static flag float32_host_add(float32 a, float32 b, float32 *res STATUS_PARAM)
+{
+    float32_host ua, ub, ur;
+    float av, bv;
+
+    if (!host_fpu_usable(status) ||
+        !float32_is_zero_or_normal(a) || !float32_is_zero_or_normal(b)) {
+        return 0;
+    }
+    ua.s = a;
+    ub.s = b;
+    ur.h = ua.h + ub.h;
+    if (!float32_host_result_ok(ur.h)) {
+        return 0;
+    }
+    if (!inexact_is_set(status)) {
+        bv = ur.h - ua.h;
+        av = ur.h - bv;
+        if ((ua.h - av) + (ub.h - bv) != 0) {
+            float_raise(float_flag_inexact STATUS_VAR);
+        }
+    }
+    *res = ur.s;
+    return 1;
+}
+
+static flag float32_host_mul(float32 a, float32 b, float32 *res STATUS_PARAM)
+{
+    float32_host ua, ub, ur;
+    double prod;
+
+    if (!host_fpu_usable(status) ||
+        !float32_is_zero_or_normal(a) || !float32_is_zero_or_normal(b)) {
+        return 0;
+    }
+    ua.s = a;
+    ub.s = b;
+    /* The product of two floats is exact in double precision.  */
+    prod = (double)ua.h * ub.h;
+    ur.h = prod;
+    if (!float32_host_result_ok(ur.h)) {
+        return 0;
+    }
+    if (ur.h != prod) {
+        float_raise(float_flag_inexact STATUS_VAR);
+    }
+    *res = ur.s;
+    return 1;
+}
+
+static flag float32_host_div(float32 a, float32 b, float32 *res STATUS_PARAM)
+{
+    float32_host ua, ub, ur;
+
+    if (!host_fpu_usable(status) || float32_is_zero(b) ||
+        !float32_is_zero_or_normal(a) || !float32_is_zero_or_normal(b)) {
+        return 0;
+    }
+    ua.s = a;
+    ub.s = b;
+    ur.h = ua.h / ub.h;
+    if (!float32_host_result_ok(ur.h)) {
+        return 0;
+    }
+    if (!inexact_is_set(status) && (double)ur.h * ub.h != ua.h) {
+        float_raise(float_flag_inexact STATUS_VAR);
+    }
+    *res = ur.s;
+    return 1;
+}
+
+static flag float32_host_sqrt(float32 a, float32 *res STATUS_PARAM)
+{
+    float32_host ua, ur;
+
+    if (!host_fpu_usable(status) || extractFloat32Sign(a) ||
+        !float32_is_zero_or_normal(a) || float32_is_zero(a)) {
+        return 0;
+    }
+    ua.s = a;
+    ur.h = sqrtf(ua.h);
+    if (!inexact_is_set(status) && (double)ur.h * ur.h != ua.h) {
+        float_raise(float_flag_inexact STATUS_VAR);
+    }
+    *res = ur.s;
+    return 1;
+}
+
+static flag float64_host_add(float64 a, float64 b, float64 *res STATUS_PARAM)
+{
+    float64_host ua, ub, ur;
+    double av, bv;
+
+    if (!host_fpu_usable(status) ||
+        !float64_is_zero_or_normal(a) || !float64_is_zero_or_normal(b)) {
+        return 0;
+    }
+    ua.s = a;
+    ub.s = b;
+    ur.h = ua.h + ub.h;
+    if (!float64_host_result_ok(ur.h)) {
+        return 0;
+    }
+    if (!inexact_is_set(status)) {
+        bv = ur.h - ua.h;
+        av = ur.h - bv;
+        if ((ua.h - av) + (ub.h - bv) != 0) {
+            float_raise(float_flag_inexact STATUS_VAR);
+        }
+    }
+    *res = ur.s;
+    return 1;
+}
+
+static flag float64_host_mul(float64 a, float64 b, float64 *res STATUS_PARAM)
+{
+    float64_host ua, ub, ur;
+
+    if (!host_fpu_usable(status) || !inexact_is_set(status) ||
+        !float64_is_zero_or_normal(a) || !float64_is_zero_or_normal(b)) {
+        return 0;
+    }
+    ua.s = a;
+    ub.s = b;
+    ur.h = ua.h * ub.h;
+    if (!float64_host_result_ok(ur.h)) {
+        return 0;
+    }
+    *res = ur.s;
+    return 1;
+}
+
+static flag float64_host_div(float64 a, float64 b, float64 *res STATUS_PARAM)
+{
+    float64_host ua, ub, ur;
+
+    if (!host_fpu_usable(status) || !inexact_is_set(status) ||
+        float64_is_zero(b) ||
+        !float64_is_zero_or_normal(a) || !float64_is_zero_or_normal(b)) {
+        return 0;
+    }
+    ua.s = a;
+    ub.s = b;
+    ur.h = ua.h / ub.h;
+    if (!float64_host_result_ok(ur.h)) {
+        return 0;
+    }
+    *res = ur.s;
+    return 1;
+}
+
+static flag float64_host_sqrt(float64 a, float64 *res STATUS_PARAM)
+{
+    float64_host ua, ur;
+
+    if (!host_fpu_usable(status) || !inexact_is_set(status) ||
+        extractFloat64Sign(a) ||
+        !float64_is_zero_or_normal(a) || float64_is_zero(a)) {
+        return 0;
+    }
+    ua.s = a;
+    ur.h = sqrt(ua.h);
+    *res = ur.s;
+    return 1;
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of adding the single-precision floating-point values `a'
 | and `b'.  The operation is performed according to the IEC/IEEE Standard for
@@ -1867,6 +2110,11 @@ static float32 subFloat32Sigs( float32 a, float32 b, flag zSign STATUS_PARAM)
 float32 float32_add( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
+    float32 r;
+
+    if (float32_host_add(a, b, &r STATUS_VAR)) {
+        return r;
+    }
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1890,6 +2138,11 @@ float32 float32_add( float32 a, float32 b STATUS_PARAM )
 float32 float32_sub( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
+    float32 r;
+
+    if (float32_host_add(a, float32_chs(b), &r STATUS_VAR)) {
+        return r;
+    }
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1917,7 +2170,11 @@ float32 float32_mul( float32 a, float32 b STATUS_PARAM )
     uint32_t aSig, bSig;
     uint64_t zSig64;
     uint32_t zSig;
+    float32 r;
 
+    if (float32_host_mul(a, b, &r STATUS_VAR)) {
+        return r;
+    }
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1978,6 +2235,11 @@ float32 float32_div( float32 a, float32 b STATUS_PARAM )
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint32_t aSig, bSig, zSig;
+    float32 r;
+
+    if (float32_host_div(a, b, &r STATUS_VAR)) {
+        return r;
+    }
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -2351,6 +2613,11 @@ float32 float32_sqrt( float32 a STATUS_PARAM )
     int_fast16_t aExp, zExp;
     uint32_t aSig, zSig;
     uint64_t rem, term;
+    float32 r;
+
+    if (float32_host_sqrt(a, &r STATUS_VAR)) {
+        return r;
+    }
     a = float32_squash_input_denormal(a STATUS_VAR);
 
     aSig = extractFloat32Frac( a );
@@ -3430,6 +3697,11 @@ static float64 subFloat64Sigs( float64 a, float64 b, flag zSign STATUS_PARAM )
 float64 float64_add( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
+    float64 r;
+
+    if (float64_host_add(a, b, &r STATUS_VAR)) {
+        return r;
+    }
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3453,6 +3725,11 @@ float64 float64_add( float64 a, float64 b STATUS_PARAM )
 float64 float64_sub( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
+    float64 r;
+
+    if (float64_host_add(a, float64_chs(b), &r STATUS_VAR)) {
+        return r;
+    }
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3478,7 +3755,11 @@ float64 float64_mul( float64 a, float64 b STATUS_PARAM )
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint64_t aSig, bSig, zSig0, zSig1;
+    float64 r;
 
+    if (float64_host_mul(a, b, &r STATUS_VAR)) {
+        return r;
+    }
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3541,6 +3822,11 @@ float64 float64_div( float64 a, float64 b STATUS_PARAM )
     uint64_t aSig, bSig, zSig;
     uint64_t rem0, rem1;
     uint64_t term0, term1;
+    float64 r;
+
+    if (float64_host_div(a, b, &r STATUS_VAR)) {
+        return r;
+    }
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3918,6 +4204,11 @@ float64 float64_sqrt( float64 a STATUS_PARAM )
     int_fast16_t aExp, zExp;
     uint64_t aSig, zSig, doubleZSig;
     uint64_t rem0, rem1, term0, term1;
+    float64 r;
+
+    if (float64_host_sqrt(a, &r STATUS_VAR)) {
+        return r;
+    }
     a = float64_squash_input_denormal(a STATUS_VAR);
 
     aSig = extractFloat64Frac( a );
@@ -1060,6 +1060,26 @@ STEXI
 @findex drive_mirror
 Start mirroring a block device's writes to a new destination,
 using the specified target.
+ETEXI
+
+    {
+        .name       = "drive_backup",
+        .args_type  = "reuse:-n,full:-f,device:B,target:s,format:s?",
+        .params     = "[-n] [-f] device target [format]",
+        .help       = "initiates a point-in-time\n\t\t\t"
+                      "copy for a device. The device's contents are\n\t\t\t"
+                      "copied to the new image file, excluding data that\n\t\t\t"
+                      "is written after the command is started.\n\t\t\t"
+                      "The -n flag requests QEMU to reuse the image found\n\t\t\t"
+                      "in new-image-file, instead of recreating it from scratch.\n\t\t\t"
+                      "The -f flag requests QEMU to copy the whole disk,\n\t\t\t"
+                      "so that the result does not need a backing file.\n\t\t\t",
+        .mhandler.cmd = hmp_drive_backup,
+    },
+STEXI
+@item drive_backup
+@findex drive_backup
+Start a point-in-time copy of a block device to a specificed target.
 ETEXI
 
     {
@@ -1451,16 +1471,25 @@ ETEXI
     },
 
 STEXI
-@item block_set_io_throttle @var{device} @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr}
+@item block_set_io_throttle @var{device} @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr} [@var{bps_max} @var{bps_rd_max} @var{bps_wr_max} @var{iops_max} @var{iops_rd_max} @var{iops_wr_max} [@var{group}]]
 @findex block_set_io_throttle
-Change I/O throttle limits for a block drive to @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr}
+Change I/O throttle limits for a block drive to @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr}.
+The optional @var{bps_max} @var{bps_rd_max} @var{bps_wr_max} @var{iops_max} @var{iops_rd_max} @var{iops_wr_max}
+set the burst limits, and @var{group} puts the drive in a named throttling group
+whose limits are shared by all of its members.
 ETEXI
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
-        .params     = "device bps bps_rd bps_wr iops iops_rd iops_wr",
-        .help       = "change I/O throttle limits for a block drive",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,"
+                      "bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,"
+                      "iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,group:s?",
+        .params     = "device bps bps_rd bps_wr iops iops_rd iops_wr "
+                      "[bps_max bps_rd_max bps_wr_max "
+                      "iops_max iops_rd_max iops_wr_max [group]]",
+        .help       = "change I/O throttle limits for a block drive\n\t\t\t"
+                      "(the *_max limits allow bursts, drives in the same "
+                      "group share their limits)",
         .mhandler.cmd = hmp_block_set_io_throttle,
     },
 
@@ -1643,6 +1672,8 @@ show qdev device model list
 show roms
 @item info tpm
 show the TPM device
+@item info thread-pools
+show I/O thread pool statistics
 @end table
 ETEXI
 
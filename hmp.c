@@ -316,6 +316,11 @@ void hmp_info_block(Monitor *mon, const QDict *qdict)
                             info->value->inserted->iops,
                             info->value->inserted->iops_rd,
                             info->value->inserted->iops_wr);
+
+            if (info->value->inserted->has_group) {
+                monitor_printf(mon, " group=%s",
+                               info->value->inserted->group);
+            }
         } else {
             monitor_printf(mon, " [not inserted]");
         }
@@ -607,6 +612,42 @@ void hmp_info_block_jobs(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_info_thread_pools(Monitor *mon, const QDict *qdict)
+{
+    ThreadPoolInfoList *list, *info;
+    Error *err = NULL;
+
+    list = qmp_query_thread_pools(&err);
+    assert(!err);
+
+    if (!list) {
+        monitor_printf(mon, "No thread pools\n");
+        return;
+    }
+
+    for (info = list; info; info = info->next) {
+        ThreadPoolInfo *p = info->value;
+        int64_t completed = MAX(p->completed, 1);
+
+        monitor_printf(mon, "%s: threads %" PRId64 " (%" PRId64 " idle, "
+                       "min %" PRId64 ", max %" PRId64 ")\n",
+                       p->main ? "main loop" : "I/O thread",
+                       p->threads, p->idle_threads,
+                       p->min_threads, p->max_threads);
+        monitor_printf(mon, "    queue depth %" PRId64 " (max %" PRId64 "), "
+                       "%" PRId64 " requests, %" PRId64 " notifications\n",
+                       p->queue_depth, p->max_queue_depth,
+                       p->completed, p->notifications);
+        monitor_printf(mon, "    average wait %" PRId64 " ns "
+                       "(max %" PRId64 " ns), average service %" PRId64
+                       " ns\n",
+                       p->wait_time_ns / completed, p->max_wait_time_ns,
+                       p->service_time_ns / completed);
+    }
+
+    qapi_free_ThreadPoolInfoList(list);
+}
+
 void hmp_info_tpm(Monitor *mon, const QDict *qdict)
 {
     TPMInfoList *info_list, *info;
@@ -861,6 +902,35 @@ void hmp_drive_mirror(Monitor *mon, const QDict *qdict)
     qmp_drive_mirror(device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
                      true, mode, false, 0, false, 0, false, 0,
+                     false, 0, false, 0, false, 0, &errp);
+    hmp_handle_error(mon, &errp);
+}
+
+void hmp_drive_backup(Monitor *mon, const QDict *qdict)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    const char *filename = qdict_get_str(qdict, "target");
+    const char *format = qdict_get_try_str(qdict, "format");
+    int reuse = qdict_get_try_bool(qdict, "reuse", 0);
+    int full = qdict_get_try_bool(qdict, "full", 0);
+    enum NewImageMode mode;
+    Error *errp = NULL;
+
+    if (!filename) {
+        error_set(&errp, QERR_MISSING_PARAMETER, "target");
+        hmp_handle_error(mon, &errp);
+        return;
+    }
+
+    if (reuse) {
+        mode = NEW_IMAGE_MODE_EXISTING;
+    } else {
+        mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
+    }
+
+    qmp_drive_backup(device, filename, !!format, format,
+                     full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
+                     true, mode, false, 0, false, NULL,
                      false, 0, false, 0, &errp);
     hmp_handle_error(mon, &errp);
 }
@@ -1017,6 +1087,7 @@ void hmp_change(Monitor *mon, const QDict *qdict)
 void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
+    const char *group = qdict_get_try_str(qdict, "group");
 
     qmp_block_set_io_throttle(qdict_get_str(qdict, "device"),
                               qdict_get_int(qdict, "bps"),
@@ -1024,7 +1095,22 @@ void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
                               qdict_get_int(qdict, "bps_wr"),
                               qdict_get_int(qdict, "iops"),
                               qdict_get_int(qdict, "iops_rd"),
-                              qdict_get_int(qdict, "iops_wr"), &err);
+                              qdict_get_int(qdict, "iops_wr"),
+                              qdict_haskey(qdict, "bps_max"),
+                              qdict_get_try_int(qdict, "bps_max", 0),
+                              qdict_haskey(qdict, "bps_rd_max"),
+                              qdict_get_try_int(qdict, "bps_rd_max", 0),
+                              qdict_haskey(qdict, "bps_wr_max"),
+                              qdict_get_try_int(qdict, "bps_wr_max", 0),
+                              qdict_haskey(qdict, "iops_max"),
+                              qdict_get_try_int(qdict, "iops_max", 0),
+                              qdict_haskey(qdict, "iops_rd_max"),
+                              qdict_get_try_int(qdict, "iops_rd_max", 0),
+                              qdict_haskey(qdict, "iops_wr_max"),
+                              qdict_get_try_int(qdict, "iops_wr_max", 0),
+                              false, 0, false, 0, false, 0, /* no length */
+                              false, 0, false, 0, false, 0,
+                              group != NULL, group, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -94,6 +94,37 @@ int ioq_submit(IOQueue *ioq)
     return rc;
 }
 
+/* The completion ring that io_setup() maps into the process.  Its layout is
+ * part of the kernel ABI and libaio's io_getevents() peeks at it too.
+ */
+#define AIO_RING_MAGIC 0xa10a10a1
+
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+    struct io_event io_events[0];
+};
+
+/* Returns true if completions are ready, without making a system call.  This
+ * is cheap enough to be called while busy-waiting.
+ */
+bool ioq_has_completions(IOQueue *ioq)
+{
+    struct aio_ring *ring = (struct aio_ring *)ioq->io_ctx;
+
+    if (ring->magic != AIO_RING_MAGIC) {
+        return false;
+    }
+    return *(volatile unsigned *)&ring->head !=
+           *(volatile unsigned *)&ring->tail;
+}
+
 int ioq_run_completion(IOQueue *ioq, IOQueueCompletion *completion,
                        void *opaque)
 {
@@ -44,6 +44,7 @@ void ioq_put_iocb(IOQueue *ioq, struct iocb *iocb);
 struct iocb *ioq_rdwr(IOQueue *ioq, bool read, struct iovec *iov,
                       unsigned int count, long long offset);
 int ioq_submit(IOQueue *ioq);
+bool ioq_has_completions(IOQueue *ioq);
 
 static inline unsigned int ioq_num_queued(IOQueue *ioq)
 {
@@ -374,6 +374,23 @@ static void handle_io(EventNotifier *e)
     }
 }
 
+/* Busy-wait callbacks, see aio_set_event_notifier_poll() */
+static bool poll_notify(EventNotifier *e)
+{
+    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
+                                           host_notifier);
+
+    return !s->vring.broken && vring_more_avail(&s->vring);
+}
+
+static bool poll_io(EventNotifier *e)
+{
+    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
+                                           io_notifier);
+
+    return s->num_reqs > 0 && ioq_has_completions(&s->ioqueue);
+}
+
 static void *data_plane_thread(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
@@ -468,6 +485,7 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     }
 
     s->ctx = aio_context_new();
+    aio_context_set_poll_params(s->ctx, s->blk->data_plane_poll_max_ns);
 
     /* Set up guest notifier (irq) */
     if (s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque, 1,
@@ -494,6 +512,8 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     }
     s->io_notifier = *ioq_get_notifier(&s->ioqueue);
     aio_set_event_notifier(s->ctx, &s->io_notifier, handle_io, flush_io);
+    aio_set_event_notifier_poll(s->ctx, &s->host_notifier, poll_notify);
+    aio_set_event_notifier_poll(s->ctx, &s->io_notifier, poll_io);
 
     s->started = true;
     trace_virtio_blk_data_plane_start(s);
@@ -10,6 +10,7 @@
 
 #include "qemu-common.h"
 #include "qemu/timer.h"
+#include "qemu/main-loop.h"
 #include "migration/vmstate.h"
 
 /* ptimer.c */
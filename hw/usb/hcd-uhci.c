@@ -29,6 +29,7 @@
 #include "hw/usb.h"
 #include "hw/pci/pci.h"
 #include "qemu/timer.h"
+#include "qemu/main-loop.h"
 #include "qemu/iov.h"
 #include "sysemu/dma.h"
 #include "trace.h"
@@ -36,6 +36,7 @@
 #include "hw/pci/pci.h"
 #include "qemu-common.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 #include "qemu/queue.h"
 #include "qemu/range.h"
 
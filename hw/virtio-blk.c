@@ -14,6 +14,7 @@
 #include "qemu-common.h"
 #include "qemu/error-report.h"
 #include "trace.h"
+#include "block/coroutine.h"
 #include "hw/block-common.h"
 #include "sysemu/blockdev.h"
 #include "hw/virtio-blk.h"
@@ -682,6 +683,9 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
     }
 #endif
 
+    /* Keep enough coroutines around for a full virtqueue of requests */
+    qemu_coroutine_adjust_pool_size(virtio_queue_get_num(&s->vdev, 0));
+
     s->change = qemu_add_vm_change_state_handler(virtio_blk_dma_restart_cb, s);
     s->qdev = dev;
     register_savevm(dev, "virtio-blk", virtio_blk_id++, 2,
@@ -706,5 +710,6 @@ void virtio_blk_exit(VirtIODevice *vdev)
     qemu_del_vm_change_state_handler(s->change);
     unregister_savevm(s->qdev, "virtio-blk", s);
     blockdev_mark_auto_del(s->bs);
+    qemu_coroutine_adjust_pool_size(-virtio_queue_get_num(vdev, 0));
     virtio_cleanup(vdev);
 }
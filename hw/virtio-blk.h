@@ -106,6 +106,7 @@ struct VirtIOBlkConf
     uint32_t scsi;
     uint32_t config_wce;
     uint32_t data_plane;
+    uint32_t data_plane_poll_max_ns;
 };
 
 #define DEFINE_VIRTIO_BLK_FEATURES(_state, _field) \
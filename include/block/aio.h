@@ -17,6 +17,7 @@
 #include "qemu-common.h"
 #include "qemu/queue.h"
 #include "qemu/event_notifier.h"
+#include "qemu/timer.h"
 
 typedef struct BlockDriverAIOCB BlockDriverAIOCB;
 typedef void BlockDriverCompletionFunc(void *opaque, int ret);
@@ -53,27 +54,49 @@ typedef struct AioContext {
      */
     int walking_handlers;
 
-    /* Anchor of the list of Bottom Halves belonging to the context */
-    struct QEMUBH *first_bh;
-
-    /* A simple lock used to protect the first_bh list, and ensure that
-     * no callbacks are removed while we're walking and dispatching callbacks.
+    /* Bottom halves that were scheduled or deleted since the last
+     * aio_bh_poll.  Any thread may add to it without locking, see async.c.
      */
-    int walking_bh;
+    QSLIST_HEAD(, QEMUBH) bh_list;
+
+    /* Bottom halves taken off bh_list that aio_bh_poll has yet to run */
+    QSLIST_HEAD(, QEMUBH) bh_slice;
 
     /* Used for aio_notify.  */
     EventNotifier notifier;
 
+    /* Set while notifier is set, so that aio_notify writes to it once */
+    int notified;
+
     /* GPollFDs for aio_poll() */
     GArray *pollfds;
 
+    /* epoll(7) instance used by aio_poll() instead of pollfds once there
+     * are many handlers, see aio-posix.c.
+     */
+    int epollfd;
+    bool epoll_enabled;
+    bool epoll_available;
+
+    /* Adaptive polling, see aio_context_set_poll_params() */
+    int64_t poll_max_ns;    /* maximum busy-wait time in nanoseconds */
+    int64_t poll_ns;        /* current busy-wait time in nanoseconds */
+
     /* Thread pool for performing work and receiving completion callbacks */
     struct ThreadPool *thread_pool;
+
+    /* Timers that run in aio_poll, see aio_timer_new() */
+    QEMUTimerListGroup tlg;
 } AioContext;
 
 /* Returns 1 if there are still outstanding AIO requests; 0 otherwise */
 typedef int (AioFlushEventNotifierHandler)(EventNotifier *e);
 
+/* Returns true if the handler has work to do.  This is called repeatedly
+ * while busy-waiting, so it must be cheap and must not make system calls.
+ */
+typedef bool (AioPollEventNotifierHandler)(EventNotifier *e);
+
 /**
  * aio_context_new: Allocate a new AioContext.
  *
@@ -99,6 +122,18 @@ void aio_context_ref(AioContext *ctx);
  */
 void aio_context_unref(AioContext *ctx);
 
+/**
+ * aio_context_set_poll_params:
+ * @ctx: The AioContext to operate on.
+ * @max_ns: Maximum time to busy-wait, in nanoseconds; 0 disables polling.
+ *
+ * Before blocking, aio_poll can busy-wait for events by calling the io_poll
+ * callbacks of the handlers (see aio_set_event_notifier_poll), which avoids
+ * the latency of going to sleep and being woken up.  The busy-wait time
+ * adapts to how long aio_poll actually has to wait, up to @max_ns.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns);
+
 /**
  * aio_bh_new: Allocate a new bottom half structure.
  *
@@ -120,6 +155,9 @@ QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque);
  *
  * Calling aio_notify is rarely necessary, because for example scheduling
  * a bottom half calls it already.
+ *
+ * aio_notify can be called from any thread.  Calls made before the
+ * AioContext has woken up are merged into a single wakeup.
  */
 void aio_notify(AioContext *ctx);
 
@@ -136,9 +174,13 @@ int aio_bh_poll(AioContext *ctx);
  * Scheduling a bottom half interrupts the main loop and causes the
  * execution of the callback that was passed to qemu_bh_new.
  *
- * Bottom halves that are scheduled from a bottom half handler are instantly
- * invoked.  This can create an infinite loop if a bottom half handler
- * schedules itself.
+ * Bottom halves run in the order they were scheduled.  Those that are
+ * scheduled from a bottom half handler are invoked in the next iteration
+ * of the event loop.  This can create an infinite loop if a bottom half
+ * handler schedules itself.
+ *
+ * qemu_bh_schedule can be called from any thread; it only wakes up the
+ * AioContext of @bh, and only if @bh was not scheduled already.
  *
  * @bh: The bottom half to be scheduled.
  */
@@ -175,6 +217,22 @@ void qemu_bh_delete(QEMUBH *bh);
  */
 bool aio_pending(AioContext *ctx);
 
+/* Return how long the AioContext may sleep before it has to run bottom
+ * halves or timers, in nanoseconds; -1 if there is nothing to wait for.
+ *
+ * This is used internally in the implementation of aio_poll and of the
+ * GSource.
+ */
+int64_t aio_compute_timeout(AioContext *ctx);
+
+/* Set up and free the state that aio_poll uses to wait for file
+ * descriptors.
+ *
+ * These are used internally when creating and finalizing an AioContext.
+ */
+void aio_context_setup(AioContext *ctx);
+void aio_context_cleanup(AioContext *ctx);
+
 /* Progress in completing AIO work to occur.  This can issue new pending
  * aio as a result of executing I/O completion or bh callbacks.
  *
@@ -187,6 +245,10 @@ bool aio_pending(AioContext *ctx);
  * blocking.  If @blocking is true, this function will wait until one
  * or more AIO events have completed, to ensure something has moved
  * before returning.
+ *
+ * Pending timers of @ctx (see aio_timer_new) count as pending AIO
+ * operations: a blocking aio_poll waits at most until the first of
+ * them expires, and runs the expired ones.
  */
 bool aio_poll(AioContext *ctx, bool blocking);
 
@@ -207,6 +269,16 @@ void aio_set_fd_handler(AioContext *ctx,
                         IOHandler *io_write,
                         AioFlushHandler *io_flush,
                         void *opaque);
+
+/* Returns true if the handler has work to do, see
+ * AioPollEventNotifierHandler.
+ */
+typedef bool (AioPollHandler)(void *opaque);
+
+/* Set the busy-wait callback of a file descriptor that is registered with
+ * aio_set_fd_handler.  When it returns true, io_read is called.
+ */
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollHandler *io_poll);
 #endif
 
 /* Register an event notifier and associated callbacks.  Behaves very similarly
@@ -221,6 +293,15 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifierHandler *io_read,
                             AioFlushEventNotifierHandler *io_flush);
 
+/* Set the callback that tells aio_poll whether @notifier has work to do
+ * while busy-waiting.  When it returns true, the io_read callback is
+ * called even if the notifier has not been set yet.  The notifier must
+ * already be registered with aio_set_event_notifier.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollEventNotifierHandler *io_poll);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -229,6 +310,25 @@ GSource *aio_get_g_source(AioContext *ctx);
 /* Return the ThreadPool bound to this AioContext */
 struct ThreadPool *aio_get_thread_pool(AioContext *ctx);
 
+/**
+ * aio_timer_new:
+ * @ctx: the AioContext that runs the timer
+ * @clock: the clock that drives the timer
+ * @scale: the scale of the expiration times, e.g. SCALE_NS
+ * @cb: the callback to run when the timer expires
+ * @opaque: the opaque argument of @cb
+ *
+ * Create a timer that is run by aio_poll for @ctx, in whatever thread
+ * calls it, rather than by the main loop.  aio_poll takes the deadlines
+ * of these timers into account when it blocks.
+ */
+static inline QEMUTimer *aio_timer_new(AioContext *ctx, QEMUClock *clock,
+                                       int scale, QEMUTimerCB *cb,
+                                       void *opaque)
+{
+    return qemu_new_timer_tlg(&ctx->tlg, clock, scale, cb, opaque);
+}
+
 /* Functions to operate on the main QEMU AioContext.  */
 
 bool qemu_aio_wait(void);
@@ -33,18 +33,12 @@
 #include "qapi/qmp/qerror.h"
 #include "monitor/monitor.h"
 #include "qemu/hbitmap.h"
+#include "qemu/throttle.h"
 
 #define BLOCK_FLAG_ENCRYPT          1
 #define BLOCK_FLAG_COMPAT6          4
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
 
-#define BLOCK_IO_LIMIT_READ     0
-#define BLOCK_IO_LIMIT_WRITE    1
-#define BLOCK_IO_LIMIT_TOTAL    2
-
-#define BLOCK_IO_SLICE_TIME     100000000
-#define NANOSECONDS_PER_SECOND  1000000000.0
-
 #define BLOCK_OPT_SIZE              "size"
 #define BLOCK_OPT_ENCRYPT           "encryption"
 #define BLOCK_OPT_COMPAT6           "compat6"
@@ -60,15 +54,7 @@
 
 typedef struct BdrvTrackedRequest BdrvTrackedRequest;
 
-typedef struct BlockIOLimit {
-    int64_t bps[3];
-    int64_t iops[3];
-} BlockIOLimit;
-
-typedef struct BlockIOBaseValue {
-    uint64_t bytes[2];
-    uint64_t ios[2];
-} BlockIOBaseValue;
+typedef struct ThrottleGroup ThrottleGroup;
 
 struct BlockDriver {
     const char *format_name;
@@ -122,6 +108,12 @@ struct BlockDriver {
         int64_t sector_num, int nb_sectors);
     int coroutine_fn (*bdrv_co_is_allocated)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum);
+    /*
+     * Like .bdrv_co_is_allocated, but returns BDRV_BLOCK_* flags.  Drivers
+     * that can tell which sectors read as zeroes implement this instead.
+     */
+    int coroutine_fn (*bdrv_co_get_block_status)(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum);
 
     /*
      * Invalidate any cached meta-data.
@@ -204,9 +196,42 @@ struct BlockDriver {
      */
     int (*bdrv_has_zero_init)(BlockDriverState *bs);
 
+    /*
+     * Returns true if persistent dirty bitmaps can be saved in the image
+     * when it is closed.  Drivers that implement this load the bitmaps
+     * back in bdrv_open.
+     */
+    bool (*bdrv_can_store_dirty_bitmaps)(BlockDriverState *bs);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
+/*
+ * A dirty bitmap tracks the sectors written to a BlockDriverState since the
+ * bitmap was created or last cleared.  Anonymous bitmaps are private to
+ * their creator (e.g. a block job); named bitmaps are managed by the user
+ * and, if persistent, saved to the image by drivers that support it.
+ */
+struct BdrvDirtyBitmap {
+    HBitmap *bitmap;
+    char *name;
+    bool persistent;
+    bool disabled;      /* not updated by writes to the BlockDriverState */
+    QLIST_ENTRY(BdrvDirtyBitmap) list;
+};
+
+struct BdrvTrackedRequest {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+    bool is_write;
+    QEMUIOVector *qiov; /* data of a write, NULL for zero writes/discards */
+    bool is_discard;
+    QLIST_ENTRY(BdrvTrackedRequest) list;
+    Coroutine *co; /* owner, used for deadlock detection */
+    CoQueue wait_queue; /* coroutines blocked on this request */
+};
+
 /*
  * Note: the function bdrv_append() copies and swaps contents of
  * BlockDriverStates, so if you add new fields to this struct, please
@@ -243,17 +268,17 @@ struct BlockDriverState {
 
     NotifierList close_notifiers;
 
+    /* Callback before write request is processed */
+    NotifierWithReturnList before_write_notifiers;
+
     /* number of in-flight copy-on-read requests */
     unsigned int copy_on_read_in_flight;
 
-    /* the time for latest disk I/O */
-    int64_t slice_time;
-    int64_t slice_start;
-    int64_t slice_end;
-    BlockIOLimit io_limits;
-    BlockIOBaseValue  io_base;
-    CoQueue      throttled_reqs;
-    QEMUTimer    *block_timer;
+    /* I/O throttling, see block/throttle-groups.c */
+    ThrottleGroup *throttle_group;
+    QLIST_ENTRY(BlockDriverState) round_robin;
+    CoQueue      throttled_reqs[2];
+    unsigned int pending_reqs[2];
     bool         io_limits_enabled;
 
     /* I/O stats (display with "info blockstats"). */
@@ -277,7 +302,7 @@ struct BlockDriverState {
     bool iostatus_enabled;
     BlockDeviceIoStatus iostatus;
     char device_name[32];
-    HBitmap *dirty_bitmap;
+    QLIST_HEAD(, BdrvDirtyBitmap) dirty_bitmaps;
     int in_use; /* users other than guest access, eg. block migration */
     QTAILQ_ENTRY(BlockDriverState) list;
 
@@ -291,8 +316,38 @@ struct BlockDriverState {
 
 int get_tmp_filename(char *filename, int size);
 
-void bdrv_set_io_limits(BlockDriverState *bs,
-                        BlockIOLimit *io_limits);
+/**
+ * bdrv_add_before_write_notifier:
+ *
+ * Register a callback that is invoked before write requests are processed but
+ * after any throttling or waiting for overlapping requests.  The notifier is
+ * passed the #BdrvTrackedRequest of the write and may fail it by returning a
+ * negative errno value.
+ */
+void bdrv_add_before_write_notifier(BlockDriverState *bs,
+                                    NotifierWithReturn *notifier);
+
+/**
+ * bdrv_write_in_flight:
+ *
+ * Returns true if a write or discard request overlapping the given range
+ * is being processed, including requests whose before write notifiers are
+ * still running.
+ */
+bool bdrv_write_in_flight(BlockDriverState *bs, int64_t sector_num,
+                          int nb_sectors);
+
+/**
+ * bdrv_co_wait_for_writes:
+ *
+ * Waits until no request that bdrv_write_in_flight() would report for the
+ * given range is being processed.
+ */
+void coroutine_fn bdrv_co_wait_for_writes(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors);
+
+void bdrv_set_io_limits(BlockDriverState *bs, ThrottleConfig *cfg);
+void bdrv_get_io_limits(BlockDriverState *bs, ThrottleConfig *cfg);
 
 /**
  * bdrv_get_aio_context:
@@ -356,6 +411,7 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
  * @granularity: The chosen granularity for the dirty bitmap.
  * @buf_size: The amount of data that can be in flight at one time.
  * @mode: Whether to collapse all images in the chain to the target.
+ * @copy_mode: Whether guest writes are copied to the target synchronously.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @cb: Completion function for the job.
@@ -369,9 +425,37 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
  */
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, int64_t granularity, int64_t buf_size,
-                  MirrorSyncMode mode, BlockdevOnError on_source_error,
+                  MirrorSyncMode mode, MirrorCopyMode copy_mode,
+                  BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp);
 
+/*
+ * backup_start:
+ * @bs: Block device to operate on.
+ * @target: Block device to write to.
+ * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @sync_mode: What parts of the disk image should be copied to the target.
+ * @sync_bitmap: The dirty bitmap selecting the clusters to copy if
+ * @sync_mode is %MIRROR_SYNC_MODE_INCREMENTAL, otherwise %NULL.
+ * @on_source_error: The action to take upon error reading from the source.
+ * @on_target_error: The action to take upon error writing to the target.
+ * @cb: Completion function for the job.
+ * @opaque: Opaque pointer value passed to @cb.
+ * @errp: Error object.
+ *
+ * Start a backup operation on @bs.  The contents of @bs at the time the job
+ * starts are copied to @target; guest writes to clusters that have not been
+ * copied yet first copy the old data.  @target is closed and deleted when
+ * the job completes.
+ */
+void backup_start(BlockDriverState *bs, BlockDriverState *target,
+                  int64_t speed, MirrorSyncMode sync_mode,
+                  BdrvDirtyBitmap *sync_bitmap,
+                  BlockdevOnError on_source_error,
+                  BlockdevOnError on_target_error,
+                  BlockDriverCompletionFunc *cb, void *opaque,
+                  Error **errp);
+
 #endif /* BLOCK_INT_H */
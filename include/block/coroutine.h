@@ -18,6 +18,7 @@
 #include <stdbool.h>
 #include "qemu/queue.h"
 #include "qemu/timer.h"
+#include "block/aio.h"
 
 /**
  * Coroutines are a mechanism for stack switching and can be used for
@@ -95,6 +96,15 @@ Coroutine *coroutine_fn qemu_coroutine_self(void);
  */
 bool qemu_in_coroutine(void);
 
+/**
+ * Adjust the number of coroutines kept for reuse
+ *
+ * Devices that keep up to @n requests in flight should call this with a
+ * positive @n when they are created, and with the negative value when
+ * they go away, so that the pool of free coroutines matches the I/O depth.
+ */
+void qemu_coroutine_adjust_pool_size(int n);
+
 
 
 /**
@@ -28,6 +28,9 @@
 #include "qemu/queue.h"
 #include "block/coroutine.h"
 
+/* Size of the stack of each coroutine, for backends that allocate one */
+#define COROUTINE_STACK_SIZE (1 << 20)
+
 typedef enum {
     COROUTINE_YIELD = 1,
     COROUTINE_TERMINATE = 2,
@@ -28,6 +28,30 @@ typedef int ThreadPoolFunc(void *opaque);
 
 typedef struct ThreadPool ThreadPool;
 
+typedef struct ThreadPoolParams {
+    int min_threads;    /* idle workers that are kept around */
+    int max_threads;
+    int *cpus;          /* CPUs the workers run on, or NULL ... */
+    int nb_cpus;        /* ... if 0, to inherit the creator's affinity */
+} ThreadPoolParams;
+
+typedef struct ThreadPoolStats {
+    int min_threads;
+    int max_threads;
+    int threads;            /* workers, including those being created */
+    int idle_threads;
+    int queue_depth;        /* requests waiting for a worker */
+    int max_queue_depth;
+    uint64_t completed;     /* requests run by a worker */
+    int64_t wait_ns;        /* total time between submission and start */
+    int64_t max_wait_ns;
+    int64_t service_ns;     /* total time spent running requests */
+    uint64_t notifications; /* completion notifications sent */
+} ThreadPoolStats;
+
+typedef void ThreadPoolStatsFunc(struct AioContext *ctx,
+                                 ThreadPoolStats *stats, void *opaque);
+
 ThreadPool *thread_pool_new(struct AioContext *ctx);
 void thread_pool_free(ThreadPool *pool);
 
@@ -38,4 +62,21 @@ int coroutine_fn thread_pool_submit_co(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg);
 void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg);
 
+/**
+ * thread_pool_set_params:
+ * @params: The new worker limits and CPU affinity.
+ * @errp: Error object.
+ *
+ * Applies @params to all existing thread pools and to those that are
+ * created later.  Running workers switch CPUs before their next request;
+ * workers above the new maximum exit once they are done.
+ */
+void thread_pool_set_params(const ThreadPoolParams *params, Error **errp);
+
+/* Returns a copy of the current parameters; free params->cpus with g_free */
+void thread_pool_get_params(ThreadPoolParams *params);
+
+/* Calls @func with the statistics of every thread pool */
+void thread_pool_foreach(ThreadPoolStatsFunc *func, void *opaque);
+
 #endif
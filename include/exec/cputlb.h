@@ -31,6 +31,8 @@ MemoryRegionSection *phys_page_find(struct AddressSpaceDispatch *d,
 void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length);
 void tlb_set_dirty(CPUArchState *env, target_ulong vaddr);
 extern int tlb_flush_count;
+extern int tlb_refill_count;
+extern int tlb_victim_hit_count;
 
 /* exec.c */
 void tb_flush_jmp_cache(CPUArchState *env, target_ulong addr);
@@ -41,6 +43,7 @@ hwaddr memory_region_section_get_iotlb(CPUArchState *env,
                                                    int prot,
                                                    target_ulong *address);
 bool memory_region_is_unassigned(MemoryRegion *mr);
+void invalidate_and_set_dirty(hwaddr addr, hwaddr length);
 
 #endif
 #endif
@@ -83,6 +83,9 @@ int cpu_gen_code(CPUArchState *env, struct TranslationBlock *tb,
 bool cpu_restore_state(CPUArchState *env, uintptr_t searched_pc);
 
 void QEMU_NORETURN cpu_resume_from_signal(CPUArchState *env1, void *puc);
+#if defined(CONFIG_USER_ONLY)
+void cpu_restore_sigmask(void *puc);
+#endif
 void QEMU_NORETURN cpu_io_recompile(CPUArchState *env, uintptr_t retaddr);
 TranslationBlock *tb_gen_code(CPUArchState *env, 
                               target_ulong pc, target_ulong cs_base, int flags,
@@ -98,10 +101,18 @@ void tb_invalidate_phys_range(tb_page_addr_t start, tb_page_addr_t end,
 /* cputlb.c */
 void tlb_flush_page(CPUArchState *env, target_ulong addr);
 void tlb_flush(CPUArchState *env, int flush_global);
+void tlb_flush_page_all(target_ulong addr);
+void tlb_flush_all(int flush_global);
 void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size);
+bool tlb_victim_hit(CPUArchState *env, int mmu_idx, int index,
+                    size_t elt_ofs, target_ulong addr);
 void tb_invalidate_phys_addr(hwaddr addr);
+
+/* cpus.c */
+bool qemu_tcg_lock_iothread(void);
+void qemu_tcg_unlock_iothread(bool locked);
 #else
 static inline void tlb_flush_page(CPUArchState *env, target_ulong addr)
 {
@@ -110,12 +121,38 @@ static inline void tlb_flush_page(CPUArchState *env, target_ulong addr)
 static inline void tlb_flush(CPUArchState *env, int flush_global)
 {
 }
+
+static inline void tlb_flush_page_all(target_ulong addr)
+{
+}
+
+static inline void tlb_flush_all(int flush_global)
+{
+}
+
+static inline bool qemu_tcg_lock_iothread(void)
+{
+    return false;
+}
+
+static inline void qemu_tcg_unlock_iothread(bool locked)
+{
+}
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
+/* the prologue is at the end of the code buffer */
+#define CODE_GEN_PROLOGUE_SIZE   1024
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+/* initial number of entries of the physical hash table, which grows
+   when its chains become too long */
+#define CODE_GEN_HTABLE_BITS     15
+#define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
+
+/* The translation buffer is split in up to this many regions.  When the
+   current one is full, the least recently used region is emptied and
+   reused, instead of flushing the whole buffer.  */
+#define CODE_GEN_MAX_REGIONS     8
 
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
@@ -142,10 +179,12 @@ struct TranslationBlock {
     uint16_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+    /* set once the TB has been removed from the physical page lists; it
+       must not be chained to anymore */
+    bool invalid;
+    uint8_t region;     /* index in tb_ctx.regions */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* first and second physical page containing code. The lower bit
        of the pointer tells the index in page_next[] */
     struct TranslationBlock *page_next[2];
@@ -169,22 +208,54 @@ struct TranslationBlock {
 };
 
 #include "exec/spinlock.h"
+#include "exec/tb-hash-xx.h"
+#include "qemu/thread.h"
+#include "qemu/qht.h"
 
 typedef struct TBContext TBContext;
+typedef struct TBRegion TBRegion;
+
+struct TBRegion {
+    /* generated code, new TBs start between code_ptr and code_end */
+    uint8_t *code_start;
+    uint8_t *code_ptr;
+    uint8_t *code_end;
+    /* TB descriptors, sorted by tc_ptr */
+    TranslationBlock *tbs;
+    int nb_tbs;
+    int max_tbs;
+    /* value of tb_ctx.clock when a TB of the region was last looked up */
+    unsigned int last_use;
+};
 
 struct TBContext {
 
     TranslationBlock *tbs;
-    TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+    /* TBs indexed by physical PC, virtual PC and flags */
+    struct qht htable;
     int nb_tbs;
+    TBRegion regions[CODE_GEN_MAX_REGIONS];
+    TBRegion *cur_region;
+    int nb_regions;
+    size_t region_size;
+    /* number of TBs generated, used to approximate LRU */
+    unsigned int clock;
     /* any access to the tbs or the page table must use this lock */
+#if defined(CONFIG_USER_ONLY)
     spinlock_t tb_lock;
+#else
+    /* only taken when parallel_cpus is set, see tb_lock() */
+    QemuMutex tb_lock;
+#endif
 
     /* statistics */
     int tb_flush_count;
     int tb_phys_invalidate_count;
+    int tb_region_evict_count;
 
-    int tb_invalidated_flag;
+    /* incremented whenever TBs are freed by a flush or an eviction, so
+       that cpu_exec does not chain TBs that it looked up before */
+    unsigned int tb_generation;
 };
 
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
@@ -202,14 +273,51 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+static inline uint32_t tb_hash_func(tb_page_addr_t phys_pc, target_ulong pc,
+                                    uint64_t flags)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    return tb_hash_func5(phys_pc, pc, flags ^ (flags >> 32));
 }
 
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUArchState *env);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
+void tb_lock(void);
+void tb_unlock(void);
+void tb_lock_reset(void);
+
+/* In user mode, mmap_lock protects the guest page flags and the memory
+   map.  It nests outside tb_lock.  */
+#if defined(CONFIG_USER_ONLY)
+void mmap_lock(void);
+void mmap_unlock(void);
+void mmap_lock_reset(void);
+#else
+static inline void mmap_lock(void)
+{
+}
+
+static inline void mmap_unlock(void)
+{
+}
+
+static inline void mmap_lock_reset(void)
+{
+}
+#endif
+
+#if defined(CONFIG_USER_ONLY)
+/* In user mode, flushing the translation buffer or evicting a region of
+   it while other threads run guest code is deferred until the threads
+   are stopped.  tb_exclusive_work() does it, and must be called between
+   start_exclusive() and end_exclusive().  */
+bool tb_exclusive_work_pending(void);
+void tb_exclusive_work(void);
+#endif
+
+/* True if the vCPUs of a system emulator each run in their own thread,
+   see qemu_tcg_configure().  */
+extern bool parallel_cpus;
 
 #if defined(USE_DIRECT_JUMP)
 
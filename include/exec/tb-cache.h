@@ -0,0 +1,33 @@
+/*
+ * Persistent cache of translated code
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef TB_CACHE_H
+#define TB_CACHE_H
+
+#include "qapi/error.h"
+
+/* Use FILENAME as the cache of translated code.  The file is read the
+   first time a TB is translated, and written back when QEMU exits.  */
+void tb_cache_init(const char *filename, Error **errp);
+
+/* Write the TBs translated in this run to the cache file.  */
+void tb_cache_save(void);
+
+#ifdef NEED_CPU_H
+/* Look up TB, whose pc, cs_base, flags and cflags are set, in the cache
+   and copy its code to tb->tc_ptr.  Returns false if it must be
+   translated.  */
+bool tb_cache_load(CPUArchState *env, TranslationBlock *tb,
+                   tb_page_addr_t phys_pc, int *gen_code_size_ptr);
+
+/* Remember the code of a TB that was just translated.  */
+void tb_cache_add(CPUArchState *env, TranslationBlock *tb,
+                  tb_page_addr_t phys_pc, int gen_code_size);
+
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf);
+#endif
+
+#endif
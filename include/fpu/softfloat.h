@@ -210,6 +210,13 @@ void set_floatx80_rounding_precision(int val STATUS_PARAM);
 *----------------------------------------------------------------------------*/
 void float_raise( int8 flags STATUS_PARAM);
 
+/*----------------------------------------------------------------------------
+| Whether single and double-precision arithmetic may use the host FPU for
+| normal inputs.  Only tests clear it, to check the host FPU fast paths
+| against the software implementation.
+*----------------------------------------------------------------------------*/
+extern flag float_use_host_fpu;
+
 /*----------------------------------------------------------------------------
 | Options to indicate which negations to perform in float*_muladd()
 | Using these differs from negating an input or output before calling
@@ -304,6 +304,8 @@ struct qemu_work_item {
     void (*func)(void *data);
     void *data;
     int done;
+    bool free;
+    bool exclusive;
 };
 
 #ifdef CONFIG_USER_ONLY
@@ -65,4 +65,26 @@
 
 #endif
 
+/* Reads and writes that the compiler may neither omit, nor tear, nor
+ * move across other atomic accesses.  They imply no memory barrier.
+ */
+#define atomic_read(ptr)       (*(__typeof__(*ptr) volatile *) (ptr))
+#define atomic_set(ptr, i)     ((*(__typeof__(*ptr) volatile *) (ptr)) = (i))
+
+/* Read-modify-write operations; all of them are full memory barriers */
+#define atomic_fetch_add       __sync_fetch_and_add
+#define atomic_fetch_sub       __sync_fetch_and_sub
+#define atomic_fetch_and       __sync_fetch_and_and
+#define atomic_fetch_or        __sync_fetch_and_or
+#define atomic_cmpxchg         __sync_val_compare_and_swap
+#define atomic_inc(ptr)        ((void) __sync_fetch_and_add(ptr, 1))
+#define atomic_dec(ptr)        ((void) __sync_fetch_and_add(ptr, -1))
+
+#if defined(__clang__)
+#define atomic_xchg(ptr, i)    __sync_swap(ptr, i)
+#else
+/* __sync_lock_test_and_set() is documented to be an acquire barrier only */
+#define atomic_xchg(ptr, i)    ({ smp_mb(); __sync_lock_test_and_set(ptr, i); })
+#endif
+
 #endif
@@ -183,6 +183,16 @@ static inline unsigned long hweight_long(unsigned long w)
     return count;
 }
 
+/**
+ * rol32 - rotate a 32-bit value left
+ * @word: value to rotate
+ * @shift: bits to roll
+ */
+static inline uint32_t rol32(uint32_t word, unsigned int shift)
+{
+    return (word << shift) | (word >> ((32 - shift) & 31));
+}
+
 /**
  * extract32:
  * @value: the value to extract the bit field from
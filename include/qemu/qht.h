@@ -0,0 +1,142 @@
+/*
+ * Resizable hash table with bucket chaining
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_QHT_H
+#define QEMU_QHT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct qht_map;
+
+/* Grow the table automatically when the chains get too long.  */
+#define QHT_MODE_AUTO_RESIZE 0x1
+
+/*
+ * The table stores opaque pointers together with their 32-bit hash; a
+ * lookup first compares the hash, and only calls the user's comparison
+ * function on the pointers whose hash matches.
+ *
+ * The table does not do any locking: the caller must serialize all the
+ * accesses, including lookups, for example with tb_lock.
+ */
+struct qht {
+    struct qht_map *map;
+    size_t n_entries;
+    unsigned int mode;
+};
+
+struct qht_stats {
+    size_t head_buckets;
+    size_t used_head_buckets;
+    size_t entries;
+    /* chain lengths, in buckets, of the used head buckets */
+    size_t max_chain;
+    double avg_chain;
+    /* fraction of the entries in use in the chains of used head buckets */
+    double occupancy;
+};
+
+typedef bool (*qht_lookup_func_t)(const void *obj, const void *userp);
+typedef void (*qht_iter_func_t)(struct qht *ht, void *p, uint32_t h,
+                                void *up);
+
+/**
+ * qht_init:
+ * @ht: the table to initialize
+ * @n_elems: number of entries the table should hold without growing
+ * @mode: a combination of QHT_MODE_* flags
+ */
+void qht_init(struct qht *ht, size_t n_elems, unsigned int mode);
+
+/**
+ * qht_destroy:
+ * @ht: the table to destroy
+ *
+ * Frees the memory used by the table; the pointers it contains are left
+ * alone.
+ */
+void qht_destroy(struct qht *ht);
+
+/**
+ * qht_insert:
+ * @ht: the table
+ * @p: the pointer to insert, which must not be NULL
+ * @hash: the hash of @p
+ *
+ * Returns true on success, false if @p is already in the table.
+ */
+bool qht_insert(struct qht *ht, void *p, uint32_t hash);
+
+/**
+ * qht_lookup:
+ * @ht: the table
+ * @func: called on each entry whose hash is @hash, until it returns true
+ * @userp: second argument of @func
+ * @hash: the hash to look for
+ *
+ * Returns the first entry for which @func returns true, or NULL.
+ */
+void *qht_lookup(struct qht *ht, qht_lookup_func_t func, const void *userp,
+                 uint32_t hash);
+
+/**
+ * qht_remove:
+ * @ht: the table
+ * @p: the pointer to remove
+ * @hash: the hash of @p, as passed to qht_insert
+ *
+ * Returns true on success, false if @p was not in the table.
+ */
+bool qht_remove(struct qht *ht, const void *p, uint32_t hash);
+
+/**
+ * qht_reset:
+ * @ht: the table
+ *
+ * Removes all the entries, keeping the current size.
+ */
+void qht_reset(struct qht *ht);
+
+/**
+ * qht_reset_size:
+ * @ht: the table
+ * @n_elems: number of entries the table should hold without growing
+ *
+ * Removes all the entries and resizes the table for @n_elems entries.
+ * Returns true if the size changed.
+ */
+bool qht_reset_size(struct qht *ht, size_t n_elems);
+
+/**
+ * qht_resize:
+ * @ht: the table
+ * @n_elems: number of entries the table should hold without growing
+ *
+ * Rehashes the entries into a table sized for @n_elems entries.
+ * Returns true if the size changed.
+ */
+bool qht_resize(struct qht *ht, size_t n_elems);
+
+/**
+ * qht_iter:
+ * @ht: the table
+ * @func: called on each entry of the table
+ * @userp: last argument of @func
+ *
+ * @func must not modify the table.
+ */
+void qht_iter(struct qht *ht, qht_iter_func_t func, void *userp);
+
+/**
+ * qht_statistics_init:
+ * @ht: the table
+ * @stats: filled with the current statistics of @ht
+ */
+void qht_statistics_init(struct qht *ht, struct qht_stats *stats);
+
+#endif /* QEMU_QHT_H */
@@ -78,7 +78,7 @@
  * For details on the use of these macros, see the queue(3) manual page.
  */
 
-#include "qemu/atomic.h" /* for smp_wmb() */
+#include "qemu/atomic.h" /* for smp_wmb() and atomic operations */
 
 /*
  * List definitions.
@@ -195,6 +195,25 @@ struct {                                                                \
         (head)->slh_first = (elm);                                      \
 } while (/*CONSTCOND*/0)
 
+/* Adds @elm to @head while other threads may do the same concurrently.
+ * Elements must only be taken off such a list with QSLIST_MOVE_ATOMIC.
+ */
+#define QSLIST_INSERT_HEAD_ATOMIC(head, elm, field) do {                 \
+        __typeof__(elm) save_sle_next;                                  \
+        do {                                                            \
+            save_sle_next = (elm)->field.sle_next =                     \
+                atomic_read(&(head)->slh_first);                        \
+        } while (atomic_cmpxchg(&(head)->slh_first, save_sle_next,      \
+                                (elm)) != save_sle_next);               \
+} while (/*CONSTCOND*/0)
+
+/* Takes all elements off @src, which is updated with
+ * QSLIST_INSERT_HEAD_ATOMIC, and stores them in @dest.
+ */
+#define QSLIST_MOVE_ATOMIC(dest, src) do {                               \
+        (dest)->slh_first = atomic_xchg(&(src)->slh_first, NULL);       \
+} while (/*CONSTCOND*/0)
+
 #define QSLIST_REMOVE_HEAD(head, field) do {                             \
         (head)->slh_first = (head)->slh_first->field.sle_next;          \
 } while (/*CONSTCOND*/0)
@@ -0,0 +1,97 @@
+/*
+ * Leaky bucket I/O throttling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef THROTTLE_H
+#define THROTTLE_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "qapi/error.h"
+
+#define NANOSECONDS_PER_SECOND  1000000000.0
+
+/* Upper bound for rates and burst sizes, about 1 PB/s */
+#define THROTTLE_VALUE_MAX      1000000000000000LL
+
+typedef enum {
+    THROTTLE_BPS_TOTAL,
+    THROTTLE_BPS_READ,
+    THROTTLE_BPS_WRITE,
+    THROTTLE_OPS_TOTAL,
+    THROTTLE_OPS_READ,
+    THROTTLE_OPS_WRITE,
+    BUCKETS_COUNT,
+} BucketType;
+
+/*
+ * Every request adds its size (in bytes or operations) to the level of the
+ * buckets that apply to it, and the buckets leak at @avg units per second.
+ * A request has to wait while the level is above the bucket size.
+ *
+ * Without a burst rate the bucket holds 1/10th of a second worth of I/O,
+ * which is enough to absorb the request grouping done by guest schedulers.
+ *
+ * With a burst rate, the bucket holds @max * @burst_length units, so that
+ * I/O can run at up to @max units per second for @burst_length seconds
+ * before being throttled down to @avg.  If @burst_length is longer than
+ * one second, a second bucket (@burst_level) leaking at @max units per
+ * second enforces the burst rate itself.
+ */
+typedef struct LeakyBucket {
+    double avg;             /* average goal in units per second */
+    double max;             /* burst rate in units per second, 0 if none */
+    double level;           /* bucket level in units */
+    double burst_level;     /* level of the burst rate bucket in units */
+    uint64_t burst_length;  /* maximum length of a burst in seconds */
+} LeakyBucket;
+
+typedef struct ThrottleConfig {
+    LeakyBucket buckets[BUCKETS_COUNT];
+} ThrottleConfig;
+
+typedef struct ThrottleState {
+    ThrottleConfig cfg;
+    int64_t previous_leak;  /* timestamp of the last leak, in ns */
+} ThrottleState;
+
+void throttle_config_init(ThrottleConfig *cfg);
+bool throttle_enabled(ThrottleConfig *cfg);
+bool throttle_is_valid(ThrottleConfig *cfg, Error **errp);
+
+void throttle_init(ThrottleState *ts, int64_t now);
+void throttle_config(ThrottleState *ts, ThrottleConfig *cfg, int64_t now);
+void throttle_get_config(ThrottleState *ts, ThrottleConfig *cfg);
+
+void throttle_leak_bucket(LeakyBucket *bkt, int64_t delta_ns);
+int64_t throttle_compute_wait(LeakyBucket *bkt);
+
+/**
+ * throttle_compute_timer:
+ * @ts: The throttling state.
+ * @is_write: Whether the next request is a write.
+ * @now: The current time in nanoseconds.
+ * @next_timestamp: Return location for the time at which the request
+ * may be submitted.
+ *
+ * Leaks the buckets up to @now and checks whether a request can be
+ * submitted right away.  Returns true if the caller must wait until
+ * @next_timestamp.
+ */
+bool throttle_compute_timer(ThrottleState *ts, bool is_write, int64_t now,
+                            int64_t *next_timestamp);
+
+/**
+ * throttle_account:
+ * @ts: The throttling state.
+ * @is_write: Whether the request is a write.
+ * @size: The size of the request in bytes.
+ *
+ * Accounts a request that is being submitted.
+ */
+void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
+
+#endif
@@ -2,7 +2,6 @@
 #define QEMU_TIMER_H
 
 #include "qemu-common.h"
-#include "qemu/main-loop.h"
 #include "qemu/notify.h"
 
 #ifdef __FreeBSD__
@@ -15,8 +14,22 @@
 #define SCALE_US 1000
 #define SCALE_NS 1
 
+#define QEMU_CLOCK_REALTIME 0
+#define QEMU_CLOCK_VIRTUAL  1
+#define QEMU_CLOCK_HOST     2
+#define QEMU_CLOCK_MAX      3
+
 typedef struct QEMUClock QEMUClock;
+typedef struct QEMUTimerList QEMUTimerList;
 typedef void QEMUTimerCB(void *opaque);
+typedef void QEMUTimerListNotifyCB(void *opaque);
+
+/* A timer list for each clock.  The main loop has one, and so does each
+ * AioContext, so that timers run in the thread that owns them.
+ */
+typedef struct QEMUTimerListGroup {
+    QEMUTimerList *tl[QEMU_CLOCK_MAX];
+} QEMUTimerListGroup;
 
 /* The real time clock should be used only for stuff which does not
    change the virtual machine state, as it is run even if the virtual
@@ -36,6 +49,9 @@ extern QEMUClock *vm_clock;
    the virtual clock. */
 extern QEMUClock *host_clock;
 
+/* The timers created with qemu_new_timer run in the main loop */
+extern QEMUTimerListGroup main_loop_tlg;
+
 int64_t qemu_get_clock_ns(QEMUClock *clock);
 int64_t qemu_clock_has_timers(QEMUClock *clock);
 int64_t qemu_clock_expired(QEMUClock *clock);
@@ -47,6 +63,49 @@ void qemu_register_clock_reset_notifier(QEMUClock *clock, Notifier *notifier);
 void qemu_unregister_clock_reset_notifier(QEMUClock *clock,
                                           Notifier *notifier);
 
+/**
+ * qemu_timer_list_new:
+ * @clock: the clock that drives the timers of the list
+ * @cb: called when the earliest deadline of the list moves closer
+ * @opaque: the opaque argument of @cb
+ *
+ * Create a timer list.  Timers are kept in a binary heap ordered by
+ * expiration time, so that adding or removing a timer costs O(log n).
+ * @cb should wake up the thread that runs the timers of the list, so that
+ * it recomputes its poll timeout.
+ */
+QEMUTimerList *qemu_timer_list_new(QEMUClock *clock,
+                                   QEMUTimerListNotifyCB *cb, void *opaque);
+void qemu_timer_list_free(QEMUTimerList *tl);
+bool qemu_timer_list_has_timers(QEMUTimerList *tl);
+
+/**
+ * qemu_timer_list_deadline_ns:
+ *
+ * Returns the time in nanoseconds until the first timer of @tl expires,
+ * 0 if it has already expired, or -1 if there are no timers or the clock
+ * is disabled.
+ */
+int64_t qemu_timer_list_deadline_ns(QEMUTimerList *tl);
+
+/**
+ * qemu_timer_list_run_timers:
+ *
+ * Run the callbacks of the expired timers of @tl.  Returns true if any
+ * timer was run.
+ */
+bool qemu_timer_list_run_timers(QEMUTimerList *tl);
+
+void qemu_timer_list_group_init(QEMUTimerListGroup *tlg,
+                                QEMUTimerListNotifyCB *cb, void *opaque);
+void qemu_timer_list_group_deinit(QEMUTimerListGroup *tlg);
+int64_t qemu_timer_list_group_deadline_ns(QEMUTimerListGroup *tlg);
+bool qemu_timer_list_group_run_timers(QEMUTimerListGroup *tlg);
+
+QEMUTimer *qemu_new_timer_tl(QEMUTimerList *tl, int scale,
+                             QEMUTimerCB *cb, void *opaque);
+QEMUTimer *qemu_new_timer_tlg(QEMUTimerListGroup *tlg, QEMUClock *clock,
+                              int scale, QEMUTimerCB *cb, void *opaque);
 QEMUTimer *qemu_new_timer(QEMUClock *clock, int scale,
                           QEMUTimerCB *cb, void *opaque);
 void qemu_free_timer(QEMUTimer *ts);
@@ -59,9 +118,27 @@ uint64_t qemu_timer_expire_time_ns(QEMUTimer *ts);
 
 void qemu_run_timers(QEMUClock *clock);
 void qemu_run_all_timers(void);
-void configure_alarms(char const *opt);
 void init_clocks(void);
-int init_timer_alarm(void);
+
+/**
+ * qemu_soonest_timeout:
+ *
+ * Returns the smaller of two timeouts in nanoseconds, where -1 means
+ * an infinite timeout.
+ */
+static inline int64_t qemu_soonest_timeout(int64_t timeout1, int64_t timeout2)
+{
+    /* -1 is the largest timeout once cast to unsigned */
+    return ((uint64_t) timeout1 < (uint64_t) timeout2) ? timeout1 : timeout2;
+}
+
+/* Converts a timeout in nanoseconds to milliseconds for poll(2), rounding
+ * up so that the timer has expired when poll returns.
+ */
+int qemu_timeout_ns_to_ms(int64_t ns);
+
+/* Like g_poll, but with a timeout in nanoseconds; -1 waits forever */
+int qemu_poll_ns(GPollFD *fds, guint nfds, int64_t timeout);
 
 int64_t cpu_get_ticks(void);
 void cpu_enable_ticks(void);
@@ -32,7 +32,8 @@
  * This means that for the moment use should be restricted to
  * per-VCPU variables, which are OK because:
  *  - the only -user mode supporting multiple VCPU threads is linux-user
- *  - TCG system mode is single-threaded regarding VCPUs
+ *  - TCG system mode is single-threaded regarding VCPUs, except with
+ *    -machine tcg-thread=multi, which is only accepted on Linux
  *  - KVM system mode is multi-threaded but limited to Linux
  *
  * TODO: proper implementations via Win32 .tls sections and
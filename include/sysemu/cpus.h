@@ -1,8 +1,11 @@
 #ifndef QEMU_CPUS_H
 #define QEMU_CPUS_H
 
+#include "qemu/option.h"
+
 /* cpus.c */
 void qemu_init_cpu_loop(void);
+void qemu_tcg_configure(QemuOpts *opts, Error **errp);
 void resume_all_vcpus(void);
 void pause_all_vcpus(void);
 void cpu_stop_current(void);
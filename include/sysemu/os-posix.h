@@ -48,4 +48,7 @@ int qemu_utimens(const char *path, const qemu_timespec *times);
 
 bool is_daemonized(void);
 
+void *qemu_alloc_stack(size_t size);
+void qemu_free_stack(void *stack, size_t size);
+
 #endif
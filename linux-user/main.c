@@ -29,11 +29,13 @@
 #include "qemu.h"
 #include "qemu-common.h"
 #include "qemu/cache-utils.h"
+#include "qemu/atomic.h"
 #include "cpu.h"
 #include "tcg.h"
 #include "qemu/timer.h"
 #include "qemu/envlist.h"
 #include "elf.h"
+#include "exec/tb-cache.h"
 
 char *exec_path;
 
@@ -109,9 +111,11 @@ static int pending_cpus;
 /* Make sure everything is in a consistent state for calling fork().  */
 void fork_start(void)
 {
-    pthread_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
+    /* Same order as everywhere else: exclusive_lock, then mmap_lock, then
+       tb_lock.  */
     pthread_mutex_lock(&exclusive_lock);
     mmap_fork_start();
+    pthread_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
 }
 
 void fork_end(int child)
@@ -130,8 +134,8 @@ void fork_end(int child)
         pthread_mutex_init(&tcg_ctx.tb_ctx.tb_lock, NULL);
         gdbserver_fork(thread_env);
     } else {
-        pthread_mutex_unlock(&exclusive_lock);
         pthread_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
+        pthread_mutex_unlock(&exclusive_lock);
     }
 }
 
@@ -179,6 +183,14 @@ static inline void end_exclusive(void)
 /* Wait for exclusive ops to finish, and begin cpu execution.  */
 static inline void cpu_exec_start(CPUState *cpu)
 {
+    /* Flushes and evictions of the translation buffer requested by
+       this or another thread.  */
+    if (tb_exclusive_work_pending()) {
+        start_exclusive();
+        tb_exclusive_work();
+        end_exclusive();
+    }
+
     pthread_mutex_lock(&exclusive_lock);
     exclusive_idle();
     cpu->running = true;
@@ -314,12 +326,15 @@ static void set_idt(int n, unsigned int dpl)
 
 void cpu_loop(CPUX86State *env)
 {
+    CPUState *cs = CPU(x86_env_get_cpu(env));
     int trapnr;
     abi_ulong pc;
     target_siginfo_t info;
 
     for(;;) {
+        cpu_exec_start(cs);
         trapnr = cpu_x86_exec(env);
+        cpu_exec_end(cs);
         switch(trapnr) {
         case 0x80:
             /* linux syscall from int $0x80 */
@@ -503,15 +518,10 @@ static void arm_kernel_cmpxchg64_helper(CPUARMState *env)
     uint64_t oldval, newval, val;
     uint32_t addr, cpsr;
     target_siginfo_t info;
+    bool swapped;
 
     /* Based on the 32 bit code in do_kernel_trap */
 
-    /* XXX: This only works between threads, not between processes.
-       It's probably possible to implement this with native host
-       operations. However things like ldrex/strex are much harder so
-       there's not much point trying.  */
-    start_exclusive();
-    cpsr = cpsr_read(env);
     addr = env->regs[2];
 
     if (get_user_u64(oldval, env->regs[0])) {
@@ -524,19 +534,33 @@ static void arm_kernel_cmpxchg64_helper(CPUARMState *env)
         goto segv;
     };
 
-    if (get_user_u64(val, addr)) {
-        env->cp15.c6_data = addr;
-        goto segv;
-    }
-
-    if (val == oldval) {
-        val = newval;
-
-        if (put_user_u64(val, addr)) {
+#if HOST_LONG_BITS == 64
+    if ((addr & 7) == 0 &&
+        page_check_range(addr, 8, PAGE_READ | PAGE_WRITE) == 0) {
+        val = tswap64(oldval);
+        swapped = atomic_cmpxchg((uint64_t *)g2h(addr), val,
+                                 tswap64(newval)) == val;
+    } else
+#endif
+    {
+        /* XXX: This only works between threads, not between processes. */
+        start_exclusive();
+        if (get_user_u64(val, addr)) {
+            end_exclusive();
             env->cp15.c6_data = addr;
             goto segv;
-        };
+        }
+        swapped = val == oldval;
+        if (swapped && put_user_u64(newval, addr)) {
+            end_exclusive();
+            env->cp15.c6_data = addr;
+            goto segv;
+        }
+        end_exclusive();
+    }
 
+    cpsr = cpsr_read(env);
+    if (swapped) {
         env->regs[0] = 0;
         cpsr |= CPSR_C;
     } else {
@@ -544,11 +568,9 @@ static void arm_kernel_cmpxchg64_helper(CPUARMState *env)
         cpsr &= ~CPSR_C;
     }
     cpsr_write(env, cpsr, CPSR_C);
-    end_exclusive();
     return;
 
 segv:
-    end_exclusive();
     /* We get the PC of the entry address - which is as good as anything,
        on a real kernel what you get depends on which mode it uses. */
     info.si_signo = SIGSEGV;
@@ -557,8 +579,6 @@ segv:
     info.si_code = TARGET_SEGV_MAPERR;
     info._sifields._sigfault._addr = env->cp15.c6_data;
     queue_signal(env, info.si_signo, &info);
-
-    end_exclusive();
 }
 
 /* Handle a jump to the kernel code page.  */
@@ -568,26 +588,37 @@ do_kernel_trap(CPUARMState *env)
     uint32_t addr;
     uint32_t cpsr;
     uint32_t val;
+    bool swapped;
 
     switch (env->regs[15]) {
     case 0xffff0fa0: /* __kernel_memory_barrier */
         /* ??? No-op. Will need to do better for SMP.  */
         break;
     case 0xffff0fc0: /* __kernel_cmpxchg */
-         /* XXX: This only works between threads, not between processes.
-            It's probably possible to implement this with native host
-            operations. However things like ldrex/strex are much harder so
-            there's not much point trying.  */
-        start_exclusive();
-        cpsr = cpsr_read(env);
         addr = env->regs[2];
-        /* FIXME: This should SEGV if the access fails.  */
-        if (get_user_u32(val, addr))
-            val = ~env->regs[0];
-        if (val == env->regs[0]) {
-            val = env->regs[1];
-            /* FIXME: Check for segfaults.  */
-            put_user_u32(val, addr);
+        if ((addr & 3) == 0 &&
+            page_check_range(addr, 4, PAGE_READ | PAGE_WRITE) == 0) {
+            /* The other threads keep running, the host's compare-and-swap
+               is atomic with respect to them.  */
+            val = tswap32(env->regs[0]);
+            swapped = atomic_cmpxchg((uint32_t *)g2h(addr), val,
+                                     tswap32(env->regs[1])) == val;
+        } else {
+            /* XXX: This only works between threads, not between
+               processes.  */
+            start_exclusive();
+            /* FIXME: This should SEGV if the access fails.  */
+            if (get_user_u32(val, addr))
+                val = ~env->regs[0];
+            swapped = val == env->regs[0];
+            if (swapped) {
+                /* FIXME: Check for segfaults.  */
+                put_user_u32(env->regs[1], addr);
+            }
+            end_exclusive();
+        }
+        cpsr = cpsr_read(env);
+        if (swapped) {
             env->regs[0] = 0;
             cpsr |= CPSR_C;
         } else {
@@ -595,7 +626,6 @@ do_kernel_trap(CPUARMState *env)
             cpsr &= ~CPSR_C;
         }
         cpsr_write(env, cpsr, CPSR_C);
-        end_exclusive();
         break;
     case 0xffff0fe0: /* __kernel_get_tls */
         env->regs[0] = env->cp15.c13_tls2;
@@ -1115,12 +1145,15 @@ static void flush_windows(CPUSPARCState *env)
 
 void cpu_loop (CPUSPARCState *env)
 {
+    CPUState *cs = CPU(sparc_env_get_cpu(env));
     int trapnr;
     abi_long ret;
     target_siginfo_t info;
 
     while (1) {
+        cpu_exec_start(cs);
         trapnr = cpu_sparc_exec (env);
+        cpu_exec_end(cs);
 
         /* Compute PSR before exposing state.  */
         if (env->cc_op != CC_OP_FLAGS) {
@@ -2403,10 +2436,13 @@ error:
 
 void cpu_loop(CPUOpenRISCState *env)
 {
+    CPUState *cs = CPU(openrisc_env_get_cpu(env));
     int trapnr, gdbsig;
 
     for (;;) {
+        cpu_exec_start(cs);
         trapnr = cpu_exec(env);
+        cpu_exec_end(cs);
         gdbsig = 0;
 
         switch (trapnr) {
@@ -2466,6 +2502,9 @@ void cpu_loop(CPUOpenRISCState *env)
         case EXCP_NR:
             qemu_log("\nNR\n");
             break;
+        case EXCP_INTERRUPT:
+            /* just indicate that signals should be handled asap */
+            break;
         default:
             qemu_log("\nqemu: unhandled CPU exception %#x - aborting\n",
                      trapnr);
@@ -2489,11 +2528,14 @@ void cpu_loop(CPUOpenRISCState *env)
 #ifdef TARGET_SH4
 void cpu_loop(CPUSH4State *env)
 {
+    CPUState *cs = CPU(sh_env_get_cpu(env));
     int trapnr, ret;
     target_siginfo_t info;
 
     while (1) {
+        cpu_exec_start(cs);
         trapnr = cpu_sh4_exec (env);
+        cpu_exec_end(cs);
 
         switch (trapnr) {
         case 0x160:
@@ -2548,11 +2590,14 @@ void cpu_loop(CPUSH4State *env)
 #ifdef TARGET_CRIS
 void cpu_loop(CPUCRISState *env)
 {
+    CPUState *cs = CPU(cris_env_get_cpu(env));
     int trapnr, ret;
     target_siginfo_t info;
     
     while (1) {
+        cpu_exec_start(cs);
         trapnr = cpu_cris_exec (env);
+        cpu_exec_end(cs);
         switch (trapnr) {
         case 0xaa:
             {
@@ -2606,11 +2651,14 @@ void cpu_loop(CPUCRISState *env)
 #ifdef TARGET_MICROBLAZE
 void cpu_loop(CPUMBState *env)
 {
+    CPUState *cs = CPU(mb_env_get_cpu(env));
     int trapnr, ret;
     target_siginfo_t info;
     
     while (1) {
+        cpu_exec_start(cs);
         trapnr = cpu_mb_exec (env);
+        cpu_exec_end(cs);
         switch (trapnr) {
         case 0xaa:
             {
@@ -2706,13 +2754,16 @@ void cpu_loop(CPUMBState *env)
 
 void cpu_loop(CPUM68KState *env)
 {
+    CPUState *cs = CPU(m68k_env_get_cpu(env));
     int trapnr;
     unsigned int n;
     target_siginfo_t info;
     TaskState *ts = env->opaque;
 
     for(;;) {
+        cpu_exec_start(cs);
         trapnr = cpu_m68k_exec(env);
+        cpu_exec_end(cs);
         switch(trapnr) {
         case EXCP_ILLEGAL:
             {
@@ -2843,12 +2894,15 @@ static void do_store_exclusive(CPUAlphaState *env, int reg, int quad)
 
 void cpu_loop(CPUAlphaState *env)
 {
+    CPUState *cs = CPU(alpha_env_get_cpu(env));
     int trapnr;
     target_siginfo_t info;
     abi_long sysret;
 
     while (1) {
+        cpu_exec_start(cs);
         trapnr = cpu_alpha_exec (env);
+        cpu_exec_end(cs);
 
         /* All of the traps imply a transition through PALcode, which
            implies an REI instruction has been executed.  Which means
@@ -3028,12 +3082,15 @@ void cpu_loop(CPUAlphaState *env)
 #ifdef TARGET_S390X
 void cpu_loop(CPUS390XState *env)
 {
+    CPUState *cs = CPU(s390_env_get_cpu(env));
     int trapnr, n, sig;
     target_siginfo_t info;
     target_ulong addr;
 
     while (1) {
+        cpu_exec_start(cs);
         trapnr = cpu_s390x_exec(env);
+        cpu_exec_end(cs);
         switch (trapnr) {
         case EXCP_INTERRUPT:
             /* Just indicate that signals should be handled asap.  */
@@ -3332,6 +3389,17 @@ static void handle_arg_singlestep(const char *arg)
     singlestep = 1;
 }
 
+static void handle_arg_tb_cache(const char *arg)
+{
+    Error *err = NULL;
+
+    tb_cache_init(arg, &err);
+    if (err) {
+        fprintf(stderr, "%s\n", error_get_pretty(err));
+        exit(1);
+    }
+}
+
 static void handle_arg_strace(const char *arg)
 {
     do_strace = 1;
@@ -3387,6 +3455,8 @@ static const struct qemu_argument arg_table[] = {
      "pagesize",   "set the host page size to 'pagesize'"},
     {"singlestep", "QEMU_SINGLESTEP",  false, handle_arg_singlestep,
      "",           "run in singlestep mode"},
+    {"tb-cache",   "QEMU_TB_CACHE",    true,  handle_arg_tb_cache,
+     "file",       "keep translated code in 'file' between runs"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
     {"version",    "QEMU_VERSION",     false, handle_arg_version,
@@ -2455,6 +2455,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show progress of ongoing block device operations",
         .mhandler.cmd = hmp_info_block_jobs,
     },
+    {
+        .name       = "thread-pools",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show I/O thread pool statistics",
+        .mhandler.cmd = hmp_info_thread_pools,
+    },
     {
         .name       = "registers",
         .args_type  = "",
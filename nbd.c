@@ -38,6 +38,11 @@
 
 #include "qemu/sockets.h"
 #include "qemu/queue.h"
+#include "qemu/iov.h"
+#include "qemu/thread.h"
+#include "qemu/event_notifier.h"
+#include "block/aio.h"
+#include "qemu/main-loop.h"
 
 //#define DEBUG_NBD
 
@@ -59,10 +64,13 @@
 
 #define NBD_REQUEST_SIZE        (4 + 4 + 8 + 8 + 4)
 #define NBD_REPLY_SIZE          (4 + 4 + 8)
+#define NBD_STRUCTURED_REPLY_SIZE (4 + 2 + 2 + 8 + 4)
 #define NBD_REQUEST_MAGIC       0x25609513
 #define NBD_REPLY_MAGIC         0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
 #define NBD_OPTS_MAGIC          0x49484156454F5054LL
 #define NBD_CLIENT_MAGIC        0x0000420281861253LL
+#define NBD_REP_MAGIC           0x0003e889045565a9LL
 
 #define NBD_SET_SOCK            _IO(0xab, 0)
 #define NBD_SET_BLKSIZE         _IO(0xab, 1)
@@ -77,15 +85,63 @@
 #define NBD_SET_FLAGS           _IO(0xab, 10)
 
 #define NBD_OPT_EXPORT_NAME     (1 << 0)
+#define NBD_OPT_ABORT           2
+#define NBD_OPT_STRUCTURED_REPLY 8
+#define NBD_OPT_SET_META_CONTEXT 10
+
+#define NBD_REP_ACK             1
+#define NBD_REP_META_CONTEXT    4
+#define NBD_REP_ERR_UNSUP       ((1U << 31) | 1)
+#define NBD_REP_ERR_INVALID     ((1U << 31) | 3)
+#define NBD_REP_ERR_UNKNOWN     ((1U << 31) | 6)
+
+#define NBD_MAX_OPTION_SIZE     4096
+
+/* The server only knows about base:allocation, so its id is fixed */
+#define NBD_META_ID_BASE_ALLOCATION 1
+
+/* Maximum number of extents in a block status reply */
+#define NBD_MAX_EXTENTS         256
 
 /* Definitions for opaque data types */
 
 typedef struct NBDRequest NBDRequest;
 
+/* A piece of a reply queued by a threaded server: either @len bytes at
+ * @data (within the request buffer), or @len bytes at offset @offset of
+ * the request's header buffer.
+ */
+typedef struct NBDReplySegment {
+    const uint8_t *data;
+    size_t offset;
+    size_t len;
+} NBDReplySegment;
+
+enum {
+    NBD_MSG_REQUEST,        /* a request is ready to be processed */
+    NBD_MSG_EOF,            /* the connection was closed by the client */
+    NBD_MSG_DETACHED,       /* the iothread has let go of the client */
+};
+
 struct NBDRequest {
     QSIMPLEQ_ENTRY(NBDRequest) entry;
     NBDClient *client;
     uint8_t *data;
+
+    /* The following fields are only used by threaded servers */
+    int msg;
+    struct nbd_request request;
+    ssize_t recv_ret;
+    size_t recv_done;
+    uint8_t recv_buf[NBD_REQUEST_SIZE];
+
+    uint8_t *hdr;           /* reply headers and small payloads */
+    size_t hdr_len, hdr_size;
+    NBDReplySegment *segs;
+    int nb_segs, max_segs;
+    struct iovec *iov;
+    int niov;
+    size_t out_len, out_done;
 };
 
 struct NBDExport {
@@ -119,8 +175,47 @@ struct NBDClient {
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
+
+    bool structured_reply;
+    bool export_meta;           /* base:allocation was negotiated */
+
+    /* Threaded servers only.  @lock protects @replies and @detach, which
+     * are how the main thread talks to the iothread; @kicked and
+     * @pending_next are protected by the iothread's lock.  All other
+     * fields below are only accessed by the iothread.
+     */
+    NBDIOThread *iothread;
+    QemuMutex lock;
+    QSIMPLEQ_HEAD(, NBDRequest) replies;
+    bool detach;
+    bool kicked;
+    QTAILQ_ENTRY(NBDClient) pending_next;
+
+    bool attached;
+    bool eof;
+    int in_flight;              /* requests not yet completely replied to */
+    NBDRequest *recv_req;
+    QSIMPLEQ_HEAD(, NBDRequest) send_queue;
+    QSIMPLEQ_HEAD(, NBDRequest) free_reqs;
 };
 
+/* An NBDIOThread runs the socket I/O of its clients in a separate thread,
+ * see nbd_client_new.
+ */
+struct NBDIOThread {
+    QemuThread thread;
+    AioContext *ctx;
+    EventNotifier notifier;
+    QemuMutex lock;
+    QTAILQ_HEAD(, NBDClient) pending;   /* clients with work to do */
+};
+
+/* Messages from the iothreads to the main thread */
+static QemuMutex nbd_main_lock;
+static EventNotifier nbd_main_notifier;
+static QSIMPLEQ_HEAD(, NBDRequest) nbd_main_queue =
+    QSIMPLEQ_HEAD_INITIALIZER(nbd_main_queue);
+
 /* That's all folks */
 
 ssize_t nbd_wr_sync(int fd, void *buffer, size_t size, bool do_read)
@@ -288,59 +383,241 @@ int unix_socket_outgoing(const char *path)
 
 */
 
+static int nbd_send_option_reply(int csock, uint32_t opt, uint32_t type,
+                                 const void *data, uint32_t len)
+{
+    uint8_t buf[8 + 4 + 4 + 4];
+
+    /* Option reply:
+        [ 0 ..   7]   NBD_REP_MAGIC
+        [ 8 ..  11]   option
+        [12 ..  15]   reply type
+        [16 ..  19]   length
+        [20 ..  xx]   data (length bytes)
+     */
+    TRACE("Reply to option %u: type 0x%x, len %u", opt, type, len);
+    cpu_to_be64w((uint64_t*)buf, NBD_REP_MAGIC);
+    cpu_to_be32w((uint32_t*)(buf + 8), opt);
+    cpu_to_be32w((uint32_t*)(buf + 12), type);
+    cpu_to_be32w((uint32_t*)(buf + 16), len);
+    if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("write failed (option reply)");
+        return -EINVAL;
+    }
+    if (len && write_sync(csock, (void *)data, len) != len) {
+        LOG("write failed (option reply data)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int nbd_drop(int csock, uint32_t length)
+{
+    char buf[256];
+
+    while (length > 0) {
+        uint32_t n = MIN(length, sizeof(buf));
+        if (read_sync(csock, buf, n) != n) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+        length -= n;
+    }
+    return 0;
+}
+
+/* NBD_OPT_SET_META_CONTEXT:
+    [ 0 ..   3]   export name length
+    [ 4 ..  xx]   export name
+    [xx .. +3 ]   number of queries
+                  followed by, for each query:
+    [ 0 ..   3]   query length
+    [ 4 ..  xx]   query
+ */
+static int nbd_negotiate_meta_context(NBDClient *client, uint32_t length)
+{
+    int csock = client->sock;
+    uint8_t *buf, *p, *end;
+    uint32_t len, nr_queries;
+    char *name;
+    int rc;
+
+    if (!client->structured_reply || length > NBD_MAX_OPTION_SIZE) {
+        rc = nbd_drop(csock, length);
+        if (rc < 0) {
+            return rc;
+        }
+        return nbd_send_option_reply(csock, NBD_OPT_SET_META_CONTEXT,
+                                     NBD_REP_ERR_INVALID, NULL, 0);
+    }
+
+    buf = g_malloc(length);
+    if (read_sync(csock, buf, length) != length) {
+        LOG("read failed");
+        rc = -EINVAL;
+        goto out;
+    }
+
+    p = buf;
+    end = buf + length;
+    rc = -EINVAL;
+    if (end - p < 8 || (len = be32_to_cpup((uint32_t *)p)) > end - p - 8) {
+        LOG("invalid SET_META_CONTEXT request");
+        goto out;
+    }
+    name = g_strndup((char *)p + 4, len);
+    p += 4 + len;
+    if (!nbd_export_find(name)) {
+        g_free(name);
+        rc = nbd_send_option_reply(csock, NBD_OPT_SET_META_CONTEXT,
+                                   NBD_REP_ERR_UNKNOWN, NULL, 0);
+        goto out;
+    }
+    g_free(name);
+
+    nr_queries = be32_to_cpup((uint32_t *)p);
+    p += 4;
+    client->export_meta = false;
+    while (nr_queries-- > 0) {
+        if (end - p < 4 || (len = be32_to_cpup((uint32_t *)p)) > end - p - 4) {
+            LOG("invalid SET_META_CONTEXT query");
+            goto out;
+        }
+        p += 4;
+        if (len == strlen(NBD_META_BASE_ALLOCATION) &&
+            !memcmp(p, NBD_META_BASE_ALLOCATION, len)) {
+            uint8_t reply[4 + sizeof(NBD_META_BASE_ALLOCATION) - 1];
+
+            cpu_to_be32w((uint32_t *)reply, NBD_META_ID_BASE_ALLOCATION);
+            memcpy(reply + 4, NBD_META_BASE_ALLOCATION, len);
+            rc = nbd_send_option_reply(csock, NBD_OPT_SET_META_CONTEXT,
+                                       NBD_REP_META_CONTEXT,
+                                       reply, sizeof(reply));
+            if (rc < 0) {
+                goto out;
+            }
+            client->export_meta = true;
+        }
+        p += len;
+    }
+
+    rc = nbd_send_option_reply(csock, NBD_OPT_SET_META_CONTEXT,
+                               NBD_REP_ACK, NULL, 0);
+
+out:
+    g_free(buf);
+    return rc;
+}
+
 static int nbd_receive_options(NBDClient *client)
 {
     int csock = client->sock;
     char name[256];
-    uint32_t tmp, length;
+    uint32_t flags, opt, length;
     uint64_t magic;
+    bool fixed;
     int rc;
 
     /* Client sends:
-        [ 0 ..   3]   reserved (0)
-        [ 4 ..  11]   NBD_OPTS_MAGIC
-        [12 ..  15]   NBD_OPT_EXPORT_NAME
-        [16 ..  19]   length
-        [20 ..  xx]   export name (length bytes)
+        [ 0 ..   3]   client flags
+
+       followed by any number of options:
+        [ 0 ..   7]   NBD_OPTS_MAGIC
+        [ 8 ..  11]   option
+        [12 ..  15]   length
+        [16 ..  xx]   option data (length bytes)
+
+       Unless the client set NBD_FLAG_C_FIXED_NEWSTYLE, the only option
+       that is understood is NBD_OPT_EXPORT_NAME; it is always the last
+       option and it does not get a reply.
      */
 
     rc = -EINVAL;
-    if (read_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp)) {
+    if (read_sync(csock, &flags, sizeof(flags)) != sizeof(flags)) {
         LOG("read failed");
         goto fail;
     }
-    TRACE("Checking reserved");
-    if (tmp != 0) {
-        LOG("Bad reserved received");
+    TRACE("Checking client flags");
+    flags = be32_to_cpu(flags);
+    if (flags & ~NBD_FLAG_C_FIXED_NEWSTYLE) {
+        LOG("Bad client flags received");
         goto fail;
     }
+    fixed = flags & NBD_FLAG_C_FIXED_NEWSTYLE;
 
-    if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
-        LOG("read failed");
-        goto fail;
-    }
-    TRACE("Checking reserved");
-    if (magic != be64_to_cpu(NBD_OPTS_MAGIC)) {
-        LOG("Bad magic received");
-        goto fail;
-    }
+    for (;;) {
+        if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
+            LOG("read failed");
+            goto fail;
+        }
+        TRACE("Checking opts magic");
+        if (magic != be64_to_cpu(NBD_OPTS_MAGIC)) {
+            LOG("Bad magic received");
+            goto fail;
+        }
 
-    if (read_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp)) {
-        LOG("read failed");
-        goto fail;
-    }
-    TRACE("Checking option");
-    if (tmp != be32_to_cpu(NBD_OPT_EXPORT_NAME)) {
-        LOG("Bad option received");
-        goto fail;
-    }
+        if (read_sync(csock, &opt, sizeof(opt)) != sizeof(opt)) {
+            LOG("read failed");
+            goto fail;
+        }
+        opt = be32_to_cpu(opt);
 
-    if (read_sync(csock, &length, sizeof(length)) != sizeof(length)) {
-        LOG("read failed");
-        goto fail;
+        if (read_sync(csock, &length, sizeof(length)) != sizeof(length)) {
+            LOG("read failed");
+            goto fail;
+        }
+        length = be32_to_cpu(length);
+
+        TRACE("Checking option %u", opt);
+        if (opt == NBD_OPT_EXPORT_NAME) {
+            break;
+        }
+        if (!fixed) {
+            LOG("Bad option received");
+            goto fail;
+        }
+
+        switch (opt) {
+        case NBD_OPT_ABORT:
+            nbd_send_option_reply(csock, opt, NBD_REP_ACK, NULL, 0);
+            goto fail;
+
+        case NBD_OPT_STRUCTURED_REPLY:
+            if (length) {
+                if (nbd_drop(csock, length) < 0) {
+                    goto fail;
+                }
+                if (nbd_send_option_reply(csock, opt, NBD_REP_ERR_INVALID,
+                                          NULL, 0) < 0) {
+                    goto fail;
+                }
+                break;
+            }
+            client->structured_reply = true;
+            if (nbd_send_option_reply(csock, opt, NBD_REP_ACK, NULL, 0) < 0) {
+                goto fail;
+            }
+            break;
+
+        case NBD_OPT_SET_META_CONTEXT:
+            if (nbd_negotiate_meta_context(client, length) < 0) {
+                goto fail;
+            }
+            break;
+
+        default:
+            if (nbd_drop(csock, length) < 0) {
+                goto fail;
+            }
+            if (nbd_send_option_reply(csock, opt, NBD_REP_ERR_UNSUP,
+                                      NULL, 0) < 0) {
+                goto fail;
+            }
+            break;
+        }
     }
+
     TRACE("Checking length");
-    length = be32_to_cpu(length);
     if (length > 255) {
         LOG("Bad length received");
         goto fail;
@@ -372,7 +649,8 @@ static int nbd_send_negotiate(NBDClient *client)
     char buf[8 + 8 + 8 + 128];
     int rc;
     const int myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
-                         NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA);
+                         NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+                         NBD_FLAG_SEND_WRITE_ZEROES);
 
     /* Negotiation header without options:
         [ 0 ..   7]   passwd       ("NBDMAGIC")
@@ -385,7 +663,7 @@ static int nbd_send_negotiate(NBDClient *client)
        Negotiation header with options, part 1:
         [ 0 ..   7]   passwd       ("NBDMAGIC")
         [ 8 ..  15]   magic        (NBD_OPTS_MAGIC)
-        [16 ..  17]   server flags (0)
+        [16 ..  17]   server flags (NBD_FLAG_FIXED_NEWSTYLE)
 
        part 2 (after options are sent):
         [18 ..  25]   size
@@ -406,6 +684,7 @@ static int nbd_send_negotiate(NBDClient *client)
         cpu_to_be16w((uint16_t*)(buf + 26), client->exp->nbdflags | myflags);
     } else {
         cpu_to_be64w((uint64_t*)(buf + 8), NBD_OPTS_MAGIC);
+        cpu_to_be16w((uint16_t*)(buf + 16), NBD_FLAG_FIXED_NEWSTYLE);
     }
 
     if (client->exp) {
@@ -440,16 +719,151 @@ fail:
     return rc;
 }
 
+static int nbd_send_option(int csock, uint32_t opt, const void *data,
+                           uint32_t len)
+{
+    uint8_t buf[8 + 4 + 4];
+
+    cpu_to_be64w((uint64_t*)buf, NBD_OPTS_MAGIC);
+    cpu_to_be32w((uint32_t*)(buf + 8), opt);
+    cpu_to_be32w((uint32_t*)(buf + 12), len);
+    if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("write failed (option %u)", opt);
+        return -EINVAL;
+    }
+    if (len && write_sync(csock, (void *)data, len) != len) {
+        LOG("write failed (option %u data)", opt);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int nbd_receive_option_reply(int csock, uint32_t opt, uint32_t *type,
+                                    uint32_t *len)
+{
+    uint8_t buf[8 + 4 + 4 + 4];
+
+    if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("read failed (option reply)");
+        return -EINVAL;
+    }
+    if (be64_to_cpup((uint64_t*)buf) != NBD_REP_MAGIC ||
+        be32_to_cpup((uint32_t*)(buf + 8)) != opt) {
+        LOG("Bad option reply received");
+        return -EINVAL;
+    }
+    *type = be32_to_cpup((uint32_t*)(buf + 12));
+    *len = be32_to_cpup((uint32_t*)(buf + 16));
+    TRACE("Option %u reply: type 0x%x, len %u", opt, *type, *len);
+    return 0;
+}
+
+static int nbd_request_meta_context(int csock, const char *name,
+                                    NBDExtensions *ext)
+{
+    const char *query = NBD_META_BASE_ALLOCATION;
+    uint32_t name_len = strlen(name), query_len = strlen(query);
+    uint32_t type, len, id;
+    char reply[256];
+    uint8_t *buf, *p;
+    int rc;
+
+    buf = p = g_malloc(4 + name_len + 4 + 4 + query_len);
+    cpu_to_be32w((uint32_t*)p, name_len);
+    memcpy(p + 4, name, name_len);
+    p += 4 + name_len;
+    cpu_to_be32w((uint32_t*)p, 1);
+    cpu_to_be32w((uint32_t*)(p + 4), query_len);
+    memcpy(p + 8, query, query_len);
+    p += 8 + query_len;
+
+    rc = nbd_send_option(csock, NBD_OPT_SET_META_CONTEXT, buf, p - buf);
+    g_free(buf);
+    if (rc < 0) {
+        return rc;
+    }
+
+    for (;;) {
+        rc = nbd_receive_option_reply(csock, NBD_OPT_SET_META_CONTEXT,
+                                      &type, &len);
+        if (rc < 0) {
+            return rc;
+        }
+        if (type != NBD_REP_META_CONTEXT) {
+            /* NBD_REP_ACK or an error; both end the reply */
+            return len ? nbd_drop(csock, len) : 0;
+        }
+        if (len < 4 || len - 4 >= sizeof(reply)) {
+            LOG("Bad metadata context reply");
+            return -EINVAL;
+        }
+        if (read_sync(csock, &id, sizeof(id)) != sizeof(id) ||
+            read_sync(csock, reply, len - 4) != len - 4) {
+            LOG("read failed (metadata context)");
+            return -EINVAL;
+        }
+        reply[len - 4] = '\0';
+        if (!strcmp(reply, query)) {
+            ext->base_allocation = true;
+            ext->context_id = be32_to_cpu(id);
+        }
+    }
+}
+
+/* Negotiates the extensions in @ext with a fixed newstyle server */
+static int nbd_negotiate_extensions(int csock, const char *name,
+                                    NBDExtensions *ext)
+{
+    bool want_meta = ext->base_allocation;
+    uint32_t type, len;
+    int rc;
+
+    ext->base_allocation = false;
+    if (!ext->structured_reply) {
+        return 0;
+    }
+
+    ext->structured_reply = false;
+    rc = nbd_send_option(csock, NBD_OPT_STRUCTURED_REPLY, NULL, 0);
+    if (rc < 0) {
+        return rc;
+    }
+    rc = nbd_receive_option_reply(csock, NBD_OPT_STRUCTURED_REPLY,
+                                  &type, &len);
+    if (rc < 0) {
+        return rc;
+    }
+    if (type != NBD_REP_ACK) {
+        /* Not supported, the server keeps sending simple replies */
+        return len ? nbd_drop(csock, len) : 0;
+    }
+    if (len) {
+        LOG("Bad structured reply option reply");
+        return -EINVAL;
+    }
+    ext->structured_reply = true;
+
+    if (want_meta) {
+        return nbd_request_meta_context(csock, name, ext);
+    }
+    return 0;
+}
+
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, size_t *blocksize)
+                          off_t *size, size_t *blocksize, NBDExtensions *ext)
 {
     char buf[256];
     uint64_t magic, s;
     uint16_t tmp;
     int rc;
+    NBDExtensions no_ext = { 0 };
 
     TRACE("Receiving negotiation.");
 
+    if (!ext) {
+        ext = &no_ext;
+    }
+
     socket_set_block(csock);
     rc = -EINVAL;
 
@@ -487,9 +901,8 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
     TRACE("Magic is 0x%" PRIx64, magic);
 
     if (name) {
-        uint32_t reserved = 0;
-        uint32_t opt;
-        uint32_t namesize;
+        uint32_t client_flags = 0;
+        uint16_t server_flags;
 
         TRACE("Checking magic (opts_magic)");
         if (magic != NBD_OPTS_MAGIC) {
@@ -500,35 +913,37 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
             LOG("flags read failed");
             goto fail;
         }
-        *flags = be16_to_cpu(tmp) << 16;
-        /* reserved for future use */
-        if (write_sync(csock, &reserved, sizeof(reserved)) !=
-            sizeof(reserved)) {
-            LOG("write failed (reserved)");
-            goto fail;
-        }
-        /* write the export name */
-        magic = cpu_to_be64(magic);
-        if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
-            LOG("write failed (magic)");
-            goto fail;
+        server_flags = be16_to_cpu(tmp);
+        *flags = server_flags << 16;
+
+        /* Options other than the export name are only possible if both
+         * sides know that they will get a reply */
+        if (server_flags & NBD_FLAG_FIXED_NEWSTYLE) {
+            client_flags |= NBD_FLAG_C_FIXED_NEWSTYLE;
         }
-        opt = cpu_to_be32(NBD_OPT_EXPORT_NAME);
-        if (write_sync(csock, &opt, sizeof(opt)) != sizeof(opt)) {
-            LOG("write failed (opt)");
+        client_flags = cpu_to_be32(client_flags);
+        if (write_sync(csock, &client_flags, sizeof(client_flags)) !=
+            sizeof(client_flags)) {
+            LOG("write failed (client flags)");
             goto fail;
         }
-        namesize = cpu_to_be32(strlen(name));
-        if (write_sync(csock, &namesize, sizeof(namesize)) !=
-            sizeof(namesize)) {
-            LOG("write failed (namesize)");
-            goto fail;
+
+        if (server_flags & NBD_FLAG_FIXED_NEWSTYLE) {
+            if (nbd_negotiate_extensions(csock, name, ext) < 0) {
+                goto fail;
+            }
+        } else {
+            memset(ext, 0, sizeof(*ext));
         }
-        if (write_sync(csock, (char*)name, strlen(name)) != strlen(name)) {
-            LOG("write failed (name)");
+
+        /* write the export name */
+        if (nbd_send_option(csock, NBD_OPT_EXPORT_NAME,
+                            name, strlen(name)) < 0) {
             goto fail;
         }
     } else {
+        memset(ext, 0, sizeof(*ext));
+
         TRACE("Checking magic (cli_magic)");
 
         if (magic != NBD_CLIENT_MAGIC) {
@@ -556,7 +971,7 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
             LOG("read failed (tmp)");
             goto fail;
         }
-        *flags |= be32_to_cpu(tmp);
+        *flags |= be16_to_cpu(tmp);
     }
     if (read_sync(csock, &buf, 124) != 124) {
         LOG("read failed (buf)");
@@ -698,21 +1113,9 @@ ssize_t nbd_send_request(int csock, struct nbd_request *request)
     return 0;
 }
 
-static ssize_t nbd_receive_request(int csock, struct nbd_request *request)
+static ssize_t nbd_decode_request(uint8_t *buf, struct nbd_request *request)
 {
-    uint8_t buf[NBD_REQUEST_SIZE];
     uint32_t magic;
-    ssize_t ret;
-
-    ret = read_sync(csock, buf, sizeof(buf));
-    if (ret < 0) {
-        return ret;
-    }
-
-    if (ret != sizeof(buf)) {
-        LOG("read failed");
-        return -EINVAL;
-    }
 
     /* Request
        [ 0 ..  3]   magic   (NBD_REQUEST_MAGIC)
@@ -739,10 +1142,9 @@ static ssize_t nbd_receive_request(int csock, struct nbd_request *request)
     return 0;
 }
 
-ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
+static ssize_t nbd_receive_request(int csock, struct nbd_request *request)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
-    uint32_t magic;
+    uint8_t buf[NBD_REQUEST_SIZE];
     ssize_t ret;
 
     ret = read_sync(csock, buf, sizeof(buf));
@@ -755,13 +1157,67 @@ ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
         return -EINVAL;
     }
 
+    return nbd_decode_request(buf, request);
+}
+
+ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
+{
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
+    uint32_t magic;
+    ssize_t ret;
+
+    /* A simple reply is as long as the common part of the headers */
+    ret = read_sync(csock, buf, NBD_REPLY_SIZE);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (ret != NBD_REPLY_SIZE) {
+        LOG("read failed");
+        return -EINVAL;
+    }
+
+    magic = be32_to_cpup((uint32_t*)buf);
+    reply->magic = magic;
+
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        /* Structured reply chunk
+           [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+           [ 4 ..  5]    flags
+           [ 6 ..  7]    type
+           [ 8 .. 15]    handle
+           [16 .. 19]    length of the payload
+         */
+        do {
+            ret = read_sync(csock, buf + NBD_REPLY_SIZE,
+                            sizeof(buf) - NBD_REPLY_SIZE);
+        } while (ret == -EAGAIN);
+        if (ret != sizeof(buf) - NBD_REPLY_SIZE) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+
+        reply->structured = true;
+        reply->error  = 0;
+        reply->flags  = be16_to_cpup((uint16_t*)(buf + 4));
+        reply->type   = be16_to_cpup((uint16_t*)(buf + 6));
+        reply->handle = be64_to_cpup((uint64_t*)(buf + 8));
+        reply->length = be32_to_cpup((uint32_t*)(buf + 16));
+
+        TRACE("Got structured reply: "
+              "{ .flags = 0x%x, .type = %d, handle = %" PRIu64
+              ", .length = %u }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
      */
 
-    magic = be32_to_cpup((uint32_t*)buf);
+    reply->structured = false;
     reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
     reply->handle = be64_to_cpup((uint64_t*)(buf + 8));
 
@@ -776,11 +1232,8 @@ ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
+static void nbd_encode_reply(uint8_t *buf, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
-    ssize_t ret;
-
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
@@ -789,19 +1242,6 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     cpu_to_be32w((uint32_t*)buf, NBD_REPLY_MAGIC);
     cpu_to_be32w((uint32_t*)(buf + 4), reply->error);
     cpu_to_be64w((uint64_t*)(buf + 8), reply->handle);
-
-    TRACE("Sending response to client");
-
-    ret = write_sync(csock, buf, sizeof(buf));
-    if (ret < 0) {
-        return ret;
-    }
-
-    if (ret != sizeof(buf)) {
-        LOG("writing to socket failed");
-        return -EINVAL;
-    }
-    return 0;
 }
 
 #define MAX_NBD_REQUESTS 16
@@ -826,10 +1266,15 @@ void nbd_client_put(NBDClient *client)
             QTAILQ_REMOVE(&client->exp->clients, client, next);
             nbd_export_put(client->exp);
         }
+        if (client->iothread) {
+            qemu_mutex_destroy(&client->lock);
+        }
         g_free(client);
     }
 }
 
+static void nbd_iothread_kick(NBDClient *client);
+
 void nbd_client_close(NBDClient *client)
 {
     if (client->closing) {
@@ -843,6 +1288,17 @@ void nbd_client_close(NBDClient *client)
      */
     shutdown(client->sock, 2);
 
+    /* The iothread drops its reference once it has stopped using the
+     * socket.  Kick it before it can see client->detach, so that it does
+     * not find the client in its pending list after detaching.
+     */
+    if (client->iothread) {
+        qemu_mutex_lock(&client->lock);
+        client->detach = true;
+        nbd_iothread_kick(client);
+        qemu_mutex_unlock(&client->lock);
+    }
+
     /* Also tell the client, so that they release their reference.  */
     if (client->close) {
         client->close(client);
@@ -989,70 +1445,321 @@ static int nbd_can_read(void *opaque);
 static void nbd_read(void *opaque);
 static void nbd_restart_write(void *opaque);
 
-static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
-                                 int len)
+static void nbd_request_add_segment(NBDRequest *req, const uint8_t *data,
+                                    size_t offset, size_t len)
 {
-    NBDClient *client = req->client;
-    int csock = client->sock;
-    ssize_t rc, ret;
-
-    qemu_co_mutex_lock(&client->send_lock);
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read,
-                         nbd_restart_write, client);
-    client->send_coroutine = qemu_coroutine_self();
+    NBDReplySegment *seg;
 
-    if (!len) {
-        rc = nbd_send_reply(csock, reply);
-    } else {
-        socket_set_cork(csock, 1);
-        rc = nbd_send_reply(csock, reply);
-        if (rc >= 0) {
-            ret = qemu_co_send(csock, req->data, len);
-            if (ret != len) {
-                rc = -EIO;
-            }
-        }
-        socket_set_cork(csock, 0);
+    if (req->nb_segs == req->max_segs) {
+        req->max_segs = MAX(req->max_segs * 2, 4);
+        req->segs = g_renew(NBDReplySegment, req->segs, req->max_segs);
     }
-
-    client->send_coroutine = NULL;
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
-    qemu_co_mutex_unlock(&client->send_lock);
-    return rc;
+    seg = &req->segs[req->nb_segs++];
+    seg->data = data;
+    seg->offset = offset;
+    seg->len = len;
 }
 
-static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
+/* Appends @iov to the reply of a threaded server.  Data that lives in the
+ * request buffer is sent from there; everything else is copied, because
+ * the caller's buffers go away before the iothread sends the reply.
+ */
+static void nbd_request_queue_output(NBDRequest *req, struct iovec *iov,
+                                     int niov)
+{
+    int i;
+
+    for (i = 0; i < niov; i++) {
+        uint8_t *base = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+
+        if (!len) {
+            continue;
+        }
+        if (base >= req->data && base < req->data + NBD_BUFFER_SIZE) {
+            nbd_request_add_segment(req, base, 0, len);
+            continue;
+        }
+        if (req->hdr_len + len > req->hdr_size) {
+            req->hdr_size = MAX(req->hdr_size * 2, req->hdr_len + len);
+            req->hdr = g_realloc(req->hdr, req->hdr_size);
+        }
+        memcpy(req->hdr + req->hdr_len, base, len);
+        nbd_request_add_segment(req, NULL, req->hdr_len, len);
+        req->hdr_len += len;
+    }
+}
+
+/* Sends @iov to the client as a single message, or queues it for the
+ * iothread of the client.
+ */
+static ssize_t nbd_co_sendv(NBDRequest *req, struct iovec *iov, int niov)
 {
     NBDClient *client = req->client;
     int csock = client->sock;
+    size_t len = iov_size(iov, niov);
     ssize_t rc;
 
-    client->recv_coroutine = qemu_coroutine_self();
-    rc = nbd_receive_request(csock, request);
-    if (rc < 0) {
-        if (rc != -EAGAIN) {
-            rc = -EIO;
+    if (client->iothread) {
+        nbd_request_queue_output(req, iov, niov);
+        return 0;
+    }
+
+    qemu_co_mutex_lock(&client->send_lock);
+    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read,
+                         nbd_restart_write, client);
+    client->send_coroutine = qemu_coroutine_self();
+
+    socket_set_cork(csock, 1);
+    rc = qemu_co_sendv(csock, iov, niov, 0, len);
+    socket_set_cork(csock, 0);
+
+    client->send_coroutine = NULL;
+    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return rc == len ? 0 : -EIO;
+}
+
+static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
+                                 int len)
+{
+    uint8_t buf[NBD_REPLY_SIZE];
+    struct iovec iov[] = {
+        { .iov_base = buf,          .iov_len = sizeof(buf) },
+        { .iov_base = req->data,    .iov_len = len },
+    };
+
+    TRACE("Sending response to client");
+
+    nbd_encode_reply(buf, reply);
+    return nbd_co_sendv(req, iov, ARRAY_SIZE(iov));
+}
+
+/* Sends a structured reply chunk, made of @payload followed by @data */
+static ssize_t nbd_co_send_chunk(NBDRequest *req, uint64_t handle,
+                                 uint16_t flags, uint16_t type,
+                                 void *payload, size_t payload_len,
+                                 void *data, size_t data_len)
+{
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
+    struct iovec iov[] = {
+        { .iov_base = buf,      .iov_len = sizeof(buf) },
+        { .iov_base = payload,  .iov_len = payload_len },
+        { .iov_base = data,     .iov_len = data_len },
+    };
+
+    cpu_to_be32w((uint32_t*)buf, NBD_STRUCTURED_REPLY_MAGIC);
+    cpu_to_be16w((uint16_t*)(buf + 4), flags);
+    cpu_to_be16w((uint16_t*)(buf + 6), type);
+    cpu_to_be64w((uint64_t*)(buf + 8), handle);
+    cpu_to_be32w((uint32_t*)(buf + 16), payload_len + data_len);
+
+    TRACE("Sending chunk to client: "
+          "{ .flags = 0x%x, .type = %d, .length = %zu }",
+          flags, type, payload_len + data_len);
+
+    return nbd_co_sendv(req, iov, ARRAY_SIZE(iov));
+}
+
+/* Sends an error reply, as a chunk if structured replies are in use */
+static ssize_t nbd_co_send_error(NBDRequest *req, struct nbd_reply *reply)
+{
+    uint8_t payload[4 + 2];
+
+    if (!req->client->structured_reply) {
+        return nbd_co_send_reply(req, reply, 0);
+    }
+
+    /* Error chunk: error (4), message length (2), no message */
+    cpu_to_be32w((uint32_t*)payload, reply->error);
+    cpu_to_be16w((uint16_t*)(payload + 4), 0);
+    return nbd_co_send_chunk(req, reply->handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, payload, sizeof(payload),
+                             NULL, 0);
+}
+
+/* Reads the data of a NBD_CMD_READ request and sends it as a series of
+ * data and hole chunks, so that unallocated areas are not transferred.
+ */
+static ssize_t nbd_co_read_structured(NBDRequest *req,
+                                      struct nbd_request *request,
+                                      struct nbd_reply *reply)
+{
+    NBDExport *exp = req->client->exp;
+    int64_t sector_num = (request->from + exp->dev_offset) / 512;
+    uint64_t offset = request->from;
+    int nb_sectors = request->len / 512;
+    uint8_t *buf = req->data;
+    uint8_t payload[8 + 4];
+    ssize_t rc;
+    int ret, n;
+
+    if (!nb_sectors) {
+        return nbd_co_send_chunk(req, reply->handle, NBD_REPLY_FLAG_DONE,
+                                 NBD_REPLY_TYPE_NONE, NULL, 0, NULL, 0);
+    }
+
+    while (nb_sectors > 0) {
+        uint16_t flags;
+
+        ret = bdrv_co_is_allocated_above(exp->bs, NULL, sector_num,
+                                         nb_sectors, &n);
+        if (ret < 0 || n == 0) {
+            /* Just read the data if the allocation status is unknown */
+            ret = 1;
+            n = nb_sectors;
         }
-        goto out;
+        flags = (n == nb_sectors) ? NBD_REPLY_FLAG_DONE : 0;
+        cpu_to_be64w((uint64_t*)payload, offset);
+
+        if (!ret) {
+            TRACE("Sending hole of %d sector(s)", n);
+            cpu_to_be32w((uint32_t*)(payload + 8), n * 512);
+            rc = nbd_co_send_chunk(req, reply->handle, flags,
+                                   NBD_REPLY_TYPE_OFFSET_HOLE,
+                                   payload, 8 + 4, NULL, 0);
+        } else {
+            ret = bdrv_read(exp->bs, sector_num, buf, n);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                reply->error = -ret;
+                return nbd_co_send_error(req, reply);
+            }
+            rc = nbd_co_send_chunk(req, reply->handle, flags,
+                                   NBD_REPLY_TYPE_OFFSET_DATA,
+                                   payload, 8, buf, n * 512);
+        }
+        if (rc < 0) {
+            return rc;
+        }
+
+        sector_num += n;
+        offset += n * 512;
+        buf += n * 512;
+        nb_sectors -= n;
+    }
+    return 0;
+}
+
+/* Replies to NBD_CMD_BLOCK_STATUS with the extents of the base:allocation
+ * context.  Areas that are not allocated anywhere in the backing chain
+ * read as zeroes.
+ */
+static ssize_t nbd_co_send_block_status(NBDRequest *req,
+                                        struct nbd_request *request,
+                                        struct nbd_reply *reply)
+{
+    NBDExport *exp = req->client->exp;
+    int64_t sector_num = (request->from + exp->dev_offset) / 512;
+    int nb_sectors = request->len / 512;
+    int max_extents = (request->type & NBD_CMD_FLAG_REQ_ONE) ? 1
+                                                             : NBD_MAX_EXTENTS;
+    uint32_t *extents;
+    uint32_t last_flags = 0;
+    int nb_extents = 0;
+    ssize_t rc;
+    int ret, n;
+
+    /* Context id followed by (length, flags) pairs */
+    extents = g_new(uint32_t, 1 + max_extents * 2);
+    cpu_to_be32w(extents, NBD_META_ID_BASE_ALLOCATION);
+
+    while (nb_sectors > 0) {
+        uint32_t flags;
+
+        ret = bdrv_co_is_allocated_above(exp->bs, NULL, sector_num,
+                                         nb_sectors, &n);
+        if (ret < 0) {
+            g_free(extents);
+            reply->error = -ret;
+            return nbd_co_send_error(req, reply);
+        }
+        if (n == 0) {
+            break;
+        }
+        flags = ret ? 0 : (NBD_STATE_HOLE | NBD_STATE_ZERO);
+
+        if (nb_extents && flags == last_flags) {
+            uint32_t *len = &extents[1 + (nb_extents - 1) * 2];
+            cpu_to_be32w(len, be32_to_cpup(len) + n * 512);
+        } else if (nb_extents < max_extents) {
+            cpu_to_be32w(&extents[1 + nb_extents * 2], n * 512);
+            cpu_to_be32w(&extents[2 + nb_extents * 2], flags);
+            nb_extents++;
+            last_flags = flags;
+        } else {
+            break;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+    }
+
+    if (!nb_extents) {
+        g_free(extents);
+        reply->error = EINVAL;
+        return nbd_co_send_error(req, reply);
     }
 
-    if (request->len > NBD_BUFFER_SIZE) {
+    rc = nbd_co_send_chunk(req, reply->handle, NBD_REPLY_FLAG_DONE,
+                           NBD_REPLY_TYPE_BLOCK_STATUS, extents,
+                           (1 + nb_extents * 2) * sizeof(uint32_t), NULL, 0);
+    g_free(extents);
+    return rc;
+}
+
+static ssize_t nbd_check_request(struct nbd_request *request)
+{
+    uint32_t command = request->type & NBD_CMD_MASK_COMMAND;
+
+    if ((command == NBD_CMD_READ || command == NBD_CMD_WRITE) &&
+        request->len > NBD_BUFFER_SIZE) {
         LOG("len (%u) is larger than max len (%u)",
             request->len, NBD_BUFFER_SIZE);
-        rc = -EINVAL;
-        goto out;
+        return -EINVAL;
     }
 
     if ((request->from + request->len) < request->from) {
         LOG("integer overflow detected! "
             "you're probably being attacked");
-        rc = -EINVAL;
+        return -EINVAL;
+    }
+
+    /* These are passed to the block layer in sectors */
+    if ((command == NBD_CMD_WRITE_ZEROES || command == NBD_CMD_BLOCK_STATUS) &&
+        ((request->from | request->len) & 511)) {
+        LOG("unaligned request (from %" PRIu64 ", len %u)",
+            request->from, request->len);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
+{
+    NBDClient *client = req->client;
+    int csock = client->sock;
+    uint32_t command;
+    ssize_t rc;
+
+    client->recv_coroutine = qemu_coroutine_self();
+    rc = nbd_receive_request(csock, request);
+    if (rc < 0) {
+        if (rc != -EAGAIN) {
+            rc = -EIO;
+        }
+        goto out;
+    }
+
+    rc = nbd_check_request(request);
+    if (rc < 0) {
         goto out;
     }
 
     TRACE("Decoding type");
 
-    if ((request->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE) {
+    command = request->type & NBD_CMD_MASK_COMMAND;
+    if (command == NBD_CMD_WRITE) {
         TRACE("Reading %u byte(s)", request->len);
 
         if (qemu_co_recv(csock, req->data, request->len) != request->len) {
@@ -1068,30 +1775,17 @@ out:
     return rc;
 }
 
-static void nbd_trip(void *opaque)
+/* Processes a request that was received with result @ret and sends the
+ * reply.  Returns a negative value if the connection must be closed.
+ */
+static int nbd_co_process_request(NBDRequest *req,
+                                  struct nbd_request *request, ssize_t ret)
 {
-    NBDClient *client = opaque;
+    NBDClient *client = req->client;
     NBDExport *exp = client->exp;
-    NBDRequest *req;
-    struct nbd_request request;
     struct nbd_reply reply;
-    ssize_t ret;
-
-    TRACE("Reading request.");
-    if (client->closing) {
-        return;
-    }
-
-    req = nbd_request_get(client);
-    ret = nbd_co_receive_request(req, &request);
-    if (ret == -EAGAIN) {
-        goto done;
-    }
-    if (ret == -EIO) {
-        goto out;
-    }
 
-    reply.handle = request.handle;
+    reply.handle = request->handle;
     reply.error = 0;
 
     if (ret < 0) {
@@ -1099,20 +1793,20 @@ static void nbd_trip(void *opaque)
         goto error_reply;
     }
 
-    if ((request.from + request.len) > exp->size) {
+    if ((request->from + request->len) > exp->size) {
             LOG("From: %" PRIu64 ", Len: %u, Size: %" PRIu64
             ", Offset: %" PRIu64 "\n",
-                    request.from, request.len,
+                    request->from, request->len,
                     (uint64_t)exp->size, (uint64_t)exp->dev_offset);
         LOG("requested operation past EOF--bad client?");
         goto invalid_request;
     }
 
-    switch (request.type & NBD_CMD_MASK_COMMAND) {
+    switch (request->type & NBD_CMD_MASK_COMMAND) {
     case NBD_CMD_READ:
         TRACE("Request type is READ");
 
-        if (request.type & NBD_CMD_FLAG_FUA) {
+        if (request->type & NBD_CMD_FLAG_FUA) {
             ret = bdrv_co_flush(exp->bs);
             if (ret < 0) {
                 LOG("flush failed");
@@ -1121,16 +1815,23 @@ static void nbd_trip(void *opaque)
             }
         }
 
-        ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
-                        req->data, request.len / 512);
+        if (client->structured_reply) {
+            if (nbd_co_read_structured(req, request, &reply) < 0) {
+                goto out;
+            }
+            break;
+        }
+
+        ret = bdrv_read(exp->bs, (request->from + exp->dev_offset) / 512,
+                        req->data, request->len / 512);
         if (ret < 0) {
             LOG("reading from file failed");
             reply.error = -ret;
             goto error_reply;
         }
 
-        TRACE("Read %u byte(s)", request.len);
-        if (nbd_co_send_reply(req, &reply, request.len) < 0)
+        TRACE("Read %u byte(s)", request->len);
+        if (nbd_co_send_reply(req, &reply, request->len) < 0)
             goto out;
         break;
     case NBD_CMD_WRITE:
@@ -1144,15 +1845,15 @@ static void nbd_trip(void *opaque)
 
         TRACE("Writing to device");
 
-        ret = bdrv_write(exp->bs, (request.from + exp->dev_offset) / 512,
-                         req->data, request.len / 512);
+        ret = bdrv_write(exp->bs, (request->from + exp->dev_offset) / 512,
+                         req->data, request->len / 512);
         if (ret < 0) {
             LOG("writing to file failed");
             reply.error = -ret;
             goto error_reply;
         }
 
-        if (request.type & NBD_CMD_FLAG_FUA) {
+        if (request->type & NBD_CMD_FLAG_FUA) {
             ret = bdrv_co_flush(exp->bs);
             if (ret < 0) {
                 LOG("flush failed");
@@ -1181,10 +1882,52 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_WRITE_ZEROES:
+        TRACE("Request type is WRITE_ZEROES");
+
+        if (exp->nbdflags & NBD_FLAG_READ_ONLY) {
+            TRACE("Server is read-only, return error");
+            reply.error = EROFS;
+            goto error_reply;
+        }
+
+        ret = bdrv_co_write_zeroes(exp->bs,
+                                   (request->from + exp->dev_offset) / 512,
+                                   request->len / 512);
+        if (ret < 0) {
+            LOG("writing zeroes to file failed");
+            reply.error = -ret;
+            goto error_reply;
+        }
+
+        if (request->type & NBD_CMD_FLAG_FUA) {
+            ret = bdrv_co_flush(exp->bs);
+            if (ret < 0) {
+                LOG("flush failed");
+                reply.error = -ret;
+                goto error_reply;
+            }
+        }
+
+        if (nbd_co_send_reply(req, &reply, 0) < 0) {
+            goto out;
+        }
+        break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+
+        if (!client->export_meta) {
+            LOG("block status without metadata context");
+            goto invalid_request;
+        }
+        if (nbd_co_send_block_status(req, request, &reply) < 0) {
+            goto out;
+        }
+        break;
     case NBD_CMD_TRIM:
         TRACE("Request type is TRIM");
-        ret = bdrv_co_discard(exp->bs, (request.from + exp->dev_offset) / 512,
-                              request.len / 512);
+        ret = bdrv_co_discard(exp->bs, (request->from + exp->dev_offset) / 512,
+                              request->len / 512);
         if (ret < 0) {
             LOG("discard failed");
             reply.error = -ret;
@@ -1194,17 +1937,43 @@ static void nbd_trip(void *opaque)
         }
         break;
     default:
-        LOG("invalid request type (%u) received", request.type);
+        LOG("invalid request type (%u) received", request->type);
     invalid_request:
-        reply.error = -EINVAL;
+        reply.error = EINVAL;
     error_reply:
-        if (nbd_co_send_reply(req, &reply, 0) < 0) {
+        if (nbd_co_send_error(req, &reply) < 0) {
             goto out;
         }
         break;
     }
 
     TRACE("Request/Reply complete");
+    return 0;
+
+out:
+    return -1;
+}
+
+static void nbd_trip(void *opaque)
+{
+    NBDClient *client = opaque;
+    NBDRequest *req;
+    struct nbd_request request;
+    ssize_t ret;
+
+    TRACE("Reading request.");
+    if (client->closing) {
+        return;
+    }
+
+    req = nbd_request_get(client);
+    ret = nbd_co_receive_request(req, &request);
+    if (ret == -EAGAIN) {
+        goto done;
+    }
+    if (ret == -EIO || nbd_co_process_request(req, &request, ret) < 0) {
+        goto out;
+    }
 
 done:
     nbd_request_put(req);
@@ -1240,7 +2009,397 @@ static void nbd_restart_write(void *opaque)
     qemu_coroutine_enter(client->send_coroutine, NULL);
 }
 
-NBDClient *nbd_client_new(NBDExport *exp, int csock,
+/* Threaded servers
+ *
+ * The socket of a client that is attached to an NBDIOThread is serviced by
+ * that thread, which receives requests (including the payload of writes)
+ * and sends replies without ever blocking, so that one client cannot hold
+ * up the others.  The block layer can only be used from the main thread,
+ * so complete requests are passed to it through nbd_main_queue and then
+ * processed by nbd_co_process_request.  Instead of being written to the
+ * socket, the reply is built in the NBDRequest by nbd_co_sendv and passed
+ * back to the iothread through client->replies.
+ *
+ * The iothread holds a reference to the client until it has detached from
+ * it, which it does when nbd_client_close sets client->detach.  Requests
+ * that complete after that point are freed by the main thread.
+ */
+
+static NBDRequest *nbd_thread_request_new(NBDClient *client, int msg)
+{
+    NBDRequest *req = g_malloc0(sizeof(NBDRequest));
+
+    req->client = client;
+    req->msg = msg;
+    return req;
+}
+
+static void nbd_thread_request_free(NBDRequest *req)
+{
+    qemu_vfree(req->data);
+    g_free(req->hdr);
+    g_free(req->segs);
+    g_free(req->iov);
+    g_free(req);
+}
+
+static void nbd_main_post(NBDRequest *req)
+{
+    qemu_mutex_lock(&nbd_main_lock);
+    QSIMPLEQ_INSERT_TAIL(&nbd_main_queue, req, entry);
+    qemu_mutex_unlock(&nbd_main_lock);
+    event_notifier_set(&nbd_main_notifier);
+}
+
+/* Asks the iothread to look at client->replies and client->detach */
+static void nbd_iothread_kick(NBDClient *client)
+{
+    NBDIOThread *t = client->iothread;
+    bool notify = false;
+
+    qemu_mutex_lock(&t->lock);
+    if (!client->kicked) {
+        client->kicked = true;
+        QTAILQ_INSERT_TAIL(&t->pending, client, pending_next);
+        notify = true;
+    }
+    qemu_mutex_unlock(&t->lock);
+
+    if (notify) {
+        event_notifier_set(&t->notifier);
+    }
+}
+
+/* Passes the reply of @req to the iothread, or drops it if the iothread
+ * has already let go of the client.  Called in the main thread.
+ */
+static void nbd_thread_request_done(NBDRequest *req)
+{
+    NBDClient *client = req->client;
+    bool detach;
+    int i;
+
+    req->iov = g_renew(struct iovec, req->iov, req->nb_segs);
+    req->niov = req->nb_segs;
+    req->out_len = 0;
+    req->out_done = 0;
+    for (i = 0; i < req->nb_segs; i++) {
+        NBDReplySegment *seg = &req->segs[i];
+
+        req->iov[i].iov_base = (void *)(seg->data ? seg->data
+                                                  : req->hdr + seg->offset);
+        req->iov[i].iov_len = seg->len;
+        req->out_len += seg->len;
+    }
+
+    qemu_mutex_lock(&client->lock);
+    detach = client->detach;
+    if (!detach) {
+        QSIMPLEQ_INSERT_TAIL(&client->replies, req, entry);
+    }
+    qemu_mutex_unlock(&client->lock);
+
+    if (detach) {
+        nbd_thread_request_free(req);
+    } else {
+        nbd_iothread_kick(client);
+    }
+}
+
+static void nbd_thread_trip(void *opaque)
+{
+    NBDRequest *req = opaque;
+    NBDClient *client = req->client;
+
+    if (nbd_co_process_request(req, &req->request, req->recv_ret) < 0) {
+        nbd_client_close(client);
+    }
+    nbd_thread_request_done(req);
+    nbd_client_put(client);
+}
+
+static void nbd_main_notify(EventNotifier *e)
+{
+    QSIMPLEQ_HEAD(, NBDRequest) queue = QSIMPLEQ_HEAD_INITIALIZER(queue);
+    NBDRequest *req;
+
+    event_notifier_test_and_clear(e);
+
+    qemu_mutex_lock(&nbd_main_lock);
+    QSIMPLEQ_CONCAT(&queue, &nbd_main_queue);
+    qemu_mutex_unlock(&nbd_main_lock);
+
+    while ((req = QSIMPLEQ_FIRST(&queue)) != NULL) {
+        NBDClient *client = req->client;
+
+        QSIMPLEQ_REMOVE_HEAD(&queue, entry);
+        switch (req->msg) {
+        case NBD_MSG_REQUEST:
+            if (client->closing) {
+                nbd_thread_request_free(req);
+                break;
+            }
+            nbd_client_get(client);
+            qemu_coroutine_enter(qemu_coroutine_create(nbd_thread_trip), req);
+            break;
+        case NBD_MSG_EOF:
+            nbd_thread_request_free(req);
+            nbd_client_close(client);
+            break;
+        case NBD_MSG_DETACHED:
+            nbd_thread_request_free(req);
+            nbd_client_put(client);
+            break;
+        default:
+            abort();
+        }
+    }
+}
+
+static void nbd_iothread_read(void *opaque);
+static void nbd_iothread_write(void *opaque);
+
+static void nbd_iothread_update(NBDClient *client)
+{
+    bool can_read = !client->eof &&
+        (client->recv_req || client->in_flight < MAX_NBD_REQUESTS);
+    bool can_write = !client->eof && !QSIMPLEQ_EMPTY(&client->send_queue);
+
+    aio_set_fd_handler(client->iothread->ctx, client->sock,
+                       can_read ? nbd_iothread_read : NULL,
+                       can_write ? nbd_iothread_write : NULL,
+                       NULL, client);
+}
+
+static void nbd_iothread_eof(NBDClient *client)
+{
+    if (!client->eof) {
+        client->eof = true;
+        nbd_main_post(nbd_thread_request_new(client, NBD_MSG_EOF));
+    }
+}
+
+/* Returns whether @req has been received completely, decoding the header
+ * when it is there.  Invalid requests are passed to the main thread without
+ * their payload, like nbd_co_receive_request does.
+ */
+static bool nbd_iothread_request_received(NBDRequest *req)
+{
+    if (req->recv_done < NBD_REQUEST_SIZE) {
+        return false;
+    }
+    if (req->recv_done == NBD_REQUEST_SIZE) {
+        req->recv_ret = nbd_decode_request(req->recv_buf, &req->request);
+        if (req->recv_ret == 0) {
+            req->recv_ret = nbd_check_request(&req->request);
+        }
+    }
+    if (req->recv_ret < 0 ||
+        (req->request.type & NBD_CMD_MASK_COMMAND) != NBD_CMD_WRITE) {
+        return true;
+    }
+    return req->recv_done == NBD_REQUEST_SIZE + req->request.len;
+}
+
+static void nbd_iothread_read(void *opaque)
+{
+    NBDClient *client = opaque;
+    NBDRequest *req;
+    uint8_t *buf;
+    size_t size;
+    ssize_t ret;
+
+    while (!client->eof) {
+        req = client->recv_req;
+        if (!req) {
+            if (client->in_flight >= MAX_NBD_REQUESTS) {
+                break;
+            }
+            req = QSIMPLEQ_FIRST(&client->free_reqs);
+            if (req) {
+                QSIMPLEQ_REMOVE_HEAD(&client->free_reqs, entry);
+            } else {
+                req = nbd_thread_request_new(client, NBD_MSG_REQUEST);
+                req->data = qemu_blockalign(client->exp->bs, NBD_BUFFER_SIZE);
+            }
+            req->recv_done = 0;
+            client->recv_req = req;
+        }
+
+        if (req->recv_done < NBD_REQUEST_SIZE) {
+            buf = req->recv_buf + req->recv_done;
+            size = NBD_REQUEST_SIZE - req->recv_done;
+        } else {
+            buf = req->data + (req->recv_done - NBD_REQUEST_SIZE);
+            size = req->request.len - (req->recv_done - NBD_REQUEST_SIZE);
+        }
+
+        ret = qemu_recv(client->sock, buf, size, 0);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (ret <= 0) {
+            nbd_iothread_eof(client);
+            break;
+        }
+
+        req->recv_done += ret;
+        if (nbd_iothread_request_received(req)) {
+            client->recv_req = NULL;
+            client->in_flight++;
+            nbd_main_post(req);
+        }
+    }
+
+    nbd_iothread_update(client);
+}
+
+static void nbd_iothread_write(void *opaque)
+{
+    NBDClient *client = opaque;
+    NBDRequest *req;
+    ssize_t ret;
+
+    while (!client->eof &&
+           (req = QSIMPLEQ_FIRST(&client->send_queue)) != NULL) {
+        if (req->out_done < req->out_len) {
+            ret = iov_send(client->sock, req->iov, req->niov, req->out_done,
+                           req->out_len - req->out_done);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (ret < 0) {
+                nbd_iothread_eof(client);
+                break;
+            }
+            req->out_done += ret;
+            if (req->out_done < req->out_len) {
+                break;
+            }
+        }
+
+        QSIMPLEQ_REMOVE_HEAD(&client->send_queue, entry);
+        req->nb_segs = 0;
+        req->hdr_len = 0;
+        QSIMPLEQ_INSERT_HEAD(&client->free_reqs, req, entry);
+        client->in_flight--;
+    }
+
+    nbd_iothread_update(client);
+}
+
+static void nbd_iothread_detach(NBDClient *client)
+{
+    NBDIOThread *t = client->iothread;
+    NBDRequest *req;
+
+    qemu_mutex_lock(&t->lock);
+    if (client->kicked) {
+        QTAILQ_REMOVE(&t->pending, client, pending_next);
+        client->kicked = false;
+    }
+    qemu_mutex_unlock(&t->lock);
+
+    aio_set_fd_handler(client->iothread->ctx, client->sock,
+                       NULL, NULL, NULL, NULL);
+
+    QSIMPLEQ_CONCAT(&client->send_queue, &client->free_reqs);
+    while ((req = QSIMPLEQ_FIRST(&client->send_queue)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&client->send_queue, entry);
+        nbd_thread_request_free(req);
+    }
+    if (client->recv_req) {
+        nbd_thread_request_free(client->recv_req);
+        client->recv_req = NULL;
+    }
+
+    nbd_main_post(nbd_thread_request_new(client, NBD_MSG_DETACHED));
+}
+
+static void nbd_iothread_notify(EventNotifier *e)
+{
+    NBDIOThread *t = container_of(e, NBDIOThread, notifier);
+    NBDClient *client;
+    bool detach;
+
+    event_notifier_test_and_clear(e);
+
+    qemu_mutex_lock(&t->lock);
+    while ((client = QTAILQ_FIRST(&t->pending)) != NULL) {
+        QTAILQ_REMOVE(&t->pending, client, pending_next);
+        client->kicked = false;
+        qemu_mutex_unlock(&t->lock);
+
+        qemu_mutex_lock(&client->lock);
+        QSIMPLEQ_CONCAT(&client->send_queue, &client->replies);
+        detach = client->detach;
+        qemu_mutex_unlock(&client->lock);
+
+        /* After detaching, the client may be freed at any time */
+        if (detach) {
+            nbd_iothread_detach(client);
+        } else {
+            nbd_iothread_write(client);
+        }
+
+        qemu_mutex_lock(&t->lock);
+    }
+    qemu_mutex_unlock(&t->lock);
+}
+
+static int nbd_iothread_flush(EventNotifier *e)
+{
+    return true;
+}
+
+static void *nbd_iothread_run(void *opaque)
+{
+    NBDIOThread *t = opaque;
+
+    for (;;) {
+        aio_poll(t->ctx, true);
+    }
+    return NULL;
+}
+
+NBDIOThread *nbd_iothread_new(void)
+{
+    static bool main_notifier_initialized;
+    NBDIOThread *t;
+
+    if (!main_notifier_initialized) {
+        if (event_notifier_init(&nbd_main_notifier, 0) < 0) {
+            return NULL;
+        }
+        qemu_mutex_init(&nbd_main_lock);
+        event_notifier_set_handler(&nbd_main_notifier, nbd_main_notify);
+        main_notifier_initialized = true;
+    }
+
+    t = g_malloc0(sizeof(NBDIOThread));
+    if (event_notifier_init(&t->notifier, 0) < 0) {
+        g_free(t);
+        return NULL;
+    }
+    qemu_mutex_init(&t->lock);
+    QTAILQ_INIT(&t->pending);
+    t->ctx = aio_context_new();
+    aio_set_event_notifier(t->ctx, &t->notifier, nbd_iothread_notify,
+                           nbd_iothread_flush);
+    qemu_thread_create(&t->thread, nbd_iothread_run, t, QEMU_THREAD_DETACHED);
+    return t;
+}
+
+/* Starts serving @csock.  If @iothread is not NULL, the socket I/O of the
+ * client is done in that thread; see "Threaded servers" above.
+ */
+NBDClient *nbd_client_new(NBDExport *exp, int csock, NBDIOThread *iothread,
                           void (*close)(NBDClient *))
 {
     NBDClient *client;
@@ -1254,11 +2413,24 @@ NBDClient *nbd_client_new(NBDExport *exp, int csock,
     }
     client->close = close;
     qemu_co_mutex_init(&client->send_lock);
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
 
     if (exp) {
         QTAILQ_INSERT_TAIL(&exp->clients, client, next);
         nbd_export_get(exp);
     }
+
+    if (iothread) {
+        client->iothread = iothread;
+        qemu_mutex_init(&client->lock);
+        QSIMPLEQ_INIT(&client->replies);
+        QSIMPLEQ_INIT(&client->send_queue);
+        QSIMPLEQ_INIT(&client->free_reqs);
+
+        /* Reference for the iothread, see nbd_iothread_detach */
+        nbd_client_get(client);
+        nbd_iothread_kick(client);
+    } else {
+        qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
+    }
     return client;
 }
@@ -30,6 +30,7 @@
 #include "qemu/error-report.h"
 #include "qemu/option.h"
 #include "qemu/sockets.h"
+#include "qemu/main-loop.h"
 #include "qemu/iov.h"
 
 typedef struct NetSocketState {
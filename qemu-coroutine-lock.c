@@ -27,6 +27,7 @@
 #include "block/coroutine_int.h"
 #include "qemu/queue.h"
 #include "block/aio.h"
+#include "qemu/main-loop.h"
 #include "trace.h"
 
 /* Coroutines are awoken from a BH to allow the current coroutine to complete
@@ -14,26 +14,169 @@
 
 #include "trace.h"
 #include "qemu-common.h"
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 #include "block/coroutine.h"
 #include "block/coroutine_int.h"
 
 enum {
-    /* Maximum free pool size prevents holding too many freed coroutines */
-    POOL_MAX_SIZE = 64,
+    /* Number of coroutines moved between a thread's pool and the shared
+     * pool at once, unless raised with qemu_coroutine_adjust_pool_size()
+     */
+    POOL_DEFAULT_BATCH_SIZE = 64,
 };
 
-/** Free list to speed up creation */
-static QSLIST_HEAD(, Coroutine) pool = QSLIST_HEAD_INITIALIZER(pool);
-static unsigned int pool_size;
+/*
+ * Freed coroutines are kept for reuse in a per-thread pool, so that
+ * creating and terminating coroutines does not need any locking.  When a
+ * thread's pool grows beyond two batches, one batch is moved to the shared
+ * pool, from which threads with an empty pool refill themselves; a thread
+ * that frees coroutines created by another thread thus passes them back
+ * in bulk rather than one by one.  The shared pool holds at most two
+ * batches as well; coroutines beyond that are really freed.
+ */
+typedef QSLIST_HEAD(, Coroutine) CoroutinePool;
+
+typedef struct {
+    CoroutinePool pool;
+    unsigned int size;
+} CoroutineThreadPool;
+
+static GStaticMutex release_pool_lock = G_STATIC_MUTEX_INIT;
+static CoroutinePool release_pool = QSLIST_HEAD_INITIALIZER(release_pool);
+static unsigned int release_pool_size;
+static unsigned int pool_batch_size = POOL_DEFAULT_BATCH_SIZE;
+
+#ifdef _WIN32
+/* coroutine-win32.c needs __thread anyway */
+static __thread CoroutineThreadPool alloc_pool;
+#else
+static pthread_key_t alloc_pool_key;
+static pthread_once_t alloc_pool_once = PTHREAD_ONCE_INIT;
+#endif
+
+/* Moves up to @n coroutines from the head of @from to @to */
+static unsigned int coroutine_pool_move(CoroutinePool *to, CoroutinePool *from,
+                                        unsigned int n)
+{
+    Coroutine *co;
+    unsigned int i;
+
+    for (i = 0; i < n && (co = QSLIST_FIRST(from)) != NULL; i++) {
+        QSLIST_REMOVE_HEAD(from, pool_next);
+        QSLIST_INSERT_HEAD(to, co, pool_next);
+    }
+    return i;
+}
+
+static void coroutine_pool_free(CoroutinePool *pool)
+{
+    Coroutine *co;
+
+    while ((co = QSLIST_FIRST(pool)) != NULL) {
+        QSLIST_REMOVE_HEAD(pool, pool_next);
+        qemu_coroutine_delete(co);
+    }
+}
+
+#ifndef _WIN32
+/* Hands the pool of an exiting thread over to the shared pool */
+static void coroutine_pool_thread_cleanup(void *opaque)
+{
+    CoroutineThreadPool *p = opaque;
+
+    g_static_mutex_lock(&release_pool_lock);
+    if (release_pool_size < 2 * pool_batch_size) {
+        release_pool_size += coroutine_pool_move(&release_pool, &p->pool,
+                                                 2 * pool_batch_size -
+                                                 release_pool_size);
+    }
+    g_static_mutex_unlock(&release_pool_lock);
+
+    coroutine_pool_free(&p->pool);
+    g_free(p);
+}
+
+static void coroutine_pool_init(void)
+{
+    if (pthread_key_create(&alloc_pool_key, coroutine_pool_thread_cleanup)) {
+        abort();
+    }
+}
+#endif
+
+/* Returns the pool of the current thread, creating it if needed */
+static CoroutineThreadPool *coroutine_thread_pool(void)
+{
+#ifdef _WIN32
+    return &alloc_pool;
+#else
+    CoroutineThreadPool *p;
+
+    pthread_once(&alloc_pool_once, coroutine_pool_init);
+    p = pthread_getspecific(alloc_pool_key);
+    if (!p) {
+        p = g_malloc0(sizeof(*p));
+        QSLIST_INIT(&p->pool);
+        pthread_setspecific(alloc_pool_key, p);
+    }
+    return p;
+#endif
+}
+
+/* Refills the pool of the current thread from the shared pool */
+static void coroutine_pool_refill(CoroutineThreadPool *p)
+{
+    unsigned int n;
+
+    g_static_mutex_lock(&release_pool_lock);
+    n = coroutine_pool_move(&p->pool, &release_pool, pool_batch_size);
+    release_pool_size -= n;
+    g_static_mutex_unlock(&release_pool_lock);
+
+    p->size += n;
+}
+
+/* Moves one batch from the pool of the current thread to the shared pool */
+static void coroutine_pool_release(CoroutineThreadPool *p)
+{
+    CoroutinePool batch = QSLIST_HEAD_INITIALIZER(batch);
+    unsigned int n;
+
+    n = coroutine_pool_move(&batch, &p->pool, pool_batch_size);
+    p->size -= n;
+
+    g_static_mutex_lock(&release_pool_lock);
+    if (release_pool_size < 2 * pool_batch_size) {
+        release_pool_size += coroutine_pool_move(&release_pool, &batch, n);
+    }
+    g_static_mutex_unlock(&release_pool_lock);
+
+    coroutine_pool_free(&batch);
+}
+
+void qemu_coroutine_adjust_pool_size(int n)
+{
+    g_static_mutex_lock(&release_pool_lock);
+    pool_batch_size = MAX((int)pool_batch_size + n, POOL_DEFAULT_BATCH_SIZE);
+    g_static_mutex_unlock(&release_pool_lock);
+}
 
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
 {
+    CoroutineThreadPool *p = coroutine_thread_pool();
     Coroutine *co;
 
-    co = QSLIST_FIRST(&pool);
+    /* release_pool_size is read without the lock, it is only a hint */
+    if (QSLIST_EMPTY(&p->pool) && release_pool_size) {
+        coroutine_pool_refill(p);
+    }
+
+    co = QSLIST_FIRST(&p->pool);
     if (co) {
-        QSLIST_REMOVE_HEAD(&pool, pool_next);
-        pool_size--;
+        QSLIST_REMOVE_HEAD(&p->pool, pool_next);
+        p->size--;
     } else {
         co = qemu_coroutine_new();
     }
@@ -44,25 +187,25 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
 
 static void coroutine_delete(Coroutine *co)
 {
-    if (pool_size < POOL_MAX_SIZE) {
-        QSLIST_INSERT_HEAD(&pool, co, pool_next);
-        co->caller = NULL;
-        pool_size++;
-        return;
-    }
+    CoroutineThreadPool *p = coroutine_thread_pool();
 
-    qemu_coroutine_delete(co);
+    co->caller = NULL;
+    QSLIST_INSERT_HEAD(&p->pool, co, pool_next);
+    p->size++;
+
+    if (p->size > 2 * pool_batch_size) {
+        coroutine_pool_release(p);
+    }
 }
 
 static void __attribute__((destructor)) coroutine_cleanup(void)
 {
-    Coroutine *co;
-    Coroutine *tmp;
+    CoroutineThreadPool *p = coroutine_thread_pool();
 
-    QSLIST_FOREACH_SAFE(co, &pool, pool_next, tmp) {
-        QSLIST_REMOVE_HEAD(&pool, pool_next);
-        qemu_coroutine_delete(co);
-    }
+    coroutine_pool_free(&p->pool);
+    p->size = 0;
+    coroutine_pool_free(&release_pool);
+    release_pool_size = 0;
 }
 
 static void coroutine_swap(Coroutine *from, Coroutine *to)
@@ -102,6 +102,11 @@ static void help(void)
            "       for qemu-img to create a sparse image during conversion\n"
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "\n"
+           "Parameters to convert subcommand:\n"
+           "  '-m' specifies how many coroutines work in parallel during the convert\n"
+           "       process (defaults to 8)\n"
+           "  '-W' allows to write to the target out of order rather than sequential\n"
+           "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
            "       '-r leaks' repairs only cluster leaks, whereas '-r all' fixes all\n"
@@ -1108,24 +1113,472 @@ out3:
     return ret;
 }
 
+enum ImgConvertBlockStatus {
+    BLK_DATA,
+    BLK_ZERO,
+    BLK_BACKING_FILE,
+};
+
+#define MAX_COROUTINES 16
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    int64_t allocated_sectors;
+    int64_t allocated_done;
+    int64_t sector_num;
+    int64_t wr_offs;
+    enum ImgConvertBlockStatus status;
+    int64_t sector_next_status;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool compressed;
+    bool target_has_backing;
+    bool wr_in_order;
+    int min_sparse;
+    int cluster_sectors;
+    int buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
+
+    /* statistics */
+    int64_t bytes_read;
+    int64_t bytes_written;
+    int64_t bytes_zeroed;
+} ImgConvertState;
+
+/* Returns the source image that contains @sector_num and its offset */
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
+{
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
+    }
+}
+
+static int coroutine_fn convert_get_block_status(BlockDriverState *bs,
+                                                 int64_t sector_num,
+                                                 int nb_sectors, int *pnum)
+{
+    if (!qemu_in_coroutine()) {
+        return bdrv_get_block_status(bs, sector_num, nb_sectors, pnum);
+    }
+    return bdrv_co_get_block_status(bs, sector_num, nb_sectors, pnum);
+}
+
+static int coroutine_fn convert_is_allocated_above(BlockDriverState *bs,
+                                                   int64_t sector_num,
+                                                   int nb_sectors, int *pnum)
+{
+    if (!qemu_in_coroutine()) {
+        return bdrv_is_allocated_above(bs, NULL, sector_num, nb_sectors,
+                                       pnum);
+    }
+    return bdrv_co_is_allocated_above(bs, NULL, sector_num, nb_sectors, pnum);
+}
+
+/*
+ * Returns the number of sectors starting at @sector_num that can be
+ * handled in one request, and sets s->status to their allocation status.
+ */
+static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
+{
+    int64_t src_cur_offset;
+    int src_cur, ret, n;
+
+    convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+
+    assert(s->total_sectors > sector_num);
+    n = MIN(s->total_sectors - sector_num, INT_MAX >> BDRV_SECTOR_BITS);
+    n = MIN(n, s->src_sectors[src_cur] - (sector_num - src_cur_offset));
+
+    if (s->sector_next_status <= sector_num) {
+        BlockDriverState *bs = s->src[src_cur];
+
+        ret = convert_get_block_status(bs, sector_num - src_cur_offset,
+                                       n, &n);
+        if (ret < 0) {
+            return ret;
+        }
+
+        if (ret & BDRV_BLOCK_ZERO) {
+            s->status = BLK_ZERO;
+        } else if (ret & BDRV_BLOCK_DATA) {
+            s->status = BLK_DATA;
+        } else if (!s->target_has_backing) {
+            /* Without a backing file for the target, the contents of the
+             * backing files must be copied as well.  Areas that are not
+             * allocated anywhere in the chain read as zeroes.
+             */
+            ret = convert_is_allocated_above(bs, sector_num - src_cur_offset,
+                                             n, &n);
+            if (ret < 0) {
+                return ret;
+            }
+            s->status = ret ? BLK_DATA : BLK_ZERO;
+        } else {
+            s->status = BLK_BACKING_FILE;
+        }
+
+        s->sector_next_status = sector_num + n;
+    }
+
+    n = MIN(n, s->sector_next_status - sector_num);
+    if (s->status == BLK_DATA) {
+        n = MIN(n, s->buf_sectors);
+    }
+
+    /* Compressed images are written in whole clusters, so an unallocated
+     * area that is shorter than a cluster must be copied as data. */
+    if (s->compressed) {
+        if (n < s->cluster_sectors) {
+            n = MIN(s->cluster_sectors, s->total_sectors - sector_num);
+            s->status = BLK_DATA;
+        } else {
+            n = n - n % s->cluster_sectors;
+        }
+    }
+
+    return n;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t src_cur_offset;
+    int src_cur, n, ret;
+
+    assert(nb_sectors <= s->buf_sectors);
+    while (nb_sectors > 0) {
+        /* A compressed cluster can span several source images */
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        n = MIN(nb_sectors,
+                s->src_sectors[src_cur] - (sector_num - src_cur_offset));
+
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(s->src[src_cur], sector_num - src_cur_offset,
+                            n, &qiov);
+        if (ret < 0) {
+            return ret;
+        }
+        s->bytes_read += n << BDRV_SECTOR_BITS;
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n << BDRV_SECTOR_BITS;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, int nb_sectors,
+                                         uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    while (nb_sectors > 0) {
+        int n = nb_sectors;
+
+        switch (status) {
+        case BLK_BACKING_FILE:
+            /* Leave areas that are unallocated in the source unallocated
+             * in the target too, so that the backing file shows through. */
+            assert(s->target_has_backing);
+            break;
+
+        case BLK_DATA:
+            /* Compressed clusters are always written as a whole, so zeroes
+             * are only detected at cluster granularity. */
+            if (s->compressed) {
+                int cluster_size = s->cluster_sectors << BDRV_SECTOR_BITS;
+
+                if (n < s->cluster_sectors) {
+                    memset(buf + (n << BDRV_SECTOR_BITS), 0,
+                           cluster_size - (n << BDRV_SECTOR_BITS));
+                }
+                if (!s->has_zero_init || !buffer_is_zero(buf, cluster_size)) {
+                    ret = bdrv_write_compressed(s->target, sector_num, buf,
+                                                s->cluster_sectors);
+                    if (ret < 0) {
+                        return ret;
+                    }
+                    s->bytes_written += cluster_size;
+                }
+                break;
+            }
+
+            /* If the output image is being created as a copy on write image,
+             * copy all sectors even the ones containing only NUL bytes,
+             * because they may differ from the sectors in the base image.
+             *
+             * If the output is to a host device, zero sectors are written
+             * out too, since whatever data was already there is garbage,
+             * not 0s.
+             */
+            if (!s->has_zero_init || s->target_has_backing ||
+                is_allocated_sectors_min(buf, n, &n, s->min_sparse)) {
+                iov.iov_base = buf;
+                iov.iov_len = n << BDRV_SECTOR_BITS;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+                if (ret < 0) {
+                    return ret;
+                }
+                s->bytes_written += n << BDRV_SECTOR_BITS;
+                break;
+            }
+            /* fall-through */
+
+        case BLK_ZERO:
+            if (s->has_zero_init) {
+                break;
+            }
+            ret = bdrv_co_write_zeroes(s->target, sector_num, n);
+            if (ret < 0) {
+                return ret;
+            }
+            s->bytes_zeroed += n << BDRV_SECTOR_BITS;
+            break;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n << BDRV_SECTOR_BITS;
+    }
+
+    return 0;
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf = NULL;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (1) {
+        int n;
+        int64_t sector_num;
+        enum ImgConvertBlockStatus status;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", s->sector_num, strerror(-n));
+            s->ret = n;
+            break;
+        }
+        /* Claim the request, so that other coroutines can already go on
+         * with the next one */
+        sector_num = s->sector_num;
+        status = s->status;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            s->allocated_done += n;
+            qemu_progress_print(100.0 * s->allocated_done /
+                                s->allocated_sectors, 0);
+
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+                break;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* Writes are issued in order; wait for the preceding request */
+            while (s->wr_offs != sector_num) {
+                if (s->ret != -EINPROGRESS) {
+                    goto out;
+                }
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        ret = convert_co_write(s, sector_num, n, buf, status);
+        if (ret < 0) {
+            error_report("error while writing sector %" PRId64
+                         ": %s", sector_num, strerror(-ret));
+            s->ret = ret;
+            break;
+        }
+
+        if (s->wr_in_order) {
+            /* Let the coroutine that waits for this write continue.  It
+             * cannot be entered twice: a coroutine has wait_sector_num set
+             * to -1 while it enters another one. */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    break;
+                }
+            }
+        }
+    }
+
+out:
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+
+    if (s->ret != -EINPROGRESS) {
+        /* Don't leave coroutines waiting for a write that never comes */
+        for (i = 0; i < s->num_coroutines; i++) {
+            if (s->co[i] && s->wait_sector_num[i] != -1) {
+                s->wait_sector_num[i] = -1;
+                qemu_coroutine_enter(s->co[i], NULL);
+            }
+        }
+    } else if (!s->running_coroutines) {
+        /* the conversion has finished successfully */
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int64_t sector_num = 0;
+    int i, n, ret;
+
+    /* Zeroes need not be written if the target reads as zeroes already */
+    s->has_zero_init = !s->target_has_backing &&
+                       bdrv_has_zero_init(s->target);
+
+    /* Compressed images are written one cluster at a time */
+    if (s->compressed) {
+        BlockDriverInfo bdi;
+
+        ret = bdrv_get_info(s->target, &bdi);
+        if (ret < 0) {
+            error_report("could not get block driver info");
+            return ret;
+        }
+        if (bdi.cluster_size <= 0 ||
+            bdi.cluster_size > s->buf_sectors * BDRV_SECTOR_SIZE) {
+            error_report("invalid cluster size");
+            return -EINVAL;
+        }
+        s->cluster_sectors = bdi.cluster_size >> BDRV_SECTOR_BITS;
+        s->buf_sectors = s->cluster_sectors;
+    }
+
+    /* Count the sectors that have to be copied, for the progress bar */
+    s->allocated_sectors = 0;
+    while (sector_num < s->total_sectors) {
+        n = convert_iteration_sectors(s, sector_num);
+        if (n < 0) {
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", sector_num, strerror(-n));
+            return n;
+        }
+        if (s->status == BLK_DATA) {
+            s->allocated_sectors += n;
+        }
+        sector_num += n;
+    }
+
+    /* Do the copy */
+    s->sector_next_status = 0;
+    s->ret = -EINPROGRESS;
+
+    qemu_co_mutex_init(&s->lock);
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+        qemu_coroutine_enter(s->co[i], s);
+    }
+
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+
+    if (s->compressed && !s->ret) {
+        /* signal EOF to align */
+        ret = bdrv_write_compressed(s->target, 0, NULL, 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return s->ret;
+}
+
+static void convert_print_stats(ImgConvertState *s, int64_t ns)
+{
+    double secs = MAX(ns, 1) / 1000000000.0;
+    int64_t bytes = s->total_sectors << BDRV_SECTOR_BITS;
+
+    printf("Converted %" PRId64 " MiB in %.2f s (%.2f MiB/s)\n",
+           bytes >> 20, secs, bytes / secs / (1 << 20));
+    printf("  read %" PRId64 " MiB (%.2f MiB/s), wrote %" PRId64
+           " MiB (%.2f MiB/s), zeroed %" PRId64 " MiB\n",
+           s->bytes_read >> 20, s->bytes_read / secs / (1 << 20),
+           s->bytes_written >> 20, s->bytes_written / secs / (1 << 20),
+           s->bytes_zeroed >> 20);
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, bs_n, bs_i, compress;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
+    int64_t total_sectors, start_time, elapsed = -1;
+    int64_t *bs_sectors_tab = NULL;
     uint64_t bs_sectors;
-    uint8_t * buf = NULL;
-    const uint8_t *buf1;
-    BlockDriverInfo bdi;
+    ImgConvertState state;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
     char *options = NULL;
     const char *snapshot_name = NULL;
-    float local_progress = 0;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
+    int num_coroutines = 8;
+    bool wr_in_order = true;
     bool quiet = false;
 
     fmt = NULL;
@@ -1134,7 +1587,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:q");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:qm:W");
         if (c == -1) {
             break;
         }
@@ -1191,6 +1644,23 @@ static int img_convert(int argc, char **argv)
         case 'q':
             quiet = true;
             break;
+        case 'm':
+        {
+            char *end;
+
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -1352,189 +1822,41 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
-
-    if (compress) {
-        ret = bdrv_get_info(out_bs, &bdi);
-        if (ret < 0) {
-            error_report("could not get block driver info");
-            goto out;
-        }
-        cluster_size = bdi.cluster_size;
-        if (cluster_size <= 0 || cluster_size > IO_BUF_SIZE) {
-            error_report("invalid cluster size");
-            ret = -1;
-            goto out;
-        }
-        cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
-
-        nb_sectors = total_sectors;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, cluster_sectors));
-        }
-
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
-
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading sector %" PRId64 ": %s",
-                                 bs_num, strerror(-ret));
-                    goto out;
-                }
-
-                buf2 += nlow * 512;
-                bs_num += nlow;
-
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
-
-            if (n < cluster_sectors) {
-                memset(buf + n * 512, 0, cluster_size - n * 512);
-            }
-            if (!buffer_is_zero(buf, cluster_size)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf,
-                                            cluster_sectors);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
-                    goto out;
-                }
-            }
-            sector_num += n;
-            qemu_progress_print(local_progress, 100);
-        }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-        }
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
+    bs_sectors_tab = g_new(int64_t, bs_n);
+    for (bs_i = 0; bs_i < bs_n; bs_i++) {
+        bdrv_get_geometry(bs[bs_i], &bs_sectors);
+        bs_sectors_tab[bs_i] = bs_sectors;
+    }
+
+    state = (ImgConvertState) {
+        .src                = bs,
+        .src_sectors        = bs_sectors_tab,
+        .src_num            = bs_n,
+        .total_sectors      = total_sectors,
+        .target             = out_bs,
+        .compressed         = compress,
+        .target_has_backing = (bool) out_baseimg,
+        .wr_in_order        = wr_in_order,
+        .min_sparse         = min_sparse,
+        .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
+        .num_coroutines     = num_coroutines,
+    };
 
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
+    start_time = get_clock();
+    ret = convert_do_copy(&state);
+    if (ret < 0 && state.compressed && state.ret == 0) {
+        error_report("error while compressing image: %s", strerror(-ret));
     }
+    elapsed = get_clock() - start_time;
+
 out:
     qemu_progress_end();
+    if (progress && !ret && elapsed >= 0) {
+        convert_print_stats(&state, elapsed);
+    }
     free_option_parameters(create_options);
     free_option_parameters(param);
-    qemu_vfree(buf);
+    g_free(bs_sectors_tab);
     if (out_bs) {
         bdrv_delete(out_bs);
     }
@@ -19,6 +19,7 @@
 #include "qemu-common.h"
 #include "block/block.h"
 #include "block/nbd.h"
+#include "qemu/main-loop.h"
 
 #include <stdarg.h>
 #include <stdio.h>
@@ -37,6 +38,9 @@
 #define QEMU_NBD_OPT_CACHE   1
 #define QEMU_NBD_OPT_AIO     2
 #define QEMU_NBD_OPT_DISCARD 3
+#define QEMU_NBD_OPT_THREADS 4
+
+#define MAX_IOTHREADS        64
 
 static NBDExport *exp;
 static int verbose;
@@ -46,6 +50,9 @@ static int persistent = 0;
 static enum { RUNNING, TERMINATE, TERMINATING, TERMINATED } state;
 static int shared = 1;
 static int nb_fds;
+static NBDIOThread *iothreads[MAX_IOTHREADS];
+static int nb_iothreads;
+static int next_iothread;
 
 static void usage(const char *name)
 {
@@ -63,6 +70,7 @@ static void usage(const char *name)
 "                       (default '"SOCKET_PATH"')\n"
 "  -e, --shared=NUM     device can be shared by NUM clients (default '1')\n"
 "  -t, --persistent     don't exit on the last connection\n"
+"      --threads=NUM    do network I/O for the clients in NUM threads\n"
 "  -v, --verbose        display extra debugging information\n"
 "\n"
 "Exposing part of the image:\n"
@@ -81,8 +89,8 @@ static void usage(const char *name)
 "  -s, --snapshot       use snapshot file\n"
 "  -n, --nocache        disable host cache\n"
 "      --cache=MODE     set cache mode (none, writeback, ...)\n"
-#ifdef CONFIG_LINUX_AIO
-"      --aio=MODE       set AIO mode (native or threads)\n"
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
+"      --aio=MODE       set AIO mode (native, io_uring or threads)\n"
 #endif
 "\n"
 "Report bugs to <qemu-devel@nongnu.org>\n"
@@ -224,7 +232,7 @@ static void *nbd_client_thread(void *arg)
     }
 
     ret = nbd_receive_negotiate(sock, NULL, &nbdflags,
-                                &size, &blocksize);
+                                &size, &blocksize, NULL);
     if (ret < 0) {
         goto out;
     }
@@ -291,6 +299,7 @@ static void nbd_accept(void *opaque)
     int server_fd = (uintptr_t) opaque;
     struct sockaddr_in addr;
     socklen_t addr_len = sizeof(addr);
+    NBDIOThread *iothread = NULL;
 
     int fd = accept(server_fd, (struct sockaddr *)&addr, &addr_len);
     if (state >= TERMINATE) {
@@ -298,7 +307,17 @@ static void nbd_accept(void *opaque)
         return;
     }
 
-    if (fd >= 0 && nbd_client_new(exp, fd, nbd_client_closed)) {
+    if (fd < 0) {
+        return;
+    }
+
+    /* Spread the clients over the I/O threads, if any */
+    if (nb_iothreads) {
+        iothread = iothreads[next_iothread];
+        next_iothread = (next_iothread + 1) % nb_iothreads;
+    }
+
+    if (nbd_client_new(exp, fd, iothread, nbd_client_closed)) {
         nb_fds++;
     }
 }
@@ -328,18 +347,20 @@ int main(int argc, char **argv)
         { "snapshot", 0, NULL, 's' },
         { "nocache", 0, NULL, 'n' },
         { "cache", 1, NULL, QEMU_NBD_OPT_CACHE },
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
         { "aio", 1, NULL, QEMU_NBD_OPT_AIO },
 #endif
         { "discard", 1, NULL, QEMU_NBD_OPT_DISCARD },
         { "shared", 1, NULL, 'e' },
         { "persistent", 0, NULL, 't' },
+        { "threads", 1, NULL, QEMU_NBD_OPT_THREADS },
         { "verbose", 0, NULL, 'v' },
         { NULL, 0, NULL, 0 }
     };
     int ch;
     int opt_ind = 0;
     int li;
+    int i;
     char *end;
     int flags = BDRV_O_RDWR;
     int partition = -1;
@@ -347,7 +368,7 @@ int main(int argc, char **argv)
     int fd;
     bool seen_cache = false;
     bool seen_discard = false;
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     bool seen_aio = false;
 #endif
     pthread_t client_thread;
@@ -377,16 +398,22 @@ int main(int argc, char **argv)
                 errx(EXIT_FAILURE, "Invalid cache mode `%s'", optarg);
             }
             break;
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
         case QEMU_NBD_OPT_AIO:
             if (seen_aio) {
                 errx(EXIT_FAILURE, "--aio can only be specified once");
             }
             seen_aio = true;
-            if (!strcmp(optarg, "native")) {
-                flags |= BDRV_O_NATIVE_AIO;
-            } else if (!strcmp(optarg, "threads")) {
+            if (!strcmp(optarg, "threads")) {
                 /* this is the default */
+#ifdef CONFIG_LINUX_AIO
+            } else if (!strcmp(optarg, "native")) {
+                flags |= BDRV_O_NATIVE_AIO;
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+            } else if (!strcmp(optarg, "io_uring")) {
+                flags |= BDRV_O_IO_URING;
+#endif
             } else {
                errx(EXIT_FAILURE, "invalid aio mode `%s'", optarg);
             }
@@ -401,6 +428,16 @@ int main(int argc, char **argv)
                 errx(EXIT_FAILURE, "Invalid discard mode `%s'", optarg);
             }
             break;
+        case QEMU_NBD_OPT_THREADS:
+            nb_iothreads = strtol(optarg, &end, 0);
+            if (*end) {
+                errx(EXIT_FAILURE, "Invalid number of threads `%s'", optarg);
+            }
+            if (nb_iothreads < 0 || nb_iothreads > MAX_IOTHREADS) {
+                errx(EXIT_FAILURE, "Number of threads must be between 0 "
+                     "and %d", MAX_IOTHREADS);
+            }
+            break;
         case 'b':
             bindto = optarg;
             break;
@@ -574,6 +611,13 @@ int main(int argc, char **argv)
 
     exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, nbd_export_closed);
 
+    for (i = 0; i < nb_iothreads; i++) {
+        iothreads[i] = nbd_iothread_new();
+        if (!iothreads[i]) {
+            errx(EXIT_FAILURE, "Failed to create I/O thread");
+        }
+    }
+
     if (sockpath) {
         fd = unix_socket_incoming(sockpath);
     } else {
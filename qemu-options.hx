@@ -35,7 +35,9 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off controls accelerated irqchip support\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
-    "                mem-merge=on|off controls memory merge support (default: on)\n",
+    "                mem-merge=on|off controls memory merge support (default: on)\n"
+    "                tcg-thread=single|multi runs TCG vCPUs in one thread or one each (default: single)\n"
+    "                tb-cache=file keeps translated code in file between runs\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -machine [type=]@var{name}[,prop=@var{value}[,...]]
@@ -58,6 +60,17 @@ Include guest memory in a core dump. The default is on.
 Enables or disables memory merge support. This feature, when supported by
 the host, de-duplicates identical memory pages among VMs instances
 (enabled by default).
+@item tcg-thread=single|multi
+Selects whether all TCG vCPUs are run by a single host thread (the default),
+or each of them by its own thread.  @code{multi} is currently supported for
+ARM guests on x86-64 Linux hosts, and cannot be combined with @option{-icount}.
+@item tb-cache=@var{file}
+Saves the code translated by TCG to @var{file} on exit, and reuses it in
+the next runs that use the same QEMU binary and options, which makes
+booting faster.  Cached code is only used if the guest code it was
+translated from is unchanged.  This is currently supported on x86 Linux
+hosts.  @var{file} contains host code that QEMU executes, so it must only
+be writable by trusted users.
 @end table
 ETEXI
 
@@ -403,9 +416,14 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "-drive [file=file][,if=type][,bus=n][,unit=m][,media=d][,index=i]\n"
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
-    "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
+    "       [,serial=s][,addr=A][,id=name][,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]\n"
+    "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
+    "       [[,iops_max=im]|[[,iops_rd_max=irm][,iops_wr_max=iwm]]]\n"
+    "       [[,bps_max_length=bl]|[[,bps_rd_max_length=rl][,bps_wr_max_length=wl]]]\n"
+    "       [[,iops_max_length=il]|[[,iops_rd_max_length=irl][,iops_wr_max_length=iwl]]]\n"
+    "       [,group=g]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -439,7 +457,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.  Native Linux AIO is only used with @option{cache=none} or @option{cache=directsync}; io_uring also works with the host page cache, and falls back to threads if the host kernel does not support it.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -461,6 +479,25 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item bps=@var{b},bps_rd=@var{r},bps_wr=@var{w}
+Limit the total, read or write throughput of the drive to the given number
+of bytes per second.
+@item iops=@var{i},iops_rd=@var{r},iops_wr=@var{w}
+Limit the total, read or write number of I/O operations per second.
+@item bps_max=@var{bm},bps_rd_max=@var{rm},bps_wr_max=@var{wm}
+@itemx iops_max=@var{im},iops_rd_max=@var{irm},iops_wr_max=@var{iwm}
+Allow bursts of I/O at up to the given rate, above the corresponding average
+limit.  Without a burst rate, the average limit can only be exceeded for
+1/10th of a second.
+@item bps_max_length=@var{bl},iops_max_length=@var{il},...
+Maximum length of a burst, in seconds (default 1).  After a burst of that
+length, I/O is throttled down to the average limit until the burst budget
+has been replenished.
+@item group=@var{g}
+Share the I/O limits with all other drives in throttle group @var{g}.  The
+limits apply to the sum of the I/O of all drives in the group, and the last
+limits that were given for a member of the group are used.  By default every
+drive is in its own group.
 @end table
 
 By default, the @option{cache=writeback} mode is used. It will report data
@@ -2708,16 +2745,8 @@ Load the contents of @var{file} as an option ROM.
 This option is useful to load things like EtherBoot.
 ETEXI
 
-DEF("clock", HAS_ARG, QEMU_OPTION_clock, \
-    "-clock          force the use of the given methods for timer alarm.\n" \
-    "                To see what timers are available use '-clock help'\n",
-    QEMU_ARCH_ALL)
-STEXI
-@item -clock @var{method}
-@findex -clock
-Force the use of the given methods for timer alarm. To see what timers
-are available use @code{-clock help}.
-ETEXI
+HXCOMM Deprecated (ignored)
+DEF("clock", HAS_ARG, QEMU_OPTION_clock, "", QEMU_ARCH_ALL)
 
 HXCOMM Options deprecated by -rtc
 DEF("localtime", 0, QEMU_OPTION_localtime, "", QEMU_ARCH_ALL)
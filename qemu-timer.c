@@ -29,23 +29,19 @@
 #include "hw/hw.h"
 
 #include "qemu/timer.h"
-#ifdef CONFIG_POSIX
-#include <pthread.h>
-#endif
-
-#ifdef _WIN32
-#include <mmsystem.h>
+#include "qemu/thread.h"
+#include "qemu/main-loop.h"
+#ifdef CONFIG_PPOLL
+#include <poll.h>
 #endif
 
 /***********************************************************/
 /* timers */
 
-#define QEMU_CLOCK_REALTIME 0
-#define QEMU_CLOCK_VIRTUAL  1
-#define QEMU_CLOCK_HOST     2
-
 struct QEMUClock {
-    QEMUTimer *active_timers;
+    /* The timer list that is run by the main loop */
+    QEMUTimerList *main_loop_timer_list;
+    QLIST_HEAD(, QEMUTimerList) timer_lists;
 
     NotifierList reset_notifiers;
     int64_t last;
@@ -54,177 +50,260 @@ struct QEMUClock {
     bool enabled;
 };
 
-struct QEMUTimer {
-    int64_t expire_time;	/* in nanoseconds */
+/* Timers are kept in a binary min-heap ordered by expiration time.  Timers
+ * with the same expiration time run in the order they were armed.
+ *
+ * The lock protects the heap, because the timers of an AioContext can be
+ * armed from other threads than the one that runs them.  Callbacks are run
+ * without the lock held.
+ */
+struct QEMUTimerList {
     QEMUClock *clock;
+    QemuMutex lock;
+    QEMUTimer **heap;
+    int nb_timers;
+    int heap_size;
+    uint64_t seq;
+
+    QEMUTimerListNotifyCB *notify_cb;
+    void *notify_opaque;
+    QLIST_ENTRY(QEMUTimerList) list;
+};
+
+struct QEMUTimer {
+    int64_t expire_time;        /* in nanoseconds */
+    uint64_t seq;
+    QEMUTimerList *timer_list;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    int heap_index;             /* -1 if the timer is not pending */
     int scale;
 };
 
-struct qemu_alarm_timer {
-    char const *name;
-    int (*start)(struct qemu_alarm_timer *t);
-    void (*stop)(struct qemu_alarm_timer *t);
-    void (*rearm)(struct qemu_alarm_timer *t, int64_t nearest_delta_ns);
-#if defined(__linux__)
-    timer_t timer;
-    int fd;
-#elif defined(_WIN32)
-    HANDLE timer;
-#endif
-    bool expired;
-    bool pending;
-};
-
-static struct qemu_alarm_timer *alarm_timer;
+QEMUTimerListGroup main_loop_tlg;
 
 static bool qemu_timer_expired_ns(QEMUTimer *timer_head, int64_t current_time)
 {
     return timer_head && (timer_head->expire_time <= current_time);
 }
 
-static int64_t qemu_next_alarm_deadline(void)
+static bool qemu_timer_before(QEMUTimer *a, QEMUTimer *b)
 {
-    int64_t delta = INT64_MAX;
-    int64_t rtdelta;
+    return a->expire_time < b->expire_time ||
+           (a->expire_time == b->expire_time && a->seq < b->seq);
+}
 
-    if (!use_icount && vm_clock->enabled && vm_clock->active_timers) {
-        delta = vm_clock->active_timers->expire_time -
-                     qemu_get_clock_ns(vm_clock);
-    }
-    if (host_clock->enabled && host_clock->active_timers) {
-        int64_t hdelta = host_clock->active_timers->expire_time -
-                 qemu_get_clock_ns(host_clock);
-        if (hdelta < delta) {
-            delta = hdelta;
+static void qemu_timer_heap_set(QEMUTimerList *tl, int i, QEMUTimer *ts)
+{
+    tl->heap[i] = ts;
+    ts->heap_index = i;
+}
+
+static void qemu_timer_heap_up(QEMUTimerList *tl, int i)
+{
+    QEMUTimer *ts = tl->heap[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+
+        if (!qemu_timer_before(ts, tl->heap[parent])) {
+            break;
         }
+        qemu_timer_heap_set(tl, i, tl->heap[parent]);
+        i = parent;
     }
-    if (rt_clock->enabled && rt_clock->active_timers) {
-        rtdelta = (rt_clock->active_timers->expire_time -
-                 qemu_get_clock_ns(rt_clock));
-        if (rtdelta < delta) {
-            delta = rtdelta;
+    qemu_timer_heap_set(tl, i, ts);
+}
+
+static void qemu_timer_heap_down(QEMUTimerList *tl, int i)
+{
+    QEMUTimer *ts = tl->heap[i];
+
+    for (;;) {
+        int child = 2 * i + 1;
+
+        if (child >= tl->nb_timers) {
+            break;
+        }
+        if (child + 1 < tl->nb_timers &&
+            qemu_timer_before(tl->heap[child + 1], tl->heap[child])) {
+            child++;
         }
+        if (!qemu_timer_before(tl->heap[child], ts)) {
+            break;
+        }
+        qemu_timer_heap_set(tl, i, tl->heap[child]);
+        i = child;
     }
-
-    return delta;
+    qemu_timer_heap_set(tl, i, ts);
 }
 
-static void qemu_rearm_alarm_timer(struct qemu_alarm_timer *t)
+static void qemu_timer_heap_insert(QEMUTimerList *tl, QEMUTimer *ts)
 {
-    int64_t nearest_delta_ns = qemu_next_alarm_deadline();
-    if (nearest_delta_ns < INT64_MAX) {
-        t->rearm(t, nearest_delta_ns);
+    if (tl->nb_timers == tl->heap_size) {
+        tl->heap_size = MAX(tl->heap_size * 2, 16);
+        tl->heap = g_renew(QEMUTimer *, tl->heap, tl->heap_size);
     }
+    ts->seq = tl->seq++;
+    qemu_timer_heap_set(tl, tl->nb_timers++, ts);
+    qemu_timer_heap_up(tl, ts->heap_index);
 }
 
-/* TODO: MIN_TIMER_REARM_NS should be optimized */
-#define MIN_TIMER_REARM_NS 250000
-
-#ifdef _WIN32
+static void qemu_timer_heap_remove(QEMUTimerList *tl, QEMUTimer *ts)
+{
+    int i = ts->heap_index;
+    QEMUTimer *last = tl->heap[--tl->nb_timers];
 
-static int mm_start_timer(struct qemu_alarm_timer *t);
-static void mm_stop_timer(struct qemu_alarm_timer *t);
-static void mm_rearm_timer(struct qemu_alarm_timer *t, int64_t delta);
+    ts->heap_index = -1;
+    if (last != ts) {
+        qemu_timer_heap_set(tl, i, last);
+        qemu_timer_heap_down(tl, i);
+        qemu_timer_heap_up(tl, last->heap_index);
+    }
+}
 
-static int win32_start_timer(struct qemu_alarm_timer *t);
-static void win32_stop_timer(struct qemu_alarm_timer *t);
-static void win32_rearm_timer(struct qemu_alarm_timer *t, int64_t delta);
+static QEMUTimer *qemu_timer_list_first(QEMUTimerList *tl)
+{
+    return tl->nb_timers ? tl->heap[0] : NULL;
+}
 
-#else
+QEMUTimerList *qemu_timer_list_new(QEMUClock *clock,
+                                   QEMUTimerListNotifyCB *cb, void *opaque)
+{
+    QEMUTimerList *tl;
 
-static int unix_start_timer(struct qemu_alarm_timer *t);
-static void unix_stop_timer(struct qemu_alarm_timer *t);
-static void unix_rearm_timer(struct qemu_alarm_timer *t, int64_t delta);
+    tl = g_malloc0(sizeof(QEMUTimerList));
+    tl->clock = clock;
+    tl->notify_cb = cb;
+    tl->notify_opaque = opaque;
+    qemu_mutex_init(&tl->lock);
+    QLIST_INSERT_HEAD(&clock->timer_lists, tl, list);
+    return tl;
+}
 
-#ifdef __linux__
+void qemu_timer_list_free(QEMUTimerList *tl)
+{
+    assert(!qemu_timer_list_has_timers(tl));
+    if (tl->clock->main_loop_timer_list == tl) {
+        tl->clock->main_loop_timer_list = NULL;
+    }
+    QLIST_REMOVE(tl, list);
+    qemu_mutex_destroy(&tl->lock);
+    g_free(tl->heap);
+    g_free(tl);
+}
 
-static int dynticks_start_timer(struct qemu_alarm_timer *t);
-static void dynticks_stop_timer(struct qemu_alarm_timer *t);
-static void dynticks_rearm_timer(struct qemu_alarm_timer *t, int64_t delta);
+bool qemu_timer_list_has_timers(QEMUTimerList *tl)
+{
+    return tl->nb_timers > 0;
+}
 
-#endif /* __linux__ */
+static void qemu_timer_list_notify(QEMUTimerList *tl)
+{
+    if (tl->notify_cb) {
+        tl->notify_cb(tl->notify_opaque);
+    }
+}
 
-#endif /* _WIN32 */
+int64_t qemu_timer_list_deadline_ns(QEMUTimerList *tl)
+{
+    int64_t expire_time, delta;
 
-static struct qemu_alarm_timer alarm_timers[] = {
-#ifndef _WIN32
-#ifdef __linux__
-    {"dynticks", dynticks_start_timer,
-     dynticks_stop_timer, dynticks_rearm_timer},
-#endif
-    {"unix", unix_start_timer, unix_stop_timer, unix_rearm_timer},
-#else
-    {"mmtimer", mm_start_timer, mm_stop_timer, mm_rearm_timer},
-    {"dynticks", win32_start_timer, win32_stop_timer, win32_rearm_timer},
-#endif
-    {NULL, }
-};
+    if (!tl->clock->enabled || !tl->nb_timers) {
+        return -1;
+    }
 
-static void show_available_alarms(void)
-{
-    int i;
+    qemu_mutex_lock(&tl->lock);
+    if (!tl->nb_timers) {
+        qemu_mutex_unlock(&tl->lock);
+        return -1;
+    }
+    expire_time = tl->heap[0]->expire_time;
+    qemu_mutex_unlock(&tl->lock);
 
-    printf("Available alarm timers, in order of precedence:\n");
-    for (i = 0; alarm_timers[i].name; i++)
-        printf("%s\n", alarm_timers[i].name);
+    delta = expire_time - qemu_get_clock_ns(tl->clock);
+    return MAX(delta, 0);
 }
 
-void configure_alarms(char const *opt)
+bool qemu_timer_list_run_timers(QEMUTimerList *tl)
 {
-    int i;
-    int cur = 0;
-    int count = ARRAY_SIZE(alarm_timers) - 1;
-    char *arg;
-    char *name;
-    struct qemu_alarm_timer tmp;
+    QEMUTimer *ts;
+    int64_t current_time;
+    bool progress = false;
 
-    if (is_help_option(opt)) {
-        show_available_alarms();
-        exit(0);
+    if (!tl->clock->enabled || !tl->nb_timers) {
+        return false;
     }
 
-    arg = g_strdup(opt);
-
-    /* Reorder the array */
-    name = strtok(arg, ",");
-    while (name) {
-        for (i = 0; i < count && alarm_timers[i].name; i++) {
-            if (!strcmp(alarm_timers[i].name, name))
-                break;
+    current_time = qemu_get_clock_ns(tl->clock);
+    for (;;) {
+        qemu_mutex_lock(&tl->lock);
+        ts = qemu_timer_list_first(tl);
+        if (!qemu_timer_expired_ns(ts, current_time)) {
+            qemu_mutex_unlock(&tl->lock);
+            break;
         }
+        /* remove timer from the list before calling the callback */
+        qemu_timer_heap_remove(tl, ts);
+        qemu_mutex_unlock(&tl->lock);
 
-        if (i == count) {
-            fprintf(stderr, "Unknown clock %s\n", name);
-            goto next;
-        }
+        /* run the callback (the timer list can be modified) */
+        ts->cb(ts->opaque);
+        progress = true;
+    }
+    return progress;
+}
 
-        if (i < cur)
-            /* Ignore */
-            goto next;
+void qemu_timer_list_group_init(QEMUTimerListGroup *tlg,
+                                QEMUTimerListNotifyCB *cb, void *opaque)
+{
+    tlg->tl[QEMU_CLOCK_REALTIME] = qemu_timer_list_new(rt_clock, cb, opaque);
+    tlg->tl[QEMU_CLOCK_VIRTUAL] = qemu_timer_list_new(vm_clock, cb, opaque);
+    tlg->tl[QEMU_CLOCK_HOST] = qemu_timer_list_new(host_clock, cb, opaque);
+}
 
-	/* Swap */
-        tmp = alarm_timers[i];
-        alarm_timers[i] = alarm_timers[cur];
-        alarm_timers[cur] = tmp;
+void qemu_timer_list_group_deinit(QEMUTimerListGroup *tlg)
+{
+    int type;
 
-        cur++;
-next:
-        name = strtok(NULL, ",");
+    for (type = 0; type < QEMU_CLOCK_MAX; type++) {
+        qemu_timer_list_free(tlg->tl[type]);
+        tlg->tl[type] = NULL;
     }
+}
 
-    g_free(arg);
+/* With -icount, vm_clock only advances while the CPUs run, so its
+ * deadlines are handled by the CPU thread and must not be used to
+ * compute poll timeouts.
+ */
+static bool qemu_clock_use_for_deadline(int type)
+{
+    return !(use_icount && type == QEMU_CLOCK_VIRTUAL);
+}
 
-    if (cur) {
-        /* Disable remaining timers */
-        for (i = cur; i < count; i++)
-            alarm_timers[i].name = NULL;
-    } else {
-        show_available_alarms();
-        exit(1);
+int64_t qemu_timer_list_group_deadline_ns(QEMUTimerListGroup *tlg)
+{
+    int64_t deadline = -1;
+    int type;
+
+    for (type = 0; type < QEMU_CLOCK_MAX; type++) {
+        if (qemu_clock_use_for_deadline(type)) {
+            deadline = qemu_soonest_timeout(deadline,
+                           qemu_timer_list_deadline_ns(tlg->tl[type]));
+        }
     }
+    return deadline;
+}
+
+bool qemu_timer_list_group_run_timers(QEMUTimerListGroup *tlg)
+{
+    bool progress = false;
+    int type;
+
+    for (type = 0; type < QEMU_CLOCK_MAX; type++) {
+        progress |= qemu_timer_list_run_timers(tlg->tl[type]);
+    }
+    return progress;
 }
 
 QEMUClock *rt_clock;
@@ -239,57 +318,89 @@ static QEMUClock *qemu_new_clock(int type)
     clock->type = type;
     clock->enabled = true;
     clock->last = INT64_MIN;
+    QLIST_INIT(&clock->timer_lists);
     notifier_list_init(&clock->reset_notifiers);
     return clock;
 }
 
 void qemu_clock_enable(QEMUClock *clock, bool enabled)
 {
+    QEMUTimerList *tl;
     bool old = clock->enabled;
+
     clock->enabled = enabled;
     if (enabled && !old) {
-        qemu_rearm_alarm_timer(alarm_timer);
+        QLIST_FOREACH(tl, &clock->timer_lists, list) {
+            qemu_timer_list_notify(tl);
+        }
     }
 }
 
 int64_t qemu_clock_has_timers(QEMUClock *clock)
 {
-    return !!clock->active_timers;
+    return qemu_timer_list_has_timers(clock->main_loop_timer_list);
 }
 
 int64_t qemu_clock_expired(QEMUClock *clock)
 {
-    return (clock->active_timers &&
-            clock->active_timers->expire_time < qemu_get_clock_ns(clock));
+    QEMUTimerList *tl = clock->main_loop_timer_list;
+    int64_t expire_time;
+
+    qemu_mutex_lock(&tl->lock);
+    if (!tl->nb_timers) {
+        qemu_mutex_unlock(&tl->lock);
+        return false;
+    }
+    expire_time = tl->heap[0]->expire_time;
+    qemu_mutex_unlock(&tl->lock);
+
+    return expire_time < qemu_get_clock_ns(clock);
 }
 
 int64_t qemu_clock_deadline(QEMUClock *clock)
 {
+    QEMUTimerList *tl = clock->main_loop_timer_list;
     /* To avoid problems with overflow limit this to 2^32.  */
     int64_t delta = INT32_MAX;
 
-    if (clock->active_timers) {
-        delta = clock->active_timers->expire_time - qemu_get_clock_ns(clock);
+    qemu_mutex_lock(&tl->lock);
+    if (tl->nb_timers) {
+        delta = tl->heap[0]->expire_time - qemu_get_clock_ns(clock);
     }
+    qemu_mutex_unlock(&tl->lock);
+
     if (delta < 0) {
         delta = 0;
     }
     return delta;
 }
 
-QEMUTimer *qemu_new_timer(QEMUClock *clock, int scale,
-                          QEMUTimerCB *cb, void *opaque)
+QEMUTimer *qemu_new_timer_tl(QEMUTimerList *tl, int scale,
+                             QEMUTimerCB *cb, void *opaque)
 {
     QEMUTimer *ts;
 
     ts = g_malloc0(sizeof(QEMUTimer));
-    ts->clock = clock;
+    ts->timer_list = tl;
     ts->cb = cb;
     ts->opaque = opaque;
     ts->scale = scale;
+    ts->heap_index = -1;
     return ts;
 }
 
+QEMUTimer *qemu_new_timer_tlg(QEMUTimerListGroup *tlg, QEMUClock *clock,
+                              int scale, QEMUTimerCB *cb, void *opaque)
+{
+    return qemu_new_timer_tl(tlg->tl[clock->type], scale, cb, opaque);
+}
+
+QEMUTimer *qemu_new_timer(QEMUClock *clock, int scale,
+                          QEMUTimerCB *cb, void *opaque)
+{
+    return qemu_new_timer_tl(clock->main_loop_timer_list, scale, cb, opaque);
+}
+
 void qemu_free_timer(QEMUTimer *ts)
 {
     g_free(ts);
@@ -298,56 +409,38 @@ void qemu_free_timer(QEMUTimer *ts)
 /* stop a timer, but do not dealloc it */
 void qemu_del_timer(QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
+    QEMUTimerList *tl = ts->timer_list;
 
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &ts->clock->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
-            break;
-        }
-        pt = &t->next;
+    qemu_mutex_lock(&tl->lock);
+    if (ts->heap_index >= 0) {
+        qemu_timer_heap_remove(tl, ts);
     }
+    qemu_mutex_unlock(&tl->lock);
 }
 
 /* modify the current timer so that it will be fired when current_time
    >= expire_time. The corresponding callback will be called. */
 void qemu_mod_timer_ns(QEMUTimer *ts, int64_t expire_time)
 {
-    QEMUTimer **pt, *t;
+    QEMUTimerList *tl = ts->timer_list;
+    bool rearm;
 
-    qemu_del_timer(ts);
-
-    /* add the timer in the sorted list */
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &ts->clock->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!qemu_timer_expired_ns(t, expire_time)) {
-            break;
-        }
-        pt = &t->next;
+    qemu_mutex_lock(&tl->lock);
+    if (ts->heap_index >= 0) {
+        qemu_timer_heap_remove(tl, ts);
     }
     ts->expire_time = expire_time;
-    ts->next = *pt;
-    *pt = ts;
-
-    /* Rearm if necessary  */
-    if (pt == &ts->clock->active_timers) {
-        if (!alarm_timer->pending) {
-            qemu_rearm_alarm_timer(alarm_timer);
-        }
-        /* Interrupt execution to force deadline recalculation.  */
-        qemu_clock_warp(ts->clock);
-        if (use_icount) {
-            qemu_notify_event();
+    qemu_timer_heap_insert(tl, ts);
+    rearm = ts->heap_index == 0;
+    qemu_mutex_unlock(&tl->lock);
+
+    /* Wake up the thread that runs the timers to recompute its deadline */
+    if (rearm) {
+        if (tl == tl->clock->main_loop_timer_list) {
+            /* Interrupt execution to force deadline recalculation.  */
+            qemu_clock_warp(tl->clock);
         }
+        qemu_timer_list_notify(tl);
     }
 }
 
@@ -358,13 +451,7 @@ void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 
 bool qemu_timer_pending(QEMUTimer *ts)
 {
-    QEMUTimer *t;
-    for (t = ts->clock->active_timers; t != NULL; t = t->next) {
-        if (t == ts) {
-            return true;
-        }
-    }
-    return false;
+    return ts->heap_index >= 0;
 }
 
 bool qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
@@ -374,25 +461,7 @@ bool qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
 
 void qemu_run_timers(QEMUClock *clock)
 {
-    QEMUTimer *ts;
-    int64_t current_time;
-   
-    if (!clock->enabled)
-        return;
-
-    current_time = qemu_get_clock_ns(clock);
-    for(;;) {
-        ts = clock->active_timers;
-        if (!qemu_timer_expired_ns(ts, current_time)) {
-            break;
-        }
-        /* remove timer from the list before calling the callback */
-        clock->active_timers = ts->next;
-        ts->next = NULL;
-
-        /* run the callback (the timer list can be modified) */
-        ts->cb(ts->opaque);
-    }
+    qemu_timer_list_run_timers(clock->main_loop_timer_list);
 }
 
 int64_t qemu_get_clock_ns(QEMUClock *clock)
@@ -430,12 +499,26 @@ void qemu_unregister_clock_reset_notifier(QEMUClock *clock, Notifier *notifier)
     notifier_remove(notifier);
 }
 
+static void qemu_main_loop_timer_notify(void *opaque)
+{
+    qemu_notify_event();
+}
+
 void init_clocks(void)
 {
+    int type;
+
     if (!rt_clock) {
         rt_clock = qemu_new_clock(QEMU_CLOCK_REALTIME);
         vm_clock = qemu_new_clock(QEMU_CLOCK_VIRTUAL);
         host_clock = qemu_new_clock(QEMU_CLOCK_HOST);
+
+        qemu_timer_list_group_init(&main_loop_tlg,
+                                   qemu_main_loop_timer_notify, NULL);
+        for (type = 0; type < QEMU_CLOCK_MAX; type++) {
+            QEMUTimerList *tl = main_loop_tlg.tl[type];
+            tl->clock->main_loop_timer_list = tl;
+        }
     }
 }
 
@@ -446,347 +529,45 @@ uint64_t qemu_timer_expire_time_ns(QEMUTimer *ts)
 
 void qemu_run_all_timers(void)
 {
-    alarm_timer->pending = false;
-
     /* vm time timers */
     qemu_run_timers(vm_clock);
     qemu_run_timers(rt_clock);
     qemu_run_timers(host_clock);
-
-    /* rearm timer, if not periodic */
-    if (alarm_timer->expired) {
-        alarm_timer->expired = false;
-        qemu_rearm_alarm_timer(alarm_timer);
-    }
-}
-
-#ifdef _WIN32
-static void CALLBACK host_alarm_handler(PVOID lpParam, BOOLEAN unused)
-#else
-static void host_alarm_handler(int host_signum)
-#endif
-{
-    struct qemu_alarm_timer *t = alarm_timer;
-    if (!t)
-	return;
-
-    t->expired = true;
-    t->pending = true;
-    qemu_notify_event();
-}
-
-#if defined(__linux__)
-
-#include "qemu/compatfd.h"
-
-static int dynticks_start_timer(struct qemu_alarm_timer *t)
-{
-    struct sigevent ev;
-    timer_t host_timer;
-    struct sigaction act;
-
-    sigfillset(&act.sa_mask);
-    act.sa_flags = 0;
-    act.sa_handler = host_alarm_handler;
-
-    sigaction(SIGALRM, &act, NULL);
-
-    /* 
-     * Initialize ev struct to 0 to avoid valgrind complaining
-     * about uninitialized data in timer_create call
-     */
-    memset(&ev, 0, sizeof(ev));
-    ev.sigev_value.sival_int = 0;
-    ev.sigev_notify = SIGEV_SIGNAL;
-#ifdef CONFIG_SIGEV_THREAD_ID
-    if (qemu_signalfd_available()) {
-        ev.sigev_notify = SIGEV_THREAD_ID;
-        ev._sigev_un._tid = qemu_get_thread_id();
-    }
-#endif /* CONFIG_SIGEV_THREAD_ID */
-    ev.sigev_signo = SIGALRM;
-
-    if (timer_create(CLOCK_REALTIME, &ev, &host_timer)) {
-        perror("timer_create");
-        return -1;
-    }
-
-    t->timer = host_timer;
-
-    return 0;
-}
-
-static void dynticks_stop_timer(struct qemu_alarm_timer *t)
-{
-    timer_t host_timer = t->timer;
-
-    timer_delete(host_timer);
-}
-
-static void dynticks_rearm_timer(struct qemu_alarm_timer *t,
-                                 int64_t nearest_delta_ns)
-{
-    timer_t host_timer = t->timer;
-    struct itimerspec timeout;
-    int64_t current_ns;
-
-    if (nearest_delta_ns < MIN_TIMER_REARM_NS)
-        nearest_delta_ns = MIN_TIMER_REARM_NS;
-
-    /* check whether a timer is already running */
-    if (timer_gettime(host_timer, &timeout)) {
-        perror("gettime");
-        fprintf(stderr, "Internal timer error: aborting\n");
-        exit(1);
-    }
-    current_ns = timeout.it_value.tv_sec * 1000000000LL + timeout.it_value.tv_nsec;
-    if (current_ns && current_ns <= nearest_delta_ns)
-        return;
-
-    timeout.it_interval.tv_sec = 0;
-    timeout.it_interval.tv_nsec = 0; /* 0 for one-shot timer */
-    timeout.it_value.tv_sec =  nearest_delta_ns / 1000000000;
-    timeout.it_value.tv_nsec = nearest_delta_ns % 1000000000;
-    if (timer_settime(host_timer, 0 /* RELATIVE */, &timeout, NULL)) {
-        perror("settime");
-        fprintf(stderr, "Internal timer error: aborting\n");
-        exit(1);
-    }
-}
-
-#endif /* defined(__linux__) */
-
-#if !defined(_WIN32)
-
-static int unix_start_timer(struct qemu_alarm_timer *t)
-{
-    struct sigaction act;
-
-    /* timer signal */
-    sigfillset(&act.sa_mask);
-    act.sa_flags = 0;
-    act.sa_handler = host_alarm_handler;
-
-    sigaction(SIGALRM, &act, NULL);
-    return 0;
-}
-
-static void unix_rearm_timer(struct qemu_alarm_timer *t,
-                             int64_t nearest_delta_ns)
-{
-    struct itimerval itv;
-    int err;
-
-    if (nearest_delta_ns < MIN_TIMER_REARM_NS)
-        nearest_delta_ns = MIN_TIMER_REARM_NS;
-
-    itv.it_interval.tv_sec = 0;
-    itv.it_interval.tv_usec = 0; /* 0 for one-shot timer */
-    itv.it_value.tv_sec =  nearest_delta_ns / 1000000000;
-    itv.it_value.tv_usec = (nearest_delta_ns % 1000000000) / 1000;
-    err = setitimer(ITIMER_REAL, &itv, NULL);
-    if (err) {
-        perror("setitimer");
-        fprintf(stderr, "Internal timer error: aborting\n");
-        exit(1);
-    }
-}
-
-static void unix_stop_timer(struct qemu_alarm_timer *t)
-{
-    struct itimerval itv;
-
-    memset(&itv, 0, sizeof(itv));
-    setitimer(ITIMER_REAL, &itv, NULL);
-}
-
-#endif /* !defined(_WIN32) */
-
-
-#ifdef _WIN32
-
-static MMRESULT mm_timer;
-static TIMECAPS mm_tc;
-
-static void CALLBACK mm_alarm_handler(UINT uTimerID, UINT uMsg,
-                                      DWORD_PTR dwUser, DWORD_PTR dw1,
-                                      DWORD_PTR dw2)
-{
-    struct qemu_alarm_timer *t = alarm_timer;
-    if (!t) {
-        return;
-    }
-    t->expired = true;
-    t->pending = true;
-    qemu_notify_event();
 }
 
-static int mm_start_timer(struct qemu_alarm_timer *t)
+int qemu_timeout_ns_to_ms(int64_t ns)
 {
-    timeGetDevCaps(&mm_tc, sizeof(mm_tc));
-
-    timeBeginPeriod(mm_tc.wPeriodMin);
-
-    mm_timer = timeSetEvent(mm_tc.wPeriodMin,   /* interval (ms) */
-                            mm_tc.wPeriodMin,   /* resolution */
-                            mm_alarm_handler,   /* function */
-                            (DWORD_PTR)t,       /* parameter */
-                            TIME_ONESHOT | TIME_CALLBACK_FUNCTION);
+    int64_t ms;
 
-    if (!mm_timer) {
-        fprintf(stderr, "Failed to initialize win32 alarm timer\n");
-        timeEndPeriod(mm_tc.wPeriodMin);
+    if (ns < 0) {
         return -1;
     }
-
-    return 0;
-}
-
-static void mm_stop_timer(struct qemu_alarm_timer *t)
-{
-    timeKillEvent(mm_timer);
-    timeEndPeriod(mm_tc.wPeriodMin);
-}
-
-static void mm_rearm_timer(struct qemu_alarm_timer *t, int64_t delta)
-{
-    int64_t nearest_delta_ms = delta / 1000000;
-    if (nearest_delta_ms < mm_tc.wPeriodMin) {
-        nearest_delta_ms = mm_tc.wPeriodMin;
-    } else if (nearest_delta_ms > mm_tc.wPeriodMax) {
-        nearest_delta_ms = mm_tc.wPeriodMax;
-    }
-
-    timeKillEvent(mm_timer);
-    mm_timer = timeSetEvent((UINT)nearest_delta_ms,
-                            mm_tc.wPeriodMin,
-                            mm_alarm_handler,
-                            (DWORD_PTR)t,
-                            TIME_ONESHOT | TIME_CALLBACK_FUNCTION);
-
-    if (!mm_timer) {
-        fprintf(stderr, "Failed to re-arm win32 alarm timer\n");
-        timeEndPeriod(mm_tc.wPeriodMin);
-        exit(1);
-    }
-}
-
-static int win32_start_timer(struct qemu_alarm_timer *t)
-{
-    HANDLE hTimer;
-    BOOLEAN success;
-
-    /* If you call ChangeTimerQueueTimer on a one-shot timer (its period
-       is zero) that has already expired, the timer is not updated.  Since
-       creating a new timer is relatively expensive, set a bogus one-hour
-       interval in the dynticks case.  */
-    success = CreateTimerQueueTimer(&hTimer,
-                          NULL,
-                          host_alarm_handler,
-                          t,
-                          1,
-                          3600000,
-                          WT_EXECUTEINTIMERTHREAD);
-
-    if (!success) {
-        fprintf(stderr, "Failed to initialize win32 alarm timer: %ld\n",
-                GetLastError());
-        return -1;
-    }
-
-    t->timer = hTimer;
-    return 0;
-}
-
-static void win32_stop_timer(struct qemu_alarm_timer *t)
-{
-    HANDLE hTimer = t->timer;
-
-    if (hTimer) {
-        DeleteTimerQueueTimer(NULL, hTimer, NULL);
-    }
-}
-
-static void win32_rearm_timer(struct qemu_alarm_timer *t,
-                              int64_t nearest_delta_ns)
-{
-    HANDLE hTimer = t->timer;
-    int64_t nearest_delta_ms;
-    BOOLEAN success;
-
-    nearest_delta_ms = nearest_delta_ns / 1000000;
-    if (nearest_delta_ms < 1) {
-        nearest_delta_ms = 1;
-    }
-    /* ULONG_MAX can be 32 bit */
-    if (nearest_delta_ms > ULONG_MAX) {
-        nearest_delta_ms = ULONG_MAX;
-    }
-    success = ChangeTimerQueueTimer(NULL,
-                                    hTimer,
-                                    (unsigned long) nearest_delta_ms,
-                                    3600000);
-
-    if (!success) {
-        fprintf(stderr, "Failed to rearm win32 alarm timer: %ld\n",
-                GetLastError());
-        exit(-1);
+    if (!ns) {
+        return 0;
     }
 
-}
-
-#endif /* _WIN32 */
-
-static void quit_timers(void)
-{
-    struct qemu_alarm_timer *t = alarm_timer;
-    alarm_timer = NULL;
-    t->stop(t);
-}
+    /* Always round up, because it's better to wait too long than to wait
+     * too little and effectively busy-wait.
+     */
+    ms = (ns + SCALE_MS - 1) / SCALE_MS;
 
-#ifdef CONFIG_POSIX
-static void reinit_timers(void)
-{
-    struct qemu_alarm_timer *t = alarm_timer;
-    t->stop(t);
-    if (t->start(t)) {
-        fprintf(stderr, "Internal timer error: aborting\n");
-        exit(1);
-    }
-    qemu_rearm_alarm_timer(t);
+    /* To avoid overflow problems, limit this to 2^31, i.e. approx 25 days */
+    return MIN(ms, INT32_MAX);
 }
-#endif /* CONFIG_POSIX */
 
-int init_timer_alarm(void)
+int qemu_poll_ns(GPollFD *fds, guint nfds, int64_t timeout)
 {
-    struct qemu_alarm_timer *t = NULL;
-    int i, err = -1;
-
-    if (alarm_timer) {
-        return 0;
-    }
-
-    for (i = 0; alarm_timers[i].name; i++) {
-        t = &alarm_timers[i];
-
-        err = t->start(t);
-        if (!err)
-            break;
-    }
+#ifdef CONFIG_PPOLL
+    if (timeout < 0) {
+        return ppoll((struct pollfd *)fds, nfds, NULL, NULL);
+    } else {
+        struct timespec ts;
 
-    if (err) {
-        err = -ENOENT;
-        goto fail;
+        ts.tv_sec = timeout / 1000000000LL;
+        ts.tv_nsec = timeout % 1000000000LL;
+        return ppoll((struct pollfd *)fds, nfds, &ts, NULL);
     }
-
-    atexit(quit_timers);
-#ifdef CONFIG_POSIX
-    pthread_atfork(NULL, NULL, reinit_timers);
+#else
+    return g_poll(fds, nfds, qemu_timeout_ns_to_ms(timeout));
 #endif
-    alarm_timer = t;
-    return 0;
-
-fail:
-    return err;
 }
-
@@ -1006,7 +1006,7 @@ EQMP
         .name       = "drive-mirror",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "granularity:i?,buf-size:i?",
+                      "granularity:i?,buf-size:i?,copy-mode:s?",
         .mhandler.cmd_new = qmp_marshal_input_drive_mirror,
     },
 
@@ -1041,6 +1041,10 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "on-target-error": the action to take on an error on the target
   (BlockdevOnError, default 'report')
+- "copy-mode": when to copy data to the destination; "background" copies
+  dirty data in the background only, "write-blocking" additionally copies
+  guest writes synchronously so that the job always converges
+  (MirrorCopyMode, default 'background')
 
 The default value of the granularity is the image cluster size clamped
 between 4096 and 65536, if the image format defines one.  If the format
@@ -1056,6 +1060,134 @@ Example:
                                                "format": "qcow2" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "drive-backup",
+        .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
+                      "bitmap:s?,on-source-error:s?,on-target-error:s?",
+        .mhandler.cmd_new = qmp_marshal_input_drive_backup,
+    },
+
+SQMP
+drive-backup
+------------
+
+Start a point-in-time copy of a block device to a new destination.  The
+status of ongoing drive-backup operations can be checked with
+query-block-jobs where the BlockJobInfo.type field has the value 'backup'.
+The operation can be stopped before it has completed using the
+block-job-cancel command.
+
+Arguments:
+
+- "device": the name of the device which should be copied.
+            (json-string)
+- "target": the target of the new image. If the file exists, or if it is a
+            device, the existing file/device will be used as the new
+            destination.  If it does not exist, a new file will be created.
+            (json-string)
+- "format": the format of the new destination, default is to probe if 'mode'
+            is 'existing', else the format of the source
+            (json-string, optional)
+- "sync": what parts of the disk image should be copied to the destination;
+  possibilities include "full" for all the disk, "top" for only the sectors
+  allocated in the topmost image, "incremental" for only the sectors marked
+  in "bitmap", or "none" to only copy the data that the guest overwrites
+  (MirrorSyncMode).
+- "mode": whether and how QEMU should create a new image
+          (NewImageMode, optional, default 'absolute-paths')
+- "speed": the maximum speed, in bytes per second (json-int, optional)
+- "bitmap": the name of the dirty bitmap to use with sync "incremental"
+            (json-string, optional)
+- "on-source-error": the action to take on an error on the source, default
+                     'report'.  'stop' and 'enospc' can only be used
+                     if the block device supports io-status.
+                     (BlockdevOnError, optional)
+- "on-target-error": the action to take on an error on the target, default
+                     'report' (no limitations, since this applies to
+                     a different block device than device).
+                     (BlockdevOnError, optional)
+
+Example:
+-> { "execute": "drive-backup", "arguments": { "device": "drive0",
+                                               "sync": "full",
+                                               "target": "backup.img" } }
+<- { "return": {} }
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-add",
+        .args_type  = "device:B,name:s,granularity:i?,persistent:b?",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
+    },
+    {
+        .name       = "block-dirty-bitmap-remove",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_remove,
+    },
+    {
+        .name       = "block-dirty-bitmap-clear",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_clear,
+    },
+
+SQMP
+block-dirty-bitmap-add
+----------------------
+
+Create a named dirty bitmap on a block device.  The bitmap records every
+sector written to the device from now on, and can be used as the source of
+an incremental backup.
+
+Arguments:
+
+- "device": device name to operate on (json-string)
+- "name": name of the new dirty bitmap (json-string)
+- "granularity": granularity of the dirty bitmap, in bytes (json-int, optional)
+- "persistent": save the bitmap in the image when the device is closed
+  (json-bool, optional, default false; qcow2 only)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-add", "arguments": { "device": "ide-hd0",
+                                                          "name": "nightly",
+                                                          "persistent": true } }
+<- { "return": {} }
+
+block-dirty-bitmap-remove
+-------------------------
+
+Delete a named dirty bitmap.  A persistent bitmap is also removed from the
+image file.
+
+Arguments:
+
+- "device": device name to operate on (json-string)
+- "name": name of the dirty bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-remove", "arguments": { "device": "ide-hd0",
+                                                             "name": "nightly" } }
+<- { "return": {} }
+
+block-dirty-bitmap-clear
+------------------------
+
+Mark every sector of a named dirty bitmap as clean.
+
+Arguments:
+
+- "device": device name to operate on (json-string)
+- "name": name of the dirty bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-clear", "arguments": { "device": "ide-hd0",
+                                                            "name": "nightly" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1312,7 +1444,13 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,"
+                      "bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,"
+                      "iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,"
+                      "bps_max_length:l?,bps_rd_max_length:l?,"
+                      "bps_wr_max_length:l?,iops_max_length:l?,"
+                      "iops_rd_max_length:l?,iops_wr_max_length:l?,"
+                      "group:s?",
         .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
     },
 
@@ -1331,6 +1469,30 @@ Arguments:
 - "iops":  total I/O operations per second(json-int)
 - "iops_rd":  read I/O operations per second(json-int)
 - "iops_wr":  write I/O operations per second(json-int)
+- "bps_max":  total burst rate in bytes per second(json-int, optional)
+- "bps_rd_max":  read burst rate in bytes per second(json-int, optional)
+- "bps_wr_max":  write burst rate in bytes per second(json-int, optional)
+- "iops_max":  total burst rate in I/O operations per second(json-int, optional)
+- "iops_rd_max":  read burst rate in I/O operations per second(json-int, optional)
+- "iops_wr_max":  write burst rate in I/O operations per second(json-int, optional)
+- "bps_max_length":  maximum length of the bps_max burst period, in seconds
+                     (json-int, optional, default 1)
+- "bps_rd_max_length":  maximum length of the bps_rd_max burst period, in seconds
+                        (json-int, optional, default 1)
+- "bps_wr_max_length":  maximum length of the bps_wr_max burst period, in seconds
+                        (json-int, optional, default 1)
+- "iops_max_length":  maximum length of the iops_max burst period, in seconds
+                      (json-int, optional, default 1)
+- "iops_rd_max_length":  maximum length of the iops_rd_max burst period, in
+                         seconds (json-int, optional, default 1)
+- "iops_wr_max_length":  maximum length of the iops_wr_max burst period, in
+                         seconds (json-int, optional, default 1)
+- "group": throttle group name, all devices of a group share the same limits
+           (json-string, optional, default: the device name)
+
+Without a burst rate, I/O can exceed the average rate for 1/10th of a second.
+With a burst rate, I/O can run at up to the burst rate for the given length
+of time before being throttled down to the average rate.
 
 Example:
 
@@ -1340,7 +1502,10 @@ Example:
                                                "bps_wr": "0",
                                                "iops": "0",
                                                "iops_rd": "0",
-                                               "iops_wr": "0" } }
+                                               "iops_wr": "0",
+                                               "bps_max": "8000000",
+                                               "bps_max_length": "60",
+                                               "group": "tenant0" } }
 <- { "return": {} }
 
 EQMP
@@ -1681,6 +1846,25 @@ Each json-object contain the following:
          - "iops": limit total I/O operations per second (json-int)
          - "iops_rd": limit read operations per second (json-int)
          - "iops_wr": limit write operations per second (json-int)
+         - "bps_max": total burst rate in bytes per second (json-int, optional)
+         - "bps_rd_max": read burst rate in bytes per second (json-int, optional)
+         - "bps_wr_max": write burst rate in bytes per second (json-int, optional)
+         - "iops_max": total burst rate in operations per second (json-int, optional)
+         - "iops_rd_max": read burst rate in operations per second (json-int, optional)
+         - "iops_wr_max": write burst rate in operations per second (json-int, optional)
+         - "bps_max_length": length of the bps_max burst period in seconds
+                             (json-int, optional)
+         - "bps_rd_max_length": length of the bps_rd_max burst period in
+                                seconds (json-int, optional)
+         - "bps_wr_max_length": length of the bps_wr_max burst period in
+                                seconds (json-int, optional)
+         - "iops_max_length": length of the iops_max burst period in seconds
+                              (json-int, optional)
+         - "iops_rd_max_length": length of the iops_rd_max burst period in
+                                 seconds (json-int, optional)
+         - "iops_wr_max_length": length of the iops_wr_max burst period in
+                                 seconds (json-int, optional)
+         - "group": throttle group name (json-string, optional)
 
 - "io-status": I/O operation status, only present if the device supports it
                and the VM is configured to stop on errors. It's always reset
@@ -2646,6 +2830,79 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_block_jobs,
     },
 
+SQMP
+query-thread-pools
+------------------
+
+Show statistics of the thread pools that run blocking I/O requests.  Each
+AioContext has its own pool.
+
+Each pool is described by a json-object, and the returned value is a
+json-array of all pools.  Each json-object contains the following:
+
+- "main": whether this is the pool of the main loop (json-bool)
+- "min-threads": number of idle workers that are kept around (json-int)
+- "max-threads": maximum number of workers (json-int)
+- "threads": current number of workers (json-int)
+- "idle-threads": number of workers waiting for a request (json-int)
+- "queue-depth": number of requests waiting for a worker (json-int)
+- "max-queue-depth": highest queue depth that was seen (json-int)
+- "completed": number of requests that were run (json-int)
+- "wait-time-ns": total time spent by requests waiting for a worker,
+                  in nanoseconds (json-int)
+- "max-wait-time-ns": longest wait for a worker, in nanoseconds (json-int)
+- "service-time-ns": total time spent running requests, in nanoseconds
+                     (json-int)
+- "notifications": number of completion notifications (json-int)
+
+Example:
+
+-> { "execute": "query-thread-pools" }
+<- { "return": [ { "main": true, "min-threads": 0, "max-threads": 64,
+                   "threads": 4, "idle-threads": 3, "queue-depth": 0,
+                   "max-queue-depth": 12, "completed": 81234,
+                   "wait-time-ns": 318213344, "max-wait-time-ns": 982113,
+                   "service-time-ns": 2874519331,
+                   "notifications": 60211 } ] }
+
+EQMP
+
+    {
+        .name       = "query-thread-pools",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_thread_pools,
+    },
+
+SQMP
+thread-pool-set-params
+----------------------
+
+Change the worker limits and CPU affinity of all I/O thread pools, including
+those that are created later.
+
+Arguments:
+
+- "min-threads": number of idle workers to keep around (json-int, optional)
+- "max-threads": maximum number of workers per pool (json-int, optional)
+- "cpus": host CPUs that workers may run on, as a list of CPU numbers and
+          ranges such as "0-3,6"; an empty string lets new workers inherit
+          the affinity of the thread that creates them
+          (json-string, optional)
+
+Example:
+
+-> { "execute": "thread-pool-set-params",
+     "arguments": { "min-threads": 4, "max-threads": 16, "cpus": "2-3" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "thread-pool-set-params",
+        .args_type  = "min-threads:i?,max-threads:i?,cpus:s?",
+        .mhandler.cmd_new = qmp_marshal_input_thread_pool_set_params,
+    },
+
     {
         .name       = "qom-list",
         .args_type  = "path:s",
@@ -0,0 +1,64 @@
+#!/usr/bin/env python
+#
+# Count host instructions generated per guest instruction
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+# The input is a log written with "-d in_asm,out_asm".  Given two logs,
+# for example of the same workload before and after a change to the code
+# generator, the second one is compared against the first.
+#
+# Usage: tcg-insn-count.py <log> [<log>]
+
+import sys
+
+def count(filename):
+    '''Return (TBs, guest insns, host insns, host bytes) for a log'''
+    tbs = guest = host = host_bytes = 0
+    section = None
+    for line in open(filename):
+        if line.startswith('IN:'):
+            section = 'in'
+            tbs += 1
+        elif line.startswith('OUT: [size='):
+            section = 'out'
+            host_bytes += int(line[len('OUT: [size='):].split(']')[0])
+        elif not line.strip():
+            section = None
+        elif line.startswith('0x'):
+            if section == 'in':
+                guest += 1
+            elif section == 'out':
+                host += 1
+    return tbs, guest, host, host_bytes
+
+def report(filename, stats):
+    tbs, guest, host, host_bytes = stats
+    print '%s:' % filename
+    print '  translation blocks  %d' % tbs
+    print '  guest insns         %d' % guest
+    print '  host insns          %d' % host
+    print '  host code size      %d bytes' % host_bytes
+    if guest:
+        print '  host insns/insn     %.3f' % (float(host) / guest)
+        print '  host bytes/insn     %.3f' % (float(host_bytes) / guest)
+
+def main(args):
+    if len(args) not in (1, 2):
+        sys.stderr.write('usage: %s <log> [<log>]\n' % sys.argv[0])
+        return 1
+
+    stats = [count(filename) for filename in args]
+    for filename, s in zip(args, stats):
+        report(filename, s)
+
+    if len(stats) == 2 and stats[0][1] and stats[1][1]:
+        before = float(stats[0][2]) / stats[0][1]
+        after = float(stats[1][2]) / stats[1][1]
+        print 'host insns/insn change: %+.2f%%' % \
+            ((after - before) * 100 / before)
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
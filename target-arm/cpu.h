@@ -33,6 +33,9 @@
 
 #define TARGET_HAS_ICE 1
 
+/* Generated code does not assume that only one vCPU runs at a time.  */
+#define TARGET_SUPPORTS_MTTCG 1
+
 #define EXCP_UDEF            1   /* undefined instruction */
 #define EXCP_SWI             2   /* software interrupt */
 #define EXCP_PREFETCH_ABORT  3
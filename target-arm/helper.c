@@ -96,11 +96,22 @@ static int contextidr_write(CPUARMState *env, const ARMCPRegInfo *ri,
     return 0;
 }
 
+/* The c8, c3 encodings are the inner shareable variants of the TLB
+   maintenance operations, which also affect the other CPUs.  */
+static bool tlbi_is_shareable(const ARMCPRegInfo *ri)
+{
+    return ri->crm == 3;
+}
+
 static int tlbiall_write(CPUARMState *env, const ARMCPRegInfo *ri,
                          uint64_t value)
 {
     /* Invalidate all (TLBIALL) */
-    tlb_flush(env, 1);
+    if (tlbi_is_shareable(ri)) {
+        tlb_flush_all(1);
+    } else {
+        tlb_flush(env, 1);
+    }
     return 0;
 }
 
@@ -108,7 +119,11 @@ static int tlbimva_write(CPUARMState *env, const ARMCPRegInfo *ri,
                          uint64_t value)
 {
     /* Invalidate single TLB entry by MVA and ASID (TLBIMVA) */
-    tlb_flush_page(env, value & TARGET_PAGE_MASK);
+    if (tlbi_is_shareable(ri)) {
+        tlb_flush_page_all(value & TARGET_PAGE_MASK);
+    } else {
+        tlb_flush_page(env, value & TARGET_PAGE_MASK);
+    }
     return 0;
 }
 
@@ -116,7 +131,11 @@ static int tlbiasid_write(CPUARMState *env, const ARMCPRegInfo *ri,
                           uint64_t value)
 {
     /* Invalidate by ASID (TLBIASID) */
-    tlb_flush(env, value == 0);
+    if (tlbi_is_shareable(ri)) {
+        tlb_flush_all(value == 0);
+    } else {
+        tlb_flush(env, value == 0);
+    }
     return 0;
 }
 
@@ -124,7 +143,11 @@ static int tlbimvaa_write(CPUARMState *env, const ARMCPRegInfo *ri,
                           uint64_t value)
 {
     /* Invalidate single entry by MVA, all ASIDs (TLBIMVAA) */
-    tlb_flush_page(env, value & TARGET_PAGE_MASK);
+    if (tlbi_is_shareable(ri)) {
+        tlb_flush_page_all(value & TARGET_PAGE_MASK);
+    } else {
+        tlb_flush_page(env, value & TARGET_PAGE_MASK);
+    }
     return 0;
 }
 
@@ -18,6 +18,7 @@
  */
 #include "cpu.h"
 #include "helper.h"
+#include "qemu/atomic.h"
 
 #define SIGNBIT (uint32_t)0x80000000
 #define SIGNBIT64 ((uint64_t)1 << 63)
@@ -50,9 +51,36 @@ uint32_t HELPER(neon_tbl)(CPUARMState *env, uint32_t ireg, uint32_t def,
     return val;
 }
 
+/* Compare and swap 1 << SIZE bytes of guest memory at HADDR.  Returns 0
+   if memory held EXPECTED and was replaced by VAL, 1 otherwise.  */
+static uint32_t strex_cmpxchg(uintptr_t haddr, uint64_t expected,
+                              uint64_t val, uint32_t size)
+{
+    switch (size) {
+    case 0:
+        return atomic_cmpxchg((uint8_t *)haddr, (uint8_t)expected,
+                              (uint8_t)val) != (uint8_t)expected;
+    case 1:
+        return atomic_cmpxchg((uint16_t *)haddr, tswap16(expected),
+                              tswap16(val)) != tswap16(expected);
+    case 2:
+        return atomic_cmpxchg((uint32_t *)haddr, tswap32(expected),
+                              tswap32(val)) != tswap32(expected);
+#if HOST_LONG_BITS == 64
+    case 3:
+        return atomic_cmpxchg((uint64_t *)haddr, tswap64(expected),
+                              tswap64(val)) != tswap64(expected);
+#endif
+    default:
+        abort();
+    }
+}
+
 #if !defined(CONFIG_USER_ONLY)
 
 #include "exec/softmmu_exec.h"
+#include "exec/memory.h"
+#include "exec/cputlb.h"
 
 #define MMUSUFFIX _mmu
 
@@ -74,9 +102,13 @@ uint32_t HELPER(neon_tbl)(CPUARMState *env, uint32_t ireg, uint32_t def,
 void tlb_fill(CPUARMState *env, target_ulong addr, int is_write, int mmu_idx,
               uintptr_t retaddr)
 {
+    bool locked;
     int ret;
 
+    /* The page table walk reads guest memory through the memory API.  */
+    locked = qemu_tcg_lock_iothread();
     ret = cpu_arm_handle_mmu_fault(env, addr, is_write, mmu_idx);
+    qemu_tcg_unlock_iothread(locked);
     if (unlikely(ret)) {
         if (retaddr) {
             /* now we have a real cpu fault */
@@ -85,6 +117,118 @@ void tlb_fill(CPUARMState *env, target_ulong addr, int is_write, int mmu_idx,
         raise_exception(env, env->exception_index);
     }
 }
+
+/* Store exclusive for -machine tcg-thread=multi.  The store only happens
+   if memory still holds the value read by the load exclusive, which is
+   checked atomically with respect to the other vCPUs.  As in the single
+   threaded implementation, an intervening store of the same value goes
+   unnoticed.  Returns the value of Rd: 0 on success, 1 on failure.  */
+uint32_t HELPER(strex)(CPUARMState *env, uint32_t addr, uint64_t val,
+                       uint32_t size)
+{
+    uintptr_t retaddr = GETPC();
+    int mmu_idx = cpu_mmu_index(env);
+    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    uint64_t expected = env->exclusive_val;
+    target_ulong tlb_addr;
+    uintptr_t haddr;
+    ram_addr_t ram_addr;
+    bool locked;
+    uint32_t ret = 1;
+
+    if (addr != env->exclusive_addr) {
+        return 1;
+    }
+    if (size == 3) {
+        expected |= (uint64_t)env->exclusive_high << 32;
+    }
+
+    tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
+    if ((addr & TARGET_PAGE_MASK) !=
+        (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        if (!tlb_victim_hit(env, mmu_idx, index,
+                            offsetof(CPUTLBEntry, addr_write), addr)) {
+            tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        }
+        tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
+    }
+    haddr = addr + env->tlb_table[mmu_idx][index].addend;
+
+    if ((addr & ((1 << size) - 1)) == 0 &&
+        (size < 3 || HOST_LONG_BITS == 64)) {
+        if ((tlb_addr & ~TARGET_PAGE_MASK) == 0) {
+            /* plain RAM */
+            return strex_cmpxchg(haddr, expected, val, size);
+        }
+        if ((tlb_addr & ~TARGET_PAGE_MASK) == TLB_NOTDIRTY) {
+            /* RAM that may hold translated code */
+            locked = qemu_tcg_lock_iothread();
+            ret = strex_cmpxchg(haddr, expected, val, size);
+            if (ret == 0) {
+                ram_addr = (env->iotlb[mmu_idx][index] & TARGET_PAGE_MASK)
+                    + addr;
+                invalidate_and_set_dirty(ram_addr, 1 << size);
+            }
+            qemu_tcg_unlock_iothread(locked);
+            return ret;
+        }
+    }
+
+    /* MMIO or misaligned: no other vCPU can race with us on a device,
+       so it is enough to hold the iothread lock.  */
+    locked = qemu_tcg_lock_iothread();
+    switch (size) {
+    case 0:
+        ret = slow_ldb_mmu(env, addr, mmu_idx, retaddr) != expected;
+        if (!ret) {
+            slow_stb_mmu(env, addr, val, mmu_idx, retaddr);
+        }
+        break;
+    case 1:
+        ret = slow_ldw_mmu(env, addr, mmu_idx, retaddr) != expected;
+        if (!ret) {
+            slow_stw_mmu(env, addr, val, mmu_idx, retaddr);
+        }
+        break;
+    case 2:
+        ret = slow_ldl_mmu(env, addr, mmu_idx, retaddr) != expected;
+        if (!ret) {
+            slow_stl_mmu(env, addr, val, mmu_idx, retaddr);
+        }
+        break;
+    default:
+        ret = slow_ldq_mmu(env, addr, mmu_idx, retaddr) != expected;
+        if (!ret) {
+            slow_stq_mmu(env, addr, val, mmu_idx, retaddr);
+        }
+        break;
+    }
+    qemu_tcg_unlock_iothread(locked);
+    return ret;
+}
+#else
+/* Store exclusive for linux-user, where guest threads run in parallel.
+   Returns the value of Rd, or 2 if the store must be left to cpu_loop
+   because the address is misaligned or not writable, so that it raises
+   the signal.  */
+uint32_t HELPER(strex)(CPUARMState *env, uint32_t addr, uint64_t val,
+                       uint32_t size)
+{
+    uint64_t expected = env->exclusive_val;
+
+    if (addr != env->exclusive_addr) {
+        return 1;
+    }
+    if (size == 3) {
+        expected |= (uint64_t)env->exclusive_high << 32;
+    }
+    if ((addr & ((1 << size) - 1)) != 0 ||
+        (size == 3 && HOST_LONG_BITS != 64) ||
+        page_check_range(addr, 1 << size, PAGE_READ | PAGE_WRITE) < 0) {
+        return 2;
+    }
+    return strex_cmpxchg((uintptr_t)g2h(addr), expected, val, size);
+}
 #endif
 
 uint32_t HELPER(add_setq)(CPUARMState *env, uint32_t a, uint32_t b)
@@ -276,7 +420,10 @@ void HELPER(set_user_reg)(CPUARMState *env, uint32_t regno, uint32_t val)
 void HELPER(set_cp_reg)(CPUARMState *env, void *rip, uint32_t value)
 {
     const ARMCPRegInfo *ri = rip;
+    bool locked = qemu_tcg_lock_iothread();
     int excp = ri->writefn(env, ri, value);
+
+    qemu_tcg_unlock_iothread(locked);
     if (excp) {
         raise_exception(env, excp);
     }
@@ -286,7 +433,10 @@ uint32_t HELPER(get_cp_reg)(CPUARMState *env, void *rip)
 {
     const ARMCPRegInfo *ri = rip;
     uint64_t value;
+    bool locked = qemu_tcg_lock_iothread();
     int excp = ri->readfn(env, ri, &value);
+
+    qemu_tcg_unlock_iothread(locked);
     if (excp) {
         raise_exception(env, excp);
     }
@@ -296,7 +446,10 @@ uint32_t HELPER(get_cp_reg)(CPUARMState *env, void *rip)
 void HELPER(set_cp_reg64)(CPUARMState *env, void *rip, uint64_t value)
 {
     const ARMCPRegInfo *ri = rip;
+    bool locked = qemu_tcg_lock_iothread();
     int excp = ri->writefn(env, ri, value);
+
+    qemu_tcg_unlock_iothread(locked);
     if (excp) {
         raise_exception(env, excp);
     }
@@ -306,7 +459,10 @@ uint64_t HELPER(get_cp_reg64)(CPUARMState *env, void *rip)
 {
     const ARMCPRegInfo *ri = rip;
     uint64_t value;
+    bool locked = qemu_tcg_lock_iothread();
     int excp = ri->readfn(env, ri, &value);
+
+    qemu_tcg_unlock_iothread(locked);
     if (excp) {
         raise_exception(env, excp);
     }
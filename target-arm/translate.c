@@ -807,7 +807,7 @@ static inline void gen_bx_im(DisasContext *s, uint32_t addr)
 /* Set PC and Thumb state from var.  var is marked as dead.  */
 static inline void gen_bx(DisasContext *s, TCGv var)
 {
-    s->is_jmp = DISAS_UPDATE;
+    s->is_jmp = DISAS_JUMP;
     tcg_gen_andi_i32(cpu_R[15], var, ~1);
     tcg_gen_andi_i32(var, var, 1);
     store_cpu_field(var, thumb);
@@ -2684,17 +2684,9 @@ static int disas_vfp_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
                     tmp = load_reg(s, rd);
                     if (insn & (1 << 23)) {
                         /* VDUP */
-                        if (size == 0) {
-                            gen_neon_dup_u8(tmp, 0);
-                        } else if (size == 1) {
-                            gen_neon_dup_low16(tmp);
-                        }
-                        for (n = 0; n <= pass * 2; n++) {
-                            tmp2 = tcg_temp_new_i32();
-                            tcg_gen_mov_i32(tmp2, tmp);
-                            neon_store_reg(rn, n, tmp2);
-                        }
-                        neon_store_reg(rn, n, tmp);
+                        tcg_gen_vec_dup_i32(cpu_env, size, pass ? 16 : 8,
+                                            vfp_reg_offset(1, rn), tmp);
+                        tcg_temp_free_i32(tmp);
                     } else {
                         /* VMOV */
                         switch (size) {
@@ -4517,6 +4509,39 @@ static int disas_neon_data_insn(CPUARMState * env, DisasContext *s, uint32_t ins
         if (q && ((rd | rn | rm) & 1)) {
             return 1;
         }
+        /* VADD, VSUB and most logic ops work on whole registers.  */
+        if (op == NEON_3R_VADD_VSUB
+            || (op == NEON_3R_LOGIC && ((u << 2) | size) != 3
+                && ((u << 2) | size) <= 4)) {
+            int oprsz = q ? 16 : 8;
+            long dofs = vfp_reg_offset(1, rd);
+            long aofs = vfp_reg_offset(1, rn);
+            long bofs = vfp_reg_offset(1, rm);
+
+            if (op == NEON_3R_VADD_VSUB) {
+                if (u) {
+                    tcg_gen_vec_sub(cpu_env, size, oprsz, dofs, aofs, bofs);
+                } else {
+                    tcg_gen_vec_add(cpu_env, size, oprsz, dofs, aofs, bofs);
+                }
+                return 0;
+            }
+            switch ((u << 2) | size) {
+            case 0: /* VAND */
+                tcg_gen_vec_and(cpu_env, oprsz, dofs, aofs, bofs);
+                break;
+            case 1: /* BIC */
+                tcg_gen_vec_andc(cpu_env, oprsz, dofs, aofs, bofs);
+                break;
+            case 2: /* VORR */
+                tcg_gen_vec_or(cpu_env, oprsz, dofs, aofs, bofs);
+                break;
+            case 4: /* VEOR */
+                tcg_gen_vec_xor(cpu_env, oprsz, dofs, aofs, bofs);
+                break;
+            }
+            return 0;
+        }
         if (size == 3 && op != NEON_3R_LOGIC) {
             /* 64-bit element instructions. */
             for (pass = 0; pass < (q ? 2 : 1); pass++) {
@@ -4990,6 +5015,27 @@ static int disas_neon_data_insn(CPUARMState * env, DisasContext *s, uint32_t ins
                    element size in bits.  */
                 if (op <= 4)
                     shift = shift - (1 << (size + 3));
+                if (op == 0 || (op == 5 && !u)) {
+                    /* VSHR, VSHL: shift the whole register at once.  */
+                    int esize = 8 << size;
+                    int oprsz = q ? 16 : 8;
+                    long dofs = vfp_reg_offset(1, rd);
+                    long aofs = vfp_reg_offset(1, rm);
+
+                    if (op == 5) {
+                        tcg_gen_vec_shli(cpu_env, size, oprsz, dofs, aofs,
+                                         shift);
+                    } else if (!u) {
+                        tcg_gen_vec_sari(cpu_env, size, oprsz, dofs, aofs,
+                                         MIN(-shift, esize - 1));
+                    } else if (-shift < esize) {
+                        tcg_gen_vec_shri(cpu_env, size, oprsz, dofs, aofs,
+                                         -shift);
+                    } else {
+                        tcg_gen_vec_dupi(cpu_env, TCG_VEC_64, oprsz, dofs, 0);
+                    }
+                    return 0;
+                }
                 if (size == 3) {
                     count = q + 1;
                 } else {
@@ -6483,8 +6529,10 @@ static void gen_logicq_cc(TCGv lo, TCGv hi)
    regular stores.
 
    In system emulation mode only one CPU will be running at once, so
-   this sequence is effectively atomic.  In user emulation mode we
-   throw an exception and handle the atomic operation elsewhere.  */
+   this sequence is effectively atomic, except with tcg-thread=multi
+   where the store is done by a helper using a host compare-and-swap.
+   In user emulation mode we throw an exception and handle the atomic
+   operation elsewhere.  */
 static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
                                TCGv addr, int size)
 {
@@ -6523,13 +6571,45 @@ static void gen_clrex(DisasContext *s)
 }
 
 #ifdef CONFIG_USER_ONLY
+/* The store is done by the host's compare-and-swap.  Only when the helper
+   cannot do it (the access would fault, or it is misaligned) does the insn
+   go to cpu_loop, which handles it in an exclusive section.  */
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
                                 TCGv addr, int size)
 {
+    TCGv_i64 val = tcg_temp_new_i64();
+    TCGv tmp, tmp_size, res;
+    int slow_label = gen_new_label();
+    int done_label = gen_new_label();
+
+    tmp = load_reg(s, rt);
+    if (size == 3) {
+        TCGv tmp2 = load_reg(s, rt2);
+        tcg_gen_concat_i32_i64(val, tmp, tmp2);
+        tcg_temp_free_i32(tmp2);
+    } else {
+        tcg_gen_extu_i32_i64(val, tmp);
+    }
+    tcg_temp_free_i32(tmp);
     tcg_gen_mov_i32(cpu_exclusive_test, addr);
+    tmp_size = tcg_const_i32(size);
+    res = tcg_temp_local_new_i32();
+    gen_helper_strex(res, cpu_env, addr, val, tmp_size);
+    tcg_temp_free_i32(tmp_size);
+    tcg_temp_free_i64(val);
+    tcg_gen_brcondi_i32(TCG_COND_EQ, res, 2, slow_label);
+    tcg_gen_mov_i32(cpu_R[rd], res);
+    tcg_gen_movi_i32(cpu_exclusive_addr, -1);
+    tcg_gen_br(done_label);
+
+    gen_set_label(slow_label);
     tcg_gen_movi_i32(cpu_exclusive_info,
                      size | (rd << 4) | (rt << 8) | (rt2 << 12));
-    gen_exception_insn(s, 4, EXCP_STREX);
+    gen_set_condexec(s);
+    gen_set_pc_im(s->pc - 4);
+    gen_exception(EXCP_STREX);
+    gen_set_label(done_label);
+    tcg_temp_free_i32(res);
 }
 #else
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
@@ -6539,6 +6619,27 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     int done_label;
     int fail_label;
 
+    if (parallel_cpus) {
+        TCGv_i64 val = tcg_temp_new_i64();
+        TCGv tmp_size;
+
+        tmp = load_reg(s, rt);
+        if (size == 3) {
+            TCGv tmp2 = load_reg(s, rt2);
+            tcg_gen_concat_i32_i64(val, tmp, tmp2);
+            tcg_temp_free_i32(tmp2);
+        } else {
+            tcg_gen_extu_i32_i64(val, tmp);
+        }
+        tcg_temp_free_i32(tmp);
+        tmp_size = tcg_const_i32(size);
+        gen_helper_strex(cpu_R[rd], cpu_env, addr, val, tmp_size);
+        tcg_temp_free_i32(tmp_size);
+        tcg_temp_free_i64(val);
+        tcg_gen_movi_i32(cpu_exclusive_addr, -1);
+        return;
+    }
+
     /* if (env->exclusive_addr == addr && env->exclusive_val == [addr]) {
          [addr] = {Rt};
          {Rd} = 0;
@@ -9989,8 +10090,12 @@ static inline void gen_intermediate_code_internal(CPUARMState *env,
         case DISAS_NEXT:
             gen_goto_tb(dc, 1, dc->pc);
             break;
-        default:
         case DISAS_JUMP:
+            /* an indirect branch: jump to the next TB if it is in the
+               jump cache, without going back to the main loop */
+            tcg_gen_lookup_and_goto_ptr(cpu_env);
+            break;
+        default:
         case DISAS_UPDATE:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
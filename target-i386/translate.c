@@ -3222,6 +3222,36 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0x63] = SSE42_OP(pcmpistri),
 };
 
+/* psrl (OP 2), psra (OP 4) or psll (OP 6) of the MMX or SSE register at
+   OFS by the immediate VAL.  Counts larger than the element size clear
+   the register, or fill it with the sign bits.  */
+static void gen_sse_shifti(int op, int vece, int oprsz, int ofs, int val)
+{
+    int bits = 8 << vece;
+
+    switch (op) {
+    case 2:
+        if (val >= bits) {
+            tcg_gen_vec_dupi(cpu_env, TCG_VEC_64, oprsz, ofs, 0);
+        } else {
+            tcg_gen_vec_shri(cpu_env, vece, oprsz, ofs, ofs, val);
+        }
+        break;
+    case 4:
+        tcg_gen_vec_sari(cpu_env, vece, oprsz, ofs, ofs, MIN(val, bits - 1));
+        break;
+    case 6:
+        if (val >= bits) {
+            tcg_gen_vec_dupi(cpu_env, TCG_VEC_64, oprsz, ofs, 0);
+        } else {
+            tcg_gen_vec_shli(cpu_env, vece, oprsz, ofs, ofs, val);
+        }
+        break;
+    default:
+        tcg_abort();
+    }
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -3617,6 +3647,24 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
 	        goto illegal_op;
             }
             val = cpu_ldub_code(env, s->pc++);
+            sse_fn_epp = sse_op_table2[((b - 1) & 3) * 8 +
+                                       (((modrm >> 3)) & 7)][b1];
+            if (!sse_fn_epp) {
+                goto illegal_op;
+            }
+            if (is_xmm) {
+                rm = (modrm & 7) | REX_B(s);
+                op2_offset = offsetof(CPUX86State,xmm_regs[rm]);
+            } else {
+                rm = (modrm & 7);
+                op2_offset = offsetof(CPUX86State,fpregs[rm].mmx);
+            }
+            /* everything but psrldq/pslldq is a shift of each element */
+            if (((modrm >> 3) & 7) != 3 && ((modrm >> 3) & 7) != 7) {
+                gen_sse_shifti((modrm >> 3) & 7, TCG_VEC_16 + ((b - 1) & 3),
+                               is_xmm ? 16 : 8, op2_offset, val);
+                break;
+            }
             if (is_xmm) {
                 gen_op_movl_T0_im(val);
                 tcg_gen_st32_tl(cpu_T[0], cpu_env, offsetof(CPUX86State,xmm_t0.XMM_L(0)));
@@ -3630,18 +3678,6 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                 tcg_gen_st32_tl(cpu_T[0], cpu_env, offsetof(CPUX86State,mmx_t0.MMX_L(1)));
                 op1_offset = offsetof(CPUX86State,mmx_t0);
             }
-            sse_fn_epp = sse_op_table2[((b - 1) & 3) * 8 +
-                                       (((modrm >> 3)) & 7)][b1];
-            if (!sse_fn_epp) {
-                goto illegal_op;
-            }
-            if (is_xmm) {
-                rm = (modrm & 7) | REX_B(s);
-                op2_offset = offsetof(CPUX86State,xmm_regs[rm]);
-            } else {
-                rm = (modrm & 7);
-                op2_offset = offsetof(CPUX86State,fpregs[rm].mmx);
-            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op2_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op1_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -4637,6 +4673,44 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt = (SSEFunc_0_eppt)sse_fn_epp;
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
+        /* integer and bitwise operations are done with vector ops */
+        case 0x54: /* andps, andpd */
+        case 0xdb: /* pand */
+            tcg_gen_vec_and(cpu_env, is_xmm ? 16 : 8,
+                            op1_offset, op1_offset, op2_offset);
+            break;
+        case 0x55: /* andnps, andnpd */
+        case 0xdf: /* pandn */
+            tcg_gen_vec_andc(cpu_env, is_xmm ? 16 : 8,
+                             op1_offset, op2_offset, op1_offset);
+            break;
+        case 0x56: /* orps, orpd */
+        case 0xeb: /* por */
+            tcg_gen_vec_or(cpu_env, is_xmm ? 16 : 8,
+                           op1_offset, op1_offset, op2_offset);
+            break;
+        case 0x57: /* xorps, xorpd */
+        case 0xef: /* pxor */
+            tcg_gen_vec_xor(cpu_env, is_xmm ? 16 : 8,
+                            op1_offset, op1_offset, op2_offset);
+            break;
+        case 0xfc: /* paddb */
+        case 0xfd: /* paddw */
+        case 0xfe: /* paddl */
+            tcg_gen_vec_add(cpu_env, b - 0xfc, is_xmm ? 16 : 8,
+                            op1_offset, op1_offset, op2_offset);
+            break;
+        case 0xd4: /* paddq */
+            tcg_gen_vec_add(cpu_env, TCG_VEC_64, is_xmm ? 16 : 8,
+                            op1_offset, op1_offset, op2_offset);
+            break;
+        case 0xf8: /* psubb */
+        case 0xf9: /* psubw */
+        case 0xfa: /* psubl */
+        case 0xfb: /* psubq */
+            tcg_gen_vec_sub(cpu_env, b - 0xf8, is_xmm ? 16 : 8,
+                            op1_offset, op1_offset, op2_offset);
+            break;
         default:
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
@@ -13,6 +13,7 @@
 
 #include "qemu-common.h"
 #include "qemu/timer.h"
+#include "qemu/main-loop.h"
 #include "kvm_ppc.h"
 #include "sysemu/device_tree.h"
 
@@ -0,0 +1,689 @@
+/*
+ * Persistent cache of translated code
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The cache file starts with a TBCacheHeader, followed by nb_entries
+ * entries of variable size.  Each one is made of:
+ *
+ * - a TBCacheEntry, which holds the lookup key of the TB and the sizes of
+ *   what follows.  Besides the usual pc, cs_base and flags, the key
+ *   identifies the CPU model and its features (see tb_cache_cpu_id), so
+ *   that code translated for one -cpu is not run with another;
+ * - the guest code, which must match the guest memory for the entry to be
+ *   used;
+ * - the host code, padded to 8 bytes;
+ * - one TBCacheReloc for each host address in the host code.
+ *
+ * The host addresses are recorded by the backend while it generates the
+ * code (see tcg_out_cache_reloc).  They are saved relative to the start of
+ * the memory area that contains them, and patched with
+ * tcg_patch_cache_reloc when the entry is loaded.  TBs that contain other
+ * host addresses, for example data pointers passed to helpers with
+ * tcg_const_ptr, are not saved.
+ *
+ * cpu_restore_state regenerates the code of a TB in place and must get
+ * the same bytes as the code that was loaded.  This is why the backend
+ * refuses to relocate an address that it would now encode differently,
+ * and why TBs translated with breakpoints, single-stepping, logging or
+ * special cflags never go through the cache.
+ *
+ * A file is only used by the QEMU executable that wrote it, with the same
+ * options: the header includes a hash of the executable and of the
+ * settings that affect code generation.  Otherwise it is ignored and
+ * overwritten on exit.  The file contains executable code, so it must not
+ * be writable by anyone who is not trusted to run code in QEMU.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "config.h"
+
+#include "qemu-common.h"
+#define NO_CPU_IO_DEFS
+#include "cpu.h"
+#include "tcg.h"
+#include "qemu/log.h"
+#include "qemu/error-report.h"
+#include "qemu/qht.h"
+#include "exec/tb-cache.h"
+
+#if defined(TCG_TARGET_HAS_CACHE_RELOCS) && defined(USE_DIRECT_JUMP) && \
+    defined(__linux__)
+
+#define TB_CACHE_MAGIC      "QEMUTBC"
+#define TB_CACHE_VERSION    2
+
+/* limit on the size of the TBs translated in a single run */
+#define TB_CACHE_MAX_NEW    (256 * 1024 * 1024)
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nb_entries;
+    uint64_t build_id;
+    uint64_t config;
+    uint64_t guest_base;
+} TBCacheHeader;
+
+typedef struct TBCacheEntry {
+    /* lookup key */
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+    uint64_t phys_pc;
+    uint64_t cpu_id;
+    uint8_t mode;
+    uint8_t pad[7];
+
+    uint32_t icount;
+    uint32_t code_size;
+    uint16_t size;
+    uint16_t nb_relocs;
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[2];
+} TBCacheEntry;
+
+typedef struct TBCacheReloc {
+    uint32_t offset;
+    uint16_t type;
+    uint16_t base;
+    int64_t value;
+} TBCacheReloc;
+
+/* what TBCacheReloc.value is relative to */
+enum {
+    TB_CACHE_BASE_CODE,         /* the host code of the TB */
+    TB_CACHE_BASE_TB,           /* the TranslationBlock, for exit_tb */
+    TB_CACHE_BASE_PROLOGUE,     /* the prologue, for tb_ret_addr */
+    TB_CACHE_BASE_EXE,          /* the QEMU executable, for helpers */
+    TB_CACHE_NB_BASES
+};
+
+/* Everything is protected by tb_lock.  */
+static struct {
+    /* NULL if the cache is not used */
+    char *filename;
+    /* set once the file has been read */
+    bool mapped;
+    bool saved;
+
+    uint64_t build_id;
+    uint64_t config;
+    uint64_t guest_base;
+    uintptr_t exe_start;
+    uintptr_t exe_end;
+
+    /* the entries of the file, indexed by tb_hash_func */
+    uint8_t *file_data;
+    size_t file_size;
+    struct qht index;
+
+    /* the entries added in this run */
+    GByteArray *new_data;
+
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long rejected;
+    unsigned long added;
+} tbc;
+
+static size_t entry_relocs_offset(const TBCacheEntry *e)
+{
+    return QEMU_ALIGN_UP(sizeof(*e) + e->size + e->code_size, 8);
+}
+
+static size_t entry_size(const TBCacheEntry *e)
+{
+    return entry_relocs_offset(e) + e->nb_relocs * sizeof(TBCacheReloc);
+}
+
+static const uint8_t *entry_guest_code(const TBCacheEntry *e)
+{
+    return (const uint8_t *)(e + 1);
+}
+
+static const uint8_t *entry_host_code(const TBCacheEntry *e)
+{
+    return entry_guest_code(e) + e->size;
+}
+
+static const TBCacheReloc *entry_relocs(const TBCacheEntry *e)
+{
+    return (const TBCacheReloc *)((const uint8_t *)e +
+                                  entry_relocs_offset(e));
+}
+
+static uint32_t entry_hash(const TBCacheEntry *e)
+{
+    return tb_hash_func(e->phys_pc, e->pc, e->flags);
+}
+
+static bool entry_cmp(const void *obj, const void *userp)
+{
+    const TBCacheEntry *a = obj;
+    const TBCacheEntry *b = userp;
+
+    return a->pc == b->pc && a->cs_base == b->cs_base &&
+           a->flags == b->flags && a->phys_pc == b->phys_pc &&
+           a->cpu_id == b->cpu_id && a->mode == b->mode;
+}
+
+static uint64_t fnv1a_64(uint64_t h, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Identify what translation depends on besides the TB flags: the CPU
+   model and, for the targets where -cpu can change them without changing
+   the QOM type, its instruction set features.  */
+static uint64_t tb_cache_cpu_id(CPUArchState *env)
+{
+    const char *type = object_get_typename(OBJECT(ENV_GET_CPU(env)));
+    uint64_t h = fnv1a_64(0xcbf29ce484222325ULL, type, strlen(type));
+#if defined(TARGET_I386)
+    uint32_t features[] = {
+        env->cpuid_vendor1, env->cpuid_level, env->cpuid_xlevel,
+        env->cpuid_features, env->cpuid_ext_features,
+        env->cpuid_ext2_features, env->cpuid_ext3_features,
+        env->cpuid_7_0_ebx_features,
+    };
+#elif defined(TARGET_ARM)
+    uint64_t features[] = { env->features };
+#elif defined(TARGET_MIPS)
+    int features[] = { env->insn_flags };
+#elif defined(TARGET_SPARC)
+    uint64_t features[] = {
+        env->def->iu_version, env->def->features, env->def->nwindows,
+    };
+#elif defined(TARGET_PPC)
+    uint64_t features[] = { env->insns_flags, env->insns_flags2 };
+#elif defined(TARGET_LM32)
+    uint32_t features[] = { env->features };
+#else
+    uint32_t features[] = { 0 };
+#endif
+
+    return fnv1a_64(h, features, sizeof(features));
+}
+
+static void entry_init_key(CPUArchState *env, TranslationBlock *tb,
+                           tb_page_addr_t phys_pc, TBCacheEntry *e)
+{
+    memset(e, 0, sizeof(*e));
+    e->pc = tb->pc;
+    e->cs_base = tb->cs_base;
+    e->flags = tb->flags;
+    e->phys_pc = phys_pc;
+    e->cpu_id = tb_cache_cpu_id(env);
+    e->mode = parallel_cpus;
+}
+
+/* FNV-1a hash of the QEMU executable, 0 if it cannot be read.  */
+static uint64_t tb_cache_build_id(void)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint8_t *buf;
+    size_t n;
+    FILE *f;
+
+    f = fopen("/proc/self/exe", "rb");
+    if (!f) {
+        return 0;
+    }
+    buf = g_malloc(65536);
+    while ((n = fread(buf, 1, 65536, f)) > 0) {
+        h = fnv1a_64(h, buf, n);
+    }
+    if (ferror(f)) {
+        h = 0;
+    }
+    g_free(buf);
+    fclose(f);
+    return h;
+}
+
+/* Find the range of addresses where the QEMU executable is mapped.  */
+static bool tb_cache_find_exe(void)
+{
+    char *exe = g_file_read_link("/proc/self/exe", NULL);
+    char line[1024];
+    FILE *f;
+
+    if (!exe) {
+        return false;
+    }
+    f = fopen("/proc/self/maps", "r");
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            unsigned long start, end;
+            char *path = strchr(line, '/');
+
+            if (!path || sscanf(line, "%lx-%lx", &start, &end) != 2) {
+                continue;
+            }
+            path[strcspn(path, "\n")] = 0;
+            if (strcmp(path, exe)) {
+                continue;
+            }
+            if (!tbc.exe_end || start < tbc.exe_start) {
+                tbc.exe_start = start;
+            }
+            tbc.exe_end = MAX(tbc.exe_end, end);
+        }
+        fclose(f);
+    }
+    g_free(exe);
+    return tbc.exe_end != 0;
+}
+
+/* Read the cache file.  This is done when the first TB is translated,
+   so that the cost is not paid if the file is not used.  */
+static void tb_cache_map(void)
+{
+    const TBCacheHeader *hdr;
+    struct stat st;
+    size_t ofs;
+    uint32_t i;
+    void *data;
+    int fd;
+
+    tbc.mapped = true;
+    tbc.build_id = tb_cache_build_id();
+    if (!tbc.build_id || !tb_cache_find_exe()) {
+        error_report("%s: cannot identify the QEMU executable, "
+                     "not using the translation cache", tbc.filename);
+        g_free(tbc.filename);
+        tbc.filename = NULL;
+        return;
+    }
+    tbc.config = tcg_cache_config() | (uint64_t)!!use_icount << 32 |
+                 (uint64_t)!!singlestep << 33;
+#if defined(CONFIG_USER_ONLY)
+    tbc.guest_base = GUEST_BASE;
+#endif
+    tbc.new_data = g_byte_array_new();
+    qht_init(&tbc.index, 0, QHT_MODE_AUTO_RESIZE);
+
+    fd = open(tbc.filename, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size >= sizeof(*hdr)) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            tbc.file_data = data;
+            tbc.file_size = st.st_size;
+        }
+    }
+    close(fd);
+    if (!tbc.file_data) {
+        return;
+    }
+
+    hdr = (const TBCacheHeader *)tbc.file_data;
+    if (memcmp(hdr->magic, TB_CACHE_MAGIC, sizeof(hdr->magic)) ||
+        hdr->version != TB_CACHE_VERSION || hdr->build_id != tbc.build_id ||
+        hdr->config != tbc.config || hdr->guest_base != tbc.guest_base) {
+        /* written by another QEMU, or with other options */
+        munmap(tbc.file_data, tbc.file_size);
+        tbc.file_data = NULL;
+        return;
+    }
+
+    ofs = sizeof(*hdr);
+    for (i = 0; i < hdr->nb_entries; i++) {
+        TBCacheEntry *e = (TBCacheEntry *)(tbc.file_data + ofs);
+
+        if (tbc.file_size - ofs < sizeof(*e) ||
+            tbc.file_size - ofs < entry_size(e)) {
+            break;
+        }
+        qht_insert(&tbc.index, e, entry_hash(e));
+        ofs += entry_size(e);
+    }
+}
+
+static bool tb_cache_enabled(CPUArchState *env, TranslationBlock *tb)
+{
+    if (!tbc.filename || tb->cflags || env->singlestep_enabled ||
+        !QTAILQ_EMPTY(&env->breakpoints) ||
+        qemu_loglevel_mask(CPU_LOG_TB_OUT_ASM | CPU_LOG_TB_IN_ASM |
+                           CPU_LOG_TB_OP | CPU_LOG_TB_OP_OPT)) {
+        return false;
+    }
+    /* goto_tb pads the code depending on its alignment */
+    if ((uintptr_t)tb->tc_ptr & (CODE_GEN_ALIGN - 1)) {
+        return false;
+    }
+    if (!tbc.mapped) {
+        tb_cache_map();
+    }
+    return tbc.filename != NULL;
+}
+
+/* The guest code of a TB, or NULL if it cannot be read or if it crosses
+   a page boundary.  */
+static const uint8_t *tb_cache_guest_code(target_ulong pc,
+                                          tb_page_addr_t phys_pc, int size)
+{
+    if (size == 0 || (pc & ~TARGET_PAGE_MASK) + size > TARGET_PAGE_SIZE) {
+        return NULL;
+    }
+#if defined(CONFIG_USER_ONLY)
+    if (page_check_range(pc, size, PAGE_READ) < 0) {
+        return NULL;
+    }
+    return g2h(pc);
+#else
+    return qemu_get_ram_ptr(phys_pc);
+#endif
+}
+
+static uintptr_t tb_cache_base(int base, TranslationBlock *tb)
+{
+    switch (base) {
+    case TB_CACHE_BASE_CODE:
+        return (uintptr_t)tb->tc_ptr;
+    case TB_CACHE_BASE_TB:
+        return (uintptr_t)tb;
+    case TB_CACHE_BASE_PROLOGUE:
+        return (uintptr_t)tcg_ctx.code_gen_prologue;
+    default:
+        return tbc.exe_start;
+    }
+}
+
+/* Find the memory area that contains the host address VALUE, or -1.  */
+static int tb_cache_classify(TranslationBlock *tb, int code_size,
+                             uintptr_t value)
+{
+    uintptr_t size[TB_CACHE_NB_BASES] = {
+        [TB_CACHE_BASE_CODE] = code_size,
+        [TB_CACHE_BASE_TB] = sizeof(*tb),
+        [TB_CACHE_BASE_PROLOGUE] = CODE_GEN_PROLOGUE_SIZE,
+        [TB_CACHE_BASE_EXE] = tbc.exe_end - tbc.exe_start,
+    };
+    int base;
+
+    for (base = 0; base < TB_CACHE_NB_BASES; base++) {
+        if (value - tb_cache_base(base, tb) < size[base]) {
+            return base;
+        }
+    }
+    return -1;
+}
+
+bool tb_cache_load(CPUArchState *env, TranslationBlock *tb,
+                   tb_page_addr_t phys_pc, int *gen_code_size_ptr)
+{
+    TBCacheEntry key;
+    const TBCacheEntry *e;
+    const TBCacheReloc *r;
+    const uint8_t *guest;
+    int i, size;
+
+    if (!tb_cache_enabled(env, tb)) {
+        return false;
+    }
+    entry_init_key(env, tb, phys_pc, &key);
+    e = qht_lookup(&tbc.index, entry_cmp, &key, entry_hash(&key));
+    if (!e) {
+        tbc.misses++;
+        return false;
+    }
+
+    guest = tb_cache_guest_code(tb->pc, phys_pc, e->size);
+    if (!guest || memcmp(guest, entry_guest_code(e), e->size) ||
+        e->code_size > TCG_MAX_OP_SIZE * OPC_BUF_SIZE) {
+        tbc.rejected++;
+        return false;
+    }
+
+    memcpy(tb->tc_ptr, entry_host_code(e), e->code_size);
+    r = entry_relocs(e);
+    for (i = 0; i < e->nb_relocs; i++, r++) {
+        size = tcg_cache_reloc_size(r->type);
+        if (r->base >= TB_CACHE_NB_BASES || size == 0 ||
+            size > e->code_size || r->offset > e->code_size - size ||
+            !tcg_patch_cache_reloc(tb->tc_ptr + r->offset, r->type,
+                                   tb_cache_base(r->base, tb) + r->value)) {
+            tbc.rejected++;
+            return false;
+        }
+    }
+    flush_icache_range((tcg_target_ulong)tb->tc_ptr,
+                       (tcg_target_ulong)tb->tc_ptr + e->code_size);
+
+    tb->size = e->size;
+    tb->icount = e->icount;
+    for (i = 0; i < 2; i++) {
+        tb->tb_next_offset[i] = e->tb_next_offset[i];
+        tb->tb_jmp_offset[i] = e->tb_jmp_offset[i];
+    }
+    *gen_code_size_ptr = e->code_size;
+    tbc.hits++;
+    return true;
+}
+
+void tb_cache_add(CPUArchState *env, TranslationBlock *tb,
+                  tb_page_addr_t phys_pc, int gen_code_size)
+{
+    static const uint8_t zero[8];
+    TCGContext *s = &tcg_ctx;
+    const uint8_t *guest;
+    TBCacheEntry e;
+    guint len;
+    int i;
+
+    if (!tb_cache_enabled(env, tb) || s->code_not_relocatable) {
+        return;
+    }
+    guest = tb_cache_guest_code(tb->pc, phys_pc, tb->size);
+    if (!guest) {
+        return;
+    }
+
+    entry_init_key(env, tb, phys_pc, &e);
+    e.icount = tb->icount;
+    e.code_size = gen_code_size;
+    e.size = tb->size;
+    e.nb_relocs = s->nb_cache_relocs;
+    for (i = 0; i < 2; i++) {
+        e.tb_next_offset[i] = tb->tb_next_offset[i];
+        e.tb_jmp_offset[i] = tb->tb_jmp_offset[i];
+    }
+    len = tbc.new_data->len;
+    if (len + entry_size(&e) > TB_CACHE_MAX_NEW) {
+        return;
+    }
+
+    g_byte_array_append(tbc.new_data, (guint8 *)&e, sizeof(e));
+    g_byte_array_append(tbc.new_data, guest, e.size);
+    g_byte_array_append(tbc.new_data, tb->tc_ptr, e.code_size);
+    g_byte_array_append(tbc.new_data, zero,
+                        entry_relocs_offset(&e) - sizeof(e) - e.size -
+                        e.code_size);
+    for (i = 0; i < s->nb_cache_relocs; i++) {
+        TCGCacheReloc *cr = &s->cache_relocs[i];
+        int base = tb_cache_classify(tb, gen_code_size, cr->value);
+        TBCacheReloc r;
+
+        if (base < 0) {
+            /* an address we do not know how to relocate */
+            g_byte_array_set_size(tbc.new_data, len);
+            return;
+        }
+        memset(&r, 0, sizeof(r));
+        r.offset = cr->offset;
+        r.type = cr->type;
+        r.base = base;
+        r.value = cr->value - tb_cache_base(base, tb);
+        g_byte_array_append(tbc.new_data, (guint8 *)&r, sizeof(r));
+    }
+    tbc.added++;
+}
+
+/* Add an entry to the table of entries to save, replacing an older one
+   with the same key.  */
+static void tb_cache_merge_entry(struct qht *ht, TBCacheEntry *e,
+                                 bool replace)
+{
+    uint32_t h = entry_hash(e);
+    TBCacheEntry *old = qht_lookup(ht, entry_cmp, e, h);
+
+    if (old) {
+        if (!replace) {
+            return;
+        }
+        qht_remove(ht, old, h);
+    }
+    qht_insert(ht, e, h);
+}
+
+static void tb_cache_merge_old(struct qht *ht, void *p, uint32_t h,
+                               void *userp)
+{
+    tb_cache_merge_entry(userp, p, false);
+}
+
+static void tb_cache_write_entry(struct qht *ht, void *p, uint32_t h,
+                                 void *userp)
+{
+    fwrite(p, entry_size(p), 1, userp);
+}
+
+void tb_cache_save(void)
+{
+    struct qht merged;
+    TBCacheHeader hdr;
+    char *tmpname;
+    size_t ofs;
+    FILE *f;
+    int fd;
+
+    tb_lock();
+    if (!tbc.filename || !tbc.mapped || tbc.saved || !tbc.added) {
+        tb_unlock();
+        return;
+    }
+    tbc.saved = true;
+
+    /* the entries translated in this run win over those of the file */
+    qht_init(&merged, tbc.index.n_entries + tbc.added, 0);
+    for (ofs = 0; ofs < tbc.new_data->len;) {
+        TBCacheEntry *e = (TBCacheEntry *)(tbc.new_data->data + ofs);
+
+        tb_cache_merge_entry(&merged, e, true);
+        ofs += entry_size(e);
+    }
+    qht_iter(&tbc.index, tb_cache_merge_old, &merged);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TB_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TB_CACHE_VERSION;
+    hdr.nb_entries = merged.n_entries;
+    hdr.build_id = tbc.build_id;
+    hdr.config = tbc.config;
+    hdr.guest_base = tbc.guest_base;
+
+    /* write a new file and rename it, so that a concurrent QEMU never
+       sees a partial file */
+    tmpname = g_strdup_printf("%s.XXXXXX", tbc.filename);
+    fd = mkstemp(tmpname);
+    f = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (!f) {
+        error_report("%s: cannot save the translation cache: %s",
+                     tbc.filename, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmpname);
+        }
+        goto out;
+    }
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    qht_iter(&merged, tb_cache_write_entry, f);
+    if (ferror(f) | fclose(f) || rename(tmpname, tbc.filename) < 0) {
+        error_report("%s: cannot save the translation cache: %s",
+                     tbc.filename, strerror(errno));
+        unlink(tmpname);
+    }
+
+out:
+    g_free(tmpname);
+    qht_destroy(&merged);
+    tb_unlock();
+}
+
+void tb_cache_init(const char *filename, Error **errp)
+{
+    int fd;
+
+    /* fail early if the file exists and cannot be read */
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 && errno != ENOENT) {
+        error_setg_errno(errp, errno, "Could not open '%s'", filename);
+        return;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    g_free(tbc.filename);
+    tbc.filename = g_strdup(filename);
+}
+
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    if (!tbc.filename) {
+        return;
+    }
+    cpu_fprintf(f, "TB cache            %s\n", tbc.filename);
+    cpu_fprintf(f, "TB cache entries    %zu loaded, %lu added\n",
+                tbc.mapped ? tbc.index.n_entries : 0, tbc.added);
+    cpu_fprintf(f, "TB cache lookups    %lu hits, %lu misses, %lu rejected\n",
+                tbc.hits, tbc.misses, tbc.rejected);
+}
+
+#else
+
+void tb_cache_init(const char *filename, Error **errp)
+{
+    error_setg(errp, "The translation cache is not supported on this host");
+}
+
+void tb_cache_save(void)
+{
+}
+
+bool tb_cache_load(CPUArchState *env, TranslationBlock *tb,
+                   tb_page_addr_t phys_pc, int *gen_code_size_ptr)
+{
+    return false;
+}
+
+void tb_cache_add(CPUArchState *env, TranslationBlock *tb,
+                  tb_page_addr_t phys_pc, int gen_code_size)
+{
+}
+
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+}
+
+#endif
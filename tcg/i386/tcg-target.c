@@ -245,12 +245,14 @@ static inline int tcg_target_const_match(tcg_target_long val,
 # define P_REXB_R	0x1000		/* REG field as byte register */
 # define P_REXB_RM	0x2000		/* R/M field as byte register */
 # define P_GS           0x4000          /* gs segment override */
+# define P_SIMDF3       0x10000         /* 0xf3 opcode prefix */
 #else
 # define P_ADDR32	0
 # define P_REXW		0
 # define P_REXB_R	0
 # define P_REXB_RM	0
 # define P_GS           0
+# define P_SIMDF3       0
 #endif
 
 #define OPC_ARITH_EvIz	(0x81)
@@ -294,6 +296,31 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_TESTL	(0x85)
 #define OPC_XCHG_ax_r32	(0x90)
 
+/* SSE2, only used by the vector ops of 64-bit hosts.  */
+#define OPC_MOVD_VyEy   (0x6e | P_EXT | P_DATA16)
+#define OPC_MOVQ_VqWq   (0x7e | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_WqVq   (0xd6 | P_EXT | P_DATA16)
+#define OPC_MOVDQU_VxWx (0x6f | P_EXT | P_SIMDF3)
+#define OPC_MOVDQU_WxVx (0x7f | P_EXT | P_SIMDF3)
+#define OPC_PADDB       (0xfc | P_EXT | P_DATA16)
+#define OPC_PADDW       (0xfd | P_EXT | P_DATA16)
+#define OPC_PADDD       (0xfe | P_EXT | P_DATA16)
+#define OPC_PADDQ       (0xd4 | P_EXT | P_DATA16)
+#define OPC_PSUBB       (0xf8 | P_EXT | P_DATA16)
+#define OPC_PSUBW       (0xf9 | P_EXT | P_DATA16)
+#define OPC_PSUBD       (0xfa | P_EXT | P_DATA16)
+#define OPC_PSUBQ       (0xfb | P_EXT | P_DATA16)
+#define OPC_PAND        (0xdb | P_EXT | P_DATA16)
+#define OPC_PANDN       (0xdf | P_EXT | P_DATA16)
+#define OPC_POR         (0xeb | P_EXT | P_DATA16)
+#define OPC_PXOR        (0xef | P_EXT | P_DATA16)
+#define OPC_PSHIFTW_Ib  (0x71 | P_EXT | P_DATA16) /* /2 /4 /6 */
+#define OPC_PSHIFTD_Ib  (0x72 | P_EXT | P_DATA16) /* /2 /4 /6 */
+#define OPC_PSHIFTQ_Ib  (0x73 | P_EXT | P_DATA16) /* /2 /6 */
+#define OPC_PUNPCKLBW   (0x60 | P_EXT | P_DATA16)
+#define OPC_PUNPCKLWD   (0x61 | P_EXT | P_DATA16)
+#define OPC_PSHUFD      (0x70 | P_EXT | P_DATA16)
+
 #define OPC_GRP3_Ev	(0xf7)
 #define OPC_GRP5	(0xff)
 
@@ -323,6 +350,11 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define EXT3_DIV   6
 #define EXT3_IDIV  7
 
+/* Opcode extensions for the SSE2 shifts by immediate.  */
+#define PSHIFT_SRL 2
+#define PSHIFT_SRA 4
+#define PSHIFT_SLL 6
+
 /* Group 5 opcode extensions for 0xff.  To be used with OPC_GRP5.  */
 #define EXT5_INC_Ev	0
 #define EXT5_DEC_Ev	1
@@ -377,6 +409,9 @@ static void tcg_out_opc(TCGContext *s, int opc, int r, int rm, int x)
     if (opc & P_ADDR32) {
         tcg_out8(s, 0x67);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    }
 
     rex = 0;
     rex |= (opc & P_REXW) >> 8;		/* REX.W */
@@ -436,6 +471,8 @@ static void tcg_out_modrm_sib_offset(TCGContext *s, int opc, int r, int rm,
     int mod, len;
 
     if (index < 0 && rm < 0) {
+        /* the code depends on the absolute address */
+        s->code_not_relocatable = true;
         if (TCG_TARGET_REG_BITS == 64) {
             /* Try for a rip-relative addressing mode.  This has replaced
                the 32-bit-mode absolute addressing encoding.  */
@@ -557,6 +594,84 @@ static void tcg_out_movi(TCGContext *s, TCGType type,
     }
 }
 
+/* How host addresses are encoded, for TCGCacheReloc.  */
+enum {
+    CACHE_RELOC_PC32,       /* displacement of a call or jmp */
+    CACHE_RELOC_IMM32,      /* movl $imm32, zero extended */
+    CACHE_RELOC_SIMM32,     /* movq $imm32, sign extended */
+    CACHE_RELOC_IMM64,      /* movabsq $imm64 */
+};
+
+/* The encoding chosen by tcg_out_movi for a pointer, -1 if none.  */
+static int movi_cache_reloc_type(tcg_target_long arg)
+{
+    if (arg == 0) {
+        return -1;
+    } else if (TCG_TARGET_REG_BITS == 32 || arg == (uint32_t)arg) {
+        return CACHE_RELOC_IMM32;
+    } else if (arg == (int32_t)arg) {
+        return CACHE_RELOC_SIMM32;
+    } else {
+        return CACHE_RELOC_IMM64;
+    }
+}
+
+/* Load a host address into RET, recording it for the TB cache.  */
+static void tcg_out_movi_addr(TCGContext *s, TCGReg ret, tcg_target_long arg)
+{
+    int type = movi_cache_reloc_type(arg);
+
+    tcg_out_movi(s, TCG_TYPE_PTR, ret, arg);
+    if (type == CACHE_RELOC_IMM64) {
+        tcg_out_cache_reloc(s, s->code_ptr - 8, type, arg);
+    } else if (type >= 0) {
+        tcg_out_cache_reloc(s, s->code_ptr - 4, type, arg);
+    }
+}
+
+static int cache_reloc_size(int type)
+{
+    switch (type) {
+    case CACHE_RELOC_PC32:
+    case CACHE_RELOC_IMM32:
+    case CACHE_RELOC_SIMM32:
+        return 4;
+    case CACHE_RELOC_IMM64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+static bool patch_cache_reloc(uint8_t *code_ptr, int type,
+                              tcg_target_long value)
+{
+    switch (type) {
+    case CACHE_RELOC_PC32:
+        value -= (tcg_target_long)code_ptr + 4;
+        if (value != (int32_t)value) {
+            return false;
+        }
+        *(int32_t *)code_ptr = value;
+        return true;
+    case CACHE_RELOC_IMM32:
+    case CACHE_RELOC_SIMM32:
+        if (movi_cache_reloc_type(value) != type) {
+            return false;
+        }
+        *(uint32_t *)code_ptr = value;
+        return true;
+    case CACHE_RELOC_IMM64:
+        if (movi_cache_reloc_type(value) != type) {
+            return false;
+        }
+        *(uint64_t *)code_ptr = value;
+        return true;
+    default:
+        return false;
+    }
+}
+
 static inline void tcg_out_pushi(TCGContext *s, tcg_target_long val)
 {
     if (val == (int8_t)val) {
@@ -982,7 +1097,10 @@ static void tcg_out_branch(TCGContext *s, int call, tcg_target_long dest)
     if (disp == (int32_t)disp) {
         tcg_out_opc(s, call ? OPC_CALL_Jz : OPC_JMP_long, 0, 0, 0);
         tcg_out32(s, disp);
+        tcg_out_cache_reloc(s, s->code_ptr - 4, CACHE_RELOC_PC32, dest);
     } else {
+        /* a later run could use the short form */
+        s->code_not_relocatable = true;
         tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_R10, dest);
         tcg_out_modrm(s, OPC_GRP5,
                       call ? EXT5_CALLN_Ev : EXT5_JMPN_Ev, TCG_REG_R10);
@@ -1129,6 +1247,16 @@ static inline void setup_guest_base_seg(void)
 static inline void setup_guest_base_seg(void) { }
 #endif /* SOFTMMU */
 
+/* The choices made by the code generator at run time.  */
+static uint32_t cache_config(void)
+{
+#if defined(CONFIG_SOFTMMU)
+    return have_cmov;
+#else
+    return have_cmov | (guest_base_flags << 1);
+#endif
+}
+
 static void tcg_out_qemu_ld_direct(TCGContext *s, int datalo, int datahi,
                                    int base, tcg_target_long ofs, int seg,
                                    int sizeop)
@@ -1662,6 +1790,112 @@ void tcg_out_tb_finalize(TCGContext *s)
 }
 #endif  /* CONFIG_SOFTMMU */
 
+#if TCG_TARGET_REG_BITS == 64
+/* The vector ops work in %xmm0 and %xmm1, which the register allocator
+   does not know about; both are call-clobbered in every host ABI.  Only
+   register operands are used, because the SSE forms with a memory operand
+   require 16-byte alignment.  */
+#define TCG_VEC_TMP0 0
+#define TCG_VEC_TMP1 1
+
+static void tcg_out_vec_ld(TCGContext *s, int oprsz, int xmm, int base,
+                           tcg_target_long ofs)
+{
+    tcg_out_modrm_offset(s, oprsz == 8 ? OPC_MOVQ_VqWq : OPC_MOVDQU_VxWx,
+                         xmm, base, ofs);
+}
+
+static void tcg_out_vec_st(TCGContext *s, int oprsz, int xmm, int base,
+                           tcg_target_long ofs)
+{
+    tcg_out_modrm_offset(s, oprsz == 8 ? OPC_MOVQ_WqVq : OPC_MOVDQU_WxVx,
+                         xmm, base, ofs);
+}
+
+static void tcg_out_vec_op(TCGContext *s, TCGOpcode opc, const TCGArg *args)
+{
+    static const int add_insn[4] = {
+        OPC_PADDB, OPC_PADDW, OPC_PADDD, OPC_PADDQ
+    };
+    static const int sub_insn[4] = {
+        OPC_PSUBB, OPC_PSUBW, OPC_PSUBD, OPC_PSUBQ
+    };
+    static const int shift_insn[4] = {
+        0, OPC_PSHIFTW_Ib, OPC_PSHIFTD_Ib, OPC_PSHIFTQ_Ib
+    };
+    int vece, oprsz, base, insn, ext;
+
+    if (opc == INDEX_op_vec_dup_i32) {
+        base = args[0];
+        vece = TCG_VEC_DESC_VECE(args[2]);
+        oprsz = TCG_VEC_DESC_OPRSZ(args[2]);
+        tcg_out_modrm(s, OPC_MOVD_VyEy, TCG_VEC_TMP0, args[1]);
+        if (vece == TCG_VEC_8) {
+            tcg_out_modrm(s, OPC_PUNPCKLBW, TCG_VEC_TMP0, TCG_VEC_TMP0);
+        }
+        if (vece <= TCG_VEC_16) {
+            tcg_out_modrm(s, OPC_PUNPCKLWD, TCG_VEC_TMP0, TCG_VEC_TMP0);
+        }
+        tcg_out_modrm(s, OPC_PSHUFD, TCG_VEC_TMP0, TCG_VEC_TMP0);
+        tcg_out8(s, 0);
+        tcg_out_vec_st(s, oprsz, TCG_VEC_TMP0, base, args[3]);
+        return;
+    }
+
+    base = args[0];
+    vece = TCG_VEC_DESC_VECE(args[1]);
+    oprsz = TCG_VEC_DESC_OPRSZ(args[1]);
+
+    switch (opc) {
+    case INDEX_op_vec_shli:
+        ext = PSHIFT_SLL;
+        goto do_shift;
+    case INDEX_op_vec_shri:
+        ext = PSHIFT_SRL;
+        goto do_shift;
+    case INDEX_op_vec_sari:
+        ext = PSHIFT_SRA;
+    do_shift:
+        tcg_out_vec_ld(s, oprsz, TCG_VEC_TMP0, base, args[3]);
+        tcg_out_modrm(s, shift_insn[vece], ext, TCG_VEC_TMP0);
+        tcg_out8(s, args[4]);
+        tcg_out_vec_st(s, oprsz, TCG_VEC_TMP0, base, args[2]);
+        return;
+
+    case INDEX_op_vec_andc:
+        /* pandn complements its destination operand.  */
+        tcg_out_vec_ld(s, oprsz, TCG_VEC_TMP0, base, args[4]);
+        tcg_out_vec_ld(s, oprsz, TCG_VEC_TMP1, base, args[3]);
+        tcg_out_modrm(s, OPC_PANDN, TCG_VEC_TMP0, TCG_VEC_TMP1);
+        tcg_out_vec_st(s, oprsz, TCG_VEC_TMP0, base, args[2]);
+        return;
+
+    case INDEX_op_vec_add:
+        insn = add_insn[vece];
+        break;
+    case INDEX_op_vec_sub:
+        insn = sub_insn[vece];
+        break;
+    case INDEX_op_vec_and:
+        insn = OPC_PAND;
+        break;
+    case INDEX_op_vec_or:
+        insn = OPC_POR;
+        break;
+    case INDEX_op_vec_xor:
+        insn = OPC_PXOR;
+        break;
+    default:
+        tcg_abort();
+    }
+
+    tcg_out_vec_ld(s, oprsz, TCG_VEC_TMP0, base, args[3]);
+    tcg_out_vec_ld(s, oprsz, TCG_VEC_TMP1, base, args[4]);
+    tcg_out_modrm(s, insn, TCG_VEC_TMP0, TCG_VEC_TMP1);
+    tcg_out_vec_st(s, oprsz, TCG_VEC_TMP0, base, args[2]);
+}
+#endif
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -1679,12 +1913,17 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 
     switch(opc) {
     case INDEX_op_exit_tb:
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        tcg_out_movi_addr(s, TCG_REG_EAX, args[0]);
         tcg_out_jmp(s, (tcg_target_long) tb_ret_addr);
         break;
     case INDEX_op_goto_tb:
         if (s->tb_jmp_offset) {
             /* direct jump method */
+            /* align the displacement, so that tb_set_jmp_target patches
+               it atomically while other vCPU threads may execute it */
+            while (((uintptr_t)s->code_ptr + 1) & 3) {
+                tcg_out8(s, OPC_XCHG_ax_r32 + TCG_REG_EAX); /* nop */
+            }
             tcg_out8(s, OPC_JMP_long); /* jmp im */
             s->tb_jmp_offset[args[0]] = s->code_ptr - s->code_buf;
             tcg_out32(s, 0);
@@ -1695,6 +1934,10 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         s->tb_next_offset[args[0]] = s->code_ptr - s->code_buf;
         break;
+    case INDEX_op_goto_ptr:
+        /* jmp *reg */
+        tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, args[0]);
+        break;
     case INDEX_op_call:
         if (const_args[0]) {
             tcg_out_calli(s, args[0]);
@@ -2005,6 +2248,19 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
     case INDEX_op_ext32s_i64:
         tcg_out_ext32s(s, args[0], args[1]);
         break;
+
+    case INDEX_op_vec_add:
+    case INDEX_op_vec_sub:
+    case INDEX_op_vec_and:
+    case INDEX_op_vec_or:
+    case INDEX_op_vec_xor:
+    case INDEX_op_vec_andc:
+    case INDEX_op_vec_shli:
+    case INDEX_op_vec_shri:
+    case INDEX_op_vec_sari:
+    case INDEX_op_vec_dup_i32:
+        tcg_out_vec_op(s, opc, args);
+        break;
 #endif
 
     OP_32_64(deposit):
@@ -2033,6 +2289,7 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
     { INDEX_op_call, { "ri" } },
     { INDEX_op_br, { } },
     { INDEX_op_mov_i32, { "r", "r" } },
@@ -2143,6 +2400,17 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_muls2_i64, { "a", "d", "a", "r" } },
     { INDEX_op_add2_i64, { "r", "r", "0", "1", "re", "re" } },
     { INDEX_op_sub2_i64, { "r", "r", "0", "1", "re", "re" } },
+
+    { INDEX_op_vec_add, { "r" } },
+    { INDEX_op_vec_sub, { "r" } },
+    { INDEX_op_vec_and, { "r" } },
+    { INDEX_op_vec_or, { "r" } },
+    { INDEX_op_vec_xor, { "r" } },
+    { INDEX_op_vec_andc, { "r" } },
+    { INDEX_op_vec_shli, { "r" } },
+    { INDEX_op_vec_shri, { "r" } },
+    { INDEX_op_vec_sari, { "r" } },
+    { INDEX_op_vec_dup_i32, { "r", "r" } },
 #endif
 
 #if TCG_TARGET_REG_BITS == 64
@@ -2253,6 +2521,11 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, tcg_target_call_iarg_regs[1]);
 #endif
 
+    /* Return path for goto_ptr.  Set return value to 0, a-la exit_tb,
+       and fall through to the rest of the epilogue.  */
+    s->code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_REG, TCG_REG_EAX, 0);
+
     /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
@@ -96,6 +96,7 @@ typedef enum {
 #define TCG_TARGET_HAS_sub2_i32         1
 #define TCG_TARGET_HAS_mulu2_i32        1
 #define TCG_TARGET_HAS_muls2_i32        1
+#define TCG_TARGET_HAS_goto_ptr         1
 
 #if TCG_TARGET_REG_BITS == 64
 #define TCG_TARGET_HAS_div2_i64         1
@@ -124,10 +125,32 @@ typedef enum {
 #define TCG_TARGET_HAS_muls2_i64        1
 #endif
 
+/* Vector ops use SSE2, which all x86-64 processors have.  */
+#if TCG_TARGET_REG_BITS == 64
+#define TCG_TARGET_HAS_vec              1
+#else
+#define TCG_TARGET_HAS_vec              0
+#endif
+
+/* Jump displacements are patched atomically (see goto_tb), and the host
+   memory model is at least as strong as the one of the supported guests,
+   so generated code can run on several threads at once.  64-bit hosts
+   only, because helpers need 64-bit compare-and-swap.  */
+#if TCG_TARGET_REG_BITS == 64
+#define TCG_TARGET_SUPPORTS_MTTCG       1
+#endif
+
+/* Host addresses in the generated code are recorded for the persistent
+   TB cache.  */
+#define TCG_TARGET_HAS_CACHE_RELOCS     1
+
 #define TCG_TARGET_deposit_i32_valid(ofs, len) \
     (((ofs) == 0 && (len) == 8) || ((ofs) == 8 && (len) == 8) || \
      ((ofs) == 0 && (len) == 16))
 #define TCG_TARGET_deposit_i64_valid    TCG_TARGET_deposit_i32_valid
+/* SSE2 has no byte shifts, and no 64-bit arithmetic right shift.  */
+#define TCG_TARGET_vec_shi_valid(vece, sar) \
+    ((vece) != TCG_VEC_8 && !((sar) && (vece) == TCG_VEC_64))
 
 #if TCG_TARGET_REG_BITS == 64
 # define TCG_AREG0 TCG_REG_R14
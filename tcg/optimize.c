@@ -47,10 +47,48 @@ struct tcg_temp_info {
     uint16_t next_copy;
     tcg_target_ulong val;
     tcg_target_ulong mask;
+    bool in_mem;
 };
 
 static struct tcg_temp_info temps[TCG_MAX_TEMPS];
 
+/* Values known to be in the CPU state, at offset OFS from env.  A load
+   LD_OP of the same size and offset can be replaced with a move from
+   TEMP.  If STORE_ARGS is not NULL, the value was put there by the store
+   at STORE_OP_INDEX and nothing has read it yet, so the store is dead if
+   the location is written again.  */
+struct tcg_mem_info {
+    tcg_target_long ofs;
+    int size;
+    TCGOpcode ld_op;
+    TCGArg temp;
+    int store_op_index;
+    TCGArg *store_args;
+};
+
+#define TCG_OPT_MAX_MEMS 16
+
+static struct tcg_mem_info mems[TCG_OPT_MAX_MEMS];
+static int nb_mems;
+
+static void remove_mem(int i)
+{
+    mems[i] = mems[--nb_mems];
+}
+
+/* Forget the values held by TEMP.  */
+static void reset_mem_temp(TCGArg temp)
+{
+    int i;
+
+    for (i = nb_mems - 1; i >= 0; i--) {
+        if (mems[i].temp == temp) {
+            remove_mem(i);
+        }
+    }
+    temps[temp].in_mem = false;
+}
+
 /* Reset TEMP's state to TCG_TEMP_UNDEF.  If TEMP only had one copy, remove
    the copy flag from the left temp.  */
 static void reset_temp(TCGArg temp)
@@ -63,6 +101,9 @@ static void reset_temp(TCGArg temp)
             temps[temps[temp].prev_copy].next_copy = temps[temp].next_copy;
         }
     }
+    if (temps[temp].in_mem) {
+        reset_mem_temp(temp);
+    }
     temps[temp].state = TCG_TEMP_UNDEF;
     temps[temp].mask = -1;
 }
@@ -74,6 +115,73 @@ static void reset_all_temps(int nb_temps)
     for (i = 0; i < nb_temps; i++) {
         temps[i].state = TCG_TEMP_UNDEF;
         temps[i].mask = -1;
+        temps[i].in_mem = false;
+    }
+    nb_mems = 0;
+}
+
+static void reset_all_mems(void)
+{
+    int i;
+
+    for (i = 0; i < nb_mems; i++) {
+        temps[mems[i].temp].in_mem = false;
+    }
+    nb_mems = 0;
+}
+
+static void record_mem(tcg_target_long ofs, int size, TCGOpcode ld_op,
+                       TCGArg temp, int store_op_index, TCGArg *store_args)
+{
+    struct tcg_mem_info *m;
+
+    if (nb_mems == TCG_OPT_MAX_MEMS) {
+        return;
+    }
+    m = &mems[nb_mems++];
+    m->ofs = ofs;
+    m->size = size;
+    m->ld_op = ld_op;
+    m->temp = temp;
+    m->store_op_index = store_op_index;
+    m->store_args = store_args;
+    temps[temp].in_mem = true;
+}
+
+static bool mem_overlaps(struct tcg_mem_info *m, tcg_target_long ofs,
+                         int size)
+{
+    return m->ofs < ofs + size && ofs < m->ofs + m->size;
+}
+
+static bool temp_is_env(TCGContext *s, TCGArg arg)
+{
+    return s->temps[arg].fixed_reg && s->temps[arg].reg == TCG_AREG0;
+}
+
+/* Return the number of bytes accessed by a host load or store.  */
+static int ld_st_size(TCGOpcode op)
+{
+    switch (op) {
+    CASE_OP_32_64(ld8u):
+    CASE_OP_32_64(ld8s):
+    CASE_OP_32_64(st8):
+        return 1;
+    CASE_OP_32_64(ld16u):
+    CASE_OP_32_64(ld16s):
+    CASE_OP_32_64(st16):
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_st_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_st32_i64:
+        return 4;
+    case INDEX_op_ld_i64:
+    case INDEX_op_st_i64:
+        return 8;
+    default:
+        tcg_abort();
     }
 }
 
@@ -483,8 +591,10 @@ static bool swap_commutative2(TCGArg *p1, TCGArg *p2)
 static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                                     TCGArg *args, TCGOpDef *tcg_op_defs)
 {
-    int i, nb_ops, op_index, nb_temps, nb_globals, nb_call_args;
-    tcg_target_ulong mask, affected;
+    int i, nb_ops, op_index, nb_temps, nb_globals, nb_call_args, size;
+    tcg_target_ulong mask, partmask, affected;
+    tcg_target_long ofs;
+    bool dead_code = false;
     TCGOpcode op;
     const TCGOpDef *def;
     TCGArg *gen_args;
@@ -504,6 +614,22 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
     for (op_index = 0; op_index < nb_ops; op_index++) {
         op = s->gen_opc_buf[op_index];
         def = &tcg_op_defs[op];
+
+        /* Nothing is reachable between an unconditional jump and the
+           next label.  */
+        if (dead_code) {
+            if (op != INDEX_op_set_label) {
+                s->gen_opc_buf[op_index] = INDEX_op_nop;
+                if (op == INDEX_op_call) {
+                    args += (args[0] >> 16) + (args[0] & 0xffff) + 3;
+                } else {
+                    args += def->nb_args;
+                }
+                continue;
+            }
+            dead_code = false;
+        }
+
         /* Do copy propagation */
         if (op == INDEX_op_call) {
             int nb_oargs = args[0] >> 16;
@@ -663,22 +789,36 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             mask = temps[args[1]].mask & mask;
             break;
 
-        CASE_OP_32_64(sar):
+        case INDEX_op_sar_i32:
+            if (temps[args[2]].state == TCG_TEMP_CONST) {
+                tmp = temps[args[2]].val & 31;
+                mask = (int32_t)temps[args[1]].mask >> tmp;
+            }
+            break;
+        case INDEX_op_sar_i64:
             if (temps[args[2]].state == TCG_TEMP_CONST) {
-                mask = ((tcg_target_long)temps[args[1]].mask
-                        >> temps[args[2]].val);
+                tmp = temps[args[2]].val & 63;
+                mask = (tcg_target_long)temps[args[1]].mask >> tmp;
             }
             break;
 
-        CASE_OP_32_64(shr):
+        case INDEX_op_shr_i32:
             if (temps[args[2]].state == TCG_TEMP_CONST) {
-                mask = temps[args[1]].mask >> temps[args[2]].val;
+                tmp = temps[args[2]].val & 31;
+                mask = (uint32_t)temps[args[1]].mask >> tmp;
+            }
+            break;
+        case INDEX_op_shr_i64:
+            if (temps[args[2]].state == TCG_TEMP_CONST) {
+                tmp = temps[args[2]].val & 63;
+                mask = (tcg_target_ulong)temps[args[1]].mask >> tmp;
             }
             break;
 
         CASE_OP_32_64(shl):
             if (temps[args[2]].state == TCG_TEMP_CONST) {
-                mask = temps[args[1]].mask << temps[args[2]].val;
+                tmp = temps[args[2]].val & (op_bits(op) - 1);
+                mask = temps[args[1]].mask << tmp;
             }
             break;
 
@@ -706,11 +846,33 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             mask = temps[args[3]].mask | temps[args[4]].mask;
             break;
 
+        CASE_OP_32_64(ld8u):
+        case INDEX_op_qemu_ld8u:
+            mask = 0xff;
+            break;
+        CASE_OP_32_64(ld16u):
+        case INDEX_op_qemu_ld16u:
+            mask = 0xffff;
+            break;
+        case INDEX_op_ld32u_i64:
+            mask = 0xffffffffu;
+            break;
+
         default:
             break;
         }
 
-        if (mask == 0) {
+        /* 32-bit ops generate 32-bit results.  For the result is zero test
+           below, we can ignore high bits, but for further optimizations we
+           need to record that the high bits contain garbage.  */
+        partmask = mask;
+        if (!(def->flags & TCG_OPF_64BIT)) {
+            mask |= ~(tcg_target_ulong)0xffffffffu;
+            partmask &= 0xffffffffu;
+            affected &= 0xffffffffu;
+        }
+
+        if (partmask == 0) {
             assert(def->nb_oargs == 1);
             s->gen_opc_buf[op_index] = op_to_movi(op);
             tcg_opt_gen_movi(gen_args, args[0], 0);
@@ -735,6 +897,104 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             continue;
         }
 
+        /* Forward values through the CPU state: a load from env can reuse
+           the temp that was stored to, or already loaded from, the same
+           location, and a store to env is dead if the location is written
+           again before anything reads it.  Calls and guest memory accesses
+           may read or modify any part of env.  */
+        switch (op) {
+        CASE_OP_32_64(ld8u):
+        CASE_OP_32_64(ld8s):
+        CASE_OP_32_64(ld16u):
+        CASE_OP_32_64(ld16s):
+        case INDEX_op_ld_i32:
+        case INDEX_op_ld32u_i64:
+        case INDEX_op_ld32s_i64:
+        case INDEX_op_ld_i64:
+            if (!temp_is_env(s, args[1])) {
+                /* The pointer may point into env.  */
+                for (i = 0; i < nb_mems; i++) {
+                    mems[i].store_args = NULL;
+                }
+                break;
+            }
+            ofs = args[2];
+            size = ld_st_size(op);
+            for (i = 0; i < nb_mems; i++) {
+                if (mems[i].ofs == ofs && mems[i].ld_op == op) {
+                    break;
+                }
+            }
+            if (i < nb_mems) {
+                tmp = mems[i].temp;
+                if (temps_are_copies(args[0], tmp)) {
+                    s->gen_opc_buf[op_index] = INDEX_op_nop;
+                } else if (temps[tmp].state == TCG_TEMP_CONST) {
+                    s->gen_opc_buf[op_index] = op_to_movi(op);
+                    tcg_opt_gen_movi(gen_args, args[0], temps[tmp].val);
+                    gen_args += 2;
+                } else {
+                    s->gen_opc_buf[op_index] = op_to_mov(op);
+                    tcg_opt_gen_mov(s, gen_args, args[0], tmp);
+                    gen_args += 2;
+                }
+                args += 3;
+                continue;
+            }
+            for (i = 0; i < nb_mems; i++) {
+                if (mem_overlaps(&mems[i], ofs, size)) {
+                    mems[i].store_args = NULL;
+                }
+            }
+            reset_temp(args[0]);
+            temps[args[0]].mask = mask;
+            record_mem(ofs, size, op, args[0], -1, NULL);
+            for (i = 0; i < 3; i++) {
+                gen_args[i] = args[i];
+            }
+            args += 3;
+            gen_args += 3;
+            continue;
+
+        CASE_OP_32_64(st8):
+        CASE_OP_32_64(st16):
+        case INDEX_op_st_i32:
+        case INDEX_op_st32_i64:
+        case INDEX_op_st_i64:
+            if (!temp_is_env(s, args[1])) {
+                reset_all_mems();
+                break;
+            }
+            ofs = args[2];
+            size = ld_st_size(op);
+            for (i = nb_mems - 1; i >= 0; i--) {
+                if (!mem_overlaps(&mems[i], ofs, size)) {
+                    continue;
+                }
+                if (mems[i].store_args
+                    && mems[i].ofs == ofs && mems[i].size == size) {
+                    /* Nothing read the previous value, drop its store.  */
+                    s->gen_opc_buf[mems[i].store_op_index] = INDEX_op_nopn;
+                    mems[i].store_args[0] = 3;
+                    mems[i].store_args[2] = 3;
+                }
+                remove_mem(i);
+            }
+            /* Only full-width stores can be read back with a move.  */
+            record_mem(ofs, size,
+                       op == INDEX_op_st_i32 ? INDEX_op_ld_i32
+                       : op == INDEX_op_st_i64 ? INDEX_op_ld_i64
+                       : INDEX_op_nop,
+                       args[0], op_index, gen_args);
+            break;
+
+        default:
+            if (def->flags & (TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS)) {
+                reset_all_mems();
+            }
+            break;
+        }
+
         /* Simplify expression for "op r, a, 0 => movi r, 0" cases */
         switch (op) {
         CASE_OP_32_64(and):
@@ -1068,6 +1328,11 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             } else {
                 for (i = 0; i < def->nb_oargs; i++) {
                     reset_temp(args[i]);
+                    /* Save the corresponding known-zero bits mask for the
+                       first output argument (only one supported so far). */
+                    if (i == 0) {
+                        temps[args[i]].mask = mask;
+                    }
                 }
             }
             for (i = 0; i < def->nb_args; i++) {
@@ -1077,6 +1342,16 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             gen_args += def->nb_args;
             break;
         }
+
+        switch (s->gen_opc_buf[op_index]) {
+        case INDEX_op_br:
+        case INDEX_op_exit_tb:
+        case INDEX_op_goto_ptr:
+            dead_code = true;
+            break;
+        default:
+            break;
+        }
     }
 
     return gen_args;
@@ -394,7 +394,7 @@ static inline void tcg_gen_helperN(void *func, int flags, int sizemask,
                                    TCGArg ret, int nargs, TCGArg *args)
 {
     TCGv_ptr fn;
-    fn = tcg_const_ptr(func);
+    fn = tcg_const_helper_ptr(func);
     tcg_gen_callN(&tcg_ctx, fn, flags, sizemask, ret,
                   nargs, args);
     tcg_temp_free_ptr(fn);
@@ -410,7 +410,7 @@ static inline void tcg_gen_helper32(void *func, int sizemask, TCGv_i32 ret,
 {
     TCGv_ptr fn;
     TCGArg args[2];
-    fn = tcg_const_ptr(func);
+    fn = tcg_const_helper_ptr(func);
     args[0] = GET_TCGV_I32(a);
     args[1] = GET_TCGV_I32(b);
     tcg_gen_callN(&tcg_ctx, fn,
@@ -424,7 +424,7 @@ static inline void tcg_gen_helper64(void *func, int sizemask, TCGv_i64 ret,
 {
     TCGv_ptr fn;
     TCGArg args[2];
-    fn = tcg_const_ptr(func);
+    fn = tcg_const_helper_ptr(func);
     args[0] = GET_TCGV_I64(a);
     args[1] = GET_TCGV_I64(b);
     tcg_gen_callN(&tcg_ctx, fn,
@@ -2592,6 +2592,390 @@ static inline void tcg_gen_goto_tb(unsigned idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+/* End a TB whose successor is only known at run time (indirect branches,
+   returns).  The CPU state, including the PC, must already be stored in
+   env.  If the next TB is in the jump cache of the CPU, execution goes on
+   there directly; otherwise this returns to cpu_exec like exit_tb(0).  */
+static inline void tcg_gen_lookup_and_goto_ptr(TCGv_ptr env)
+{
+    if (TCG_TARGET_HAS_goto_ptr) {
+        TCGv_ptr ptr = tcg_temp_new_ptr();
+        TCGArg args[1];
+        int sizemask = 0;
+
+        /* Return value and argument are pointers.  */
+        sizemask |= tcg_gen_sizemask(0, TCG_TARGET_REG_BITS == 64, 0);
+        sizemask |= tcg_gen_sizemask(1, TCG_TARGET_REG_BITS == 64, 0);
+        args[0] = GET_TCGV_PTR(env);
+        tcg_gen_helperN(tcg_helper_lookup_tb_ptr, TCG_CALL_NO_WG_SE,
+                        sizemask, GET_TCGV_PTR(ptr), 1, args);
+        tcg_gen_op1i(INDEX_op_goto_ptr, GET_TCGV_PTR(ptr));
+        tcg_temp_free_ptr(ptr);
+    } else {
+        tcg_gen_exit_tb(0);
+    }
+}
+
+/* Vector operations on the CPU state.  The operands are OPRSZ bytes
+   (8 or 16) at offsets DOFS, AOFS and BOFS in ENV, all 8-byte aligned.
+   Sources and destination are either the same or disjoint, and must not
+   be the backing store of a TCG global.  Elements are 1 << VECE bytes
+   wide.  Hosts without vector ops work on 64-bit lanes, with the usual
+   tricks to keep carries from crossing elements.  */
+
+/* Replicate the low 1 << VECE bytes of C in a 64-bit value.  */
+static inline uint64_t tcg_vec_dup_const(unsigned vece, uint64_t c)
+{
+    switch (vece) {
+    case TCG_VEC_8:
+        return 0x0101010101010101ull * (uint8_t)c;
+    case TCG_VEC_16:
+        return 0x0001000100010001ull * (uint16_t)c;
+    case TCG_VEC_32:
+        return 0x0000000100000001ull * (uint32_t)c;
+    default:
+        return c;
+    }
+}
+
+static inline void tcg_gen_vec_op(TCGOpcode opc, TCGv_ptr env, unsigned vece,
+                                  unsigned oprsz, TCGArg dofs, TCGArg aofs,
+                                  TCGArg arg)
+{
+    *tcg_ctx.gen_opc_ptr++ = opc;
+    *tcg_ctx.gen_opparam_ptr++ = GET_TCGV_PTR(env);
+    *tcg_ctx.gen_opparam_ptr++ = TCG_VEC_DESC(vece, oprsz);
+    *tcg_ctx.gen_opparam_ptr++ = dofs;
+    *tcg_ctx.gen_opparam_ptr++ = aofs;
+    *tcg_ctx.gen_opparam_ptr++ = arg;
+}
+
+typedef void TCGVecLaneFn(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b);
+
+static inline void tcg_gen_vec_lanes(TCGv_ptr env, unsigned vece,
+                                     unsigned oprsz, TCGArg dofs,
+                                     TCGArg aofs, TCGArg bofs,
+                                     TCGVecLaneFn *fn)
+{
+    TCGv_i64 a = tcg_temp_new_i64();
+    TCGv_i64 b = tcg_temp_new_i64();
+    unsigned i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(a, env, aofs + i);
+        tcg_gen_ld_i64(b, env, bofs + i);
+        fn(vece, a, a, b);
+        tcg_gen_st_i64(a, env, dofs + i);
+    }
+    tcg_temp_free_i64(a);
+    tcg_temp_free_i64(b);
+}
+
+static inline void tcg_gen_vec_add_lane(unsigned vece, TCGv_i64 d,
+                                        TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m, t1, t2, t3;
+
+    if (vece == TCG_VEC_64) {
+        tcg_gen_add_i64(d, a, b);
+        return;
+    }
+
+    /* Add without the sign bits, then put them back with an xor.  */
+    m = tcg_const_i64(tcg_vec_dup_const(vece, 1ull << ((8 << vece) - 1)));
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_andc_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_xor_i64(d, d, t3);
+    tcg_temp_free_i64(m);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static inline void tcg_gen_vec_sub_lane(unsigned vece, TCGv_i64 d,
+                                        TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m, t1, t2, t3;
+
+    if (vece == TCG_VEC_64) {
+        tcg_gen_sub_i64(d, a, b);
+        return;
+    }
+
+    /* Setting the sign bits of the minuend keeps borrows within each
+       element; the xor then computes the real sign bits.  */
+    m = tcg_const_i64(tcg_vec_dup_const(vece, 1ull << ((8 << vece) - 1)));
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_or_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_xor_i64(d, d, t3);
+    tcg_temp_free_i64(m);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static inline void tcg_gen_vec_and_lane(unsigned vece, TCGv_i64 d,
+                                        TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_and_i64(d, a, b);
+}
+
+static inline void tcg_gen_vec_or_lane(unsigned vece, TCGv_i64 d,
+                                       TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_or_i64(d, a, b);
+}
+
+static inline void tcg_gen_vec_xor_lane(unsigned vece, TCGv_i64 d,
+                                        TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_xor_i64(d, a, b);
+}
+
+static inline void tcg_gen_vec_andc_lane(unsigned vece, TCGv_i64 d,
+                                         TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_andc_i64(d, a, b);
+}
+
+/* D = A + B and D = A - B, element-wise with wrap-around.  */
+static inline void tcg_gen_vec_add(TCGv_ptr env, unsigned vece,
+                                   unsigned oprsz, TCGArg dofs,
+                                   TCGArg aofs, TCGArg bofs)
+{
+    if (TCG_TARGET_HAS_vec) {
+        tcg_gen_vec_op(INDEX_op_vec_add, env, vece, oprsz, dofs, aofs, bofs);
+    } else {
+        tcg_gen_vec_lanes(env, vece, oprsz, dofs, aofs, bofs,
+                          tcg_gen_vec_add_lane);
+    }
+}
+
+static inline void tcg_gen_vec_sub(TCGv_ptr env, unsigned vece,
+                                   unsigned oprsz, TCGArg dofs,
+                                   TCGArg aofs, TCGArg bofs)
+{
+    if (TCG_TARGET_HAS_vec) {
+        tcg_gen_vec_op(INDEX_op_vec_sub, env, vece, oprsz, dofs, aofs, bofs);
+    } else {
+        tcg_gen_vec_lanes(env, vece, oprsz, dofs, aofs, bofs,
+                          tcg_gen_vec_sub_lane);
+    }
+}
+
+/* Bitwise operations; D = A & ~B for andc.  */
+static inline void tcg_gen_vec_and(TCGv_ptr env, unsigned oprsz,
+                                   TCGArg dofs, TCGArg aofs, TCGArg bofs)
+{
+    if (TCG_TARGET_HAS_vec) {
+        tcg_gen_vec_op(INDEX_op_vec_and, env, TCG_VEC_64, oprsz,
+                       dofs, aofs, bofs);
+    } else {
+        tcg_gen_vec_lanes(env, TCG_VEC_64, oprsz, dofs, aofs, bofs,
+                          tcg_gen_vec_and_lane);
+    }
+}
+
+static inline void tcg_gen_vec_or(TCGv_ptr env, unsigned oprsz,
+                                  TCGArg dofs, TCGArg aofs, TCGArg bofs)
+{
+    if (TCG_TARGET_HAS_vec) {
+        tcg_gen_vec_op(INDEX_op_vec_or, env, TCG_VEC_64, oprsz,
+                       dofs, aofs, bofs);
+    } else {
+        tcg_gen_vec_lanes(env, TCG_VEC_64, oprsz, dofs, aofs, bofs,
+                          tcg_gen_vec_or_lane);
+    }
+}
+
+static inline void tcg_gen_vec_xor(TCGv_ptr env, unsigned oprsz,
+                                   TCGArg dofs, TCGArg aofs, TCGArg bofs)
+{
+    if (TCG_TARGET_HAS_vec) {
+        tcg_gen_vec_op(INDEX_op_vec_xor, env, TCG_VEC_64, oprsz,
+                       dofs, aofs, bofs);
+    } else {
+        tcg_gen_vec_lanes(env, TCG_VEC_64, oprsz, dofs, aofs, bofs,
+                          tcg_gen_vec_xor_lane);
+    }
+}
+
+static inline void tcg_gen_vec_andc(TCGv_ptr env, unsigned oprsz,
+                                    TCGArg dofs, TCGArg aofs, TCGArg bofs)
+{
+    if (TCG_TARGET_HAS_vec) {
+        tcg_gen_vec_op(INDEX_op_vec_andc, env, TCG_VEC_64, oprsz,
+                       dofs, aofs, bofs);
+    } else {
+        tcg_gen_vec_lanes(env, TCG_VEC_64, oprsz, dofs, aofs, bofs,
+                          tcg_gen_vec_andc_lane);
+    }
+}
+
+/* Shifts of each element by SHIFT, which is less than the element size
+   in bits.  */
+static inline void tcg_gen_vec_shli(TCGv_ptr env, unsigned vece,
+                                    unsigned oprsz, TCGArg dofs,
+                                    TCGArg aofs, unsigned shift)
+{
+    TCGv_i64 t;
+    unsigned i;
+
+    tcg_debug_assert(shift < (8u << vece));
+    if (TCG_TARGET_HAS_vec && TCG_TARGET_vec_shi_valid(vece, 0)) {
+        tcg_gen_vec_op(INDEX_op_vec_shli, env, vece, oprsz, dofs, aofs, shift);
+        return;
+    }
+
+    t = tcg_temp_new_i64();
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t, env, aofs + i);
+        tcg_gen_shli_i64(t, t, shift);
+        if (vece != TCG_VEC_64) {
+            tcg_gen_andi_i64(t, t, tcg_vec_dup_const(vece, -1ull << shift));
+        }
+        tcg_gen_st_i64(t, env, dofs + i);
+    }
+    tcg_temp_free_i64(t);
+}
+
+static inline void tcg_gen_vec_shri(TCGv_ptr env, unsigned vece,
+                                    unsigned oprsz, TCGArg dofs,
+                                    TCGArg aofs, unsigned shift)
+{
+    TCGv_i64 t;
+    unsigned i;
+
+    tcg_debug_assert(shift < (8u << vece));
+    if (TCG_TARGET_HAS_vec && TCG_TARGET_vec_shi_valid(vece, 0)) {
+        tcg_gen_vec_op(INDEX_op_vec_shri, env, vece, oprsz, dofs, aofs, shift);
+        return;
+    }
+
+    t = tcg_temp_new_i64();
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t, env, aofs + i);
+        tcg_gen_shri_i64(t, t, shift);
+        if (vece != TCG_VEC_64) {
+            uint64_t mask = (1ull << (8 << vece)) - 1;
+            tcg_gen_andi_i64(t, t, tcg_vec_dup_const(vece, mask >> shift));
+        }
+        tcg_gen_st_i64(t, env, dofs + i);
+    }
+    tcg_temp_free_i64(t);
+}
+
+static inline void tcg_gen_vec_sari(TCGv_ptr env, unsigned vece,
+                                    unsigned oprsz, TCGArg dofs,
+                                    TCGArg aofs, unsigned shift)
+{
+    TCGv_i64 t, s;
+    uint64_t mask;
+    unsigned i;
+
+    tcg_debug_assert(shift < (8u << vece));
+    if (TCG_TARGET_HAS_vec && TCG_TARGET_vec_shi_valid(vece, 1)) {
+        tcg_gen_vec_op(INDEX_op_vec_sari, env, vece, oprsz, dofs, aofs, shift);
+        return;
+    }
+
+    t = tcg_temp_new_i64();
+    if (vece == TCG_VEC_64) {
+        for (i = 0; i < oprsz; i += 8) {
+            tcg_gen_ld_i64(t, env, aofs + i);
+            tcg_gen_sari_i64(t, t, shift);
+            tcg_gen_st_i64(t, env, dofs + i);
+        }
+        tcg_temp_free_i64(t);
+        return;
+    }
+
+    /* Logical shift, then sign-extend each element from its shifted sign
+       bit S with (t ^ S) - S.  */
+    mask = (1ull << (8 << vece)) - 1;
+    s = tcg_const_i64(tcg_vec_dup_const(vece,
+                                        (1ull << ((8 << vece) - 1)) >> shift));
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t, env, aofs + i);
+        tcg_gen_shri_i64(t, t, shift);
+        tcg_gen_andi_i64(t, t, tcg_vec_dup_const(vece, mask >> shift));
+        tcg_gen_xor_i64(t, t, s);
+        tcg_gen_vec_sub_lane(vece, t, t, s);
+        tcg_gen_st_i64(t, env, dofs + i);
+    }
+    tcg_temp_free_i64(s);
+    tcg_temp_free_i64(t);
+}
+
+/* Store VAL in every element of D.  */
+static inline void tcg_gen_vec_dup_i64(TCGv_ptr env, unsigned oprsz,
+                                       TCGArg dofs, TCGv_i64 val)
+{
+    unsigned i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_st_i64(val, env, dofs + i);
+    }
+}
+
+static inline void tcg_gen_vec_dupi(TCGv_ptr env, unsigned vece,
+                                    unsigned oprsz, TCGArg dofs, uint64_t c)
+{
+    TCGv_i64 t = tcg_const_i64(tcg_vec_dup_const(vece, c));
+
+    tcg_gen_vec_dup_i64(env, oprsz, dofs, t);
+    tcg_temp_free_i64(t);
+}
+
+/* Store the low 1 << VECE bytes of VAL in every element of D; VECE is
+   at most TCG_VEC_32.  */
+static inline void tcg_gen_vec_dup_i32(TCGv_ptr env, unsigned vece,
+                                       unsigned oprsz, TCGArg dofs,
+                                       TCGv_i32 val)
+{
+    TCGv_i64 t;
+
+    tcg_debug_assert(vece <= TCG_VEC_32);
+    if (TCG_TARGET_HAS_vec) {
+        *tcg_ctx.gen_opc_ptr++ = INDEX_op_vec_dup_i32;
+        *tcg_ctx.gen_opparam_ptr++ = GET_TCGV_PTR(env);
+        *tcg_ctx.gen_opparam_ptr++ = GET_TCGV_I32(val);
+        *tcg_ctx.gen_opparam_ptr++ = TCG_VEC_DESC(vece, oprsz);
+        *tcg_ctx.gen_opparam_ptr++ = dofs;
+        return;
+    }
+
+    t = tcg_temp_new_i64();
+    tcg_gen_extu_i32_i64(t, val);
+    switch (vece) {
+    case TCG_VEC_8:
+        tcg_gen_ext8u_i64(t, t);
+        tcg_gen_muli_i64(t, t, 0x0101010101010101ull);
+        break;
+    case TCG_VEC_16:
+        tcg_gen_ext16u_i64(t, t);
+        tcg_gen_muli_i64(t, t, 0x0001000100010001ull);
+        break;
+    default:
+        tcg_gen_deposit_i64(t, t, t, 32, 32);
+        break;
+    }
+    tcg_gen_vec_dup_i64(env, oprsz, dofs, t);
+    tcg_temp_free_i64(t);
+}
+
 #if TCG_TARGET_REG_BITS == 32
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
@@ -164,6 +164,23 @@ DEF(sub2_i64, 2, 4, 0, IMPL64 | IMPL(TCG_TARGET_HAS_sub2_i64))
 DEF(mulu2_i64, 2, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_mulu2_i64))
 DEF(muls2_i64, 2, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_muls2_i64))
 
+/* vector ops: the input is env, the constants are the descriptor and the
+   offsets in env of the destination and of the sources */
+#define VEC_FLAGS (TCG_OPF_SIDE_EFFECTS | IMPL(TCG_TARGET_HAS_vec))
+DEF(vec_add, 0, 1, 4, VEC_FLAGS)
+DEF(vec_sub, 0, 1, 4, VEC_FLAGS)
+DEF(vec_and, 0, 1, 4, VEC_FLAGS)
+DEF(vec_or, 0, 1, 4, VEC_FLAGS)
+DEF(vec_xor, 0, 1, 4, VEC_FLAGS)
+DEF(vec_andc, 0, 1, 4, VEC_FLAGS)
+/* the last constant is the shift count */
+DEF(vec_shli, 0, 1, 4, VEC_FLAGS)
+DEF(vec_shri, 0, 1, 4, VEC_FLAGS)
+DEF(vec_sari, 0, 1, 4, VEC_FLAGS)
+/* the inputs are env and the value, the constants descriptor and offset */
+DEF(vec_dup_i32, 0, 2, 2, VEC_FLAGS)
+#undef VEC_FLAGS
+
 /* QEMU specific */
 #if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
 DEF(debug_insn_start, 0, 0, 2, 0)
@@ -172,6 +189,7 @@ DEF(debug_insn_start, 0, 0, 1, 0)
 #endif
 DEF(exit_tb, 0, 0, 1, TCG_OPF_BB_END)
 DEF(goto_tb, 0, 0, 1, TCG_OPF_BB_END)
+DEF(goto_ptr, 0, 1, 0, TCG_OPF_BB_END | IMPL(TCG_TARGET_HAS_goto_ptr))
 /* Note: even if TARGET_LONG_BITS is not defined, the INDEX_op
    constants must be defined */
 #if TCG_TARGET_REG_BITS == 32
@@ -17,4 +17,7 @@ uint64_t tcg_helper_divu_i64(uint64_t arg1, uint64_t arg2);
 uint64_t tcg_helper_remu_i64(uint64_t arg1, uint64_t arg2);
 uint64_t tcg_helper_muluh_i64(uint64_t arg1, uint64_t arg2);
 
+/* cpu-exec.c, because it depends on the target */
+void *tcg_helper_lookup_tb_ptr(void *env);
+
 #endif
@@ -67,6 +67,12 @@ static void tcg_target_init(TCGContext *s);
 static void tcg_target_qemu_prologue(TCGContext *s);
 static void patch_reloc(uint8_t *code_ptr, int type, 
                         tcg_target_long value, tcg_target_long addend);
+#ifdef TCG_TARGET_HAS_CACHE_RELOCS
+static bool patch_cache_reloc(uint8_t *code_ptr, int type,
+                              tcg_target_long value);
+static int cache_reloc_size(int type);
+static uint32_t cache_config(void);
+#endif
 
 static void tcg_register_jit_int(void *buf, size_t size,
                                  void *debug_frame, size_t debug_frame_size)
@@ -156,6 +162,23 @@ static void tcg_out_label(TCGContext *s, int label_index, void *ptr)
     l->u.value = value;
 }
 
+/* record a host address in the code of the current TB */
+static void __attribute__((unused))
+tcg_out_cache_reloc(TCGContext *s, uint8_t *code_ptr, int type,
+                    tcg_target_long value)
+{
+    TCGCacheReloc *r;
+
+    if (s->nb_cache_relocs == TCG_MAX_CACHE_RELOCS) {
+        s->code_not_relocatable = true;
+        return;
+    }
+    r = &s->cache_relocs[s->nb_cache_relocs++];
+    r->offset = code_ptr - s->code_buf;
+    r->type = type;
+    r->value = value;
+}
+
 int gen_new_label(void)
 {
     TCGContext *s = &tcg_ctx;
@@ -296,6 +319,9 @@ void tcg_func_start(TCGContext *s)
     s->gen_opc_ptr = s->gen_opc_buf;
     s->gen_opparam_ptr = s->gen_opparam_buf;
 
+    s->nb_cache_relocs = 0;
+    s->code_not_relocatable = false;
+
 #if defined(CONFIG_QEMU_LDST_OPTIMIZATION) && defined(CONFIG_SOFTMMU)
     /* Initialize qemu_ld/st labels to assist code generation at the end of TB
        for TLB miss cases at the end of TB */
@@ -2371,6 +2397,29 @@ int tcg_gen_code_search_pc(TCGContext *s, uint8_t *gen_code_buf, long offset)
     return tcg_gen_code_common(s, gen_code_buf, offset);
 }
 
+#ifdef TCG_TARGET_HAS_CACHE_RELOCS
+/* Point a host address recorded in cache_relocs to VALUE.  Fails if the
+   backend would now encode it differently, because regenerating the
+   code (e.g. in cpu_restore_state) must produce the same layout.  */
+bool tcg_patch_cache_reloc(uint8_t *code_ptr, int type, tcg_target_long value)
+{
+    return patch_cache_reloc(code_ptr, type, value);
+}
+
+/* Number of bytes that tcg_patch_cache_reloc writes for TYPE, 0 if the
+   type is not valid.  */
+int tcg_cache_reloc_size(int type)
+{
+    return cache_reloc_size(type);
+}
+
+/* Host features that the generated code depends on.  */
+uint32_t tcg_cache_config(void)
+{
+    return cache_config();
+}
+#endif
+
 #ifdef CONFIG_PROFILER
 void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
 {
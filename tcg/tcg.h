@@ -97,6 +97,24 @@ typedef uint64_t TCGRegSet;
 #define TCG_TARGET_deposit_i64_valid(ofs, len) 1
 #endif
 
+/* Element size of the vector operations.  The operands of a vector op are
+   in CPUArchState; its descriptor is the element size and the total size
+   in bytes (8 or 16) of the operation.  */
+typedef enum TCGVecElem {
+    TCG_VEC_8,
+    TCG_VEC_16,
+    TCG_VEC_32,
+    TCG_VEC_64,
+} TCGVecElem;
+
+#define TCG_VEC_DESC(vece, oprsz)   (((oprsz) << 2) | (vece))
+#define TCG_VEC_DESC_VECE(desc)     ((desc) & 3)
+#define TCG_VEC_DESC_OPRSZ(desc)    ((desc) >> 2)
+
+#ifndef TCG_TARGET_vec_shi_valid
+#define TCG_TARGET_vec_shi_valid(vece, sar) 1
+#endif
+
 /* Only one of DIV or DIV2 should be defined.  */
 #if defined(TCG_TARGET_HAS_div_i32)
 #define TCG_TARGET_HAS_div2_i32         0
@@ -395,6 +413,18 @@ typedef struct TCGHelperInfo {
     const char *name;
 } TCGHelperInfo;
 
+/* A host address in the code of a TB.  The persistent TB cache (see
+   tb-cache.c) saves the code together with these records, so that a later
+   run can relocate it.  TYPE is backend specific and tells how the address
+   is encoded at OFFSET from the start of the TB.  */
+typedef struct TCGCacheReloc {
+    uint32_t offset;
+    uint32_t type;
+    tcg_target_long value;
+} TCGCacheReloc;
+
+#define TCG_MAX_CACHE_RELOCS 256
+
 typedef struct TCGContext TCGContext;
 
 struct TCGContext {
@@ -473,14 +503,21 @@ struct TCGContext {
     /* Code generation */
     int code_gen_max_blocks;
     uint8_t *code_gen_prologue;
+    /* epilogue entry that returns 0 to cpu_exec, for goto_ptr */
+    uint8_t *code_gen_epilogue;
     uint8_t *code_gen_buffer;
     size_t code_gen_buffer_size;
     /* threshold to flush the translated code buffer */
     size_t code_gen_buffer_max_size;
-    uint8_t *code_gen_ptr;
 
     TBContext tb_ctx;
 
+    /* host addresses in the code of the current TB; if code_not_relocatable
+       is set, some addresses could not be recorded */
+    TCGCacheReloc cache_relocs[TCG_MAX_CACHE_RELOCS];
+    int nb_cache_relocs;
+    bool code_not_relocatable;
+
 #if defined(CONFIG_QEMU_LDST_OPTIMIZATION) && defined(CONFIG_SOFTMMU)
     /* labels info for qemu_ld/st IRs
        The labels help to generate TLB miss case codes at the end of TB */
@@ -518,6 +555,11 @@ void tcg_func_start(TCGContext *s);
 
 int tcg_gen_code(TCGContext *s, uint8_t *gen_code_buf);
 int tcg_gen_code_search_pc(TCGContext *s, uint8_t *gen_code_buf, long offset);
+#ifdef TCG_TARGET_HAS_CACHE_RELOCS
+bool tcg_patch_cache_reloc(uint8_t *code_ptr, int type, tcg_target_long value);
+int tcg_cache_reloc_size(int type);
+uint32_t tcg_cache_config(void);
+#endif
 
 void tcg_set_frame(TCGContext *s, int reg,
                    tcg_target_long start, tcg_target_long size);
@@ -637,7 +679,8 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define TCGV_NAT_TO_PTR(n) MAKE_TCGV_PTR(GET_TCGV_I32(n))
 #define TCGV_PTR_TO_NAT(n) MAKE_TCGV_I32(GET_TCGV_PTR(n))
 
-#define tcg_const_ptr(V) TCGV_NAT_TO_PTR(tcg_const_i32((tcg_target_long)(V)))
+#define tcg_const_helper_ptr(V) \
+    TCGV_NAT_TO_PTR(tcg_const_i32((tcg_target_long)(V)))
 #define tcg_global_reg_new_ptr(R, N) \
     TCGV_NAT_TO_PTR(tcg_global_reg_new_i32((R), (N)))
 #define tcg_global_mem_new_ptr(R, O, N) \
@@ -648,7 +691,8 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define TCGV_NAT_TO_PTR(n) MAKE_TCGV_PTR(GET_TCGV_I64(n))
 #define TCGV_PTR_TO_NAT(n) MAKE_TCGV_I64(GET_TCGV_PTR(n))
 
-#define tcg_const_ptr(V) TCGV_NAT_TO_PTR(tcg_const_i64((tcg_target_long)(V)))
+#define tcg_const_helper_ptr(V) \
+    TCGV_NAT_TO_PTR(tcg_const_i64((tcg_target_long)(V)))
 #define tcg_global_reg_new_ptr(R, N) \
     TCGV_NAT_TO_PTR(tcg_global_reg_new_i64((R), (N)))
 #define tcg_global_mem_new_ptr(R, O, N) \
@@ -657,6 +701,12 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define tcg_temp_free_ptr(T) tcg_temp_free_i64(TCGV_PTR_TO_NAT(T))
 #endif
 
+/* A pointer to data of this run of QEMU makes the code of the TB
+   impossible to reuse in another run.  The address of a helper, passed
+   with tcg_const_helper_ptr, is relocated by the backend instead.  */
+#define tcg_const_ptr(V) \
+    (tcg_ctx.code_not_relocatable = true, tcg_const_helper_ptr(V))
+
 void tcg_gen_callN(TCGContext *s, TCGv_ptr func, unsigned int flags,
                    int sizemask, TCGArg ret, int nargs, TCGArg *args);
 
@@ -0,0 +1,219 @@
+/*
+ * Softfloat benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Measures the throughput of the single and double-precision arithmetic
+ * functions of softfloat, in millions of operations per second.  The
+ * program is linked with the softfloat code of each target, because NaN
+ * handling and other details are target-specific; "make bench-fp" runs
+ * all of them.
+ *
+ * Each operation is run three times on random normal inputs:
+ * - "nearest": round to nearest-even with the inexact flag set, which is
+ *   what most guest code runs with;
+ * - "clear": the flags are cleared before each operation, as some targets
+ *   do, so the inexact flag has to be computed every time;
+ * - "to-zero": round to zero, which always uses the soft implementation.
+ *
+ * Usage: fp-bench [-n ITERATIONS] [OP...]
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "fpu/softfloat.h"
+
+#define N_INPUTS 1024
+
+enum {
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_SQRT,
+    OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = {
+    [OP_ADD] = "add",
+    [OP_SUB] = "sub",
+    [OP_MUL] = "mul",
+    [OP_DIV] = "div",
+    [OP_SQRT] = "sqrt",
+};
+
+enum {
+    MODE_NEAREST,
+    MODE_CLEAR,
+    MODE_TO_ZERO,
+    MODE_COUNT
+};
+
+static const char *mode_names[MODE_COUNT] = {
+    [MODE_NEAREST] = "nearest",
+    [MODE_CLEAR] = "clear",
+    [MODE_TO_ZERO] = "to-zero",
+};
+
+static float32 f32_in[2][N_INPUTS];
+static float64 f64_in[2][N_INPUTS];
+static volatile uint64_t sink;
+
+static void init_inputs(void)
+{
+    GRand *rand = g_rand_new_with_seed(1);
+    union {
+        float h;
+        float32 s;
+    } u32;
+    union {
+        double h;
+        float64 s;
+    } u64;
+    int i, j;
+
+    /* Positive values between 2^-20 and 2^20, so that nothing overflows
+       or underflows and square roots are defined.  */
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < N_INPUTS; j++) {
+            u64.h = ldexp(g_rand_double_range(rand, 1.0, 2.0),
+                          g_rand_int_range(rand, -20, 20));
+            u32.h = u64.h;
+            f64_in[i][j] = u64.s;
+            f32_in[i][j] = u32.s;
+        }
+    }
+    g_rand_free(rand);
+}
+
+static double run(int op, bool dp, int mode, long n)
+{
+    float_status status;
+    GTimer *timer;
+    uint64_t acc = 0;
+    double secs;
+    long i;
+
+    memset(&status, 0, sizeof(status));
+    set_float_rounding_mode(mode == MODE_TO_ZERO ? float_round_to_zero
+                            : float_round_nearest_even, &status);
+    set_float_exception_flags(mode == MODE_CLEAR ? 0 : float_flag_inexact,
+                              &status);
+
+    timer = g_timer_new();
+    for (i = 0; i < n; i++) {
+        int j = i & (N_INPUTS - 1);
+
+        if (mode == MODE_CLEAR) {
+            set_float_exception_flags(0, &status);
+        }
+        if (dp) {
+            float64 a = f64_in[0][j], b = f64_in[1][j], r;
+
+            switch (op) {
+            case OP_ADD:
+                r = float64_add(a, b, &status);
+                break;
+            case OP_SUB:
+                r = float64_sub(a, b, &status);
+                break;
+            case OP_MUL:
+                r = float64_mul(a, b, &status);
+                break;
+            case OP_DIV:
+                r = float64_div(a, b, &status);
+                break;
+            default:
+                r = float64_sqrt(a, &status);
+                break;
+            }
+            acc += float64_val(r);
+        } else {
+            float32 a = f32_in[0][j], b = f32_in[1][j], r;
+
+            switch (op) {
+            case OP_ADD:
+                r = float32_add(a, b, &status);
+                break;
+            case OP_SUB:
+                r = float32_sub(a, b, &status);
+                break;
+            case OP_MUL:
+                r = float32_mul(a, b, &status);
+                break;
+            case OP_DIV:
+                r = float32_div(a, b, &status);
+                break;
+            default:
+                r = float32_sqrt(a, &status);
+                break;
+            }
+            acc += float32_val(r);
+        }
+    }
+    secs = g_timer_elapsed(timer, NULL);
+    g_timer_destroy(timer);
+
+    sink += acc;
+    return secs > 0 ? n / secs / 1e6 : 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n ITERATIONS] [add|sub|mul|div|sqrt...]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    bool selected[OP_COUNT];
+    bool any = false;
+    long n = 10000000;
+    int i, op, mode, dp;
+
+    memset(selected, 0, sizeof(selected));
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            n = atol(argv[++i]);
+            continue;
+        }
+        for (op = 0; op < OP_COUNT; op++) {
+            if (!strcmp(argv[i], op_names[op])) {
+                break;
+            }
+        }
+        if (op == OP_COUNT) {
+            usage(argv[0]);
+        }
+        selected[op] = any = true;
+    }
+    if (n <= 0) {
+        usage(argv[0]);
+    }
+
+    init_inputs();
+    printf("%-10s", "MOps/s");
+    for (mode = 0; mode < MODE_COUNT; mode++) {
+        printf(" %10s", mode_names[mode]);
+    }
+    printf("\n");
+
+    for (dp = 0; dp < 2; dp++) {
+        for (op = 0; op < OP_COUNT; op++) {
+            if (any && !selected[op]) {
+                continue;
+            }
+            printf("%s%-7s", dp ? "f64" : "f32", op_names[op]);
+            for (mode = 0; mode < MODE_COUNT; mode++) {
+                printf(" %10.1f", run(op, dp, mode, n));
+            }
+            printf("\n");
+        }
+    }
+    return 0;
+}
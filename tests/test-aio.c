@@ -12,6 +12,8 @@
 
 #include <glib.h>
 #include "block/aio.h"
+#include "qemu/main-loop.h"
+#include "qemu/thread.h"
 
 AioContext *ctx;
 
@@ -55,6 +57,7 @@ typedef struct {
     int n;
     int active;
     bool auto_set;
+    bool poll_ready;
 } EventNotifierTestData;
 
 static int event_active_cb(EventNotifier *e)
@@ -76,6 +79,23 @@ static void event_ready_cb(EventNotifier *e)
     }
 }
 
+typedef struct {
+    QEMUTimer *timer;
+    int n;
+    int max;
+    int64_t ns;
+} TimerTestData;
+
+static void timer_test_cb(void *opaque)
+{
+    TimerTestData *data = opaque;
+
+    if (++data->n < data->max) {
+        qemu_mod_timer_ns(data->timer,
+                          qemu_get_clock_ns(rt_clock) + data->ns);
+    }
+}
+
 /* Tests using aio_*.  */
 
 static void test_notify(void)
@@ -140,6 +160,28 @@ static void test_bh_cancel(void)
     qemu_bh_delete(data.bh);
 }
 
+static void test_bh_unidle(void)
+{
+    BHTestData data = { .n = 0 };
+    data.bh = aio_bh_new(ctx, bh_test_cb, &data);
+
+    /* A cancelled idle bottom half is scheduled as a normal one... */
+    qemu_bh_schedule_idle(data.bh);
+    qemu_bh_cancel(data.bh);
+    qemu_bh_schedule(data.bh);
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+
+    /* ... and so is a pending one */
+    qemu_bh_schedule_idle(data.bh);
+    qemu_bh_schedule(data.bh);
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 2);
+
+    g_assert(!aio_poll(ctx, false));
+    qemu_bh_delete(data.bh);
+}
+
 static void test_bh_delete(void)
 {
     BHTestData data = { .n = 0 };
@@ -227,6 +269,79 @@ static void test_bh_flush(void)
     qemu_bh_delete(data.bh);
 }
 
+/* Bottom halves scheduled from other threads must wake up aio_poll */
+
+#define BH_THREADS              4
+#define BH_THREAD_ITERATIONS    10000
+
+typedef struct {
+    QEMUBH *bh;
+    QemuThread thread;
+    int scheduled;
+    int n;
+} BHThreadData;
+
+static void bh_thread_cb(void *opaque)
+{
+    BHThreadData *data = opaque;
+
+    data->n++;
+    atomic_xchg(&data->scheduled, 0);
+}
+
+static void *bh_thread_fn(void *opaque)
+{
+    BHThreadData *data = opaque;
+    int i;
+
+    for (i = 0; i < BH_THREAD_ITERATIONS; i++) {
+        while (atomic_read(&data->scheduled)) {
+            g_usleep(0);
+        }
+        atomic_xchg(&data->scheduled, 1);
+        qemu_bh_schedule(data->bh);
+    }
+    return NULL;
+}
+
+static void test_bh_schedule_threads(void)
+{
+    EventNotifierTestData dummy = { .n = 0, .active = 1 };
+    BHThreadData data[BH_THREADS];
+    int i, done;
+
+    /* Keep aio_poll blocking until the bottom halves wake it up */
+    event_notifier_init(&dummy.e, false);
+    aio_set_event_notifier(ctx, &dummy.e, event_ready_cb, event_active_cb);
+
+    for (i = 0; i < BH_THREADS; i++) {
+        data[i].bh = aio_bh_new(ctx, bh_thread_cb, &data[i]);
+        data[i].scheduled = 0;
+        data[i].n = 0;
+        qemu_thread_create(&data[i].thread, bh_thread_fn, &data[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    do {
+        aio_poll(ctx, true);
+        done = 0;
+        for (i = 0; i < BH_THREADS; i++) {
+            done += data[i].n;
+        }
+    } while (done < BH_THREADS * BH_THREAD_ITERATIONS);
+
+    for (i = 0; i < BH_THREADS; i++) {
+        qemu_thread_join(&data[i].thread);
+        g_assert_cmpint(data[i].n, ==, BH_THREAD_ITERATIONS);
+        qemu_bh_delete(data[i].bh);
+    }
+    g_assert_cmpint(dummy.n, ==, 0);
+
+    aio_set_event_notifier(ctx, &dummy.e, NULL, NULL);
+    event_notifier_cleanup(&dummy.e);
+    g_assert(!aio_poll(ctx, false));
+}
+
 static void test_set_event_notifier(void)
 {
     EventNotifierTestData data = { .n = 0, .active = 0 };
@@ -340,6 +455,273 @@ static void test_wait_event_notifier_noflush(void)
     event_notifier_cleanup(&data.e);
 }
 
+static bool event_poll_cb(EventNotifier *e)
+{
+    EventNotifierTestData *data = container_of(e, EventNotifierTestData, e);
+    return data->poll_ready;
+}
+
+static void event_poll_ready_cb(EventNotifier *e)
+{
+    EventNotifierTestData *data = container_of(e, EventNotifierTestData, e);
+    event_notifier_test_and_clear(e);
+    data->poll_ready = false;
+    data->n++;
+    if (data->active > 0) {
+        data->active--;
+    }
+}
+
+static void test_poll_event_notifier(void)
+{
+    EventNotifierTestData data = { .n = 0, .active = 2 };
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, event_poll_ready_cb, event_active_cb);
+    aio_set_event_notifier_poll(ctx, &data.e, event_poll_cb);
+    aio_context_set_poll_params(ctx, 1000000);
+
+    /* An event that arrives quickly makes aio_poll start busy-waiting */
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(ctx->poll_ns, >, 0);
+
+    /* The poll callback is enough to dispatch the handler */
+    data.poll_ready = true;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 2);
+    g_assert_cmpint(data.active, ==, 0);
+
+    aio_context_set_poll_params(ctx, 0);
+    aio_set_event_notifier(ctx, &data.e, NULL, NULL);
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 2);
+
+    event_notifier_cleanup(&data.e);
+}
+
+#define MANY_NOTIFIERS 100
+
+static void test_wait_event_notifier_many(void)
+{
+    EventNotifierTestData data[MANY_NOTIFIERS];
+    int i;
+
+    /* This is enough for aio_poll to switch to epoll, where available */
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        data[i] = (EventNotifierTestData) { .n = 0, .active = 1 };
+        event_notifier_init(&data[i].e, false);
+        aio_set_event_notifier(ctx, &data[i].e, event_ready_cb,
+                               event_active_cb);
+    }
+    g_assert(aio_poll(ctx, false));
+    g_assert(aio_poll(ctx, false));
+
+    /* Only the notifiers that are set are dispatched */
+    for (i = 0; i < MANY_NOTIFIERS; i += 10) {
+        event_notifier_set(&data[i].e);
+    }
+    g_assert(aio_poll(ctx, false));
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        g_assert_cmpint(data[i].n, ==, i % 10 == 0);
+    }
+
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        if (i % 10) {
+            event_notifier_set(&data[i].e);
+        }
+    }
+    wait_for_aio();
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        g_assert_cmpint(data[i].n, ==, 1);
+        g_assert_cmpint(data[i].active, ==, 0);
+    }
+
+    /* Idle handlers still do not make aio_poll block */
+    g_assert(!aio_poll(ctx, true));
+
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL, NULL);
+        event_notifier_cleanup(&data[i].e);
+    }
+    g_assert(!aio_poll(ctx, false));
+}
+
+static void test_timer_schedule(void)
+{
+    TimerTestData data = { .n = 0, .max = 2, .ns = SCALE_MS * 20 };
+    int64_t start;
+
+    data.timer = aio_timer_new(ctx, rt_clock, SCALE_NS, timer_test_cb, &data);
+    g_assert(!aio_poll(ctx, false));
+
+    start = qemu_get_clock_ns(rt_clock);
+    qemu_mod_timer_ns(data.timer, start + data.ns);
+
+    /* A pending timer counts as outstanding work, but does not fire early */
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 0);
+
+    /* The deadline is not rounded down to milliseconds */
+    do {
+        g_assert(aio_poll(ctx, true));
+    } while (data.n == 0);
+    g_assert_cmpint(qemu_get_clock_ns(rt_clock) - start, >=, data.ns);
+
+    /* The callback rearmed the timer once */
+    g_assert(qemu_timer_pending(data.timer));
+    while (data.n < 2) {
+        aio_poll(ctx, true);
+    }
+    g_assert(!qemu_timer_pending(data.timer));
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 2);
+
+    qemu_free_timer(data.timer);
+}
+
+#define MANY_TIMERS 1000
+
+typedef struct {
+    QEMUTimer *timer;
+    int64_t expire_time;
+    int order;
+} OrderTestData;
+
+static int timers_fired;
+
+static void timer_order_cb(void *opaque)
+{
+    OrderTestData *data = opaque;
+
+    data->order = timers_fired++;
+}
+
+static void test_timer_order(void)
+{
+    OrderTestData data[MANY_TIMERS];
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    int i, j, n;
+
+    /* Arm timers in the past in a scrambled order, with many ties */
+    for (i = 0; i < MANY_TIMERS; i++) {
+        data[i].timer = aio_timer_new(ctx, rt_clock, SCALE_NS,
+                                      timer_order_cb, &data[i]);
+        data[i].expire_time = now - SCALE_MS - (i * 7919 % 97);
+        data[i].order = -1;
+        qemu_mod_timer_ns(data[i].timer, data[i].expire_time);
+    }
+
+    /* Deleting and moving timers keeps the others in order */
+    for (i = 0; i < MANY_TIMERS; i += 3) {
+        qemu_del_timer(data[i].timer);
+        g_assert(!qemu_timer_pending(data[i].timer));
+    }
+    for (i = 1; i < MANY_TIMERS; i += 5) {
+        data[i].expire_time -= 50;
+        qemu_mod_timer_ns(data[i].timer, data[i].expire_time);
+    }
+
+    timers_fired = 0;
+    g_assert(aio_poll(ctx, false));
+    g_assert(!aio_poll(ctx, false));
+
+    n = 0;
+    for (i = 0; i < MANY_TIMERS; i++) {
+        if (i % 3 == 0) {
+            g_assert_cmpint(data[i].order, ==, -1);
+            continue;
+        }
+        n++;
+        for (j = 0; j < i; j++) {
+            if (j % 3 == 0) {
+                continue;
+            }
+            /* Timers with the same expiration time are not reordered */
+            g_assert((data[j].order < data[i].order) ==
+                     (data[j].expire_time <= data[i].expire_time));
+        }
+    }
+    g_assert_cmpint(timers_fired, ==, n);
+
+    for (i = 0; i < MANY_TIMERS; i++) {
+        qemu_free_timer(data[i].timer);
+    }
+}
+
+/* Measures how long it takes to dispatch one event notifier, while @opaque
+ * other file descriptors are waited for but never ready.
+ */
+static void perf_wait_event_notifier(gconstpointer opaque)
+{
+    int count = GPOINTER_TO_INT(opaque);
+    EventNotifierTestData *idle = g_new0(EventNotifierTestData, count);
+    EventNotifierTestData data = {
+        .n = 0, .active = 100000, .auto_set = true
+    };
+    double duration;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        idle[i].active = 1;
+        event_notifier_init(&idle[i].e, false);
+        aio_set_event_notifier(ctx, &idle[i].e, event_ready_cb,
+                               event_active_cb);
+    }
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, event_ready_cb, event_active_cb);
+
+    g_test_timer_start();
+    event_notifier_set(&data.e);
+    while (data.active) {
+        aio_poll(ctx, true);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("%d idle file descriptors, %d iterations: %f s\n",
+                   count, data.n, duration);
+
+    aio_set_event_notifier(ctx, &data.e, NULL, NULL);
+    event_notifier_cleanup(&data.e);
+    for (i = 0; i < count; i++) {
+        aio_set_event_notifier(ctx, &idle[i].e, NULL, NULL);
+        event_notifier_cleanup(&idle[i].e);
+    }
+    g_free(idle);
+}
+
+/* Measures the cost of rearming one of @opaque pending timers */
+static void perf_timer_mod(gconstpointer opaque)
+{
+    int count = GPOINTER_TO_INT(opaque);
+    QEMUTimer **timers = g_new(QEMUTimer *, count);
+    int64_t now = qemu_get_clock_ns(rt_clock) + 1000 * SCALE_MS * 1000LL;
+    double duration;
+    int i, iterations = 1000000;
+
+    for (i = 0; i < count; i++) {
+        timers[i] = aio_timer_new(ctx, rt_clock, SCALE_NS,
+                                  timer_order_cb, NULL);
+        qemu_mod_timer_ns(timers[i], now + i * 1000);
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        qemu_mod_timer_ns(timers[i % count],
+                          now + (i * 7919LL % count) * 1000);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("%d timers, %d updates: %f s\n",
+                   count, iterations, duration);
+
+    for (i = 0; i < count; i++) {
+        qemu_del_timer(timers[i]);
+        qemu_free_timer(timers[i]);
+    }
+    g_free(timers);
+}
+
 /* Now the same tests, using the context as a GSource.  They are
  * very similar to the ones above, with g_main_context_iteration
  * replacing aio_poll.  However:
@@ -407,6 +789,29 @@ static void test_source_bh_schedule10(void)
     qemu_bh_delete(data.bh);
 }
 
+static void test_source_timer_schedule(void)
+{
+    TimerTestData data = { .n = 0, .max = 1, .ns = SCALE_MS * 20 };
+    int64_t start;
+
+    data.timer = aio_timer_new(ctx, rt_clock, SCALE_NS, timer_test_cb, &data);
+    start = qemu_get_clock_ns(rt_clock);
+    qemu_mod_timer_ns(data.timer, start + data.ns);
+
+    g_assert(!g_main_context_iteration(NULL, false));
+    g_assert_cmpint(data.n, ==, 0);
+
+    /* glib computes the poll timeout from the timer deadline */
+    while (data.n == 0) {
+        g_main_context_iteration(NULL, true);
+    }
+    g_assert_cmpint(qemu_get_clock_ns(rt_clock) - start, >=, data.ns);
+
+    while (g_main_context_iteration(NULL, false));
+    g_assert(!g_main_context_iteration(NULL, false));
+    qemu_free_timer(data.timer);
+}
+
 static void test_source_bh_cancel(void)
 {
     BHTestData data = { .n = 0 };
@@ -640,19 +1045,26 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/bh/schedule",             test_bh_schedule);
     g_test_add_func("/aio/bh/schedule10",           test_bh_schedule10);
     g_test_add_func("/aio/bh/cancel",               test_bh_cancel);
+    g_test_add_func("/aio/bh/unidle",               test_bh_unidle);
     g_test_add_func("/aio/bh/delete",               test_bh_delete);
     g_test_add_func("/aio/bh/callback-delete/one",  test_bh_delete_from_cb);
     g_test_add_func("/aio/bh/callback-delete/many", test_bh_delete_from_cb_many);
     g_test_add_func("/aio/bh/flush",                test_bh_flush);
+    g_test_add_func("/aio/bh/schedule/threads",     test_bh_schedule_threads);
     g_test_add_func("/aio/event/add-remove",        test_set_event_notifier);
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
+    g_test_add_func("/aio/event/wait/many",         test_wait_event_notifier_many);
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
+    g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+    g_test_add_func("/aio/timer/order",             test_timer_order);
 
     g_test_add_func("/aio-gsource/notify",                  test_source_notify);
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
     g_test_add_func("/aio-gsource/bh/schedule",             test_source_bh_schedule);
     g_test_add_func("/aio-gsource/bh/schedule10",           test_source_bh_schedule10);
+    g_test_add_func("/aio-gsource/timer/schedule",          test_source_timer_schedule);
     g_test_add_func("/aio-gsource/bh/cancel",               test_source_bh_cancel);
     g_test_add_func("/aio-gsource/bh/delete",               test_source_bh_delete);
     g_test_add_func("/aio-gsource/bh/callback-delete/one",  test_source_bh_delete_from_cb);
@@ -662,5 +1074,17 @@ int main(int argc, char **argv)
     g_test_add_func("/aio-gsource/event/wait",              test_source_wait_event_notifier);
     g_test_add_func("/aio-gsource/event/wait/no-flush-cb",  test_source_wait_event_notifier_noflush);
     g_test_add_func("/aio-gsource/event/flush",             test_source_flush_event_notifier);
+    if (g_test_perf()) {
+        g_test_add_data_func("/aio/perf/event/8", GINT_TO_POINTER(8),
+                             perf_wait_event_notifier);
+        g_test_add_data_func("/aio/perf/event/64", GINT_TO_POINTER(64),
+                             perf_wait_event_notifier);
+        g_test_add_data_func("/aio/perf/event/512", GINT_TO_POINTER(512),
+                             perf_wait_event_notifier);
+        g_test_add_data_func("/aio/perf/timer/16", GINT_TO_POINTER(16),
+                             perf_timer_mod);
+        g_test_add_data_func("/aio/perf/timer/1024", GINT_TO_POINTER(1024),
+                             perf_timer_mod);
+    }
     return g_test_run();
 }
@@ -12,6 +12,7 @@
  */
 
 #include <glib.h>
+#include "qemu/thread.h"
 #include "block/coroutine.h"
 
 /*
@@ -150,6 +151,75 @@ static void test_lifecycle(void)
     g_assert(done); /* expect done to be true (second time) */
 }
 
+/*
+ * Check that many coroutines can be alive at the same time, more than
+ * the pool of free coroutines holds, and that they are reused afterwards
+ */
+
+static void coroutine_fn yield_once(void *opaque)
+{
+    unsigned int *done = opaque;
+
+    qemu_coroutine_yield();
+    (*done)++;
+}
+
+/* Creates @depth coroutines that all wait, then lets them terminate */
+static void run_depth(unsigned int depth)
+{
+    Coroutine *coroutines[depth];
+    unsigned int i, done = 0;
+
+    for (i = 0; i < depth; i++) {
+        coroutines[i] = qemu_coroutine_create(yield_once);
+        qemu_coroutine_enter(coroutines[i], &done);
+    }
+    g_assert_cmpint(done, ==, 0);
+
+    for (i = 0; i < depth; i++) {
+        qemu_coroutine_enter(coroutines[i], NULL);
+    }
+    g_assert_cmpint(done, ==, depth);
+}
+
+static void test_pool_depth(void)
+{
+    run_depth(1000);
+    run_depth(1000);
+
+    qemu_coroutine_adjust_pool_size(1000);
+    run_depth(1000);
+    qemu_coroutine_adjust_pool_size(-1000);
+}
+
+/*
+ * Check that coroutines can be created and terminated concurrently
+ */
+
+static void *pool_thread_fn(void *opaque)
+{
+    unsigned int i;
+
+    for (i = 0; i < 100; i++) {
+        run_depth(200);
+    }
+    return NULL;
+}
+
+static void test_pool_threads(void)
+{
+    QemuThread threads[4];
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(threads); i++) {
+        qemu_thread_create(&threads[i], pool_thread_fn, NULL,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < ARRAY_SIZE(threads); i++) {
+        qemu_thread_join(&threads[i]);
+    }
+}
+
 /*
  * Lifecycle benchmark
  */
@@ -177,6 +247,56 @@ static void perf_lifecycle(void)
     g_test_message("Lifecycle %u iterations: %f s\n", max, duration);
 }
 
+static void perf_lifecycle_depth(void)
+{
+    unsigned int i, max, depth;
+    double duration;
+
+    max = 10000;
+    depth = 256;
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        run_depth(depth);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("Lifecycle %u iterations of %u coroutines each: %f s\n",
+                   max, depth, duration);
+}
+
+static void *perf_lifecycle_thread_fn(void *opaque)
+{
+    Coroutine *coroutine;
+    unsigned int i;
+
+    for (i = 0; i < 1000000; i++) {
+        coroutine = qemu_coroutine_create(empty_coroutine);
+        qemu_coroutine_enter(coroutine, NULL);
+    }
+    return NULL;
+}
+
+static void perf_lifecycle_threads(void)
+{
+    QemuThread threads[4];
+    unsigned int i;
+    double duration;
+
+    g_test_timer_start();
+    for (i = 0; i < ARRAY_SIZE(threads); i++) {
+        qemu_thread_create(&threads[i], perf_lifecycle_thread_fn, NULL,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < ARRAY_SIZE(threads); i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("Lifecycle %u iterations in %zu threads: %f s\n",
+                   1000000, ARRAY_SIZE(threads), duration);
+}
+
 static void perf_nesting(void)
 {
     unsigned int i, maxcycles, maxnesting;
@@ -211,8 +331,12 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/nesting", test_nesting);
     g_test_add_func("/basic/self", test_self);
     g_test_add_func("/basic/in_coroutine", test_in_coroutine);
+    g_test_add_func("/basic/pool/depth", test_pool_depth);
+    g_test_add_func("/basic/pool/threads", test_pool_threads);
     if (g_test_perf()) {
         g_test_add_func("/perf/lifecycle", perf_lifecycle);
+        g_test_add_func("/perf/lifecycle/depth", perf_lifecycle_depth);
+        g_test_add_func("/perf/lifecycle/threads", perf_lifecycle_threads);
         g_test_add_func("/perf/nesting", perf_nesting);
     }
     return g_test_run();
@@ -0,0 +1,161 @@
+/*
+ * Resizable hash table unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu/qht.h"
+
+#define N 5000
+
+static struct qht ht;
+static int32_t arr[N * 2];
+
+static bool is_equal(const void *obj, const void *userp)
+{
+    const int32_t *a = obj;
+    const int32_t *b = userp;
+
+    return *a == *b;
+}
+
+/* A poor hash, so that the chains get long and the table has to grow.  */
+static uint32_t hash_of(int32_t val)
+{
+    return val / 3;
+}
+
+static void insert(int a, int b)
+{
+    int i;
+
+    for (i = a; i < b; i++) {
+        arr[i] = i;
+        g_assert(qht_insert(&ht, &arr[i], hash_of(i)));
+    }
+}
+
+static void rm(int a, int b)
+{
+    int i;
+
+    for (i = a; i < b; i++) {
+        g_assert(qht_remove(&ht, &arr[i], hash_of(i)));
+    }
+}
+
+static void check(int a, int b, bool expected)
+{
+    int i;
+
+    for (i = a; i < b; i++) {
+        int32_t val = i;
+        void *p = qht_lookup(&ht, is_equal, &val, hash_of(i));
+
+        g_assert(!!p == expected);
+        if (p) {
+            g_assert(p == &arr[i]);
+        }
+    }
+}
+
+static void count_func(struct qht *ht, void *p, uint32_t hash, void *userp)
+{
+    unsigned int *curr = userp;
+
+    g_assert(hash == hash_of(*(int32_t *)p));
+    (*curr)++;
+}
+
+static void check_n(size_t expected)
+{
+    struct qht_stats stats;
+    unsigned int curr = 0;
+
+    qht_iter(&ht, count_func, &curr);
+    g_assert_cmpint(curr, ==, expected);
+    g_assert_cmpint(ht.n_entries, ==, expected);
+
+    qht_statistics_init(&ht, &stats);
+    g_assert_cmpint(stats.entries, ==, expected);
+    g_assert(stats.used_head_buckets <= stats.head_buckets);
+    if (expected) {
+        g_assert(stats.max_chain >= 1);
+        g_assert(stats.avg_chain >= 1.0);
+        g_assert(stats.occupancy > 0 && stats.occupancy <= 1.0);
+    }
+}
+
+static void qht_do_test(unsigned int mode, size_t init_entries)
+{
+    qht_init(&ht, init_entries, mode);
+
+    insert(0, N);
+    check(0, N, true);
+    check_n(N);
+    check(-N, -1, false);
+
+    /* duplicates are refused */
+    g_assert(!qht_insert(&ht, &arr[0], hash_of(0)));
+
+    /* removal in the middle of chains keeps the other entries visible */
+    rm(0, N / 2);
+    check(0, N / 2, false);
+    check(N / 2, N, true);
+    check_n(N - N / 2);
+    g_assert(!qht_remove(&ht, &arr[0], hash_of(0)));
+
+    insert(N, N * 2);
+    check(N / 2, N * 2, true);
+    check_n(N * 2 - N / 2);
+
+    qht_resize(&ht, N * 4);
+    check(N / 2, N * 2, true);
+    check_n(N * 2 - N / 2);
+
+    qht_reset(&ht);
+    check(0, N * 2, false);
+    check_n(0);
+
+    insert(0, N);
+    qht_reset_size(&ht, 0);
+    check(0, N, false);
+    check_n(0);
+    insert(0, N);
+    check(0, N, true);
+    check_n(N);
+
+    qht_destroy(&ht);
+}
+
+static void test_default(void)
+{
+    qht_do_test(0, 0);
+    qht_do_test(0, 1 << 14);
+}
+
+static void test_resize(void)
+{
+    struct qht_stats stats;
+
+    qht_do_test(QHT_MODE_AUTO_RESIZE, 0);
+
+    /* a table starting with a single bucket grows as entries come in */
+    qht_init(&ht, 0, QHT_MODE_AUTO_RESIZE);
+    qht_statistics_init(&ht, &stats);
+    g_assert_cmpint(stats.head_buckets, ==, 1);
+    insert(0, N);
+    qht_statistics_init(&ht, &stats);
+    g_assert(stats.head_buckets > 1);
+    qht_destroy(&ht);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qht/mode/default", test_default);
+    g_test_add_func("/qht/mode/resize", test_resize);
+    return g_test_run();
+}
@@ -0,0 +1,317 @@
+/*
+ * Softfloat host FPU fast path tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Runs each single and double-precision operation that has a host FPU fast
+ * path twice, once as usual and once with float_use_host_fpu cleared, and
+ * checks that the results and the exception flags are bit-identical.  The
+ * operands are special and boundary values plus random ones, and each pair
+ * is tried in every rounding mode, with and without the inexact flag
+ * already set, and with the flush-to-zero, default NaN and tininess
+ * settings toggled.
+ *
+ * Like fp-bench, the program is linked with the softfloat code of each
+ * target, because NaN handling and other details are target-specific.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "fpu/softfloat.h"
+
+enum {
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_SQRT,
+    OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = {
+    [OP_ADD] = "add",
+    [OP_SUB] = "sub",
+    [OP_MUL] = "mul",
+    [OP_DIV] = "div",
+    [OP_SQRT] = "sqrt",
+};
+
+static const int rounding_modes[] = {
+    float_round_nearest_even,
+    float_round_down,
+    float_round_up,
+    float_round_to_zero,
+};
+
+/* The low two bits select the rounding mode, the others one setting each */
+#define CONFIG_INEXACT      4
+#define CONFIG_FLUSH        8
+#define CONFIG_DEFAULT_NAN  16
+#define CONFIG_TINY_BEFORE  32
+#define N_CONFIGS           64
+
+/* Special and boundary operands; their negations are tried as well.  */
+static const uint32_t f32_edge[] = {
+    0x00000000, /* zero */
+    0x00000001, /* smallest denormal */
+    0x007fffff, /* largest denormal */
+    0x00800000, /* smallest normal */
+    0x00800001,
+    0x00ffffff,
+    0x01000000,
+    0x1f800000, /* 2^-64, products near the underflow threshold */
+    0x20000000,
+    0x3dcccccd, /* 0.1 */
+    0x3f800000, /* 1 */
+    0x3f800001,
+    0x3fffffff,
+    0x40400000, /* 3, inexact quotients */
+    0x4b800000, /* 2^24 */
+    0x5f000000, /* 2^63, products near the overflow threshold */
+    0x5f800000,
+    0x7f000000,
+    0x7f7ffffe,
+    0x7f7fffff, /* largest normal */
+    0x7f800000, /* infinity */
+    0x7fa00000, /* NaNs, signalling or quiet per target */
+    0x7fc00000,
+};
+
+static const uint64_t f64_edge[] = {
+    0x0000000000000000ULL, /* zero */
+    0x0000000000000001ULL, /* smallest denormal */
+    0x000fffffffffffffULL, /* largest denormal */
+    0x0010000000000000ULL, /* smallest normal */
+    0x0010000000000001ULL,
+    0x001fffffffffffffULL,
+    0x0020000000000000ULL,
+    0x1ff0000000000000ULL, /* 2^-512, products near the underflow threshold */
+    0x2000000000000000ULL,
+    0x3fb999999999999aULL, /* 0.1 */
+    0x3ff0000000000000ULL, /* 1 */
+    0x3ff0000000000001ULL,
+    0x3fffffffffffffffULL,
+    0x4008000000000000ULL, /* 3, inexact quotients */
+    0x4340000000000000ULL, /* 2^53 */
+    0x5fe0000000000000ULL, /* 2^511, products near the overflow threshold */
+    0x5ff0000000000000ULL,
+    0x7fe0000000000000ULL,
+    0x7feffffffffffffeULL,
+    0x7fefffffffffffffULL, /* largest normal */
+    0x7ff0000000000000ULL, /* infinity */
+    0x7ff4000000000000ULL, /* NaNs, signalling or quiet per target */
+    0x7ff8000000000000ULL,
+};
+
+static void init_status(float_status *status, int config)
+{
+    memset(status, 0, sizeof(*status));
+    set_float_rounding_mode(rounding_modes[config & 3], status);
+    set_float_exception_flags(config & CONFIG_INEXACT ? float_flag_inexact
+                              : 0, status);
+    set_flush_to_zero(!!(config & CONFIG_FLUSH), status);
+    set_flush_inputs_to_zero(!!(config & CONFIG_FLUSH), status);
+    set_default_nan_mode(!!(config & CONFIG_DEFAULT_NAN), status);
+    set_float_detect_tininess(config & CONFIG_TINY_BEFORE
+                              ? float_tininess_before_rounding
+                              : float_tininess_after_rounding, status);
+}
+
+/* Picks a biased exponent: anywhere, near one, or near either threshold */
+static int random_exp(GRand *rand, int max_exp, int bias, int spread)
+{
+    switch (g_rand_int_range(rand, 0, 4)) {
+    case 0:
+        return g_rand_int_range(rand, 0, max_exp + 1);
+    case 1:
+        return bias + g_rand_int_range(rand, -spread, spread + 1);
+    case 2:
+        return g_rand_int_range(rand, 0, spread);
+    default:
+        return max_exp - g_rand_int_range(rand, 1, spread + 1);
+    }
+}
+
+/* Short significands make exact results, and thus inexact flag
+ * computations that can go wrong, much more likely.
+ */
+static uint32_t random_f32(GRand *rand)
+{
+    uint32_t frac = g_rand_int(rand) & 0x7fffff;
+    uint32_t exp = random_exp(rand, 0xff, 0x7f, 30);
+
+    if (g_rand_boolean(rand)) {
+        frac &= ~0U << g_rand_int_range(rand, 0, 24);
+    }
+    return (g_rand_boolean(rand) ? 0x80000000 : 0) | exp << 23 | frac;
+}
+
+static uint64_t random_f64(GRand *rand)
+{
+    uint64_t frac = ((uint64_t)g_rand_int(rand) << 32 | g_rand_int(rand)) &
+                    0xfffffffffffffULL;
+    uint64_t exp = random_exp(rand, 0x7ff, 0x3ff, 60);
+
+    if (g_rand_boolean(rand)) {
+        frac &= ~0ULL << g_rand_int_range(rand, 0, 53);
+    }
+    return (g_rand_boolean(rand) ? 0x8000000000000000ULL : 0) |
+           exp << 52 | frac;
+}
+
+static float32 do_f32(int op, float32 a, float32 b, float_status *status)
+{
+    switch (op) {
+    case OP_ADD:
+        return float32_add(a, b, status);
+    case OP_SUB:
+        return float32_sub(a, b, status);
+    case OP_MUL:
+        return float32_mul(a, b, status);
+    case OP_DIV:
+        return float32_div(a, b, status);
+    default:
+        return float32_sqrt(a, status);
+    }
+}
+
+static float64 do_f64(int op, float64 a, float64 b, float_status *status)
+{
+    switch (op) {
+    case OP_ADD:
+        return float64_add(a, b, status);
+    case OP_SUB:
+        return float64_sub(a, b, status);
+    case OP_MUL:
+        return float64_mul(a, b, status);
+    case OP_DIV:
+        return float64_div(a, b, status);
+    default:
+        return float64_sqrt(a, status);
+    }
+}
+
+static void check_f32(int op, uint32_t a, uint32_t b)
+{
+    float_status host, soft;
+    uint32_t rh, rs;
+    int config;
+
+    for (config = 0; config < N_CONFIGS; config++) {
+        init_status(&host, config);
+        init_status(&soft, config);
+
+        float_use_host_fpu = 1;
+        rh = float32_val(do_f32(op, make_float32(a), make_float32(b), &host));
+        float_use_host_fpu = 0;
+        rs = float32_val(do_f32(op, make_float32(a), make_float32(b), &soft));
+        float_use_host_fpu = 1;
+
+        if (rh != rs || get_float_exception_flags(&host) !=
+                        get_float_exception_flags(&soft)) {
+            g_test_message("f32 %s %08x %08x, config %d: host %08x flags %#x, "
+                           "soft %08x flags %#x\n", op_names[op], a, b, config,
+                           rh, get_float_exception_flags(&host),
+                           rs, get_float_exception_flags(&soft));
+        }
+        g_assert_cmphex(rh, ==, rs);
+        g_assert_cmphex(get_float_exception_flags(&host), ==,
+                        get_float_exception_flags(&soft));
+    }
+}
+
+static void check_f64(int op, uint64_t a, uint64_t b)
+{
+    float_status host, soft;
+    uint64_t rh, rs;
+    int config;
+
+    for (config = 0; config < N_CONFIGS; config++) {
+        init_status(&host, config);
+        init_status(&soft, config);
+
+        float_use_host_fpu = 1;
+        rh = float64_val(do_f64(op, make_float64(a), make_float64(b), &host));
+        float_use_host_fpu = 0;
+        rs = float64_val(do_f64(op, make_float64(a), make_float64(b), &soft));
+        float_use_host_fpu = 1;
+
+        if (rh != rs || get_float_exception_flags(&host) !=
+                        get_float_exception_flags(&soft)) {
+            g_test_message("f64 %s %016" PRIx64 " %016" PRIx64 ", config %d: "
+                           "host %016" PRIx64 " flags %#x, "
+                           "soft %016" PRIx64 " flags %#x\n",
+                           op_names[op], a, b, config,
+                           rh, get_float_exception_flags(&host),
+                           rs, get_float_exception_flags(&soft));
+        }
+        g_assert_cmphex(rh, ==, rs);
+        g_assert_cmphex(get_float_exception_flags(&host), ==,
+                        get_float_exception_flags(&soft));
+    }
+}
+
+static int random_iterations(void)
+{
+    return g_test_slow() ? 500000 : 10000;
+}
+
+static void test_f32(gconstpointer opaque)
+{
+    int op = GPOINTER_TO_INT(opaque);
+    int n = ARRAY_SIZE(f32_edge);
+    GRand *rand;
+    int i, j;
+
+    for (i = 0; i < 2 * n; i++) {
+        for (j = 0; j < 2 * n; j++) {
+            check_f32(op, f32_edge[i % n] ^ (i < n ? 0 : 0x80000000),
+                      f32_edge[j % n] ^ (j < n ? 0 : 0x80000000));
+        }
+    }
+
+    rand = g_rand_new_with_seed(op);
+    for (i = 0; i < random_iterations(); i++) {
+        check_f32(op, random_f32(rand), random_f32(rand));
+    }
+    g_rand_free(rand);
+}
+
+static void test_f64(gconstpointer opaque)
+{
+    int op = GPOINTER_TO_INT(opaque);
+    int n = ARRAY_SIZE(f64_edge);
+    GRand *rand;
+    int i, j;
+
+    for (i = 0; i < 2 * n; i++) {
+        for (j = 0; j < 2 * n; j++) {
+            check_f64(op, f64_edge[i % n] ^ (i < n ? 0 : 1ULL << 63),
+                      f64_edge[j % n] ^ (j < n ? 0 : 1ULL << 63));
+        }
+    }
+
+    rand = g_rand_new_with_seed(op);
+    for (i = 0; i < random_iterations(); i++) {
+        check_f64(op, random_f64(rand), random_f64(rand));
+    }
+    g_rand_free(rand);
+}
+
+int main(int argc, char **argv)
+{
+    char *path;
+    int op;
+
+    g_test_init(&argc, &argv, NULL);
+    for (op = 0; op < OP_COUNT; op++) {
+        path = g_strdup_printf("/softfloat/f32/%s", op_names[op]);
+        g_test_add_data_func(path, GINT_TO_POINTER(op), test_f32);
+        g_free(path);
+        path = g_strdup_printf("/softfloat/f64/%s", op_names[op]);
+        g_test_add_data_func(path, GINT_TO_POINTER(op), test_f64);
+        g_free(path);
+    }
+    return g_test_run();
+}
@@ -201,6 +201,50 @@ static void test_cancel(void)
     }
 }
 
+static void stats_cb(AioContext *pool_ctx, ThreadPoolStats *stats,
+                     void *opaque)
+{
+    if (pool_ctx == ctx) {
+        *(ThreadPoolStats *)opaque = *stats;
+    }
+}
+
+static void test_params(void)
+{
+    ThreadPoolParams params = { .min_threads = 3, .max_threads = 2 };
+    ThreadPoolStats stats = { 0 };
+    Error *err = NULL;
+    uint64_t completed, notifications;
+
+    thread_pool_foreach(stats_cb, &stats);
+    completed = stats.completed;
+    notifications = stats.notifications;
+
+    thread_pool_set_params(&params, &err);
+    g_assert(err != NULL);
+    error_free(err);
+    err = NULL;
+
+    params.min_threads = 1;
+    thread_pool_set_params(&params, &err);
+    g_assert(!err);
+
+    test_submit_many();
+
+    thread_pool_foreach(stats_cb, &stats);
+    g_assert_cmpint(stats.min_threads, ==, 1);
+    g_assert_cmpint(stats.max_threads, ==, 2);
+    g_assert_cmpint(stats.threads, >=, 1);
+    g_assert_cmpint(stats.queue_depth, ==, 0);
+    g_assert_cmpint(stats.completed, ==, completed + 100);
+    g_assert_cmpint(stats.notifications, >, notifications);
+    g_assert_cmpint(stats.notifications, <=, notifications + 100);
+
+    params = (ThreadPoolParams) { .min_threads = 0, .max_threads = 64 };
+    thread_pool_set_params(&params, &err);
+    g_assert(!err);
+}
+
 int main(int argc, char **argv)
 {
     int ret;
@@ -214,6 +258,7 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-co", test_submit_co);
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
     g_test_add_func("/thread-pool/cancel", test_cancel);
+    g_test_add_func("/thread-pool/params", test_params);
 
     ret = g_test_run();
 
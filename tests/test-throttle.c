@@ -0,0 +1,236 @@
+/*
+ * Leaky bucket throttling unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <math.h>
+#include "qemu/throttle.h"
+
+#define NS_PER_SEC          1000000000LL
+
+static ThrottleConfig cfg;
+static ThrottleState ts;
+
+static bool double_cmp(double x, double y)
+{
+    return fabs(x - y) < 1e-6;
+}
+
+static void test_leak_bucket(void)
+{
+    LeakyBucket bkt = {
+        .avg = 150,
+        .max = 15,
+        .level = 1.5,
+        .burst_length = 1,
+    };
+
+    /* half a second at 150 units/s leaks 75 units, but not below zero */
+    throttle_leak_bucket(&bkt, NS_PER_SEC / 2);
+    g_assert(bkt.level == 0);
+
+    bkt.level = 100;
+    throttle_leak_bucket(&bkt, NS_PER_SEC / 2);
+    g_assert(double_cmp(bkt.level, 25));
+}
+
+static void test_compute_wait(void)
+{
+    LeakyBucket bkt = { .burst_length = 1 };
+
+    /* no operation limit */
+    g_assert(!throttle_compute_wait(&bkt));
+
+    /* the bucket holds 1/10th of a second worth of I/O */
+    bkt.avg = 150;
+    bkt.level = 15;
+    g_assert(!throttle_compute_wait(&bkt));
+
+    /* 30 extra units take 0.2 seconds to leak */
+    bkt.level = 45;
+    g_assert_cmpint(throttle_compute_wait(&bkt), ==, NS_PER_SEC / 5);
+
+    /* a burst rate makes the bucket bigger */
+    bkt.max = 300;
+    g_assert(!throttle_compute_wait(&bkt));
+    bkt.level = 450;
+    g_assert_cmpint(throttle_compute_wait(&bkt), ==, NS_PER_SEC);
+
+    /* long bursts are limited by the burst rate */
+    bkt.burst_length = 10;
+    bkt.level = 450;
+    bkt.burst_level = 30;
+    g_assert(!throttle_compute_wait(&bkt));
+    bkt.burst_level = 60;
+    g_assert_cmpint(throttle_compute_wait(&bkt), ==, NS_PER_SEC / 10);
+}
+
+static void test_init(void)
+{
+    int i;
+
+    throttle_init(&ts, 42);
+    g_assert_cmpint(ts.previous_leak, ==, 42);
+    g_assert(!throttle_enabled(&ts.cfg));
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        g_assert(!ts.cfg.buckets[i].avg);
+        g_assert(!ts.cfg.buckets[i].max);
+        g_assert(!ts.cfg.buckets[i].level);
+        g_assert_cmpint(ts.cfg.buckets[i].burst_length, ==, 1);
+    }
+}
+
+static void test_config(void)
+{
+    ThrottleConfig out;
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_BPS_READ].avg = 1000;
+    cfg.buckets[THROTTLE_BPS_READ].level = 500;
+    g_assert(throttle_enabled(&cfg));
+
+    throttle_init(&ts, 0);
+    throttle_config(&ts, &cfg, 100);
+    g_assert_cmpint(ts.previous_leak, ==, 100);
+
+    throttle_get_config(&ts, &out);
+    g_assert(double_cmp(out.buckets[THROTTLE_BPS_READ].avg, 1000));
+    g_assert(!out.buckets[THROTTLE_BPS_READ].level);
+}
+
+static bool config_is_valid(void)
+{
+    Error *err = NULL;
+    bool valid;
+
+    valid = throttle_is_valid(&cfg, &err);
+    g_assert(valid == !err);
+    if (err) {
+        error_free(err);
+    }
+    return valid;
+}
+
+static void test_is_valid(void)
+{
+    throttle_config_init(&cfg);
+    g_assert(config_is_valid());
+
+    /* total and read/write limits conflict */
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = 1;
+    cfg.buckets[THROTTLE_BPS_WRITE].avg = 1;
+    g_assert(!config_is_valid());
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = 0;
+    g_assert(config_is_valid());
+
+    cfg.buckets[THROTTLE_OPS_READ].avg = -1;
+    g_assert(!config_is_valid());
+    cfg.buckets[THROTTLE_OPS_READ].avg = 0;
+
+    /* a burst rate needs an average and cannot be lower than it */
+    cfg.buckets[THROTTLE_OPS_TOTAL].max = 100;
+    g_assert(!config_is_valid());
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 200;
+    g_assert(!config_is_valid());
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 50;
+    g_assert(config_is_valid());
+
+    /* the burst length needs a burst rate */
+    cfg.buckets[THROTTLE_OPS_TOTAL].burst_length = 60;
+    g_assert(config_is_valid());
+    cfg.buckets[THROTTLE_OPS_TOTAL].burst_length = 0;
+    g_assert(!config_is_valid());
+    cfg.buckets[THROTTLE_OPS_TOTAL].burst_length = 1;
+    cfg.buckets[THROTTLE_BPS_WRITE].burst_length = 2;
+    g_assert(!config_is_valid());
+    cfg.buckets[THROTTLE_BPS_WRITE].max = 10;
+    g_assert(config_is_valid());
+
+    cfg.buckets[THROTTLE_BPS_WRITE].burst_length = UINT64_MAX;
+    g_assert(!config_is_valid());
+}
+
+/* Submits requests of @size bytes as fast as allowed for @duration ns and
+ * returns the number of requests that were submitted.
+ */
+static int64_t run_requests(bool is_write, uint64_t size, int64_t start,
+                            int64_t duration)
+{
+    int64_t now = start, next;
+    int64_t count = 0;
+
+    while (now < start + duration) {
+        if (throttle_compute_timer(&ts, is_write, now, &next)) {
+            g_assert_cmpint(next, >, now);
+            now = next;
+            continue;
+        }
+        throttle_account(&ts, is_write, size);
+        count++;
+    }
+    return count;
+}
+
+static void test_average(void)
+{
+    int64_t count, next;
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_OPS_WRITE].avg = 100;
+    throttle_init(&ts, 0);
+    throttle_config(&ts, &cfg, 0);
+
+    /* reads are not limited */
+    g_assert(!throttle_compute_timer(&ts, false, 0, &next));
+
+    /* 10 seconds at 100 iops, plus the 1/10th second bucket */
+    count = run_requests(true, 4096, 0, 10 * NS_PER_SEC);
+    g_assert_cmpint(count, >=, 1000);
+    g_assert_cmpint(count, <=, 1012);
+}
+
+static void test_burst(void)
+{
+    int64_t count;
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = 1000;
+    cfg.buckets[THROTTLE_BPS_TOTAL].max = 10000;
+    cfg.buckets[THROTTLE_BPS_TOTAL].burst_length = 5;
+    throttle_init(&ts, 0);
+    throttle_config(&ts, &cfg, 0);
+
+    /* The first second runs at the burst rate */
+    count = run_requests(false, 100, 0, NS_PER_SEC);
+    g_assert_cmpint(count, >=, 100);
+    g_assert_cmpint(count, <=, 112);
+
+    /* The burst budget of 50000 bytes is only exhausted after more than
+     * 5 seconds, because the bucket also leaks at the average rate...
+     */
+    count += run_requests(true, 100, NS_PER_SEC, 4 * NS_PER_SEC);
+    g_assert_cmpint(count, >=, 500);
+    g_assert_cmpint(count, <=, 512);
+    run_requests(true, 100, 5 * NS_PER_SEC, 5 * NS_PER_SEC);
+
+    /* ... and then I/O is throttled down to the average rate */
+    count = run_requests(true, 100, 10 * NS_PER_SEC, 10 * NS_PER_SEC);
+    g_assert_cmpint(count, >=, 99);
+    g_assert_cmpint(count, <=, 101);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/throttle/leak_bucket", test_leak_bucket);
+    g_test_add_func("/throttle/compute_wait", test_compute_wait);
+    g_test_add_func("/throttle/init", test_init);
+    g_test_add_func("/throttle/config", test_config);
+    g_test_add_func("/throttle/is_valid", test_is_valid);
+    g_test_add_func("/throttle/average", test_average);
+    g_test_add_func("/throttle/burst", test_burst);
+    return g_test_run();
+}
@@ -22,7 +22,11 @@
 #include "trace.h"
 #include "block/block_int.h"
 #include "qemu/event_notifier.h"
+#include "qemu/main-loop.h"
 #include "block/thread-pool.h"
+#ifdef CONFIG_LINUX
+#include <sched.h>
+#endif
 
 static void do_spawn_thread(ThreadPool *pool);
 
@@ -48,6 +52,9 @@ struct ThreadPoolElement {
     enum ThreadState state;
     int ret;
 
+    /* Written before the request is queued, read by the worker.  */
+    int64_t submit_ns;
+
     /* Access to this list is protected by lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
@@ -62,7 +69,6 @@ struct ThreadPool {
     QemuCond check_cancel;
     QemuCond worker_stopped;
     QemuSemaphore sem;
-    int max_threads;
     QEMUBH *new_thread_bh;
 
     /* The following variables are only accessed from one AioContext. */
@@ -70,55 +76,136 @@ struct ThreadPool {
 
     /* The following variables are protected by lock.  */
     QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    int min_threads;
+    int max_threads;
+    int *cpus;           /* CPUs the workers run on, see ThreadPoolParams */
+    int nb_cpus;
+    unsigned affinity_gen; /* incremented whenever cpus changes */
     int cur_threads;
     int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
+    int pending_wakeups; /* sem posts not yet consumed by a worker */
     int pending_cancellations; /* whether we need a cond_broadcast */
+    bool completion_pending; /* notifier set, completions not reaped yet */
     bool stopping;
+    ThreadPoolStats stats;
+
+    /* Access to this list is protected by thread_pools_lock.  */
+    QLIST_ENTRY(ThreadPool) list;
+};
+
+/* All pools, for thread_pool_set_params and thread_pool_foreach */
+static QemuMutex thread_pools_lock;
+static QLIST_HEAD(, ThreadPool) thread_pools =
+    QLIST_HEAD_INITIALIZER(thread_pools);
+static ThreadPoolParams thread_pool_params = {
+    .min_threads = 0,
+    .max_threads = 64,
 };
 
+static void __attribute__((constructor)) thread_pool_init(void)
+{
+    qemu_mutex_init(&thread_pools_lock);
+}
+
+/* Runs with lock taken.  Workers adopt the CPU list of the pool before
+ * picking up their next request.
+ */
+static void worker_set_affinity(ThreadPool *pool)
+{
+#ifdef CONFIG_LINUX
+    cpu_set_t set;
+    int i;
+
+    /* An empty list only affects new workers, which inherit the
+     * affinity of the thread that creates them.
+     */
+    if (!pool->nb_cpus) {
+        return;
+    }
+
+    CPU_ZERO(&set);
+    for (i = 0; i < pool->nb_cpus; i++) {
+        CPU_SET(pool->cpus[i], &set);
+    }
+    sched_setaffinity(0, sizeof(set), &set);
+#endif
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
+    unsigned affinity_gen;
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
+    affinity_gen = pool->affinity_gen;
+    worker_set_affinity(pool);
     do_spawn_thread(pool);
 
-    while (!pool->stopping) {
+    while (!pool->stopping && pool->cur_threads <= pool->max_threads) {
         ThreadPoolElement *req;
+        int64_t start, wait_ns, service_ns;
         int ret;
 
-        do {
+        /* Workers only sleep when there is nothing queued, so a busy pool
+         * runs back-to-back requests without any wakeup.
+         */
+        if (QTAILQ_EMPTY(&pool->request_list)) {
             pool->idle_threads++;
             qemu_mutex_unlock(&pool->lock);
             ret = qemu_sem_timedwait(&pool->sem, 10000);
             qemu_mutex_lock(&pool->lock);
             pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
-        if (ret == -1 || pool->stopping) {
-            break;
+            if (ret == 0) {
+                pool->pending_wakeups--;
+            } else if (QTAILQ_EMPTY(&pool->request_list) &&
+                       pool->cur_threads > pool->min_threads) {
+                break;
+            }
+            continue;
         }
 
         req = QTAILQ_FIRST(&pool->request_list);
         QTAILQ_REMOVE(&pool->request_list, req, reqs);
         req->state = THREAD_ACTIVE;
+        pool->stats.queue_depth--;
+        if (affinity_gen != pool->affinity_gen) {
+            affinity_gen = pool->affinity_gen;
+            worker_set_affinity(pool);
+        }
         qemu_mutex_unlock(&pool->lock);
 
+        start = get_clock();
         ret = req->func(req->arg);
+        service_ns = get_clock() - start;
+        wait_ns = start - req->submit_ns;
+
+        /* Account the request before it can be reaped.  */
+        qemu_mutex_lock(&pool->lock);
+        pool->stats.completed++;
+        pool->stats.wait_ns += wait_ns;
+        pool->stats.max_wait_ns = MAX(pool->stats.max_wait_ns, wait_ns);
+        pool->stats.service_ns += service_ns;
 
         req->ret = ret;
         /* Write ret before state.  */
         smp_wmb();
         req->state = THREAD_DONE;
 
-        qemu_mutex_lock(&pool->lock);
         if (pool->pending_cancellations) {
             qemu_cond_broadcast(&pool->check_cancel);
         }
 
-        event_notifier_set(&pool->notifier);
+        /* One notification covers all requests that complete before the
+         * AioContext gets to reap them.
+         */
+        if (!pool->completion_pending) {
+            pool->completion_pending = true;
+            pool->stats.notifications++;
+            event_notifier_set(&pool->notifier);
+        }
     }
 
     pool->cur_threads--;
@@ -173,6 +260,11 @@ static void event_notifier_ready(EventNotifier *notifier)
     ThreadPoolElement *elem, *next;
 
     event_notifier_test_and_clear(notifier);
+
+    /* Workers that complete a request after this point notify again.  */
+    qemu_mutex_lock(&pool->lock);
+    pool->completion_pending = false;
+    qemu_mutex_unlock(&pool->lock);
 restart:
     QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
         if (elem->state != THREAD_CANCELED && elem->state != THREAD_DONE) {
@@ -211,14 +303,14 @@ static void thread_pool_cancel(BlockDriverAIOCB *acb)
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
     qemu_mutex_lock(&pool->lock);
-    if (elem->state == THREAD_QUEUED &&
-        /* No thread has yet started working on elem. we can try to "steal"
-         * the item from the worker if we can get a signal from the
-         * semaphore.  Because this is non-blocking, we can do it with
-         * the lock taken and ensure that elem will remain THREAD_QUEUED.
+    if (elem->state == THREAD_QUEUED) {
+        /* No thread has yet started working on elem, and workers only
+         * dequeue requests with the lock taken, so we can "steal" it.
+         * A worker that is woken up for it will find the queue empty
+         * and go back to sleep.
          */
-        qemu_sem_timedwait(&pool->sem, 0) == 0) {
         QTAILQ_REMOVE(&pool->request_list, elem, reqs);
+        pool->stats.queue_depth--;
         elem->state = THREAD_CANCELED;
         event_notifier_set(&pool->notifier);
     } else {
@@ -241,24 +333,39 @@ BlockDriverAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
     ThreadPoolElement *req;
+    bool wakeup;
 
     req = qemu_aio_get(&thread_pool_aiocb_info, NULL, cb, opaque);
     req->func = func;
     req->arg = arg;
     req->state = THREAD_QUEUED;
     req->pool = pool;
+    req->submit_ns = get_clock();
 
     QLIST_INSERT_HEAD(&pool->head, req, all);
 
     trace_thread_pool_submit(pool, req, arg);
 
     qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
+    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
+    pool->stats.queue_depth++;
+    pool->stats.max_queue_depth = MAX(pool->stats.max_queue_depth,
+                                      pool->stats.queue_depth);
+
+    /* Only wake up a worker if none is already on its way; busy workers
+     * pick up the request when they are done with the current one.
+     */
+    wakeup = pool->idle_threads > pool->pending_wakeups;
+    if (wakeup) {
+        pool->pending_wakeups++;
+    } else if (pool->cur_threads < pool->max_threads) {
         spawn_thread(pool);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
     qemu_mutex_unlock(&pool->lock);
-    qemu_sem_post(&pool->sem);
+
+    if (wakeup) {
+        qemu_sem_post(&pool->sem);
+    }
     return &req->common;
 }
 
@@ -290,6 +397,33 @@ void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg)
     thread_pool_submit_aio(pool, func, arg, NULL, NULL);
 }
 
+/* Runs with lock taken.  */
+static void thread_pool_apply_params(ThreadPool *pool,
+                                     const ThreadPoolParams *params)
+{
+    pool->min_threads = params->min_threads;
+    pool->max_threads = params->max_threads;
+
+    g_free(pool->cpus);
+    pool->cpus = g_memdup(params->cpus, params->nb_cpus * sizeof(int));
+    pool->nb_cpus = params->nb_cpus;
+    pool->affinity_gen++;
+
+    /* Workers in excess of max_threads exit when they are done with their
+     * current request; idle ones have to be woken up for that.
+     */
+    while (pool->cur_threads < pool->min_threads) {
+        spawn_thread(pool);
+    }
+    if (pool->cur_threads > pool->max_threads) {
+        int n = MIN(pool->cur_threads - pool->max_threads, pool->idle_threads);
+        while (n-- > 0) {
+            pool->pending_wakeups++;
+            qemu_sem_post(&pool->sem);
+        }
+    }
+}
+
 static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
 {
     if (!ctx) {
@@ -303,7 +437,6 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     qemu_cond_init(&pool->check_cancel);
     qemu_cond_init(&pool->worker_stopped);
     qemu_sem_init(&pool->sem, 0);
-    pool->max_threads = 64;
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
@@ -311,6 +444,13 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
 
     aio_set_event_notifier(ctx, &pool->notifier, event_notifier_ready,
                            thread_pool_active);
+
+    qemu_mutex_lock(&thread_pools_lock);
+    qemu_mutex_lock(&pool->lock);
+    thread_pool_apply_params(pool, &thread_pool_params);
+    qemu_mutex_unlock(&pool->lock);
+    QLIST_INSERT_HEAD(&thread_pools, pool, list);
+    qemu_mutex_unlock(&thread_pools_lock);
 }
 
 ThreadPool *thread_pool_new(AioContext *ctx)
@@ -328,6 +468,10 @@ void thread_pool_free(ThreadPool *pool)
 
     assert(QLIST_EMPTY(&pool->head));
 
+    qemu_mutex_lock(&thread_pools_lock);
+    QLIST_REMOVE(pool, list);
+    qemu_mutex_unlock(&thread_pools_lock);
+
     qemu_mutex_lock(&pool->lock);
 
     /* Stop new threads from spawning */
@@ -338,6 +482,7 @@ void thread_pool_free(ThreadPool *pool)
     /* Wait for worker threads to terminate */
     pool->stopping = true;
     while (pool->cur_threads > 0) {
+        pool->pending_wakeups++;
         qemu_sem_post(&pool->sem);
         qemu_cond_wait(&pool->worker_stopped, &pool->lock);
     }
@@ -350,5 +495,76 @@ void thread_pool_free(ThreadPool *pool)
     qemu_cond_destroy(&pool->worker_stopped);
     qemu_mutex_destroy(&pool->lock);
     event_notifier_cleanup(&pool->notifier);
+    g_free(pool->cpus);
     g_free(pool);
 }
+
+void thread_pool_get_params(ThreadPoolParams *params)
+{
+    qemu_mutex_lock(&thread_pools_lock);
+    *params = thread_pool_params;
+    params->cpus = g_memdup(params->cpus, params->nb_cpus * sizeof(int));
+    qemu_mutex_unlock(&thread_pools_lock);
+}
+
+void thread_pool_set_params(const ThreadPoolParams *params, Error **errp)
+{
+    ThreadPool *pool;
+    int i;
+
+    if (params->min_threads < 0 || params->max_threads < 1 ||
+        params->min_threads > params->max_threads) {
+        error_setg(errp, "invalid thread pool size, the minimum must be "
+                   "between 0 and the maximum, and the maximum at least 1");
+        return;
+    }
+    for (i = 0; i < params->nb_cpus; i++) {
+#ifdef CONFIG_LINUX
+        if (params->cpus[i] < 0 || params->cpus[i] >= CPU_SETSIZE) {
+            error_setg(errp, "invalid CPU number %d", params->cpus[i]);
+            return;
+        }
+#else
+        error_setg(errp, "thread pool CPU affinity is not supported "
+                   "on this host");
+        return;
+#endif
+    }
+
+    qemu_mutex_lock(&thread_pools_lock);
+    g_free(thread_pool_params.cpus);
+    thread_pool_params = *params;
+    thread_pool_params.cpus = g_memdup(params->cpus,
+                                       params->nb_cpus * sizeof(int));
+
+    QLIST_FOREACH(pool, &thread_pools, list) {
+        qemu_mutex_lock(&pool->lock);
+        thread_pool_apply_params(pool, &thread_pool_params);
+        qemu_mutex_unlock(&pool->lock);
+    }
+    qemu_mutex_unlock(&thread_pools_lock);
+}
+
+static void thread_pool_get_stats(ThreadPool *pool, ThreadPoolStats *stats)
+{
+    qemu_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    stats->min_threads = pool->min_threads;
+    stats->max_threads = pool->max_threads;
+    stats->threads = pool->cur_threads;
+    stats->idle_threads = pool->idle_threads;
+    qemu_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_foreach(ThreadPoolStatsFunc *func, void *opaque)
+{
+    ThreadPool *pool;
+    ThreadPoolStats stats;
+
+    qemu_mutex_lock(&thread_pools_lock);
+    QLIST_FOREACH(pool, &thread_pools, list) {
+        thread_pool_get_stats(pool, &stats);
+        func(pool->ctx, &stats, opaque);
+    }
+    qemu_mutex_unlock(&thread_pools_lock);
+}
@@ -36,6 +36,8 @@
 #include "disas/disas.h"
 #include "tcg.h"
 #include "qemu/timer.h"
+#include "qemu/atomic.h"
+#include "qemu/tls.h"
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
 #if defined(CONFIG_USER_ONLY)
@@ -58,6 +60,7 @@
 #endif
 
 #include "exec/cputlb.h"
+#include "exec/tb-cache.h"
 #include "translate-all.h"
 
 //#define DEBUG_TB_INVALIDATE
@@ -121,6 +124,52 @@ static void *l1_map[V_L1_SIZE];
 /* code generation context */
 TCGContext tcg_ctx;
 
+bool parallel_cpus;
+
+/* tb_lock nests, so that the invalidation entry points can take it whether
+   or not their caller (e.g. a TLB fill during translation) already did.
+   The count is only per-thread on Linux (see qemu/tls.h); elsewhere all
+   TCG code runs under the iothread lock, so the count stays balanced.  */
+static DEFINE_TLS(int, have_tb_lock);
+
+void tb_lock(void)
+{
+    if (tls_var(have_tb_lock)++) {
+        return;
+    }
+#if defined(CONFIG_USER_ONLY)
+    spin_lock(&tcg_ctx.tb_ctx.tb_lock);
+#else
+    if (parallel_cpus) {
+        qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
+    }
+#endif
+}
+
+void tb_unlock(void)
+{
+    assert(tls_var(have_tb_lock) > 0);
+    if (--tls_var(have_tb_lock)) {
+        return;
+    }
+#if defined(CONFIG_USER_ONLY)
+    spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
+#else
+    if (parallel_cpus) {
+        qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
+    }
+#endif
+}
+
+/* Drop tb_lock if an exception longjmp'ed out of a region that held it.  */
+void tb_lock_reset(void)
+{
+    if (tls_var(have_tb_lock)) {
+        tls_var(have_tb_lock) = 1;
+        tb_unlock();
+    }
+}
+
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2);
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
@@ -251,13 +300,17 @@ static int cpu_restore_state_from_tb(TranslationBlock *tb, CPUArchState *env,
 bool cpu_restore_state(CPUArchState *env, uintptr_t retaddr)
 {
     TranslationBlock *tb;
+    bool found = false;
 
+    /* Retranslating uses tcg_ctx, which another thread may be using.  */
+    tb_lock();
     tb = tb_find_pc(retaddr);
     if (tb) {
         cpu_restore_state_from_tb(tb, env, retaddr);
-        return true;
+        found = true;
     }
-    return false;
+    tb_unlock();
+    return found;
 }
 
 #ifdef _WIN32
@@ -386,39 +439,60 @@ static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
         P = mmap(NULL, SIZE, PROT_READ | PROT_WRITE,    \
                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);   \
     } while (0)
+# define FREE(P, SIZE) \
+    do { munmap(P, SIZE); } while (0)
 #else
 # define ALLOC(P, SIZE) \
     do { P = g_malloc0(SIZE); } while (0)
+# define FREE(P, SIZE) \
+    do { g_free(P); } while (0)
 #endif
 
+    /* The levels are installed with a compare-and-swap, so that threads
+       can look up and allocate page descriptors without taking a lock;
+       the loser of a race frees its copy.  */
+
     /* Level 1.  Always allocated.  */
     lp = l1_map + ((index >> V_L1_SHIFT) & (V_L1_SIZE - 1));
 
     /* Level 2..N-1.  */
     for (i = V_L1_SHIFT / L2_BITS - 1; i > 0; i--) {
-        void **p = *lp;
+        void **p = atomic_read(lp);
 
         if (p == NULL) {
+            void **existing;
+
             if (!alloc) {
                 return NULL;
             }
             ALLOC(p, sizeof(void *) * L2_SIZE);
-            *lp = p;
+            existing = atomic_cmpxchg(lp, NULL, p);
+            if (unlikely(existing)) {
+                FREE(p, sizeof(void *) * L2_SIZE);
+                p = existing;
+            }
         }
 
         lp = p + ((index >> (i * L2_BITS)) & (L2_SIZE - 1));
     }
 
-    pd = *lp;
+    pd = atomic_read(lp);
     if (pd == NULL) {
+        PageDesc *existing;
+
         if (!alloc) {
             return NULL;
         }
         ALLOC(pd, sizeof(PageDesc) * L2_SIZE);
-        *lp = pd;
+        existing = atomic_cmpxchg(lp, NULL, pd);
+        if (unlikely(existing)) {
+            FREE(pd, sizeof(PageDesc) * L2_SIZE);
+            pd = existing;
+        }
     }
 
 #undef ALLOC
+#undef FREE
 
     return pd + (index & (L2_SIZE - 1));
 }
@@ -428,11 +502,6 @@ static inline PageDesc *page_find(tb_page_addr_t index)
     return page_find_alloc(index, 0);
 }
 
-#if !defined(CONFIG_USER_ONLY)
-#define mmap_lock() do { } while (0)
-#define mmap_unlock() do { } while (0)
-#endif
-
 #if defined(CONFIG_USER_ONLY)
 /* Currently it is not recommended to allocate big chunks of data in
    user mode. It will change when a dedicated libc will be used.  */
@@ -571,8 +640,8 @@ static inline void code_gen_alloc(size_t tb_size)
        that we don't need to mark (additional) portions of the data segment
        as executable.  */
     tcg_ctx.code_gen_prologue = tcg_ctx.code_gen_buffer +
-            tcg_ctx.code_gen_buffer_size - 1024;
-    tcg_ctx.code_gen_buffer_size -= 1024;
+            tcg_ctx.code_gen_buffer_size - CODE_GEN_PROLOGUE_SIZE;
+    tcg_ctx.code_gen_buffer_size -= CODE_GEN_PROLOGUE_SIZE;
 
     tcg_ctx.code_gen_buffer_max_size = tcg_ctx.code_gen_buffer_size -
         (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
@@ -582,6 +651,59 @@ static inline void code_gen_alloc(size_t tb_size)
             g_malloc(tcg_ctx.code_gen_max_blocks * sizeof(TranslationBlock));
 }
 
+static void tb_region_reset(TBRegion *r)
+{
+    r->code_ptr = r->code_start;
+    r->nb_tbs = 0;
+    r->last_use = tcg_ctx.tb_ctx.clock;
+}
+
+/* Split the translation buffer and the TB descriptors in regions.  Each
+   region keeps room for the largest possible TB at its end, so small
+   buffers get fewer regions.  */
+static void tb_regions_init(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    size_t margin = TCG_MAX_OP_SIZE * OPC_BUF_SIZE;
+    int i, n, max_tbs;
+
+    n = CODE_GEN_MAX_REGIONS;
+    while (n > 1 && tcg_ctx.code_gen_buffer_size / n < 4 * margin) {
+        n--;
+    }
+    ctx->nb_regions = n;
+    ctx->region_size = (tcg_ctx.code_gen_buffer_size / n) &
+                       ~(size_t)(CODE_GEN_ALIGN - 1);
+    max_tbs = tcg_ctx.code_gen_max_blocks / n;
+
+    for (i = 0; i < n; i++) {
+        TBRegion *r = &ctx->regions[i];
+
+        r->code_start = tcg_ctx.code_gen_buffer + i * ctx->region_size;
+        r->code_end = r->code_start + ctx->region_size - margin;
+        r->tbs = ctx->tbs + i * max_tbs;
+        r->max_tbs = max_tbs;
+        tb_region_reset(r);
+    }
+    ctx->cur_region = &ctx->regions[0];
+}
+
+#if defined(DEBUG_FLUSH) || !defined(CONFIG_USER_ONLY)
+/* size of the generated code in all regions */
+static size_t tb_code_size(void)
+{
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_regions; i++) {
+        TBRegion *r = &tcg_ctx.tb_ctx.regions[i];
+
+        size += r->code_ptr - r->code_start;
+    }
+    return size;
+}
+#endif
+
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
    (in bytes) allocated to the translation buffer. Zero means default
    size. */
@@ -589,9 +711,14 @@ void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
     code_gen_alloc(tb_size);
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
+    tb_regions_init();
     tcg_register_jit(tcg_ctx.code_gen_buffer, tcg_ctx.code_gen_buffer_size);
     page_init();
+    qht_init(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE,
+             QHT_MODE_AUTO_RESIZE);
+#if !defined(CONFIG_USER_ONLY)
+    qemu_mutex_init(&tcg_ctx.tb_ctx.tb_lock);
+#endif
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
     /* There's no guest base to take into account, so go ahead and
        initialize the prologue now.  */
@@ -604,31 +731,35 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Allocate a new translation block in the current region.  Return NULL
+   if it has too many translation blocks or too much generated code. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBRegion *r = tcg_ctx.tb_ctx.cur_region;
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks ||
-        (tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer) >=
-         tcg_ctx.code_gen_buffer_max_size) {
+    if (r->nb_tbs >= r->max_tbs || r->code_ptr >= r->code_end) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &r->tbs[r->nb_tbs++];
+    tcg_ctx.tb_ctx.nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    tb->invalid = false;
+    tb->region = r - tcg_ctx.tb_ctx.regions;
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    TBRegion *r = &tcg_ctx.tb_ctx.regions[tb->region];
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
-        tcg_ctx.code_gen_ptr = tb->tc_ptr;
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
+        r->code_ptr = tb->tc_ptr;
+        r->nb_tbs--;
         tcg_ctx.tb_ctx.nb_tbs--;
     }
 }
@@ -676,93 +807,239 @@ static void page_flush_tb(void)
 }
 
 /* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUArchState *env1)
+static void do_tb_flush(CPUArchState *env1)
 {
     CPUArchState *env;
+    int i;
 
 #if defined(DEBUG_FLUSH)
-    printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer),
-           tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.tb_ctx.nb_tbs > 0 ?
-           ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)) /
-           tcg_ctx.tb_ctx.nb_tbs : 0);
+    printf("qemu: flush code_size=%zd nb_tbs=%d avg_tb_size=%zd\n",
+           tb_code_size(), tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.tb_ctx.nb_tbs > 0 ?
+           tb_code_size() / tcg_ctx.tb_ctx.nb_tbs : 0);
 #endif
-    if ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)
-        > tcg_ctx.code_gen_buffer_size) {
-        cpu_abort(env1, "Internal error: code buffer overflow\n");
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_regions; i++) {
+        TBRegion *r = &tcg_ctx.tb_ctx.regions[i];
+
+        if (r->code_ptr - r->code_start > tcg_ctx.tb_ctx.region_size) {
+            cpu_abort(env1, "Internal error: code buffer overflow\n");
+        }
+        tb_region_reset(r);
     }
+    tcg_ctx.tb_ctx.cur_region = &tcg_ctx.tb_ctx.regions[0];
     tcg_ctx.tb_ctx.nb_tbs = 0;
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof(void *));
     }
 
-    memset(tcg_ctx.tb_ctx.tb_phys_hash, 0,
-            CODE_GEN_PHYS_HASH_SIZE * sizeof(void *));
+    qht_reset_size(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
 
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tcg_ctx.tb_ctx.tb_flush_count++;
+    tcg_ctx.tb_ctx.tb_generation++;
 }
 
-#ifdef DEBUG_TB_CHECK
+#if defined(CONFIG_USER_ONLY)
+/* Requests from tb_flush and tb_evict_region, protected by tb_lock.  */
+static bool tb_flush_requested;
+static bool tb_evict_requested;
 
-static void tb_invalidate_check(target_ulong address)
+/* Other guest threads may be running code from the buffer, unless the
+   calling thread is the only one.  */
+static bool tb_exclusive_work_needed(void)
 {
-    TranslationBlock *tb;
+    return first_cpu && first_cpu->next_cpu;
+}
+
+/* Leave the execution loop, if the calling thread is in it, so that
+   cpu_exec_start runs the request.  */
+static void tb_request_exclusive_work(bool *request)
+{
+    tb_lock();
+    *request = true;
+    tb_unlock();
+    if (cpu_single_env) {
+        cpu_exit(cpu_single_env);
+    }
+}
+
+bool tb_exclusive_work_pending(void)
+{
+    return atomic_read(&tb_flush_requested) ||
+           atomic_read(&tb_evict_requested);
+}
+#else
+static void tb_flush_safe_work(void *data)
+{
+    /* Skip the flush if another request already did it.  */
+    if (tcg_ctx.tb_ctx.tb_flush_count == (int)(uintptr_t)data) {
+        do_tb_flush(first_cpu);
+    }
+}
+#endif
+
+void tb_flush(CPUArchState *env1)
+{
+#if defined(CONFIG_USER_ONLY)
+    if (tb_exclusive_work_needed()) {
+        tb_request_exclusive_work(&tb_flush_requested);
+        return;
+    }
+#else
+    if (parallel_cpus) {
+        /* Other vCPUs may be running code from the buffer, so the flush
+           is done once they have all left cpu_exec.  */
+        CPUArchState *env = cpu_single_env ? cpu_single_env : first_cpu;
+
+        async_safe_run_on_cpu(ENV_GET_CPU(env), tb_flush_safe_work,
+                              (void *)(uintptr_t)
+                              tcg_ctx.tb_ctx.tb_flush_count);
+        return;
+    }
+#endif
+    do_tb_flush(env1);
+}
+
+/* Empty the least recently used region other than the current one, and
+   make it the current region.  */
+static void do_tb_evict_region(CPUArchState *env1)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *victim = NULL;
     int i;
 
-    address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_ctx.tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
-                  address >= tb->pc + tb->size)) {
-                printf("ERROR invalidate: address=" TARGET_FMT_lx
-                       " PC=%08lx size=%04x\n",
-                       address, (long)tb->pc, tb->size);
+    if (ctx->nb_regions == 1) {
+        do_tb_flush(env1);
+        return;
+    }
+
+    for (i = 0; i < ctx->nb_regions; i++) {
+        TBRegion *r = &ctx->regions[i];
+
+        if (r == ctx->cur_region) {
+            continue;
+        }
+        if (!r->nb_tbs) {
+            victim = r;
+            break;
+        }
+        if (!victim || (int)(r->last_use - victim->last_use) < 0) {
+            victim = r;
+        }
+    }
+
+    if (victim->nb_tbs) {
+        /* This also unchains the TBs of the other regions that jump
+           into the victim.  */
+        for (i = 0; i < victim->nb_tbs; i++) {
+            TranslationBlock *tb = &victim->tbs[i];
+
+            if (!tb->invalid) {
+                tb_phys_invalidate(tb, -1);
             }
         }
+        ctx->nb_tbs -= victim->nb_tbs;
+        ctx->tb_region_evict_count++;
+        ctx->tb_generation++;
     }
+    tb_region_reset(victim);
+    ctx->cur_region = victim;
 }
 
-/* verify that all the pages have correct rights for code */
-static void tb_page_check(void)
+#if defined(CONFIG_USER_ONLY)
+void tb_exclusive_work(void)
 {
-    TranslationBlock *tb;
-    int i, flags1, flags2;
-
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
-                tb = tb->phys_hash_next) {
-            flags1 = page_get_flags(tb->pc);
-            flags2 = page_get_flags(tb->pc + tb->size - 1);
-            if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
-                printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
-                       (long)tb->pc, tb->size, flags1, flags2);
-            }
-        }
+    mmap_lock();
+    tb_lock();
+    if (tb_flush_requested) {
+        /* the flush empties every region, so it does the eviction too */
+        do_tb_flush(first_cpu);
+    } else if (tb_evict_requested) {
+        do_tb_evict_region(first_cpu);
+    }
+    tb_flush_requested = false;
+    tb_evict_requested = false;
+    tb_unlock();
+    mmap_unlock();
+}
+#else
+static void tb_evict_region_safe_work(void *data)
+{
+    /* Skip the eviction if another request already did it.  */
+    if (tcg_ctx.tb_ctx.tb_region_evict_count == (int)(uintptr_t)data) {
+        do_tb_evict_region(first_cpu);
     }
 }
+#endif
 
+/* Called when the current region is full.  Returns false if the eviction
+   was only scheduled, because other vCPUs may be running code from the
+   victim region.  */
+static bool tb_evict_region(CPUArchState *env1)
+{
+#if defined(CONFIG_USER_ONLY)
+    if (tb_exclusive_work_needed()) {
+        tb_request_exclusive_work(&tb_evict_requested);
+        return false;
+    }
+#else
+    if (parallel_cpus) {
+        async_safe_run_on_cpu(ENV_GET_CPU(env1), tb_evict_region_safe_work,
+                              (void *)(uintptr_t)
+                              tcg_ctx.tb_ctx.tb_region_evict_count);
+        return false;
+    }
 #endif
+    do_tb_evict_region(env1);
+    return true;
+}
+
+#ifdef DEBUG_TB_CHECK
 
-static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
+static void do_tb_invalidate_check(struct qht *ht, void *p, uint32_t hash,
+                                   void *userp)
 {
-    TranslationBlock *tb1;
+    TranslationBlock *tb = p;
+    target_ulong address = *(target_ulong *)userp;
 
-    for (;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = tb1->phys_hash_next;
-            break;
-        }
-        ptb = &tb1->phys_hash_next;
+    if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
+          address >= tb->pc + tb->size)) {
+        printf("ERROR invalidate: address=" TARGET_FMT_lx
+               " PC=%08lx size=%04x\n",
+               address, (long)tb->pc, tb->size);
+    }
+}
+
+static void tb_invalidate_check(target_ulong address)
+{
+    address &= TARGET_PAGE_MASK;
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_invalidate_check, &address);
+}
+
+static void do_tb_page_check(struct qht *ht, void *p, uint32_t hash,
+                             void *userp)
+{
+    TranslationBlock *tb = p;
+    int flags1, flags2;
+
+    flags1 = page_get_flags(tb->pc);
+    flags2 = page_get_flags(tb->pc + tb->size - 1);
+    if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
+        printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
+               (long)tb->pc, tb->size, flags1, flags2);
     }
 }
 
+/* verify that all the pages have correct rights for code */
+static void tb_page_check(void)
+{
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_page_check, NULL);
+}
+
+#endif
+
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -821,14 +1098,15 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 {
     CPUArchState *env;
     PageDesc *p;
-    unsigned int h, n1;
+    unsigned int n1;
+    uint32_t h;
     tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
-    /* remove the TB from the hash list */
+    /* remove the TB from the hash table */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_hash_remove(&tcg_ctx.tb_ctx.tb_phys_hash[h], tb);
+    h = tb_hash_func(phys_pc, tb->pc, tb->flags);
+    qht_remove(&tcg_ctx.tb_ctx.htable, tb, h);
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -842,7 +1120,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
         invalidate_page_bitmap(p);
     }
 
-    tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
+    tb->invalid = true;
 
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
@@ -943,21 +1221,30 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+        /* the current region is full, reuse another one */
+        if (!tb_evict_region(env)) {
+            /* the eviction is only scheduled; leave the execution loop so
+               that it can run */
+            env->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(env);
+        }
         /* cannot fail at this point */
         tb = tb_alloc(pc);
-        /* Don't forget to invalidate previous TB info.  */
-        tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
     }
-    tc_ptr = tcg_ctx.code_gen_ptr;
+    tcg_ctx.tb_ctx.clock++;
+    tcg_ctx.tb_ctx.cur_region->last_use = tcg_ctx.tb_ctx.clock;
+    tc_ptr = tcg_ctx.tb_ctx.cur_region->code_ptr;
     tb->tc_ptr = tc_ptr;
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
-    cpu_gen_code(env, tb, &code_gen_size);
-    tcg_ctx.code_gen_ptr = (void *)(((uintptr_t)tcg_ctx.code_gen_ptr +
-            code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+    if (!tb_cache_load(env, tb, phys_pc, &code_gen_size)) {
+        cpu_gen_code(env, tb, &code_gen_size);
+        tb_cache_add(env, tb, phys_pc, code_gen_size);
+    }
+    tcg_ctx.tb_ctx.cur_region->code_ptr =
+        (void *)(((uintptr_t)tc_ptr + code_gen_size + CODE_GEN_ALIGN - 1) &
+                 ~(CODE_GEN_ALIGN - 1));
 
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
@@ -979,11 +1266,13 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
 void tb_invalidate_phys_range(tb_page_addr_t start, tb_page_addr_t end,
                               int is_cpu_write_access)
 {
+    tb_lock();
     while (start < end) {
         tb_invalidate_phys_page_range(start, end, is_cpu_write_access);
         start &= TARGET_PAGE_MASK;
         start += TARGET_PAGE_SIZE;
     }
+    tb_unlock();
 }
 
 /*
@@ -1158,6 +1447,7 @@ static void tb_invalidate_phys_page(tb_page_addr_t addr,
     if (!p) {
         return;
     }
+    tb_lock();
     tb = p->first_tb;
 #ifdef TARGET_HAS_PRECISE_SMC
     if (tb && pc != 0) {
@@ -1195,10 +1485,14 @@ static void tb_invalidate_phys_page(tb_page_addr_t addr,
            modifying the memory. It will ensure that it cannot modify
            itself */
         cpu->current_tb = NULL;
+        /* tb_gen_code leaves the signal handler too if it has to wait
+           for a region of the buffer to be evicted */
+        cpu_restore_sigmask(puc);
         tb_gen_code(env, current_pc, current_cs_base, current_flags, 1);
-        cpu_resume_from_signal(env, puc);
+        cpu_resume_from_signal(env, NULL);
     }
 #endif
+    tb_unlock();
 }
 #endif
 
@@ -1266,17 +1560,14 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
+    uint32_t h;
 
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
     /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
+    h = tb_hash_func(phys_pc, tb->pc, tb->flags);
+    qht_insert(&tcg_ctx.tb_ctx.htable, tb, h);
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1309,7 +1600,8 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
 bool is_tcg_gen_code(uintptr_t tc_ptr)
 {
     /* This can be called during code generation, code_gen_buffer_max_size
-       is used instead of code_gen_ptr for upper boundary checking */
+       is used instead of the regions' code_ptr for upper boundary
+       checking */
     return (tc_ptr >= (uintptr_t)tcg_ctx.code_gen_buffer &&
             tc_ptr < (uintptr_t)(tcg_ctx.code_gen_buffer +
                     tcg_ctx.code_gen_buffer_max_size));
@@ -1323,20 +1615,24 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
     int m_min, m_max, m;
     uintptr_t v;
     TranslationBlock *tb;
+    TBRegion *r;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
+        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_buffer +
+                  tcg_ctx.tb_ctx.nb_regions * tcg_ctx.tb_ctx.region_size) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    r = &tcg_ctx.tb_ctx.regions[(tc_ptr - (uintptr_t)tcg_ctx.code_gen_buffer) /
+                                tcg_ctx.tb_ctx.region_size];
+    if (r->nb_tbs <= 0 || tc_ptr >= (uintptr_t)r->code_ptr) {
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &r->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1346,7 +1642,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return &r->tbs[m_max];
 }
 
 #if defined(TARGET_HAS_ICE) && !defined(CONFIG_USER_ONLY)
@@ -1363,7 +1659,9 @@ void tb_invalidate_phys_addr(hwaddr addr)
     }
     ram_addr = (memory_region_get_ram_addr(section->mr) & TARGET_PAGE_MASK)
         + memory_region_section_addr(section, addr);
+    tb_lock();
     tb_invalidate_phys_page_range(ram_addr, ram_addr + 1, 0);
+    tb_unlock();
 }
 #endif /* TARGET_HAS_ICE && !defined(CONFIG_USER_ONLY) */
 
@@ -1421,6 +1719,7 @@ void cpu_io_recompile(CPUArchState *env, uintptr_t retaddr)
     target_ulong pc, cs_base;
     uint64_t flags;
 
+    tb_lock();
     tb = tb_find_pc(retaddr);
     if (!tb) {
         cpu_abort(env, "cpu_io_recompile: could not find TB for pc=%p",
@@ -1464,6 +1763,7 @@ void cpu_io_recompile(CPUArchState *env, uintptr_t retaddr)
     /* FIXME: In theory this could raise an exception.  In practice
        we have already translated the block once so it's probably ok.  */
     tb_gen_code(env, pc, cs_base, flags, cflags);
+    tb_unlock();
     /* TODO: If env->pc != tb->pc (i.e. the faulting instruction was not
        the first in the TB) then we end up generating a whole new TB and
        repeating the fault, which is horribly inefficient.
@@ -1489,49 +1789,60 @@ void tb_flush_jmp_cache(CPUArchState *env, target_ulong addr)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    size_t guest_insns;
     TranslationBlock *tb;
+    struct qht_stats hst;
+    size_t code_size = tb_code_size();
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    guest_insns = 0;
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_regions; i++) {
+        TBRegion *r = &tcg_ctx.tb_ctx.regions[i];
+
+        for (j = 0; j < r->nb_tbs; j++) {
+            tb = &r->tbs[j];
+            target_code_size += tb->size;
+            guest_insns += tb->icount;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %zd/%zd\n",
+                code_size, tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "regions             %d x %zd bytes, current %td\n",
+                tcg_ctx.tb_ctx.nb_regions, tcg_ctx.tb_ctx.region_size,
+                tcg_ctx.tb_ctx.cur_region - tcg_ctx.tb_ctx.regions);
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
             tcg_ctx.tb_ctx.nb_tbs ? target_code_size /
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %zd bytes (expansion ratio: %0.1f)\n",
+            tcg_ctx.tb_ctx.nb_tbs ? code_size / tcg_ctx.tb_ctx.nb_tbs : 0,
+            target_code_size ? (double) code_size / target_code_size : 0);
+    cpu_fprintf(f, "TB avg guest insns  %0.1f (%0.1f host bytes/insn)\n",
+            tcg_ctx.tb_ctx.nb_tbs ?
+                    (double) guest_insns / tcg_ctx.tb_ctx.nb_tbs : 0,
+            guest_insns ? (double) code_size / guest_insns : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -1544,9 +1855,23 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                         tcg_ctx.tb_ctx.nb_tbs : 0);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "TB region evictions %d\n",
+                tcg_ctx.tb_ctx.tb_region_evict_count);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
+    qht_statistics_init(&tcg_ctx.tb_ctx.htable, &hst);
+    cpu_fprintf(f, "TB hash buckets     %zu/%zu (%0.2f%% head buckets used)\n",
+                hst.used_head_buckets, hst.head_buckets,
+                hst.head_buckets ?
+                (double)hst.used_head_buckets / hst.head_buckets * 100 : 0);
+    cpu_fprintf(f, "TB hash occupancy   %0.2f%% avg chain occ.\n",
+                hst.occupancy * 100);
+    cpu_fprintf(f, "TB hash avg chain   %0.3f buckets, max %zu\n",
+                hst.avg_chain, hst.max_chain);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "TLB refill count    %d\n", tlb_refill_count);
+    cpu_fprintf(f, "TLB victim hits     %d\n", tlb_victim_hit_count);
+    tb_cache_dump_info(f, cpu_fprintf);
     tcg_dump_info(f, cpu_fprintf);
 }
 
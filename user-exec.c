@@ -46,10 +46,9 @@ static void exception_action(CPUArchState *env1)
 #endif
 }
 
-/* exit the current TB from a signal handler. The host registers are
-   restored in a state compatible with the CPU emulator
- */
-void cpu_resume_from_signal(CPUArchState *env1, void *puc)
+/* Restore the signal mask of the context interrupted by a signal, before
+   leaving the handler with a longjmp.  */
+void cpu_restore_sigmask(void *puc)
 {
 #ifdef __linux__
     struct ucontext *uc = puc;
@@ -69,6 +68,14 @@ void cpu_resume_from_signal(CPUArchState *env1, void *puc)
         sigprocmask(SIG_SETMASK, &uc->sc_mask, NULL);
 #endif
     }
+}
+
+/* exit the current TB from a signal handler. The host registers are
+   restored in a state compatible with the CPU emulator
+ */
+void cpu_resume_from_signal(CPUArchState *env1, void *puc)
+{
+    cpu_restore_sigmask(puc);
     env1->exception_index = -1;
     siglongjmp(env1->jmp_env, 1);
 }
@@ -52,6 +52,7 @@ extern int daemon(int, int);
 #include "sysemu/sysemu.h"
 #include "trace.h"
 #include "qemu/sockets.h"
+#include <sys/mman.h>
 
 #if defined(CONFIG_VALGRIND)
 static int running_on_valgrind = -1;
@@ -134,6 +135,44 @@ void qemu_vfree(void *ptr)
     free(ptr);
 }
 
+/* Coroutine stacks are mapped on demand, so the memory is only committed
+ * as deep as the stack is actually used.  An inaccessible guard page below
+ * the stack turns a stack overflow into a segfault instead of silently
+ * corrupting whatever is mapped next to it.
+ */
+void *qemu_alloc_stack(size_t size)
+{
+    size_t pagesz = getpagesize();
+    int flags = MAP_PRIVATE | MAP_ANON;
+    void *ptr;
+
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    size = QEMU_ALIGN_UP(size, pagesz) + pagesz;
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (ptr == MAP_FAILED) {
+        fprintf(stderr, "Failed to allocate %zu B stack: %s\n",
+                size, strerror(errno));
+        abort();
+    }
+    if (mprotect(ptr, pagesz, PROT_NONE) != 0) {
+        fprintf(stderr, "Failed to set up stack guard page: %s\n",
+                strerror(errno));
+        abort();
+    }
+    trace_qemu_alloc_stack(size, ptr);
+    return ptr + pagesz;
+}
+
+void qemu_free_stack(void *stack, size_t size)
+{
+    size_t pagesz = getpagesize();
+
+    trace_qemu_free_stack(stack);
+    munmap(stack - pagesz, QEMU_ALIGN_UP(size, pagesz) + pagesz);
+}
+
 void socket_set_block(int fd)
 {
     int f;
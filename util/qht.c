@@ -0,0 +1,347 @@
+/*
+ * Resizable hash table with bucket chaining
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include <assert.h>
+#include "qemu-common.h"
+#include "qemu/qht.h"
+
+/* Each bucket holds a few entries, so that a lookup usually touches a
+ * single cache line: the hashes are compared before the pointers are
+ * dereferenced.  When a bucket is full, another one is chained to it.
+ *
+ * The entries of a chain are kept packed at its beginning, so the first
+ * NULL pointer ends a walk.
+ */
+#if HOST_LONG_BITS == 32
+#define QHT_BUCKET_ENTRIES 6
+#else
+#define QHT_BUCKET_ENTRIES 4
+#endif
+
+/* With QHT_MODE_AUTO_RESIZE, the table doubles in size once more than
+ * 1/QHT_ADDED_BUCKETS_THRESHOLD_DIV of its head buckets have an overflow
+ * bucket.
+ */
+#define QHT_ADDED_BUCKETS_THRESHOLD_DIV 8
+
+struct qht_bucket {
+    uint32_t hashes[QHT_BUCKET_ENTRIES];
+    void *pointers[QHT_BUCKET_ENTRIES];
+    struct qht_bucket *next;
+};
+
+struct qht_map {
+    struct qht_bucket *buckets;
+    size_t n_buckets;
+    size_t n_added_buckets;
+    size_t n_added_buckets_threshold;
+};
+
+static size_t qht_elems_to_buckets(size_t n_elems)
+{
+    size_t n_buckets = 1;
+
+    while (n_buckets * QHT_BUCKET_ENTRIES < n_elems) {
+        n_buckets <<= 1;
+    }
+    return n_buckets;
+}
+
+static struct qht_map *qht_map_create(size_t n_buckets)
+{
+    struct qht_map *map = g_new0(struct qht_map, 1);
+
+    map->n_buckets = n_buckets;
+    map->buckets = g_new0(struct qht_bucket, n_buckets);
+    map->n_added_buckets_threshold =
+        MAX(n_buckets / QHT_ADDED_BUCKETS_THRESHOLD_DIV, 1);
+    return map;
+}
+
+static void qht_map_destroy(struct qht_map *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        struct qht_bucket *b = map->buckets[i].next;
+
+        while (b) {
+            struct qht_bucket *next = b->next;
+
+            g_free(b);
+            b = next;
+        }
+    }
+    g_free(map->buckets);
+    g_free(map);
+}
+
+static void qht_map_reset(struct qht_map *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        struct qht_bucket *b = &map->buckets[i];
+
+        do {
+            memset(b->hashes, 0, sizeof(b->hashes));
+            memset(b->pointers, 0, sizeof(b->pointers));
+            b = b->next;
+        } while (b);
+    }
+}
+
+static inline struct qht_bucket *qht_map_to_bucket(struct qht_map *map,
+                                                   uint32_t hash)
+{
+    return &map->buckets[hash & (map->n_buckets - 1)];
+}
+
+void qht_init(struct qht *ht, size_t n_elems, unsigned int mode)
+{
+    ht->mode = mode;
+    ht->n_entries = 0;
+    ht->map = qht_map_create(qht_elems_to_buckets(n_elems));
+}
+
+void qht_destroy(struct qht *ht)
+{
+    qht_map_destroy(ht->map);
+    memset(ht, 0, sizeof(*ht));
+}
+
+void *qht_lookup(struct qht *ht, qht_lookup_func_t func, const void *userp,
+                 uint32_t hash)
+{
+    struct qht_bucket *b = qht_map_to_bucket(ht->map, hash);
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            void *p = b->pointers[i];
+
+            if (!p) {
+                return NULL;
+            }
+            if (b->hashes[i] == hash && func(p, userp)) {
+                return p;
+            }
+        }
+        b = b->next;
+    } while (b);
+
+    return NULL;
+}
+
+/* Returns false if @p is already in @map.  */
+static bool qht_map_insert(struct qht_map *map, void *p, uint32_t hash)
+{
+    struct qht_bucket *b = qht_map_to_bucket(map, hash);
+    struct qht_bucket *prev = NULL;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (!b->pointers[i]) {
+                goto found;
+            }
+            if (b->pointers[i] == p) {
+                return false;
+            }
+        }
+        prev = b;
+        b = b->next;
+    } while (b);
+
+    b = g_new0(struct qht_bucket, 1);
+    prev->next = b;
+    map->n_added_buckets++;
+    i = 0;
+
+ found:
+    b->hashes[i] = hash;
+    b->pointers[i] = p;
+    return true;
+}
+
+static void qht_map_copy(struct qht *ht, void *p, uint32_t hash, void *userp)
+{
+    struct qht_map *new = userp;
+
+    qht_map_insert(new, p, hash);
+}
+
+static bool qht_do_resize(struct qht *ht, size_t n_buckets)
+{
+    struct qht_map *old = ht->map;
+
+    if (n_buckets == old->n_buckets) {
+        return false;
+    }
+    ht->map = qht_map_create(n_buckets);
+    if (ht->n_entries) {
+        struct qht tmp = { .map = old };
+
+        qht_iter(&tmp, qht_map_copy, ht->map);
+    }
+    qht_map_destroy(old);
+    return true;
+}
+
+bool qht_insert(struct qht *ht, void *p, uint32_t hash)
+{
+    struct qht_map *map = ht->map;
+
+    assert(p);
+    if (!qht_map_insert(map, p, hash)) {
+        return false;
+    }
+    ht->n_entries++;
+
+    if ((ht->mode & QHT_MODE_AUTO_RESIZE) &&
+        map->n_added_buckets > map->n_added_buckets_threshold) {
+        qht_do_resize(ht, map->n_buckets * 2);
+    }
+    return true;
+}
+
+bool qht_remove(struct qht *ht, const void *p, uint32_t hash)
+{
+    struct qht_bucket *b = qht_map_to_bucket(ht->map, hash);
+    struct qht_bucket *last_b;
+    int i, last_i;
+
+    /* find the entry */
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (!b->pointers[i]) {
+                return false;
+            }
+            if (b->pointers[i] == p) {
+                assert(b->hashes[i] == hash);
+                goto found;
+            }
+        }
+        b = b->next;
+    } while (b);
+    return false;
+
+ found:
+    /* move the last entry of the chain into the hole */
+    last_b = b;
+    last_i = i;
+    for (;;) {
+        int j;
+
+        for (j = (last_b == b ? i + 1 : 0); j < QHT_BUCKET_ENTRIES; j++) {
+            if (!last_b->pointers[j]) {
+                break;
+            }
+            last_i = j;
+        }
+        if (j < QHT_BUCKET_ENTRIES || !last_b->next ||
+            !last_b->next->pointers[0]) {
+            break;
+        }
+        last_b = last_b->next;
+        last_i = 0;
+    }
+
+    b->hashes[i] = last_b->hashes[last_i];
+    b->pointers[i] = last_b->pointers[last_i];
+    last_b->hashes[last_i] = 0;
+    last_b->pointers[last_i] = NULL;
+    ht->n_entries--;
+    return true;
+}
+
+void qht_reset(struct qht *ht)
+{
+    qht_map_reset(ht->map);
+    ht->n_entries = 0;
+}
+
+bool qht_reset_size(struct qht *ht, size_t n_elems)
+{
+    size_t n_buckets = qht_elems_to_buckets(n_elems);
+
+    if (n_buckets == ht->map->n_buckets) {
+        qht_reset(ht);
+        return false;
+    }
+    qht_map_destroy(ht->map);
+    ht->map = qht_map_create(n_buckets);
+    ht->n_entries = 0;
+    return true;
+}
+
+bool qht_resize(struct qht *ht, size_t n_elems)
+{
+    return qht_do_resize(ht, qht_elems_to_buckets(n_elems));
+}
+
+void qht_iter(struct qht *ht, qht_iter_func_t func, void *userp)
+{
+    struct qht_map *map = ht->map;
+    size_t i;
+    int j;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        struct qht_bucket *b = &map->buckets[i];
+
+        do {
+            for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+                if (!b->pointers[j]) {
+                    goto next_head;
+                }
+                func(ht, b->pointers[j], b->hashes[j], userp);
+            }
+            b = b->next;
+        } while (b);
+    next_head:
+        ;
+    }
+}
+
+void qht_statistics_init(struct qht *ht, struct qht_stats *stats)
+{
+    struct qht_map *map = ht->map;
+    size_t chains = 0, slots = 0;
+    size_t i;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->head_buckets = map->n_buckets;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        struct qht_bucket *b = &map->buckets[i];
+        size_t chain = 0;
+        int j;
+
+        if (!b->pointers[0]) {
+            continue;
+        }
+        stats->used_head_buckets++;
+        do {
+            chain++;
+            for (j = 0; j < QHT_BUCKET_ENTRIES && b->pointers[j]; j++) {
+                stats->entries++;
+            }
+            b = b->next;
+        } while (b && b->pointers[0]);
+
+        chains += chain;
+        stats->max_chain = MAX(stats->max_chain, chain);
+    }
+
+    slots = chains * QHT_BUCKET_ENTRIES;
+    if (stats->used_head_buckets) {
+        stats->avg_chain = (double)chains / stats->used_head_buckets;
+        stats->occupancy = (double)stats->entries / slots;
+    }
+}
@@ -0,0 +1,234 @@
+/*
+ * Leaky bucket I/O throttling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include <string.h>
+#include "qemu-common.h"
+#include "qemu/throttle.h"
+
+/* The buckets that are checked and filled for reads and writes */
+static const BucketType throttle_buckets[2][4] = {
+    { THROTTLE_BPS_TOTAL, THROTTLE_OPS_TOTAL,
+      THROTTLE_BPS_READ, THROTTLE_OPS_READ },
+    { THROTTLE_BPS_TOTAL, THROTTLE_OPS_TOTAL,
+      THROTTLE_BPS_WRITE, THROTTLE_OPS_WRITE },
+};
+
+void throttle_config_init(ThrottleConfig *cfg)
+{
+    int i;
+
+    memset(cfg, 0, sizeof(*cfg));
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        cfg->buckets[i].burst_length = 1;
+    }
+}
+
+bool throttle_enabled(ThrottleConfig *cfg)
+{
+    int i;
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        if (cfg->buckets[i].avg > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool throttle_conflicting(ThrottleConfig *cfg, int total,
+                                 int read, int write)
+{
+    LeakyBucket *b = cfg->buckets;
+
+    return (b[total].avg && (b[read].avg || b[write].avg)) ||
+           (b[total].max && (b[read].max || b[write].max));
+}
+
+bool throttle_is_valid(ThrottleConfig *cfg, Error **errp)
+{
+    int i;
+
+    if (throttle_conflicting(cfg, THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ,
+                             THROTTLE_BPS_WRITE) ||
+        throttle_conflicting(cfg, THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ,
+                             THROTTLE_OPS_WRITE)) {
+        error_setg(errp, "bps(iops) and bps_rd/bps_wr(iops_rd/iops_wr) "
+                         "cannot be used at the same time");
+        return false;
+    }
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        LeakyBucket *bkt = &cfg->buckets[i];
+
+        if (bkt->avg < 0 || bkt->max < 0) {
+            error_setg(errp, "bps and iops values must be 0 or greater");
+            return false;
+        }
+        if (bkt->avg > THROTTLE_VALUE_MAX || bkt->max > THROTTLE_VALUE_MAX) {
+            error_setg(errp, "bps and iops values must be %lld or less",
+                       THROTTLE_VALUE_MAX);
+            return false;
+        }
+        if (bkt->max && !bkt->avg) {
+            error_setg(errp, "bps_max/iops_max require corresponding "
+                             "bps/iops values");
+            return false;
+        }
+        if (bkt->max && bkt->max < bkt->avg) {
+            error_setg(errp, "bps_max/iops_max cannot be lower than "
+                             "bps/iops values");
+            return false;
+        }
+        if (bkt->burst_length == 0) {
+            error_setg(errp, "the burst length must be 1 or greater");
+            return false;
+        }
+        if (bkt->burst_length > 1 && !bkt->max) {
+            error_setg(errp, "bps_max_length/iops_max_length require "
+                             "corresponding bps_max/iops_max values");
+            return false;
+        }
+        if (bkt->burst_length > THROTTLE_VALUE_MAX / MAX(bkt->max, 1)) {
+            error_setg(errp, "the burst size bps_max*bps_max_length "
+                             "(iops_max*iops_max_length) is too large");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void throttle_init(ThrottleState *ts, int64_t now)
+{
+    memset(ts, 0, sizeof(*ts));
+    throttle_config_init(&ts->cfg);
+    ts->previous_leak = now;
+}
+
+/* Applies a new configuration and empties the buckets */
+void throttle_config(ThrottleState *ts, ThrottleConfig *cfg, int64_t now)
+{
+    int i;
+
+    ts->cfg = *cfg;
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        ts->cfg.buckets[i].level = 0;
+        ts->cfg.buckets[i].burst_level = 0;
+    }
+    ts->previous_leak = now;
+}
+
+void throttle_get_config(ThrottleState *ts, ThrottleConfig *cfg)
+{
+    *cfg = ts->cfg;
+}
+
+void throttle_leak_bucket(LeakyBucket *bkt, int64_t delta_ns)
+{
+    double leak;
+
+    leak = (bkt->avg * (double) delta_ns) / NANOSECONDS_PER_SECOND;
+    bkt->level = MAX(bkt->level - leak, 0);
+
+    if (bkt->burst_length > 1) {
+        leak = (bkt->max * (double) delta_ns) / NANOSECONDS_PER_SECOND;
+        bkt->burst_level = MAX(bkt->burst_level - leak, 0);
+    }
+}
+
+static void throttle_do_leak(ThrottleState *ts, int64_t now)
+{
+    int64_t delta_ns = now - ts->previous_leak;
+    int i;
+
+    /* the clock may not be monotonic across migration */
+    if (delta_ns <= 0) {
+        return;
+    }
+    ts->previous_leak = now;
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        throttle_leak_bucket(&ts->cfg.buckets[i], delta_ns);
+    }
+}
+
+/* Returns the time in ns until @extra units have leaked at @rate */
+static int64_t throttle_do_compute_wait(double rate, double extra)
+{
+    return extra * NANOSECONDS_PER_SECOND / rate;
+}
+
+int64_t throttle_compute_wait(LeakyBucket *bkt)
+{
+    double bucket_size, burst_bucket_size, extra;
+
+    if (!bkt->avg) {
+        return 0;
+    }
+
+    if (!bkt->max) {
+        bucket_size = bkt->avg / 10;
+        burst_bucket_size = 0;
+    } else {
+        bucket_size = bkt->max * bkt->burst_length;
+        burst_bucket_size = bkt->max / 10;
+    }
+
+    extra = bkt->level - bucket_size;
+    if (extra > 0) {
+        return throttle_do_compute_wait(bkt->avg, extra);
+    }
+
+    /* Bursts longer than a second must also stay below the burst rate */
+    if (bkt->burst_length > 1) {
+        extra = bkt->burst_level - burst_bucket_size;
+        if (extra > 0) {
+            return throttle_do_compute_wait(bkt->max, extra);
+        }
+    }
+
+    return 0;
+}
+
+bool throttle_compute_timer(ThrottleState *ts, bool is_write, int64_t now,
+                            int64_t *next_timestamp)
+{
+    int64_t wait, max_wait = 0;
+    int i;
+
+    throttle_do_leak(ts, now);
+
+    for (i = 0; i < ARRAY_SIZE(throttle_buckets[is_write]); i++) {
+        BucketType index = throttle_buckets[is_write][i];
+        wait = throttle_compute_wait(&ts->cfg.buckets[index]);
+        max_wait = MAX(max_wait, wait);
+    }
+
+    *next_timestamp = now + max_wait;
+    return max_wait > 0;
+}
+
+void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(throttle_buckets[is_write]); i++) {
+        BucketType index = throttle_buckets[is_write][i];
+        LeakyBucket *bkt = &ts->cfg.buckets[index];
+        double units;
+
+        if (!bkt->avg) {
+            continue;
+        }
+
+        units = index < THROTTLE_OPS_TOTAL ? size : 1;
+        bkt->level += units;
+        if (bkt->burst_length > 1) {
+            bkt->burst_level += units;
+        }
+    }
+}
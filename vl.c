@@ -166,6 +166,7 @@ int main(int argc, char **argv)
 #include "qemu/queue.h"
 #include "sysemu/cpus.h"
 #include "sysemu/arch_init.h"
+#include "exec/tb-cache.h"
 #include "qemu/osdep.h"
 
 #include "ui/qemu-spice.h"
@@ -429,6 +430,14 @@ static QemuOptsList qemu_machine_opts = {
             .name = "usb",
             .type = QEMU_OPT_BOOL,
             .help = "Set on/off to enable/disable usb",
+        }, {
+            .name = "tcg-thread",
+            .type = QEMU_OPT_STRING,
+            .help = "single or multi, selects whether TCG vCPUs share a thread",
+        }, {
+            .name = "tb-cache",
+            .type = QEMU_OPT_STRING,
+            .help = "file where translated code is kept between runs",
         },
         { /* End of list */ }
     },
@@ -2621,6 +2630,14 @@ static QEMUMachine *machine_parse(const char *name)
 
 static int tcg_init(void)
 {
+    Error *err = NULL;
+
+    qemu_tcg_configure(qemu_opts_find(qemu_find_opts("machine"), 0), &err);
+    if (err) {
+        fprintf(stderr, "%s\n", error_get_pretty(err));
+        error_free(err);
+        exit(1);
+    }
     tcg_exec_init(tcg_tb_size * 1024 * 1024);
     return 0;
 }
@@ -3719,7 +3736,9 @@ int main(int argc, char **argv, char **envp)
                 old_param = 1;
                 break;
             case QEMU_OPTION_clock:
-                configure_alarms(optarg);
+                /* Timers no longer use an alarm signal; the option is
+                 * accepted for backwards compatibility and ignored.
+                 */
                 break;
             case QEMU_OPTION_startdate:
                 configure_rtc_date_offset(optarg, 1);
@@ -4401,6 +4420,7 @@ int main(int argc, char **argv, char **envp)
     main_loop();
     bdrv_close_all();
     pause_all_vcpus();
+    tb_cache_save();
     res_free();
 #ifdef CONFIG_TPM
     tpm_cleanup();